@@ -0,0 +1,775 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_bulk.c
+//  Description    : This is the implementation of the HDD bulk transfers.  An
+//                   export lists the files from the directory, then hands
+//                   them out to worker threads that each open their own
+//                   server connection.  A worker keeps a pipeline of reads
+//                   on the wire, chunks of a file with ranged reads (or whole
+//                   blocks from servers without them), and writes each chunk
+//                   to its place in the host file as it arrives, so no file
+//                   is ever held in memory whole (a sparse file's map is
+//                   read first, then just its chunks, the holes left as
+//                   holes in the host file).  An import maps each
+//                   host file and keeps the block creates on the wire
+//                   straight from the mappings, handing each block to its
+//                   file as the create returns (small files are written
+//                   instead, so they are packed, as are ones too big for a
+//                   block); the directory changes go to the journal in
+//                   groups as usual.
+//
+//  Author         :
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// Project Includes
+#include <hdd_bulk.h>
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_file_io.h>
+#include <hdd_dir.h>
+#include <hdd_crc.h>
+#include <hdd_pool.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+
+// A file to export
+typedef struct {
+	char    *name;       // name in the HDD filesystem (and the host directory)
+	uint32_t bid;        // block holding its data (0 if none)
+	uint32_t size;       // bytes of data
+	uint32_t capacity;   // bytes in the block (or its slice of a pack block)
+	uint32_t start;      // where the data starts in the block (0 unless packed)
+	int      sparse;     // its block is a map of chunks (see hdd_file_io.h)
+	HddSparseChunk *chunks;   // the chunks holding data, once the map is read
+	uint32_t nchunks;    // how many there are
+	uint32_t chunk;      // the one being read
+	int      failed;     // a read or write of it went wrong
+} HddBulkFile;
+
+// An export under way, shared by the workers
+typedef struct {
+	HddBulkFile *files;  // the files to export, in name order
+	uint32_t nfiles;     // how many there are
+	uint32_t maxfiles;   // and room for
+	const char *pattern; // glob the names must match (NULL for all)
+	int      dirfd;      // the host directory
+	uint32_t next;       // next file to hand out (atomic)
+	uint32_t exported;   // files written out (atomic)
+	uint32_t failures;   // files that failed (atomic)
+	uint64_t bytes;      // bytes written out (atomic)
+	int      connected;  // workers connected so far (the next may connect)
+	pthread_mutex_t lock;     // guards connected
+	pthread_cond_t  joined;   // a worker has connected
+} HddBulkExport;
+
+// A read on the wire, and where its data goes
+typedef struct {
+	HddClientRequest req;  // the read
+	uint8_t    *buf;       // receives the data
+	HddBulkFile *file;     // the file it is part of
+	int         fd;        // the host file
+	uint32_t    offset;    // where the data goes in it
+	uint32_t    skip;      // bytes of the block before the contents (whole pack blocks)
+	uint32_t    length;    // how many bytes of the data are file contents
+	int         last;      // the file is done once this is written
+} HddBulkRead;
+
+// A create on the wire, and the host file it holds
+typedef struct {
+	HddClientRequest req;  // the create
+	char       *name;      // the file
+	void       *map;       // its contents, mapped
+	uint32_t    size;      // bytes in it
+	int         direct;    // written by hdd_write (to pack it, or over many blocks), not created
+} HddBulkWrite;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_list
+// Description  : directory walk callback adding the files that match
+//
+// Inputs       : name/entry - the file, arg - the export
+// Outputs      : 0 to carry on, -1 when out of memory
+
+static int bulk_list(const char *name, const HddDirEntry *entry, void *arg) {
+	HddBulkExport *ex = arg;
+	HddBulkFile *files;
+
+	if ((ex->pattern != NULL) && (fnmatch(ex->pattern, name, 0) != 0)) {
+		return(0);
+	}
+	if (ex->nfiles == ex->maxfiles) {
+		ex->maxfiles = (ex->maxfiles == 0) ? 1024 : ex->maxfiles * 2;
+		if ((files = realloc(ex->files, sizeof(HddBulkFile) * ex->maxfiles)) == NULL) {
+			return(-1);
+		}
+		ex->files = files;
+	}
+	files = &ex->files[ex->nfiles];
+	if ((files->name = strdup(name)) == NULL) {
+		return(-1);
+	}
+	files->bid = entry->bid;
+	files->size = (entry->bid != 0) ? entry->size : 0;
+	files->capacity = entry->capacity;
+	files->start = entry->offset;
+	files->sparse = (entry->capacity == HDD_SPARSE_CAPACITY);
+	files->chunks = NULL;
+	files->nchunks = files->chunk = 0;
+	files->failed = 0;
+	ex->nfiles++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_create
+// Description  : make (or empty) the host file for a file, and the
+//                directories on its way, refusing names that would land
+//                outside the directory
+//
+// Inputs       : ex - the export, file - the file
+// Outputs      : the open host file or -1 on failure
+
+static int bulk_create(HddBulkExport *ex, HddBulkFile *file) {
+	char path[MAX_FILENAME_LENGTH+1];
+	const char *part = file->name;
+	int fd;
+
+	while (part != NULL) {
+		if ((*part == '/') || ((strncmp(part, "..", 2) == 0) && ((part[2] == '/') || (part[2] == 0)))) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : not exporting [%s], it leaves the directory", file->name);
+			return(-1);
+		}
+		if ((part = strchr(part, '/')) != NULL) {
+			// The directory so far (another worker may have made it already)
+			snprintf(path, sizeof(path), "%.*s", (int)(part - file->name), file->name);
+			if ((mkdirat(ex->dirfd, path, S_IRWXU|S_IRGRP|S_IXGRP) == -1) && (errno != EEXIST)) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : mkdir of [%s] failed [%s]", path, strerror(errno));
+				return(-1);
+			}
+			part++;
+		}
+	}
+	if ((fd = openat(ex->dirfd, file->name, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : open of [%s] failed [%s]", file->name, strerror(errno));
+	}
+	return(fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_finish
+// Description  : close the host file of a file (sized, if sparse) and count it
+//
+// Inputs       : ex - the export, file - the file, fd - its host file
+// Outputs      : none
+
+static void bulk_finish(HddBulkExport *ex, HddBulkFile *file, int fd) {
+	if (file->sparse && (ftruncate(fd, file->size) == -1)) {
+		file->failed = 1;   // (a hole at the end has nothing written to it)
+	}
+	free(file->chunks);
+	file->chunks = NULL;
+	if (close(fd) == -1) {
+		file->failed = 1;
+	}
+	if (file->failed) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : export of [%s] failed", file->name);
+		__atomic_add_fetch(&ex->failures, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&ex->exported, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&ex->bytes, file->size, __ATOMIC_RELAXED);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_chunks
+// Description  : read the map of a sparse file, the chunks to fetch
+//
+// Inputs       : file - the file
+// Outputs      : 0 if successful, -1 on failure
+
+static int bulk_chunks(HddBulkFile *file) {
+	uint8_t *buf = hdd_pool_alloc(HDD_MAX_BLOCK_SIZE);   // the server says how much there is
+	HddBitResp resp;
+	int r = -1;
+
+	if (buf != NULL) {
+		resp = hdd_block_operation(construct(file->bid, 0, 0, HDD_MAX_BLOCK_SIZE, HDD_BLOCK_READ), buf);
+		if (get_response(resp) == 0) {
+			r = hdd_sparse_decode(buf, (resp >> 36) & 67108863, &file->chunks, &file->nchunks);
+		}
+		hdd_pool_free(buf);
+	}
+	if (r == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : map block %u of [%s] is unreadable", file->bid, file->name);
+	}
+	return(r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_store
+// Description  : check the data of a finished read and write it out
+//
+// Inputs       : rd - the read, caps - extensions of the connection
+// Outputs      : 0 if written, -1 on failure
+
+static int bulk_store(HddBulkRead *rd, uint32_t caps) {
+	HddBitResp resp = hdd_client_wait(&rd->req);
+	uint32_t got = (resp >> 36) & 67108863, done = 0;
+	ssize_t wrote;
+
+	if ((resp == (HddBitResp)-1) || (get_response(resp) == 1) || (got < rd->skip + rd->length)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : read of [%s] at %u failed", rd->file->name, rd->offset);
+		return(-1);
+	}
+	if ((caps & HDD_CAP_CHECKSUM) && (hdd_crc32c(0, rd->buf, got) != rd->req.crc)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : checksum mismatch reading [%s] at %u", rd->file->name, rd->offset);
+		return(-1);
+	}
+	while (done < rd->length) {
+		if ((wrote = pwrite(rd->fd, rd->buf + rd->skip + done, rd->length - done, rd->offset + done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : write of [%s] failed [%s]", rd->file->name, strerror(errno));
+			return(-1);
+		}
+		done += wrote;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_export_worker
+// Description  : export files over a connection of its own until there are
+//                none left, keeping up to HDD_BULK_DEPTH reads on the wire
+//
+// Inputs       : arg - the export
+// Outputs      : NULL
+
+static void *bulk_export_worker(void *arg) {
+	HddBulkExport *ex = arg;
+	HddBulkRead reads[HDD_BULK_DEPTH], *rd;
+	HddBulkFile *file = NULL;
+	uint32_t caps, chunk, depth, offset = 0, idx;
+	int head = 0, count = 0, fd = -1, broken, i;
+
+	// Connect, the extensions granted say how files can be read (then the
+	// next worker may connect, so a small accept queue isn't overrun)
+	memset(reads, 0x0, sizeof(reads));
+	broken = get_response(hdd_client_operation(construct(0, 0, HDD_INIT, 0, HDD_DEVICE), NULL));
+	caps = hdd_client_capabilities();
+	pthread_mutex_lock(&ex->lock);
+	ex->connected++;
+	pthread_cond_signal(&ex->joined);
+	pthread_mutex_unlock(&ex->lock);
+	if (caps & HDD_CAP_RANGE_READ) {
+		chunk = HDD_BULK_CHUNK;
+		depth = HDD_BULK_DEPTH;
+	} else {
+		chunk = HDD_MAX_BLOCK_SIZE;   // whole blocks, so fewer of them at once
+		depth = HDD_BULK_DEPTH / 4;
+	}
+	for (i = 0; i < depth; i++) {
+		if ((reads[i].buf = hdd_pool_alloc(chunk)) == NULL) {
+			broken = 1;
+		}
+	}
+
+	while (1) {
+
+		// Put reads on the wire, starting on the next file when one is done
+		while (!broken && (count < depth)) {
+			if (file == NULL) {
+				if ((idx = __atomic_fetch_add(&ex->next, 1, __ATOMIC_RELAXED)) >= ex->nfiles) {
+					break;
+				}
+				file = &ex->files[idx];
+				offset = 0;
+				if ((fd = bulk_create(ex, file)) == -1) {
+					__atomic_add_fetch(&ex->failures, 1, __ATOMIC_RELAXED);
+					file = NULL;
+					continue;
+				}
+				if (file->sparse && (bulk_chunks(file) == -1)) {
+					file->failed = 1;
+				}
+				if ((file->size == 0) || file->failed || (file->sparse && (file->nchunks == 0))) {
+					bulk_finish(ex, file, fd);
+					file = NULL;
+					continue;
+				}
+			}
+
+			rd = &reads[(head + count) % depth];
+			rd->file = file;
+			rd->fd = fd;
+			rd->offset = offset;
+			memset(&rd->req, 0x0, sizeof(rd->req));
+			rd->req.buf = rd->buf;
+			rd->skip = 0;
+			if (file->sparse) {
+				HddSparseChunk *ck = &file->chunks[file->chunk];   // offset is into its data
+
+				rd->offset = ck->index * HDD_SPARSE_CHUNK + ck->start + offset;
+				if (caps & HDD_CAP_RANGE_READ) {
+					rd->length = (ck->length - offset < chunk) ? ck->length - offset : chunk;
+					rd->req.cmd = construct(ck->bid, 0, HDD_RANGE, rd->length, HDD_BLOCK_READ);
+					rd->req.offset = offset;
+				} else {
+					rd->length = ck->length;
+					rd->req.cmd = construct(ck->bid, 0, 0, ck->length, HDD_BLOCK_READ);
+				}
+			} else if (caps & HDD_CAP_RANGE_READ) {
+				rd->length = (file->size - offset < chunk) ? file->size - offset : chunk;
+				rd->req.cmd = construct(file->bid, 0, HDD_RANGE, rd->length, HDD_BLOCK_READ);
+				rd->req.offset = file->start + offset;
+			} else if (file->start != 0) {
+				rd->skip = file->start;   // all of the pack block, then just the slice
+				rd->length = file->size;
+				rd->req.cmd = construct(file->bid, 0, 0, HDD_PACK_BLOCK_SIZE, HDD_BLOCK_READ);
+			} else {
+				rd->length = file->size;
+				rd->req.cmd = construct(file->bid, 0, 0, file->capacity, HDD_BLOCK_READ);
+			}
+			if (hdd_client_post(&rd->req) == -1) {
+				broken = 1;
+				break;
+			}
+			offset += rd->length;
+			if (file->sparse && (offset == file->chunks[file->chunk].length)) {
+				offset = 0;   // on to the next chunk
+				rd->last = (++file->chunk == file->nchunks);
+			} else {
+				rd->last = !file->sparse && (offset == file->size);
+			}
+			count++;
+			if (rd->last) {
+				file = NULL;
+			}
+		}
+		if (count == 0) {
+			break;
+		}
+
+		// Then write out the oldest as it arrives
+		rd = &reads[head];
+		if (broken || (bulk_store(rd, caps) == -1)) {
+			rd->file->failed = 1;
+		}
+		if (rd->last) {
+			bulk_finish(ex, rd->file, rd->fd);
+		}
+		head = (head + 1) % depth;
+		count--;
+	}
+
+	// A file cut short by a lost connection counts as failed
+	if (file != NULL) {
+		file->failed = 1;
+		bulk_finish(ex, file, fd);
+	}
+	for (i = 0; i < depth; i++) {
+		hdd_pool_free(reads[i].buf);
+	}
+	hdd_client_disconnect();
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_bulk_export
+// Description  : export the files matching a glob into a host directory
+//
+// Inputs       : dir - the host directory, pattern - glob (NULL for all)
+//                connections - server connections to use at once
+// Outputs      : 0 if every file was exported, -1 if any failed
+
+int hdd_bulk_export(const char *dir, const char *pattern, int connections) {
+	HddBulkExport ex;
+	pthread_t threads[HDD_BULK_MAX_CONNECTIONS];
+	struct timespec start, stop;
+	double secs;
+	uint32_t i;
+	int started = 0, r;
+
+	if ((connections < 1) || (connections > HDD_BULK_MAX_CONNECTIONS)) {
+		connections = HDD_BULK_CONNECTIONS;
+	}
+	memset(&ex, 0x0, sizeof(ex));
+	ex.pattern = pattern;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// List the files, then let the connection go so the workers get the server
+	if (hdd_mount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : mount failed, nothing exported");
+		return(-1);
+	}
+	pthread_mutex_init(&ex.lock, NULL);
+	pthread_cond_init(&ex.joined, NULL);
+	r = hdd_dir_walk(bulk_list, &ex);
+	if ((hdd_unmount() != 0) || (r != 0)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : listing the files failed, nothing exported");
+		r = -1;
+	} else if (((mkdir(dir, S_IRWXU|S_IRGRP|S_IXGRP) == -1) && (errno != EEXIST)) ||
+			((ex.dirfd = open(dir, O_RDONLY|O_DIRECTORY)) == -1)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : can't use directory [%s] [%s]", dir, strerror(errno));
+		r = -1;
+	}
+
+	// Fetch them over the connections at once (no more than there are files)
+	if (r == 0) {
+		if (connections > ex.nfiles) {
+			connections = (ex.nfiles > 0) ? ex.nfiles : 1;
+		}
+		for (started = 0; started < connections; started++) {
+			if (pthread_create(&threads[started], NULL, bulk_export_worker, &ex)) {
+				break;
+			}
+			pthread_mutex_lock(&ex.lock);   // one connecting at a time
+			while (ex.connected <= started) {
+				pthread_cond_wait(&ex.joined, &ex.lock);
+			}
+			pthread_mutex_unlock(&ex.lock);
+		}
+		if (started == 0) {
+			bulk_export_worker(&ex);   // no threads to be had, do it here
+		}
+		while (started > 0) {
+			pthread_join(threads[--started], NULL);
+		}
+		close(ex.dirfd);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+		hdd_log(LOG_OUTPUT_LEVEL, "HDD_BULK : exported %u of %u files (%llu bytes) to [%s] in %.2fs, %.0f files/s, %.1f MB/s",
+				ex.exported, ex.nfiles, (unsigned long long)ex.bytes, dir, secs,
+				ex.exported / secs, ex.bytes / secs / (1 << 20));
+		r = (ex.exported == ex.nfiles) ? 0 : -1;   // lost connections leave files unclaimed
+	}
+
+	for (i = 0; i < ex.nfiles; i++) {
+		free(ex.files[i].name);
+	}
+	free(ex.files);
+	pthread_cond_destroy(&ex.joined);
+	pthread_mutex_destroy(&ex.lock);
+	return(r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_names
+// Description  : the names of the regular files in a host directory, sorted
+//                (so the directory pages fill in order)
+//
+// Inputs       : dirfd - the directory, count - where the number goes
+// Outputs      : the names (NULL terminated) or NULL on failure
+
+static int bulk_compare(const void *a, const void *b) {
+	return(strcmp(*(char * const *)a, *(char * const *)b));
+}
+
+static char **bulk_names(int dirfd, uint32_t *count) {
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char **names = NULL, **more;
+	uint32_t n = 0, max = 0;
+
+	if ((dir = fdopendir(dup(dirfd))) == NULL) {
+		return(NULL);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if ((de->d_type != DT_REG) && ((de->d_type != DT_UNKNOWN) ||
+				(fstatat(dirfd, de->d_name, &st, 0) == -1) || !S_ISREG(st.st_mode))) {
+			continue;   // only plain files (not subdirectories, links ...)
+		}
+		if (n + 1 >= max) {
+			max = (max == 0) ? 1024 : max * 2;
+			if ((more = realloc(names, sizeof(char *) * max)) == NULL) {
+				break;
+			}
+			names = more;
+		}
+		if ((names[n] = strdup(de->d_name)) == NULL) {
+			break;
+		}
+		names[++n] = NULL;
+	}
+	closedir(dir);
+	if (de != NULL) {
+		while (n > 0) {
+			free(names[--n]);
+		}
+		free(names);
+		return(NULL);
+	}
+	if (names == NULL) {
+		names = calloc(1, sizeof(char *));
+	}
+	qsort(names, n, sizeof(char *), bulk_compare);
+	*count = n;
+	return(names);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_map
+// Description  : map a host file for sending
+//
+// Inputs       : dirfd - the directory, wr - takes the name, gets the mapping
+// Outputs      : 0 if mapped, -1 if the file can't be imported
+
+static int bulk_map(int dirfd, HddBulkWrite *wr) {
+	struct stat st;
+	int fd;
+
+	wr->map = NULL;
+	if (strlen(wr->name) >= MAX_FILENAME_LENGTH) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : not importing [%s], the name is too long", wr->name);
+		return(-1);
+	}
+	if ((fd = openat(dirfd, wr->name, O_RDONLY)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : open of [%s] failed [%s]", wr->name, strerror(errno));
+		return(-1);
+	}
+	if (fstat(fd, &st) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : stat of [%s] failed [%s]", wr->name, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	if (st.st_size > INT32_MAX) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : not importing [%s], it is larger than a file can be", wr->name);
+		close(fd);
+		return(-1);
+	}
+	wr->size = st.st_size;
+	if (wr->size > 0) {
+		if ((wr->map = mmap(NULL, wr->size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : mmap of [%s] failed [%s]", wr->name, strerror(errno));
+			wr->map = NULL;
+			close(fd);
+			return(-1);
+		}
+		madvise(wr->map, wr->size, MADV_SEQUENTIAL|MADV_WILLNEED);
+	}
+	close(fd);   // the mapping keeps the file
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_adopt
+// Description  : make the block of a finished create the file's contents
+//                (a file without data just gets made)
+//
+// Inputs       : wr - the create (or an empty file)
+// Outputs      : 0 if successful, -1 on failure
+
+static int bulk_adopt(HddBulkWrite *wr) {
+	HddBitResp resp;
+	uint32_t bid = 0;
+	int16_t fh;
+	int r;
+
+	if (wr->size > 0) {
+		resp = hdd_client_wait(&wr->req);
+		if ((resp == (HddBitResp)-1) || (get_response(resp) == 1)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : create for [%s] failed", wr->name);
+			return(-1);
+		}
+		bid = get_bid(resp);
+	}
+	if ((fh = hdd_open(wr->name)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : hdd_open of [%s] failed", wr->name);
+		r = -1;
+	} else {
+		r = hdd_adopt(fh, bid, wr->size);
+		hdd_close(fh);
+	}
+	if ((r == -1) && (bid != 0)) {
+		hdd_client_operation(construct(bid, 0, 0, 0, HDD_BLOCK_DELETE), NULL);   // nobody has it
+	}
+	return(r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_write
+// Description  : write a file through hdd_write instead of a create of its
+//                own, so a small one is packed and a large one spread over
+//                blocks (its old contents dropped first)
+//
+// Inputs       : wr - the file
+// Outputs      : 0 if successful, -1 on failure
+
+static int bulk_write(HddBulkWrite *wr) {
+	uint32_t done = 0, count;
+	int16_t fh;
+	int r;
+
+	if ((fh = hdd_open(wr->name)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : hdd_open of [%s] failed", wr->name);
+		return(-1);
+	}
+	r = hdd_adopt(fh, 0, 0);
+	while ((r == 0) && (done < wr->size)) {
+		count = (wr->size - done < HDD_BULK_WRITE) ? wr->size - done : HDD_BULK_WRITE;
+		if (hdd_write(fh, (char *)wr->map + done, count) != count) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : write of [%s] at %u failed", wr->name, done);
+			r = -1;
+		}
+		done += count;
+	}
+	hdd_close(fh);
+	return(r);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bulk_discard
+// Description  : drain the create of a file an aborted import won't adopt,
+//                deleting the block it made
+//
+// Inputs       : wr - the create (or an empty file)
+// Outputs      : none
+
+static void bulk_discard(HddBulkWrite *wr) {
+	HddBitResp resp;
+
+	if ((wr->size == 0) || wr->direct) {
+		return;   // nothing on the wire
+	}
+	resp = hdd_client_wait(&wr->req);
+	if ((resp != (HddBitResp)-1) && (get_response(resp) == 0)) {
+		if (get_response(hdd_client_operation(construct(get_bid(resp), 0, 0, 0, HDD_BLOCK_DELETE), NULL)) == 1) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : block %u of [%s] was not deleted", get_bid(resp), wr->name);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_bulk_import
+// Description  : import the plain files of a host directory
+//
+// Inputs       : dir - the host directory
+// Outputs      : 0 if every file was imported, -1 if any failed
+
+int hdd_bulk_import(const char *dir) {
+	HddBulkWrite writes[HDD_BULK_DEPTH], *wr;
+	struct timespec start, stop;
+	char **names;
+	uint32_t nfiles = 0, next = 0, imported = 0, failures = 0, caps;
+	uint64_t bytes = 0;
+	int dirfd, head = 0, count = 0, broken = 0, i;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((dirfd = open(dir, O_RDONLY|O_DIRECTORY)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : can't use directory [%s] [%s]", dir, strerror(errno));
+		return(-1);
+	}
+	if ((names = bulk_names(dirfd, &nfiles)) == NULL) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : listing [%s] failed", dir);
+		close(dirfd);
+		return(-1);
+	}
+	if (hdd_mount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : mount failed, nothing imported");
+		broken = 1;
+	}
+	caps = hdd_client_capabilities();
+
+	while (!broken || (count > 0)) {
+
+		// Put creates on the wire, straight from the mappings
+		while (!broken && (count < HDD_BULK_DEPTH) && (next < nfiles)) {
+			wr = &writes[(head + count) % HDD_BULK_DEPTH];
+			wr->name = names[next++];
+			if (bulk_map(dirfd, wr) == -1) {
+				failures++;
+				continue;
+			}
+			wr->direct = (wr->size > HDD_MAX_BLOCK_SIZE) ||
+					((wr->size > 0) && (wr->size <= HDD_PACK_THRESHOLD) && ((caps & HDD_BULK_PACK_CAPS) == HDD_BULK_PACK_CAPS));
+			if ((wr->size > 0) && !wr->direct) {
+				memset(&wr->req, 0x0, sizeof(wr->req));
+				wr->req.cmd = construct(0, 0, 0, wr->size, HDD_BLOCK_CREATE);
+				wr->req.buf = wr->map;
+				if (caps & HDD_CAP_CHECKSUM) {
+					wr->req.crc = hdd_crc32c(0, wr->map, wr->size);
+				}
+				hdd_client_place(wr->name);   // its shard, when sharded
+				if (hdd_client_post(&wr->req) == -1) {
+					munmap(wr->map, wr->size);
+					failures++;
+					broken = 1;
+					break;
+				}
+			}
+			count++;
+		}
+		if (count == 0) {
+			break;
+		}
+
+		// Then hand the oldest block to its file (or, aborting, drop it)
+		wr = &writes[head];
+		if (broken) {
+			bulk_discard(wr);
+			failures++;
+		} else if ((wr->direct ? bulk_write(wr) : bulk_adopt(wr)) == -1) {
+			failures++;
+		} else {
+			imported++;
+			bytes += wr->size;
+		}
+		if (wr->map != NULL) {
+			munmap(wr->map, wr->size);
+		}
+		head = (head + 1) % HDD_BULK_DEPTH;
+		count--;
+	}
+
+	// Everything is on the device once the directory changes are
+	if (!broken && hdd_unmount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_BULK : unmount failed, the import may be lost");
+		imported = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	close(dirfd);
+
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_BULK : imported %u of %u files (%llu bytes) from [%s] in %.2fs, %.0f files/s, %.1f MB/s",
+			imported, nfiles, (unsigned long long)bytes, dir, secs, imported / secs, bytes / secs / (1 << 20));
+
+	for (i = 0; i < nfiles; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return((!broken && (imported == nfiles)) ? 0 : -1);
+}
@@ -0,0 +1,39 @@
+#ifndef HDD_BULK_INCLUDED
+#define HDD_BULK_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_bulk.h
+//  Description    : This is the header file for the HDD bulk transfers, which
+//                   move many files between the HDD filesystem and a host
+//                   directory at once.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define HDD_BULK_CONNECTIONS 8      // server connections used by default
+#define HDD_BULK_MAX_CONNECTIONS 64 // most connections a transfer may use
+#define HDD_BULK_CHUNK (64 << 10)   // bytes asked for per ranged read
+#define HDD_BULK_DEPTH 16           // requests a connection keeps on the wire
+#define HDD_BULK_WRITE (1 << 20)    // bytes per write of an imported file too big for a block
+#define HDD_BULK_PACK_CAPS (HDD_CAP_RANGE_READ|HDD_CAP_RANGE_WRITE|HDD_CAP_RESIZE)   // servers small files are packed on
+
+//
+// Functional Prototypes
+
+int hdd_bulk_export(const char *dir, const char *pattern, int connections);
+	// Copy every file whose name matches the glob "pattern" (all of them if
+	// NULL) into the host directory "dir" (made if need be), fetching over
+	// "connections" server connections at once; 0 if every file was
+	// exported, -1 if any failed
+
+int hdd_bulk_import(const char *dir);
+	// Copy the plain files of the host directory "dir" into the filesystem,
+	// replacing files of the same names; 0 if every file was imported, -1
+	// if any failed
+
+#endif
@@ -11,21 +11,75 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/select.h>
+#include <poll.h>
+#include <pthread.h>
 
 // Project Include Files
 #include <hdd_network.h>
 #include <cmpsc311_log.h>
+#include <hdd_log.h>
 #include <cmpsc311_util.h>
 #include <hdd_driver.h>
+#include <hdd_crc.h>
 
-int sfd = -1;                // socket file descriptor
-static struct sockaddr_in a;  // socket address
+// Defines
+#define HDD_CLIENT_CAPS (HDD_CAP_CHECKSUM|HDD_CAP_RANGE_READ|HDD_CAP_RANGE_WRITE|HDD_CAP_RESIZE|HDD_CAP_NAMESPACE)   // extensions this client understands
+
+// The connection belongs to the thread that made it, so threads that each
+// send their own HDD_INIT talk to the server in parallel; a thread can also
+// switch to a connection of its own making (a volume's, see hdd_client_use)
+static __thread HddConnection thread_conn = HDD_CONNECTION_INIT;   // the thread's own
+static __thread HddConnection *conn = NULL;   // the one in use, NULL for the thread's own
+
+// A thread running coroutines has its socket waits go to their scheduler
+// instead of blocking (see hdd_client_waiter); its sockets are then only
+// ever read and written without blocking
+static __thread HddClientWaiter waiter = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+//  connection: the connection the calling thread's requests go over
+
+static HddConnection *connection(void)
+{
+	return (conn != NULL) ? conn : &thread_conn;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  hdd_client_use: makes "c" the calling thread's connection (NULL for its
+//                  own), returning the one used before (NULL if its own)
+
+HddConnection *hdd_client_use(HddConnection *c)
+{
+	HddConnection *before = conn;
+
+	conn = c;
+	return before;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  hdd_client_waiter: has the calling thread's socket waits call "w" (NULL
+//                     to block again), returning the one set before
+
+HddClientWaiter hdd_client_waiter(HddClientWaiter w)
+{
+	HddClientWaiter before = waiter;
+
+	waiter = w;
+	return before;
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 //  get_op: extracts op from HddBitCmd
@@ -64,35 +118,278 @@ int get_size(HddBitResp response)
 
 
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_client_operation
-// Description  : This the client operation that sends a request to the CRUD
-//                server.   It will:
-//
-//                1) if INIT make a connection to the server
-//                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
-//
-// Inputs       : cmd - the request opcode for the command
-//                buf - the block to be read/written from (READ/WRITE)
-// Outputs      : the response structure encoded as needed
+///////////////////////////////////////////////////////////////////////////////
+//  send_all: writes every byte described by the io vector to the socket,
+//            header and payload together so they leave in one segment
 
-HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
+static int send_all(HddConnection *c, struct iovec *iov, int cnt)
+{
+	struct msghdr msg;
 
-    //int sfd = -1;
+	while (cnt > 0)
+	{
+		ssize_t written;   // write what the socket takes
+
+		if (waiter != NULL)
+		{
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = cnt;
+			written = sendmsg(c->sfd, &msg, MSG_DONTWAIT);
+		}
+		else
+			written = writev(c->sfd, iov, cnt);
+
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && waiter != NULL)
+			{
+				if (waiter(c->sfd, POLLOUT) == -1)   // (full) let the others run meanwhile
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+
+		while (cnt > 0 && written >= iov->iov_len)  // skip fully written pieces
+		{
+			written -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+
+		if (cnt > 0)                                 // advance into a partial piece
+		{
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  recv_all: reads exactly len bytes from the socket
+
+static int recv_all(HddConnection *c, void *buf, size_t len)
+{
+	size_t red = 0;
+
+	while (red < len)      // make sure all bytes read
+	{
+		ssize_t got = (waiter != NULL) ? recv(c->sfd, &((char*)buf)[red], len - red, MSG_DONTWAIT) :
+			read(c->sfd, &((char*)buf)[red], len - red);
+
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && waiter != NULL)
+		{
+			if (waiter(c->sfd, POLLIN) == -1)   // (nothing yet) let the others run meanwhile
+				return -1;
+			continue;
+		}
+		if (got <= 0)
+			return -1;
+
+		red += got;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  hdd_client_capabilities: extensions granted by the server at HDD_INIT
+
+uint32_t hdd_client_capabilities(void)
+{
+	HddConnection *c = connection();
+
+	return c->caps;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  has_payload: whether a command is followed by block data
+
+static int has_payload(HddBitCmd cmd)
+{
+	return ((get_op(cmd) == HDD_BLOCK_CREATE || get_op(cmd) == HDD_BLOCK_OVERWRITE) &&
+		(get_flag(cmd) == HDD_NULL_FLAG || get_flag(cmd) == HDD_META_BLOCK)) ||
+		(get_op(cmd) == HDD_BLOCK_OVERWRITE && get_flag(cmd) == HDD_RANGE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  is_device: whether a command is for the device as a whole (HDD_DEVICE
+//             shares its opcode with HDD_BLOCK_CREATE, the flag tells them apart)
+
+static int is_device(HddBitCmd cmd)
+{
+	return get_op(cmd) == HDD_DEVICE &&
+		(get_flag(cmd) == HDD_INIT || get_flag(cmd) == HDD_FORMAT || get_flag(cmd) == HDD_SAVE_AND_CLOSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  send_request: sends the header, the offset of ranged commands and any
+//                payload (with its checksum trailer) in one go
+
+static int send_request(HddConnection *c, HddClientRequest *req)
+{
+	HddBitCmd command_nbo = htonll64(req->cmd);   // convert to network byte order
+	uint32_t offset_nbo = htonl(req->offset);
+	uint32_t crc_nbo;
+	struct iovec iov[4];
+	int iovcnt = 0;
+
+	hdd_log(HDD_LOG_TRACE_LEVEL, "HDD_CLIENT : sending op %d flags %d block %u [%d bytes]",
+		get_op(req->cmd), get_flag(req->cmd), (uint32_t)(req->cmd & 0xffffffff), get_size(req->cmd));
+
+	iov[iovcnt].iov_base = &command_nbo;
+	iov[iovcnt++].iov_len = sizeof(HddBitCmd);
+
+	if (get_flag(req->cmd) == HDD_RANGE)   // ranged commands say where they start
+	{
+		iov[iovcnt].iov_base = &offset_nbo;
+		iov[iovcnt++].iov_len = sizeof(offset_nbo);
+	}
+
+	//  see if buffer also needed   //
+
+	if (has_payload(req->cmd))
+	{
+		iov[iovcnt].iov_base = req->buf;
+		iov[iovcnt++].iov_len = get_size(req->cmd);
+
+		if (c->caps & HDD_CAP_CHECKSUM)   // checksum trailer follows the block
+		{
+			crc_nbo = htonl(req->crc);
+			iov[iovcnt].iov_base = &crc_nbo;
+			iov[iovcnt++].iov_len = sizeof(crc_nbo);
+		}
+	}
+
+	if (send_all(c, iov, iovcnt) == -1)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT : error sending to server [%s]", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  recv_response: reads the response to a request, plus the block (and its
+//                 checksum) for successful reads; marks the request done
+//                 (the block IDs a shard answers with are given its index)
+
+static int recv_response(HddConnection *c, HddClientRequest *req)
+{
+	HddBitResp resp;
+	uint32_t crc_nbo;
+	int quickack = 1;
+
+	req->done = 1;
+	req->resp = -1;
 
-	if (get_flag(cmd) == HDD_INIT)  // check if initializing
+	// ACK at once: a server that holds back small responses until the last
+	// one is acknowledged (Nagle) would otherwise stall a pipeline on
+	// delayed ACKs (the setting wears off, so it is made per response)
+	setsockopt(c->sfd, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+
+	if (recv_all(c, &resp, sizeof(HddBitResp)) == -1)   // read data
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT : error receiving from server [%s]", strerror(errno));
+		return -1;
+	}
+
+	HddBitResp resp_hbo = ntohll64(resp);  // convert back to host byte order
+
+	if (get_op(resp_hbo) == HDD_BLOCK_READ && ((resp_hbo >> 32) & 1) == 0)   // check if buffer is needed
+	{
+		if (recv_all(c, req->buf, get_size(resp_hbo)) == -1)   // read buffer
+			return -1;
+
+		if (c->caps & HDD_CAP_CHECKSUM)   // and the checksum stored with it
+		{
+			if (recv_all(c, &crc_nbo, sizeof(crc_nbo)) == -1)
+				return -1;
+			req->crc = ntohl(crc_nbo);
+		}
+	}
+
+	if (c->shard_index >= 0 && !is_device(resp_hbo))
+	{
+		if ((resp_hbo & 0xffffffff) > HDD_SHARD_BID_MASK)   // no room for the index
+		{
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT : shard %d block ID %u out of range",
+				c->shard_index, (uint32_t)(resp_hbo & 0xffffffff));
+			resp_hbo |= (HddBitResp)1 << 32;
+		}
+		resp_hbo |= (HddBitResp)c->shard_index << HDD_SHARD_SHIFT;
+	}
+
+	req->resp = resp_hbo;
+	return 0;
+}
+
+static void flight_land(HddClientRequest *req);   // (see Coalescing, below)
+
+///////////////////////////////////////////////////////////////////////////////
+//  collect: collects the response to the oldest posted request (freeing
+//           it if nobody waits for it)
+
+static int collect(HddConnection *c)
+{
+	HddClientRequest *req = c->pending[0];
+	int r;
+
+	memmove(&c->pending[0], &c->pending[1], sizeof(c->pending[0]) * (c->npending - 1));
+	c->npending--;
+
+	r = recv_response(c, req);
+	if (req->discard)
+		free(req);
+	else if (req->flight != NULL)
+		flight_land(req);   // hand the answer to the reads sharing it
+	return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  drain: collects responses to posted requests, oldest first, until
+//         "until" is done (or all of them if NULL)
+
+static int drain(HddConnection *c, HddClientRequest *until)
+{
+	while (c->npending > 0 && (until == NULL || !until->done))
 	{
-		 printf("INIT flagged\n");
+		if (collect(c) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  server_connect: opens the connection to its server (or the one named by
+//                  hdd_network_address/hdd_network_port, or the default)
+
+static int server_connect(HddConnection *c)
+{
+	struct sockaddr_in a;   // socket address
+	const char *address = (c->address != NULL) ? c->address :
+		(hdd_network_address != NULL) ? (const char *)hdd_network_address : HDD_DEFAULT_IP;
+	unsigned short port = (c->port != 0) ? c->port :
+		(hdd_network_port != 0) ? hdd_network_port : HDD_DEFAULT_PORT;
+
+	 hdd_log(HDD_LOG_TRACE_LEVEL, "HDD_CLIENT : connecting to %s:%d", address, port);
 
         // create socket // 
 
-        sfd = socket(PF_INET, SOCK_STREAM, 0);
+        c->sfd = socket(PF_INET, SOCK_STREAM, 0);
 
-        if (sfd == -1)
+        if (c->sfd == -1)
         {
-            printf("Error on socket creation\n");   // make sure socket created successfully
+            hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT : socket creation failed [%s]", strerror(errno));   // make sure socket created successfully
             return(-1);
         }
         	
@@ -100,111 +397,1813 @@ HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
 
 	    // specify address //
 
-	    //struct sockaddr_in a;
-
 	    a.sin_family = AF_INET;
-	    a.sin_port = htons(HDD_DEFAULT_PORT);
+	    a.sin_port = htons(port);
 
-	    if (inet_aton(HDD_DEFAULT_IP, &(a.sin_addr)) == 0)
+	    if (inet_aton(address, &(a.sin_addr)) == 0)
 		   return -1;
 
 	    // connect //
 
-	    if (connect(sfd, (const struct sockaddr *)&a, 
+	    if (connect(c->sfd, (const struct sockaddr *)&a, 
 		sizeof(struct sockaddr)) == -1)
 	    {
-		    printf("Error connecting to server\n");   // check for server connection
+		    hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT : connecting to server failed [%s]", strerror(errno));   // check for server connection
+		    close(c->sfd);
+		    c->sfd = -1;
 		    return -1;
 	    }
+
+	    int on = 1;   // pipelined small requests mustn't wait on the server's ACKs
+	    setsockopt(c->sfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	    c->npending = 0;
+	    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  server_request: sends a request over the connection and waits for the
+//                  response, connecting at HDD_INIT and closing at
+//                  HDD_SAVE_AND_CLOSE
+
+static HddBitResp server_request(HddConnection *c, HddClientRequest *req)
+{
+    //int sfd = -1;
+
+	if (get_flag(req->cmd) == HDD_INIT)  // check if initializing
+	{
+		if (server_connect(c) == -1)
+			return -1;
+
+	    req->cmd |= HDD_CLIENT_CAPS;   // offer our extensions in the (unused) block field
 	}
 
-	//printf("made it this far\n");
-	
+	// send, then collect what was posted before us, then our response //
 
-	// send //
+	if (send_request(c, req) == -1 || drain(c, NULL) == -1 || recv_response(c, req) == -1)
+		return -1;
 
-	printf("attempting send\n");
+	HddBitResp response = req->resp; // used as return value
+
+	if (get_flag(req->cmd) == HDD_INIT && ((response >> 32) & 1) == 0)   // remember what the server agreed to
+	{
+		c->caps = get_size(response) & HDD_CLIENT_CAPS;
+	}
 
-	HddBitCmd *command_nbo = malloc(sizeof(HddBitCmd));  // allocate size for command pointer
-	*command_nbo = htonll64(cmd);                          // convert to network byte order
+	// close if necessary //
 
-	int written = write(sfd, command_nbo, sizeof(HddBitCmd)); // write data
-	// check
-	
-	while (written < sizeof(HddBitCmd))   // make sure all bytes written
+	if (get_flag(req->cmd) == HDD_SAVE_AND_CLOSE)   // close socket
 	{
-		
-		written += write(sfd, &((char*)command_nbo)[written], sizeof(HddBitCmd) - written);
+		close(c->sfd);
+		c->sfd = -1;
+		c->caps = 0;
+		hdd_log(HDD_LOG_TRACE_LEVEL, "HDD_CLIENT : connection closed");
 	}
 
-	free(command_nbo);
+	return response;
+    
+}
 
-	//  see if buffer also needed   //
+///////////////////////////////////////////////////////////////////////////////
+//  server_post: sends a request over the connection without waiting
+
+static int server_post(HddConnection *c, HddClientRequest *req)
+{
+	if (c->sfd == -1 || get_flag(req->cmd) == HDD_INIT || get_flag(req->cmd) == HDD_SAVE_AND_CLOSE)
+		return -1;   // connection changes are never pipelined
+
+	if (c->npending == HDD_CLIENT_MAX_PENDING && drain(c, c->pending[0]) == -1)
+		return -1;   // make room by collecting the oldest
+
+	if (send_request(c, req) == -1)
+		return -1;
+
+	c->pending[c->npending++] = req;
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  server_disconnect: closes the connection once what was posted is answered
 
-	if ((get_op(cmd) == HDD_BLOCK_CREATE || get_op(cmd) == HDD_BLOCK_OVERWRITE) &&
-		(get_flag(cmd) == HDD_NULL_FLAG || get_flag(cmd) == HDD_META_BLOCK))
+static int server_disconnect(HddConnection *c)
+{
+	if (c->sfd == -1)
+		return -1;
+
+	drain(c, NULL);   // nothing posted is left unanswered
+	while (c->npending > 0)   // (unless the connection broke)
 	{
-		
-		 int written_buf = write(sfd, buf, get_size(cmd));  // send buffer
-		
-		 
-		while (written_buf < get_size(cmd))  // make sure all bytes sent
-	    {
-	    	
-	    	written_buf += write(sfd, &(((char*)buf)[written_buf]), get_size(cmd) - written_buf);
-	    }
+		HddClientRequest *req = c->pending[--c->npending];
 
+		if (req->discard)
+			free(req);
+		else
+			flight_land(req);
 	}
+	close(c->sfd);
+	c->sfd = -1;
+	c->caps = 0;
+	return 0;
+}
 
-	
+//
+// Groups: a connection that names no server of its own goes to every
+// endpoint given to hdd_client_shards or hdd_client_replicas, one
+// connection (a peer) each.  Device commands go to all of them, and what is
+// granted is what all of them grant.
+//
+// Sharding: a new block is placed by consistent hashing of the key given to
+// hdd_client_place (the file's name), on a ring of HDD_SHARD_VNODES points
+// per endpoint, so adding an endpoint moves only the keys that now land on
+// it; blocks created with no key and the meta block stay on shard 0, the
+// metadata shard.  The shard's index rides in the top bits of the block IDs
+// handed out, so every later command goes straight to the shard that holds
+// the block.
+//
+// Replicas: every write goes to every replica, which hand out the same
+// block IDs as they see the same commands (one that answers differently
+// from the first is stale from then on, and no longer used).  A read goes to
+// one replica; if it is not answered within the connection's recent read
+// latency at hdd_client_hedge's percentile, a duplicate goes to a second
+// replica and the first answer wins (the other is collected and dropped).
 
-	// receive //
+typedef enum {
+	HDD_GROUP_NONE     = 0,   // a single server
+	HDD_GROUP_SHARDS   = 1,   // blocks spread over the endpoints
+	HDD_GROUP_REPLICAS = 2,   // blocks copied to every endpoint
+} HddGroupKind;
 
-	
+typedef struct {
+	uint32_t point;   // where on the ring
+	int      shard;   // the endpoint it belongs to
+} HddShardPoint;
+
+static HddGroupKind group_kind = HDD_GROUP_NONE;                  // what the endpoints are
+static int group_count = 0;                                       // endpoints, 0 for a single server
+static char *group_address[HDD_CLIENT_MAX_PEERS];                 // their addresses
+static unsigned short group_port[HDD_CLIENT_MAX_PEERS];           // and ports
+static HddShardPoint shard_ring[HDD_CLIENT_MAX_PEERS * HDD_SHARD_VNODES];   // sorted by point
+static int hedge_percentile = HDD_HEDGE_PERCENTILE;               // read latency a hedge waits for
+static uint32_t hedge_min_us = HDD_HEDGE_MIN_US;                  // and never less than this
+static int next_reader = 0;                                       // replica the next group reads from (atomic)
+
+// Read latency (us) histogram: exact below 64, then 16 steps per power of two
+#define HDD_LAT_BUCKETS (64 + 26 * 16)
+static uint64_t lat_hist[HDD_LAT_BUCKETS];                       // reads per bucket (atomic)
+static uint64_t stat_reads, stat_hedged, stat_hedge_wins, stat_stale, stat_coalesced;   // (atomic)
+
+///////////////////////////////////////////////////////////////////////////////
+//  now_us: the monotonic clock in microseconds
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  lat_bucket/lat_value: a latency's histogram bucket, and the least
+//                        latency a bucket holds
+
+static int lat_bucket(uint32_t us)
+{
+	int e;
+
+	if (us < 64)
+		return us;
+	e = 31 - __builtin_clz(us);   // 6 and up
+	return 64 + (e - 6) * 16 + ((us >> (e - 4)) & 15);
+}
+
+static uint32_t lat_value(int bucket)
+{
+	if (bucket < 64)
+		return bucket;
+	return (uint32_t)(16 + (bucket - 64) % 16) << ((bucket - 64) / 16 + 2);
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint32_t la = *(const uint32_t *)a, lb = *(const uint32_t *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  read_timed: counts a read's latency, and every so often works out how
+//              long the connection's reads wait before being hedged
 
-	HddBitResp *resp = malloc(sizeof(HddBitResp)); // allocate size for response pointer
+static void read_timed(HddConnection *c, uint32_t us)
+{
+	uint32_t sorted[HDD_HEDGE_SAMPLES];
 
-	int red = read(sfd, resp, sizeof(HddBitResp));  // read data
-	//check
+	__atomic_add_fetch(&lat_hist[lat_bucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stat_reads, 1, __ATOMIC_RELAXED);
 
-	while (red < sizeof(HddBitResp))      // make sure all bytes read
+	c->lat[c->nlat++ % HDD_HEDGE_SAMPLES] = us;
+	if (c->nlat >= HDD_HEDGE_WARMUP && c->nlat % HDD_HEDGE_UPDATE == 0)
 	{
-		
-		red += read(sfd, &((char*)resp)[red], sizeof(HddBitResp) - red);
+		uint32_t n = (c->nlat < HDD_HEDGE_SAMPLES) ? c->nlat : HDD_HEDGE_SAMPLES;
+
+		memcpy(sorted, c->lat, n * sizeof(uint32_t));
+		qsort(sorted, n, sizeof(uint32_t), lat_cmp);
+		c->hedge_us = sorted[(n - 1) * hedge_percentile / 100];
+		if (c->hedge_us < hedge_min_us)
+			c->hedge_us = hedge_min_us;
 	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_read_stats
+// Description  : Copies out the read latency and hedging counters (of every
+//                thread)
+//
+// Inputs       : stats - where to put them
+// Outputs      : none
 
-	HddBitResp resp_hbo = ntohll64(*resp);  // convert back to host byte order
-	free(resp);
+void hdd_client_read_stats(HddClientReadStats *stats)
+{
+	uint64_t counts[HDD_LAT_BUCKETS], total = 0, seen = 0;
+	uint32_t *pct[3] = { &stats->p50_us, &stats->p95_us, &stats->p99_us };
+	int want[3] = { 50, 95, 99 }, b, k = 0;
+
+	memset(stats, 0x0, sizeof(HddClientReadStats));
+	stats->reads = __atomic_load_n(&stat_reads, __ATOMIC_RELAXED);
+	stats->hedged = __atomic_load_n(&stat_hedged, __ATOMIC_RELAXED);
+	stats->hedge_wins = __atomic_load_n(&stat_hedge_wins, __ATOMIC_RELAXED);
+	stats->stale = __atomic_load_n(&stat_stale, __ATOMIC_RELAXED);
+	stats->coalesced = __atomic_load_n(&stat_coalesced, __ATOMIC_RELAXED);
 
-	if (get_op(resp_hbo) == HDD_BLOCK_READ)   // check if buffer is needed
+	for (b = 0; b < HDD_LAT_BUCKETS; b++)
 	{
-        
+		counts[b] = __atomic_load_n(&lat_hist[b], __ATOMIC_RELAXED);
+		total += counts[b];
+	}
 
-		int read_buf = read(sfd, buf, get_size(resp_hbo)); // read biffer
-		// check
+	for (b = 0; b < HDD_LAT_BUCKETS && k < 3; b++)   // the bucket each percentile falls in
+	{
+		seen += counts[b];
+		while (k < 3 && total > 0 && seen * 100 >= total * want[k])
+			*pct[k++] = lat_value(b);
+	}
+}
 
-		while (read_buf < get_size(resp_hbo))    // make sure all bytes are read
-	    {
-	    	
-	    	read_buf += read(sfd, &((char*)buf)[read_buf], get_size(resp_hbo) - read_buf);
-	    }
+///////////////////////////////////////////////////////////////////////////////
+//  shard_hash: spreads a key over the ring (CRC32C, then mixed so close keys
+//              land far apart)
+
+static uint32_t shard_hash(const void *key, size_t len)
+{
+	uint32_t h = hdd_crc32c(0, key, len);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static int shard_point_cmp(const void *a, const void *b)
+{
+	uint32_t pa = ((const HddShardPoint *)a)->point, pb = ((const HddShardPoint *)b)->point;
+
+	return (pa > pb) - (pa < pb);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  group_set: takes the endpoints of a group (copies of them)
+
+static int group_set(HddGroupKind kind, int n, const char **addresses, const unsigned short *ports)
+{
+	int i;
+
+	if (n < 0 || n > HDD_CLIENT_MAX_PEERS)
+		return -1;
+
+	for (i = 0; i < group_count; i++)
+		free(group_address[i]);
+	group_count = 0;
+	group_kind = HDD_GROUP_NONE;
+
+	for (i = 0; i < n; i++)
+	{
+		group_address[i] = strdup((addresses[i] != NULL) ? addresses[i] : HDD_DEFAULT_IP);
+		group_port[i] = (ports[i] != 0) ? ports[i] : HDD_DEFAULT_PORT;
 	}
 
-	
+	group_count = n;
+	group_kind = (n > 0) ? kind : HDD_GROUP_NONE;
+	return 0;
+}
 
-	HddBitResp response = resp_hbo; // used as return value
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_shards
+// Description  : Spreads the blocks of connections that name no server over
+//                the n endpoints (0 to go back to a single server); call it
+//                before any such connection is made
+//
+// Inputs       : n - the number of endpoints, addresses/ports - them
+// Outputs      : 0 if successful, -1 on failure
 
-	// close if necessary //
+int hdd_client_shards(int n, const char **addresses, const unsigned short *ports)
+{
+	char label[64];
+	int i, v;
 
-	if (get_flag(cmd) == HDD_SAVE_AND_CLOSE)   // close socket
+	if (group_set(HDD_GROUP_SHARDS, n, addresses, ports) == -1)
+		return -1;
+
+	for (i = 0; i < n; i++)
 	{
-		close(sfd);
-		sfd = -1;
-		printf("closed\n");
+		for (v = 0; v < HDD_SHARD_VNODES; v++)   // the endpoint's points, from its name
+		{
+			snprintf(label, sizeof(label), "%s:%u#%d", group_address[i], group_port[i], v);
+			shard_ring[i * HDD_SHARD_VNODES + v].point = shard_hash(label, strlen(label));
+			shard_ring[i * HDD_SHARD_VNODES + v].shard = i;
+		}
 	}
 
-	return response;
-    
+	qsort(shard_ring, n * HDD_SHARD_VNODES, sizeof(HddShardPoint), shard_point_cmp);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_replicas
+// Description  : Copies the blocks of connections that name no server to
+//                each of the n endpoints (0 to go back to a single server);
+//                call it before any such connection is made
+//
+// Inputs       : n - the number of endpoints, addresses/ports - them
+// Outputs      : 0 if successful, -1 on failure
+
+int hdd_client_replicas(int n, const char **addresses, const unsigned short *ports)
+{
+	return group_set(HDD_GROUP_REPLICAS, n, addresses, ports);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_hedge
+// Description  : Sets when a read from a replica is duplicated to another:
+//                once it has waited the given percentile of the recent read
+//                latencies (0 never hedges), and at least min_us
+//
+// Inputs       : percentile - of recent latencies, min_us - the least wait
+// Outputs      : none
+
+void hdd_client_hedge(int percentile, uint32_t min_us)
+{
+	hedge_percentile = (percentile > 100) ? 100 : (percentile < 0) ? 0 : percentile;
+	hedge_min_us = min_us;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_place
+// Description  : Names what the calling thread's next new block belongs to,
+//                so a sharded connection can place it
+//
+// Inputs       : key - the file's name
+// Outputs      : none
+
+void hdd_client_place(const char *key)
+{
+	HddConnection *c = connection();
+
+	c->place = shard_hash(key, strlen(key));
+	c->placed = 1;
+}
 
+///////////////////////////////////////////////////////////////////////////////
+//  shard_locate: the endpoint owning a key, the first point at or after it
+
+static int shard_locate(uint32_t key)
+{
+	int lo = 0, hi = group_count * HDD_SHARD_VNODES;
+
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+
+		if (shard_ring[mid].point < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return shard_ring[(lo == group_count * HDD_SHARD_VNODES) ? 0 : lo].shard;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  shard_route: the shard a block command goes to (-1 if none), and the
+//               command as that shard knows the block
+
+static int shard_route(HddConnection *c, HddBitCmd cmd, HddBitCmd *local)
+{
+	uint32_t bid = cmd & 0xffffffff;
+	int shard;
+
+	if (get_flag(cmd) == HDD_META_BLOCK)
+		shard = 0;
+	else if (get_op(cmd) == HDD_BLOCK_CREATE)
+		shard = c->placed ? shard_locate(c->place) : 0;
+	else
+		shard = bid >> HDD_SHARD_SHIFT;
+
+	if (get_op(cmd) == HDD_BLOCK_CREATE)
+		c->placed = 0;   // the key was for this block only
+
+	*local = (cmd & ~(HddBitCmd)0xffffffff) | (bid & HDD_SHARD_BID_MASK);
+	return (shard < c->npeers) ? shard : -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  group_device: sends a device command to every peer, making the peer
+//                connections at HDD_INIT; what is granted is what all of
+//                them grant, the response the first failure or peer 0's
+
+static HddBitResp group_device(HddConnection *c, HddClientRequest *req)
+{
+	HddBitResp resp = 0;
+	uint32_t caps = HDD_CLIENT_CAPS;
+	int i, failed = 0;
+
+	if (get_flag(req->cmd) == HDD_INIT && c->peer == NULL)
+	{
+		if ((c->peer = calloc(group_count, sizeof(HddConnection))) == NULL)
+			return -1;
+		for (i = 0; i < group_count; i++)
+		{
+			c->peer[i] = (HddConnection)HDD_CONNECTION_INIT;
+			c->peer[i].address = group_address[i];
+			c->peer[i].port = group_port[i];
+			if (group_kind == HDD_GROUP_SHARDS)
+				c->peer[i].shard_index = i;
+		}
+		c->npeers = group_count;
+		c->reader = __atomic_fetch_add(&next_reader, 1, __ATOMIC_RELAXED) % group_count;
+	}
+
+	if (c->peer == NULL)
+		return -1;
+
+	for (i = 0; i < c->npeers; i++)
+	{
+		HddClientRequest one = { .cmd = req->cmd };
+		HddBitResp r = server_request(&c->peer[i], &one);
+
+		if (!failed && (i == 0 || r == -1 || ((r >> 32) & 1)))
+		{
+			resp = r;
+			failed = (r == -1 || ((r >> 32) & 1));
+		}
+		caps &= c->peer[i].caps;
+	}
+
+	if (get_flag(req->cmd) == HDD_INIT && failed)
+	{
+		for (i = 0; i < c->npeers; i++)   // all or nothing
+			server_disconnect(&c->peer[i]);
+	}
+
+	if (get_flag(req->cmd) == HDD_SAVE_AND_CLOSE || (get_flag(req->cmd) == HDD_INIT && failed))
+	{
+		free(c->peer);
+		c->peer = NULL;
+		c->npeers = 0;
+		caps = 0;
+	}
+	else
+	{
+		for (i = 0; i < c->npeers; i++)   // a checksum is sent to all or none
+		{
+			c->peer[i].caps = caps;
+			if (get_flag(req->cmd) == HDD_FORMAT && !failed)
+				c->peer[i].stale = 0;     // all empty, so all alike again
+		}
+	}
+
+	c->caps = caps;
+	req->resp = resp;
+	req->done = 1;
+	return resp;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  grouped: whether the connection's requests go to a group of peers
+
+static int grouped(HddConnection *c, HddBitCmd cmd)
+{
+	return (c->peer != NULL) ||
+		(get_flag(cmd) == HDD_INIT && group_count > 0 && c->address == NULL && c->port == 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  replica_live: the first replica from "from" on (wrapping) that is not
+//                stale and isn't "not", -1 if none
+
+static int replica_live(HddConnection *c, int from, int not)
+{
+	int i, r;
+
+	for (i = 0; i < c->npeers; i++)
+	{
+		r = (from + i) % c->npeers;
+		if (r != not && !c->peer[r].stale)
+			return r;
+	}
+
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  replica_write: sends a write to every live replica at once, then
+//                 collects the answers; the first replica to succeed gives
+//                 the answer, and any failing or answering differently goes
+//                 stale (if none succeeds, the first to answer gives it and
+//                 just those not answering go stale)
+
+static HddBitResp replica_write(HddConnection *c, HddClientRequest *req)
+{
+	HddClientRequest copy[HDD_CLIENT_MAX_PEERS];
+	int sent[HDD_CLIENT_MAX_PEERS], first = -1, ok = -1, i;
+
+	for (i = 0; i < c->npeers; i++)
+	{
+		copy[i] = *req;
+		copy[i].resp = -1;
+		sent[i] = !c->peer[i].stale && send_request(&c->peer[i], &copy[i]) == 0;
+	}
+
+	for (i = 0; i < c->npeers; i++)
+	{
+		if (sent[i] && (drain(&c->peer[i], NULL) == -1 || recv_response(&c->peer[i], &copy[i]) == -1))
+			copy[i].resp = -1;
+		if (first == -1 && copy[i].resp != -1)
+			first = i;
+		if (ok == -1 && copy[i].resp != -1 && ((copy[i].resp >> 32) & 1) == 0)
+			ok = i;
+	}
+	if (ok != -1)
+		first = ok;
+
+	for (i = 0; i < c->npeers; i++)
+	{
+		if (i != first && !c->peer[i].stale &&
+			(first == -1 || copy[i].resp == -1 || (ok != -1 && copy[i].resp != copy[first].resp)))
+		{
+			hdd_log(LOG_WARNING_LEVEL, "HDD_CLIENT : replica %d answered differently, no longer used", i);
+			__atomic_add_fetch(&stat_stale, 1, __ATOMIC_RELAXED);
+			c->peer[i].stale = 1;
+		}
+	}
+
+	req->resp = (first == -1) ? -1 : copy[first].resp;
+	req->done = 1;
+	return req->resp;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  discard_request: a copy of a read whose answer nobody waits for (it is
+//                   freed, with its buffer, once collected)
+
+static HddClientRequest *discard_request(HddClientRequest *req)
+{
+	HddClientRequest *dup = malloc(sizeof(HddClientRequest) + get_size(req->cmd));
+
+	if (dup == NULL)
+		return NULL;
+
+	*dup = *req;
+	dup->buf = dup + 1;
+	dup->discard = 1;
+	dup->flight = NULL;
+	dup->done = 0;
+	return dup;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  readable: waits up to "us" microseconds (forever if negative) for either
+//            socket to have an answer, 1 for the first, 2 for the second,
+//            3 for both, 0 if neither
+
+static int readable(int fd1, int fd2, int64_t us)
+{
+	uint64_t until = now_us() + us;
+	struct timeval tv;
+	fd_set fds;
+	int n;
+
+	if (waiter != NULL && fd2 == -1 && us < 0)   // just the one, for as long as it takes
+		return (waiter(fd1, POLLIN) == -1) ? 0 : 1;
+
+	for (;;)   // (with a waiter, look and let the others run until it's time)
+	{
+		tv.tv_sec = (waiter != NULL) ? 0 : us / 1000000;
+		tv.tv_usec = (waiter != NULL) ? 0 : us % 1000000;
+		FD_ZERO(&fds);
+		FD_SET(fd1, &fds);
+		if (fd2 != -1)
+			FD_SET(fd2, &fds);
+
+		n = select(((fd1 > fd2) ? fd1 : fd2) + 1, &fds, NULL, NULL, (us < 0 && waiter == NULL) ? NULL : &tv);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0 && waiter != NULL && (us < 0 || now_us() < until) && waiter(-1, 0) == 0)
+			continue;
+		break;
+	}
+	if (n <= 0)
+		return 0;
+
+	return (FD_ISSET(fd1, &fds) ? 1 : 0) | ((fd2 != -1 && FD_ISSET(fd2, &fds)) ? 2 : 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  replica_read: reads from the connection's replica, hedging to another
+//                once the read has waited longer than the hedge delay
+
+static HddBitResp replica_read(HddConnection *c, HddClientRequest *req)
+{
+	int r = replica_live(c, c->reader, -1), h, ready;
+	HddConnection *p, *q;
+	HddClientRequest *dup, *lost;
+	uint64_t sent;
+	int64_t left;
+
+	if (r == -1)
+		return -1;
+	p = &c->peer[r];
+
+	if (send_request(p, req) == -1 || drain(p, NULL) == -1)
+		return -1;
+	sent = now_us();
+
+	left = c->hedge_us - (int64_t)(now_us() - sent);   // (already past it, just look)
+	h = replica_live(c, r + 1, r);
+	if (h == -1 || hedge_percentile == 0 || c->hedge_us == 0 ||
+		readable(p->sfd, -1, (left > 0) ? left : 0) & 1)
+	{
+		recv_response(p, req);   // answered in time, or nobody to hedge to
+		return req->resp;
+	}
+
+	// Too slow: the same read from the next replica, the first answer wins
+	q = &c->peer[h];
+	if ((dup = discard_request(req)) == NULL || server_post(q, dup) == -1)
+	{
+		free(dup);
+		recv_response(p, req);
+		return req->resp;
+	}
+	__atomic_add_fetch(&stat_hedged, 1, __ATOMIC_RELAXED);
+
+	while (1)
+	{
+		ready = readable(p->sfd, q->sfd, -1);
+
+		if (ready == 0)   // the wait itself failed, both answers go to copies nobody reads
+		{
+			if ((lost = discard_request(req)) == NULL)
+				recv_response(p, req);
+			else
+				p->pending[p->npending++] = lost;
+			req->resp = -1;
+			req->done = 1;
+			return -1;
+		}
+
+		if (ready & 1)   // the first replica after all, the duplicate is dropped when collected
+		{
+			recv_response(p, req);
+			return req->resp;
+		}
+
+		if (ready & 2)
+		{
+			if (q->pending[0] != dup)   // something posted before it
+			{
+				if (collect(q) == -1)
+					break;
+				continue;
+			}
+
+			memmove(&q->pending[0], &q->pending[1], sizeof(q->pending[0]) * (q->npending - 1));
+			q->npending--;
+			if (recv_response(q, dup) == -1)
+				break;
+
+			if (((dup->resp >> 32) & 1) == 0)
+				memcpy(req->buf, dup->buf, get_size(dup->resp));
+			req->resp = dup->resp;
+			req->crc = dup->crc;
+			req->done = 1;
+			free(dup);
+			__atomic_add_fetch(&stat_hedge_wins, 1, __ATOMIC_RELAXED);
+
+			// The first replica's answer is still coming, into a copy nobody reads
+			if ((lost = discard_request(req)) == NULL)
+			{
+				drain(p, NULL);
+				recv_response(p, req);
+				return req->resp;
+			}
+			p->pending[p->npending++] = lost;   // (nothing else is pending there)
+			return req->resp;
+		}
+	}
+
+	free(dup);   // (a broken connection, the duplicate was taken off it)
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  client_request: sends a request to the connection's server or group and
+//                  waits for its response
+
+static HddBitResp client_request(HddConnection *c, HddClientRequest *req)
+{
+	if (!grouped(c, req->cmd))
+	{
+		if (get_op(req->cmd) != HDD_BLOCK_READ)
+			return server_request(c, req);
+
+		uint64_t start = now_us();
+
+		server_request(c, req);
+		read_timed(c, now_us() - start);
+		return req->resp;
+	}
+
+	if (is_device(req->cmd))
+		return group_device(c, req);
+
+	if (group_kind == HDD_GROUP_REPLICAS)
+	{
+		if (get_op(req->cmd) != HDD_BLOCK_READ)
+			return replica_write(c, req);
+
+		uint64_t start = now_us();
+
+		replica_read(c, req);
+		read_timed(c, now_us() - start);
+		return req->resp;
+	}
+
+	HddBitCmd cmd = req->cmd;
+	int shard = shard_route(c, cmd, &req->cmd);
+
+	if (shard == -1)
+	{
+		req->cmd = cmd;
+		req->done = 1;
+		req->resp = -1;
+		return -1;
+	}
+
+	if (get_op(cmd) == HDD_BLOCK_READ)
+	{
+		uint64_t start = now_us();
+
+		server_request(&c->peer[shard], req);
+		read_timed(c, now_us() - start);
+	}
+	else
+		server_request(&c->peer[shard], req);
+	req->cmd = cmd;
+	return req->resp;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  client_post: sends a request to the connection's server or group without
+//               waiting (writes to replicas are answered before it returns)
+
+static int client_post(HddConnection *c, HddClientRequest *req)
+{
+	if (c->peer == NULL)
+		return server_post(c, req);
+
+	if (is_device(req->cmd))
+		return -1;
+
+	if (group_kind == HDD_GROUP_REPLICAS)
+	{
+		int r = replica_live(c, c->reader, -1);
+
+		if (get_op(req->cmd) != HDD_BLOCK_READ)   // every replica, so here and now
+			return (replica_write(c, req) == -1) ? -1 : 0;
+		return (r == -1) ? -1 : server_post(&c->peer[r], req);
+	}
+
+	HddBitCmd cmd = req->cmd;
+	int shard = shard_route(c, cmd, &req->cmd);
+	int r = (shard == -1) ? -1 : server_post(&c->peer[shard], req);
+
+	req->cmd = cmd;   // (it is on the wire as the shard knows it)
+	return r;
+}
+
+//
+// Coalescing: a read of a block that is already on the wire, to the same
+// server with the same size and offset, shares it instead of going out
+// again (a flight).  The read that went out leads it; when its answer
+// arrives it is copied to every read sharing it, whose callers are woken.
+// A synchronous read waits for its leader, which is never waiting on anyone
+// itself; a read waiting on a posted leader whose answer hasn't come yet
+// stops sharing and goes out on its own instead (the leader is answered only
+// when its thread gets to it, which may be never if that thread is waiting
+// on us).  A write or delete of the block, or any device command, ends the
+// sharing of the reads on the wire before it, so no read started after it
+// shares an answer from before it.
+
+#define HDD_FLIGHT_BUCKETS 64       // hash chains of reads on the wire
+#define HDD_FLIGHT_FOLLOWERS 16     // reads that can share one
+
+typedef struct HddFlight {
+	uint64_t          server;       // where it went (see flight_server)
+	HddBitCmd         cmd;          // the read, as the caller made it
+	uint32_t          offset;       // and its offset
+	HddClientRequest *leader;       // the read on the wire
+	int               posted;       // whether the leader was posted
+	HddClientRequest *follower[HDD_FLIGHT_FOLLOWERS];   // the reads sharing it
+	int               nfollowers;   // number of them
+	struct HddFlight *next;         // on the chain
+} HddFlight;
+
+typedef struct {
+	pthread_mutex_t lock;           // guards the chain and its flights' followers
+	pthread_cond_t  landed;         // a flight on the chain was answered
+	HddFlight      *head;           // the chain
+} HddFlightChain;
+
+static HddFlightChain flights[HDD_FLIGHT_BUCKETS];
+static pthread_once_t flights_once = PTHREAD_ONCE_INIT;
+
+static void flights_init(void)
+{
+	int i;
+
+	for (i = 0; i < HDD_FLIGHT_BUCKETS; i++)
+	{
+		pthread_mutex_init(&flights[i].lock, NULL);
+		pthread_cond_init(&flights[i].landed, NULL);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  flight_server: what a connection's reads are keyed by, its server's
+//                 address and port (or 1 for a group, which is process-wide)
+
+static uint64_t flight_server(HddConnection *c)
+{
+	const char *address = (c->address != NULL) ? c->address :
+		(hdd_network_address != NULL) ? (const char *)hdd_network_address : HDD_DEFAULT_IP;
+	unsigned short port = (c->port != 0) ? c->port :
+		(hdd_network_port != 0) ? hdd_network_port : HDD_DEFAULT_PORT;
+
+	if (c->peer != NULL)
+		return 1;
+	return ((uint64_t)inet_addr(address) << 16) | port;
+}
+
+static HddFlightChain *flight_chain(uint64_t server, uint32_t bid)
+{
+	return &flights[(uint32_t)((server * 0x9e3779b97f4a7c15ull) >> 40 ^ bid) % HDD_FLIGHT_BUCKETS];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  flight_join: shares an identical read already on the wire (1), or else
+//               makes this read the leader of a new flight (0, or 0 with no
+//               flight if none could be had)
+
+static int flight_join(HddConnection *c, HddClientRequest *req, int posted)
+{
+	uint64_t server = flight_server(c);
+	HddFlightChain *chain = flight_chain(server, req->cmd & 0xffffffff);
+	HddFlight *f;
+
+	pthread_once(&flights_once, flights_init);
+	req->flight = NULL;
+
+	pthread_mutex_lock(&chain->lock);
+	for (f = chain->head; f != NULL; f = f->next)
+	{
+		if (f->server == server && f->cmd == req->cmd && f->offset == req->offset &&
+			f->nfollowers < HDD_FLIGHT_FOLLOWERS && (!posted || c->nfollow < HDD_CLIENT_MAX_PENDING))
+		{
+			f->follower[f->nfollowers++] = req;
+			req->flight = f;
+			if (posted)
+				c->follow[c->nfollow++] = req;
+			pthread_mutex_unlock(&chain->lock);
+			return 1;
+		}
+	}
+
+	if ((f = calloc(1, sizeof(HddFlight))) != NULL)
+	{
+		f->server = server;
+		f->cmd = req->cmd;
+		f->offset = req->offset;
+		f->leader = req;
+		f->posted = posted;
+		f->next = chain->head;
+		chain->head = f;
+		req->flight = f;
+	}
+	pthread_mutex_unlock(&chain->lock);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  flight_unlink: takes a flight off its chain (the chain held)
+
+static void flight_unlink(HddFlightChain *chain, HddFlight *f)
+{
+	HddFlight **pp;
+
+	for (pp = &chain->head; *pp != NULL; pp = &(*pp)->next)
+	{
+		if (*pp == f)
+		{
+			*pp = f->next;
+			return;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  flight_land: hands the leader's answer to the reads sharing it (which go
+//               out on their own if it failed), then ends the flight
+
+static void flight_land(HddClientRequest *req)
+{
+	HddFlight *f = req->flight;
+	HddFlightChain *chain;
+	HddClientRequest *fol;
+	int i, ok;
+
+	if (f == NULL)
+		return;
+
+	chain = flight_chain(f->server, f->cmd & 0xffffffff);
+	ok = req->done && req->resp != (HddBitResp)-1;
+
+	pthread_mutex_lock(&chain->lock);
+	flight_unlink(chain, f);
+	for (i = 0; i < f->nfollowers; i++)
+	{
+		fol = f->follower[i];
+		fol->flight = NULL;
+		if (!ok)
+			continue;   // (not done and no flight: it goes out itself)
+
+		if (get_op(req->resp) == HDD_BLOCK_READ && ((req->resp >> 32) & 1) == 0)
+			memcpy(fol->buf, req->buf, get_size(req->resp));
+		fol->resp = req->resp;
+		fol->crc = req->crc;
+		fol->done = 1;
+		__atomic_add_fetch(&stat_coalesced, 1, __ATOMIC_RELAXED);
+	}
+	pthread_cond_broadcast(&chain->landed);
+	pthread_mutex_unlock(&chain->lock);
+
+	req->flight = NULL;
+	free(f);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  flight_follow: waits for the read a request shares to be answered, 1 if
+//                 it was (the request is done), 0 if the request has to go
+//                 out on its own
+
+static int flight_follow(HddConnection *c, HddClientRequest *req)
+{
+	HddFlightChain *chain = flight_chain(flight_server(c), req->cmd & 0xffffffff);
+	HddFlight *f;
+	int i, done;
+
+	pthread_mutex_lock(&chain->lock);
+	while (!req->done && req->flight != NULL && !req->flight->posted)
+	{
+		if (waiter == NULL)
+		{
+			pthread_cond_wait(&chain->landed, &chain->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&chain->lock);   // the leader may be a coroutine of this thread
+		waiter(-1, 0);
+		pthread_mutex_lock(&chain->lock);
+	}
+
+	if (!req->done && (f = req->flight) != NULL)   // a posted leader not answered yet
+	{
+		for (i = 0; i < f->nfollowers; i++)
+		{
+			if (f->follower[i] == req)
+			{
+				f->follower[i] = f->follower[--f->nfollowers];
+				break;
+			}
+		}
+		req->flight = NULL;
+	}
+	done = req->done;
+	pthread_mutex_unlock(&chain->lock);
+	return done;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  follow_resolve: settles the connection's posted reads that share another
+//                  (before anything that must come after them)
+
+static void follow_resolve(HddConnection *c)
+{
+	int i;
+
+	for (i = 0; i < c->nfollow; i++)
+	{
+		if (!flight_follow(c, c->follow[i]))
+			client_request(c, c->follow[i]);
+	}
+	c->nfollow = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  flight_forget: ends the sharing of reads of a block (or all the server's
+//                 blocks if bid is -1) that are already on the wire
+
+static void flight_forget(HddConnection *c, int64_t bid)
+{
+	uint64_t server = flight_server(c);
+	HddFlightChain *chain;
+	HddFlight *f, *next;
+	int i;
+
+	pthread_once(&flights_once, flights_init);
+	for (i = 0; i < HDD_FLIGHT_BUCKETS; i++)
+	{
+		chain = &flights[i];
+		if (bid != -1 && chain != flight_chain(server, (uint32_t)bid))
+			continue;
+
+		pthread_mutex_lock(&chain->lock);
+		for (f = chain->head; f != NULL; f = next)
+		{
+			next = f->next;
+			if (f->server == server && (bid == -1 || (f->cmd & 0xffffffff) == (uint64_t)bid))
+			{
+				flight_unlink(chain, f);   // the leader still lands it, but nobody new joins
+				f->next = NULL;
+			}
+		}
+		pthread_mutex_unlock(&chain->lock);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_operation
+// Description  : This the client operation that sends a request to the CRUD
+//                server.   It will:
+//
+//                1) if INIT make a connection to the server
+//                2) send any request to the server, returning results
+//                3) if CLOSE, will close the connection
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+
+HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf) {
+	HddConnection *c = connection();
+	HddClientRequest req = { .cmd = cmd, .buf = buf };
+
+	if (has_payload(cmd) && (c->caps & HDD_CAP_CHECKSUM))
+		req.crc = hdd_crc32c(0, buf, get_size(cmd));
+
+	return hdd_client_request(&req);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_checked_operation
+// Description  : As hdd_client_operation, but when the server granted
+//                HDD_CAP_CHECKSUM every payload carries a CRC32C trailer:
+//                on CREATE/OVERWRITE the trailer is *crc, on READ the
+//                received trailer is stored in *crc for the caller to verify.
+//
+// Inputs       : cmd - the request opcode for the command
+//                buf - the block to be read/written from (READ/WRITE)
+//                crc - the block checksum (in on writes, out on reads)
+// Outputs      : the response structure encoded as needed
+
+HddBitResp hdd_client_checked_operation(HddBitCmd cmd, void *buf, uint32_t *crc) {
+
+	HddClientRequest req = { .cmd = cmd, .buf = buf, .crc = *crc };
+	HddBitResp response = hdd_client_request(&req);
+
+	*crc = req.crc;
+	return response;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_request
+// Description  : Sends a request and waits for its response.  Responses to
+//                earlier posted requests are collected on the way, so the
+//                new request is already on the wire while they arrive.  A
+//                read of a block already being read the same way shares
+//                that read's answer instead.
+//
+// Inputs       : req - the request
+// Outputs      : the response structure encoded as needed
+
+HddBitResp hdd_client_request(HddClientRequest *req) {
+	HddConnection *c = connection();
+
+	req->done = 0;
+	req->flight = NULL;
+
+	if (c->offline != NULL)   // no server, answer it here
+	{
+		req->resp = c->offline(c->offline_ctx, req);
+		req->done = 1;
+
+		if (get_flag(req->cmd) == HDD_INIT && ((req->resp >> 32) & 1) == 0)
+			c->caps = get_size(req->resp) & HDD_CLIENT_CAPS;
+		else if (get_flag(req->cmd) == HDD_SAVE_AND_CLOSE)
+			c->caps = 0;
+
+		return req->resp;
+	}
+
+	if (get_op(req->cmd) == HDD_BLOCK_READ)
+	{
+		if (flight_join(c, req, 0) && flight_follow(c, req))
+			return req->resp;   // shared
+
+		client_request(c, req);
+		flight_land(req);
+		return req->resp;
+	}
+
+	follow_resolve(c);
+	flight_forget(c, is_device(req->cmd) ? -1 : (int64_t)(req->cmd & 0xffffffff));
+	return client_request(c, req);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_post
+// Description  : Sends a request without waiting for the response, which
+//                is collected by hdd_client_wait or by a later request
+//                (writes to replicas are answered before it returns)
+//
+// Inputs       : req - the request (must stay valid until done)
+// Outputs      : 0 if sent, -1 on failure
+
+int hdd_client_post(HddClientRequest *req) {
+	HddConnection *c = connection();
+
+	req->done = 0;
+	req->flight = NULL;
+
+	if (c->offline != NULL)   // answered at once, waiting finds it done
+	{
+		req->resp = c->offline(c->offline_ctx, req);
+		req->done = 1;
+		return 0;
+	}
+
+	if (get_op(req->cmd) == HDD_BLOCK_READ)
+	{
+		if (flight_join(c, req, 1))
+			return 0;   // shares one on the wire, waiting collects it
+
+		if (client_post(c, req) == -1)
+		{
+			flight_land(req);   // (the reads sharing it go out themselves)
+			return -1;
+		}
+		return 0;
+	}
+
+	follow_resolve(c);
+	flight_forget(c, is_device(req->cmd) ? -1 : (int64_t)(req->cmd & 0xffffffff));
+	return client_post(c, req);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_wait
+// Description  : Waits for the response to a posted request
+//
+// Inputs       : req - the posted request
+// Outputs      : the response structure encoded as needed
+
+HddBitResp hdd_client_wait(HddClientRequest *req) {
+	HddConnection *c = connection();
+	int i, j;
+
+	for (i = 0; i < c->nfollow; i++)   // sharing another read's answer
+	{
+		if (c->follow[i] == req)
+		{
+			c->follow[i] = c->follow[--c->nfollow];
+			if (!flight_follow(c, req))
+				client_request(c, req);
+			return req->resp;
+		}
+	}
+
+	if (req->done)
+		return req->resp;
+
+	if (c->peer == NULL)
+		return (drain(c, req) == -1) ? -1 : req->resp;
+
+	for (i = 0; i < c->npeers; i++)   // the peer it was posted to
+	{
+		for (j = 0; j < c->peer[i].npending; j++)
+		{
+			if (c->peer[i].pending[j] == req)
+				return (drain(&c->peer[i], req) == -1) ? -1 : req->resp;
+		}
+	}
+
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_disconnect
+// Description  : Closes the calling thread's connection without asking the
+//                server to save (for sessions that only read)
+//
+// Inputs       : none
+// Outputs      : 0 if closed, -1 if there was no connection
+
+int hdd_client_disconnect(void) {
+	HddConnection *c = connection();
+	int i;
+
+	follow_resolve(c);
+
+	if (c->peer == NULL)
+		return server_disconnect(c);
+
+	for (i = 0; i < c->npeers; i++)
+		server_disconnect(&c->peer[i]);
+	free(c->peer);
+	c->peer = NULL;
+	c->npeers = 0;
+	c->caps = 0;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_client_offline
+// Description  : Has "serve" answer the calling thread's requests in place of
+//                a server (NULL goes back to the network)
+//
+// Inputs       : serve - answers a request, ctx - passed to it
+// Outputs      : none
+
+void hdd_client_offline(HddClientServe serve, void *ctx) {
+	HddConnection *c = connection();
+
+	c->offline = serve;
+	c->offline_ctx = ctx;
+	c->caps = 0;
+}
+
+//
+// Unit testing
+
+#define HDD_CLIENT_UTEST_SHARDS 4       // endpoints the shard test places keys on
+#define HDD_CLIENT_UTEST_KEYS 20000     // keys it places
+#define HDD_CLIENT_UTEST_REPLICAS 3     // replicas the replica test writes to
+#define HDD_CLIENT_UTEST_BLOCK 4096     // largest block it sends or reads
+
+// A replica the replica test talks to over a socket pair
+typedef struct {
+	int       fd;          // its end
+	pthread_t thread;      // answering what comes over it
+	uint32_t  delay_us;    // how long it takes over a read
+	uint32_t  skew;        // added to the block IDs it hands out
+	int       fail;        // fails writes if set
+	uint8_t   fill;        // what its blocks read as
+	int       commands;    // commands it was sent (atomic)
+} HddClientUtestReplica;
+
+///////////////////////////////////////////////////////////////////////////////
+//  client_utest_cmd: a block command for the unit tests
+
+static HddBitCmd client_utest_cmd(int op, int flags, uint32_t size, uint32_t bid)
+{
+	return ((HddBitCmd)op << 62) | ((HddBitCmd)size << 36) | ((HddBitCmd)flags << 33) | bid;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_utest_shards
+// Description  : checks the placement ring against a plain search of it,
+//                that keys spread evenly and only move to an endpoint that
+//                is added, and that commands are routed to the shard in
+//                their block IDs (sets, then clears, the shard endpoints)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int client_utest_shards(void)
+{
+	char address[HDD_CLIENT_UTEST_SHARDS + 1][16], key[32];
+	const char *addresses[HDD_CLIENT_UTEST_SHARDS + 1];
+	unsigned short ports[HDD_CLIENT_UTEST_SHARDS + 1];
+	uint32_t load[HDD_CLIENT_UTEST_SHARDS + 1] = { 0 }, moved = 0, h;
+	uint8_t *placed = malloc(HDD_CLIENT_UTEST_KEYS);
+	HddConnection c = HDD_CONNECTION_INIT;
+	HddBitCmd local;
+	int i, k, n, s, want;
+
+	for (i = 0; i <= HDD_CLIENT_UTEST_SHARDS; i++)
+	{
+		snprintf(address[i], sizeof(address[i]), "10.0.0.%d", i + 1);
+		addresses[i] = address[i];
+		ports[i] = 3000 + i;
+	}
+
+	for (n = HDD_CLIENT_UTEST_SHARDS; n <= HDD_CLIENT_UTEST_SHARDS + 1; n++)
+	{
+		if (placed == NULL || hdd_client_shards(n, addresses, ports) == -1)
+		{
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : setting %d shards failed", n);
+			free(placed);
+			return -1;
+		}
+
+		for (i = 1; i < n * HDD_SHARD_VNODES; i++)   // sorted
+		{
+			if (shard_ring[i - 1].point > shard_ring[i].point)
+			{
+				hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : ring out of order at point %d", i);
+				free(placed);
+				return -1;
+			}
+		}
+
+		memset(load, 0x0, sizeof(load));
+		for (k = 0; k < HDD_CLIENT_UTEST_KEYS; k++)
+		{
+			snprintf(key, sizeof(key), "file%05d.dat", k);
+			h = shard_hash(key, strlen(key));
+			for (i = 0; i < n * HDD_SHARD_VNODES && shard_ring[i].point < h; i++)
+				;   // the first point at or after the key, wrapping
+			want = shard_ring[(i == n * HDD_SHARD_VNODES) ? 0 : i].shard;
+
+			if ((s = shard_locate(h)) != want)
+			{
+				hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : [%s] placed on %d, not %d", key, s, want);
+				free(placed);
+				return -1;
+			}
+			if (n > HDD_CLIENT_UTEST_SHARDS && s != placed[k])   // moved, so to the new one
+			{
+				if (s != HDD_CLIENT_UTEST_SHARDS)
+				{
+					hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : [%s] moved from %d to %d", key, placed[k], s);
+					free(placed);
+					return -1;
+				}
+				moved++;
+			}
+			placed[k] = s;
+			load[s]++;
+		}
+
+		for (i = 0; i < n; i++)   // each within half of its share either way
+		{
+			if (load[i] * n * 2 < HDD_CLIENT_UTEST_KEYS || load[i] * n * 2 > HDD_CLIENT_UTEST_KEYS * 3)
+			{
+				hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : %u of %d keys on shard %d of %d",
+					load[i], HDD_CLIENT_UTEST_KEYS, i, n);
+				free(placed);
+				return -1;
+			}
+		}
+	}
+	free(placed);
+
+	// About a fifth of the keys moved to the fifth endpoint
+	if (moved * (HDD_CLIENT_UTEST_SHARDS + 1) * 2 < HDD_CLIENT_UTEST_KEYS ||
+		moved * (HDD_CLIENT_UTEST_SHARDS + 1) > HDD_CLIENT_UTEST_KEYS * 2)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : %u of %d keys moved to a fifth shard", moved, HDD_CLIENT_UTEST_KEYS);
+		return -1;
+	}
+
+	// The meta block and unplaced blocks go to shard 0, placed ones to
+	// their key's shard, and the rest to the shard in their block ID
+	c.npeers = HDD_CLIENT_UTEST_SHARDS + 1;
+	if (shard_route(&c, client_utest_cmd(HDD_BLOCK_READ, HDD_META_BLOCK, 100, 0), &local) != 0 ||
+		shard_route(&c, client_utest_cmd(HDD_BLOCK_CREATE, HDD_NULL_FLAG, 100, 0), &local) != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : meta or unplaced block not routed to shard 0");
+		return -1;
+	}
+	c.place = shard_hash("file00042.dat", strlen("file00042.dat"));
+	c.placed = 1;
+	if (shard_route(&c, client_utest_cmd(HDD_BLOCK_CREATE, HDD_NULL_FLAG, 100, 0), &local) != shard_locate(c.place) ||
+		c.placed || shard_route(&c, client_utest_cmd(HDD_BLOCK_CREATE, HDD_NULL_FLAG, 100, 0), &local) != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : placed block not routed to its key's shard (just once)");
+		return -1;
+	}
+	for (s = 0; s <= HDD_CLIENT_UTEST_SHARDS + 1; s++)
+	{
+		h = ((uint32_t)s << HDD_SHARD_SHIFT) | 77;
+		want = (s <= HDD_CLIENT_UTEST_SHARDS) ? s : -1;   // (no such shard)
+		if (shard_route(&c, client_utest_cmd(HDD_BLOCK_OVERWRITE, HDD_NULL_FLAG, 100, h), &local) != want ||
+			(local & 0xffffffff) != 77 || get_op(local) != HDD_BLOCK_OVERWRITE || get_size(local) != 100)
+		{
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : block %x not routed to shard %d as block 77", h, want);
+			return -1;
+		}
+	}
+
+	hdd_client_shards(0, NULL, NULL);
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  client_utest_replica: answers the commands sent to a replica of the
+//                        replica test until its socket is closed (writes
+//                        with the next block ID, reads with a block of its
+//                        fill byte)
+
+static void *client_utest_replica(void *arg)
+{
+	HddClientUtestReplica *r = arg;
+	uint8_t buf[HDD_CLIENT_UTEST_BLOCK];
+	uint32_t next = 1, red;
+	HddBitCmd cmd;
+	HddBitResp resp;
+	ssize_t got;
+
+	while (1)
+	{
+		for (red = 0; red < sizeof(cmd); red += got)
+		{
+			if ((got = read(r->fd, (char *)&cmd + red, sizeof(cmd) - red)) <= 0)
+				return NULL;
+		}
+		cmd = ntohll64(cmd);
+		__atomic_add_fetch(&r->commands, 1, __ATOMIC_RELAXED);
+
+		for (red = 0; has_payload(cmd) && red < get_size(cmd); red += got)
+		{
+			if ((got = read(r->fd, buf, get_size(cmd) - red)) <= 0)
+				return NULL;
+		}
+
+		if (get_op(cmd) == HDD_BLOCK_READ)
+		{
+			usleep(r->delay_us);
+			memset(buf, r->fill, get_size(cmd));
+			resp = htonll64(cmd);
+			if (write(r->fd, &resp, sizeof(resp)) != sizeof(resp) ||
+				write(r->fd, buf, get_size(cmd)) != get_size(cmd))
+				return NULL;
+			continue;
+		}
+
+		resp = (get_op(cmd) == HDD_BLOCK_CREATE) ? (cmd & ~(HddBitCmd)0xffffffff) | (next++ + r->skew) : cmd;
+		resp = htonll64(r->fail ? resp | (HddBitResp)1 << 32 : resp);
+		if (write(r->fd, &resp, sizeof(resp)) != sizeof(resp))
+			return NULL;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_utest_replicas
+// Description  : writes to replicas that answer alike, differently and
+//                not at all, checking which go stale; works out hedge
+//                delays from read latencies; and reads from a slow replica,
+//                which is hedged to another
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int client_utest_replicas(void)
+{
+	HddClientUtestReplica rep[HDD_CLIENT_UTEST_REPLICAS];
+	HddConnection c = HDD_CONNECTION_INIT, peer[HDD_CLIENT_UTEST_REPLICAS];
+	uint8_t buf[HDD_CLIENT_UTEST_BLOCK], expect[HDD_CLIENT_UTEST_BLOCK];
+	HddClientRequest req = { .buf = buf };
+	uint64_t stale = stat_stale, hedged = stat_hedged, wins = stat_hedge_wins;
+	int sv[2], i, r = -1;
+
+	memset(rep, 0x0, sizeof(rep));
+	for (i = 0; i < HDD_CLIENT_UTEST_REPLICAS; i++)
+	{
+		peer[i] = (HddConnection)HDD_CONNECTION_INIT;
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+			break;
+		peer[i].sfd = sv[0];
+		rep[i].fd = sv[1];
+		rep[i].fill = 'a' + i;
+		if (pthread_create(&rep[i].thread, NULL, client_utest_replica, &rep[i]) != 0)
+		{
+			close(sv[0]);
+			close(sv[1]);
+			break;
+		}
+	}
+	c.peer = peer;
+	c.npeers = i;
+	if (i < HDD_CLIENT_UTEST_REPLICAS)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : making replica %d failed [%s]", i, strerror(errno));
+		goto done;
+	}
+
+	// The third hands out different block IDs, so it goes stale and gets
+	// no more writes
+	rep[2].skew = 1000;
+	memset(buf, 'w', HDD_CLIENT_UTEST_BLOCK);
+	req.cmd = client_utest_cmd(HDD_BLOCK_CREATE, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 0);
+	if (replica_write(&c, &req) != client_utest_cmd(HDD_BLOCK_CREATE, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 1) ||
+		peer[0].stale || peer[1].stale || !peer[2].stale || stat_stale != stale + 1 ||
+		replica_write(&c, &req) != client_utest_cmd(HDD_BLOCK_CREATE, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 2) ||
+		rep[2].commands != 1)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : replica answering differently not dropped");
+		goto done;
+	}
+	if (replica_live(&c, 2, -1) != 0 || replica_live(&c, 0, 0) != 1 || replica_live(&c, 1, 1) != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : stale replica still picked");
+		goto done;
+	}
+
+	// Reads wait the percentile of the recent latencies, and never less
+	// than the least wait
+	hdd_client_hedge(50, 10);
+	for (i = 1; i < HDD_HEDGE_WARMUP; i++)
+		read_timed(&c, i);
+	if (c.hedge_us != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : hedge delay set before %d reads", HDD_HEDGE_WARMUP);
+		goto done;
+	}
+	read_timed(&c, HDD_HEDGE_WARMUP);
+	if (c.hedge_us != HDD_HEDGE_WARMUP / 2)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : hedge delay %u us, not %u", c.hedge_us, HDD_HEDGE_WARMUP / 2);
+		goto done;
+	}
+	hdd_client_hedge(50, 2000);
+	for (i = 0; i < HDD_HEDGE_UPDATE; i++)
+		read_timed(&c, 1);
+	if (c.hedge_us != 2000)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : hedge delay %u us, not the least of 2000", c.hedge_us);
+		goto done;
+	}
+
+	// A slow read is hedged to the next replica, whose answer wins; the
+	// slow answer is collected later and dropped
+	rep[0].delay_us = 200000;
+	req.cmd = client_utest_cmd(HDD_BLOCK_READ, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 1);
+	req.done = 0;
+	memset(expect, rep[1].fill, HDD_CLIENT_UTEST_BLOCK);
+	if (replica_read(&c, &req) != req.cmd || memcmp(buf, expect, HDD_CLIENT_UTEST_BLOCK) ||
+		stat_hedged != hedged + 1 || stat_hedge_wins != wins + 1 || peer[0].npending != 1 ||
+		drain(&peer[0], NULL) == -1)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : slow read not answered by its hedge");
+		goto done;
+	}
+
+	// One answered in time isn't, nor is any when hedging is off
+	memset(expect, rep[0].fill, HDD_CLIENT_UTEST_BLOCK);
+	for (i = 0; i < 2; i++)
+	{
+		rep[0].delay_us = (i == 0) ? 0 : 20000;
+		hdd_client_hedge((i == 0) ? 50 : 0, 2000);
+		req.done = 0;
+		if (replica_read(&c, &req) != req.cmd || memcmp(buf, expect, HDD_CLIENT_UTEST_BLOCK) ||
+			stat_hedged != hedged + 1)
+		{
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read hedged %s", (i == 0) ? "in time" : "with hedging off");
+			goto done;
+		}
+	}
+
+	// A replica failing a write goes stale too, leaving one
+	rep[1].fail = 1;
+	req.cmd = client_utest_cmd(HDD_BLOCK_OVERWRITE, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 1);
+	if (replica_write(&c, &req) != req.cmd || peer[0].stale || !peer[1].stale ||
+		replica_live(&c, 1, -1) != 0 || replica_live(&c, 0, 0) != -1)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : replica failing a write not dropped");
+		goto done;
+	}
+	r = 0;
+
+done:
+	hdd_client_hedge(HDD_HEDGE_PERCENTILE, HDD_HEDGE_MIN_US);
+	for (i = 0; i < c.npeers; i++)   // the replicas see the end of their sockets
+	{
+		close(peer[i].sfd);
+		pthread_join(rep[i].thread, NULL);
+		close(rep[i].fd);
+	}
+	return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//  client_utest_land: answers a flight's leader a little later (on its own
+//                     thread, as if collected there)
+
+static void *client_utest_land(void *arg)
+{
+	HddClientRequest *leader = arg;
+
+	usleep(20000);
+	leader->resp = leader->cmd;
+	leader->done = 1;
+	flight_land(leader);
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_utest_flights
+// Description  : has reads join reads already on the wire (not on a server,
+//                the answers are made up), checking which share and what
+//                they get: the same read shares, a different one doesn't,
+//                a failed answer sends the sharers out on their own, a
+//                forgotten flight takes nobody new, and a read waiting on a
+//                posted leader stops sharing
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int client_utest_flights(void)
+{
+	HddConnection c = HDD_CONNECTION_INIT;
+	uint8_t buf[HDD_FLIGHT_FOLLOWERS + 3][HDD_CLIENT_UTEST_BLOCK];
+	HddClientRequest req[HDD_FLIGHT_FOLLOWERS + 3];
+	HddBitCmd read = client_utest_cmd(HDD_BLOCK_READ, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 7);
+	uint64_t coalesced = stat_coalesced;
+	pthread_t lander;
+	int i;
+
+	c.address = "10.0.0.99";   // (nobody else's reads)
+	c.port = 3999;
+	memset(req, 0x0, sizeof(req));
+	for (i = 0; i < HDD_FLIGHT_FOLLOWERS + 3; i++)
+	{
+		req[i].cmd = read;
+		req[i].buf = buf[i];
+	}
+
+	// The same read shares the leader's, another offset or block doesn't
+	req[3].offset = 64;
+	req[4].cmd = client_utest_cmd(HDD_BLOCK_READ, HDD_NULL_FLAG, HDD_CLIENT_UTEST_BLOCK, 8);
+	if (flight_join(&c, &req[0], 0) != 0 || req[0].flight == NULL ||
+		flight_join(&c, &req[1], 0) != 1 || req[1].flight != req[0].flight ||
+		flight_join(&c, &req[2], 1) != 1 || c.nfollow != 1 ||
+		flight_join(&c, &req[3], 0) != 0 || flight_join(&c, &req[4], 0) != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : reads shared (or not) wrongly");
+		return -1;
+	}
+
+	// Its answer goes to all that share it
+	memset(buf[0], 'x', HDD_CLIENT_UTEST_BLOCK);
+	req[0].resp = read;
+	req[0].done = 1;
+	flight_land(&req[0]);
+	follow_resolve(&c);   // (answered, so nothing is sent)
+	for (i = 1; i <= 2; i++)
+	{
+		if (!req[i].done || req[i].resp != read || req[i].flight != NULL || memcmp(buf[i], buf[0], HDD_CLIENT_UTEST_BLOCK))
+		{
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read %d sharing a flight not answered", i);
+			return -1;
+		}
+	}
+	if (c.nfollow != 0 || stat_coalesced != coalesced + 2)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : shared reads not counted or still pending");
+		return -1;
+	}
+	flight_land(&req[3]);   // (unanswered, nobody shares them)
+	flight_land(&req[4]);
+
+	// A failed answer, and a forgotten flight, send those sharing on their own
+	memset(req, 0x0, 4 * sizeof(HddClientRequest));
+	for (i = 0; i < 4; i++)
+	{
+		req[i].cmd = read;
+		req[i].buf = buf[i];
+	}
+	flight_forget(&c, 7);   // (nothing to forget)
+	if (flight_join(&c, &req[0], 0) != 0 || flight_join(&c, &req[1], 0) != 1)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read did not share a new flight");
+		return -1;
+	}
+	flight_forget(&c, 7);
+	if (flight_join(&c, &req[2], 0) != 0 || flight_join(&c, &req[3], 0) != 1 || req[3].flight != req[2].flight)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read joined a forgotten flight");
+		return -1;
+	}
+	req[0].resp = read;
+	req[0].done = 1;
+	flight_land(&req[0]);   // (joined before it was forgotten)
+	req[2].resp = -1;
+	req[2].done = 1;
+	flight_land(&req[2]);
+	if (!req[1].done || req[3].done || req[3].flight != NULL || stat_coalesced != coalesced + 3)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : failed or forgotten flight answered wrongly");
+		return -1;
+	}
+
+	// A read waits for a leader landed elsewhere, but not for a posted one
+	memset(req, 0x0, 4 * sizeof(HddClientRequest));
+	for (i = 0; i < 4; i++)
+	{
+		req[i].cmd = read;
+		req[i].buf = buf[i];
+	}
+	if (flight_join(&c, &req[0], 0) != 0 || flight_join(&c, &req[1], 0) != 1 ||
+		pthread_create(&lander, NULL, client_utest_land, &req[0]) != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read did not share a new flight");
+		return -1;
+	}
+	i = flight_follow(&c, &req[1]);
+	pthread_join(lander, NULL);
+	if (i != 1 || !req[1].done || req[1].resp != read)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read sharing a synchronous one not answered");
+		return -1;
+	}
+	if (flight_join(&c, &req[2], 1) != 0 || flight_join(&c, &req[3], 0) != 1 ||
+		flight_follow(&c, &req[3]) != 0 || req[3].flight != NULL || req[2].flight->nfollowers != 0)
+	{
+		hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read kept waiting on a posted one");
+		return -1;
+	}
+	flight_land(&req[2]);
+
+	// Only so many share one, the next leads another
+	memset(req, 0x0, sizeof(req));
+	for (i = 0; i < HDD_FLIGHT_FOLLOWERS + 2; i++)
+	{
+		req[i].cmd = read;
+		req[i].buf = buf[i];
+		if (flight_join(&c, &req[i], 0) != (i != 0 && i <= HDD_FLIGHT_FOLLOWERS))
+		{
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CLIENT_UTEST : read %d of a full flight shared wrongly", i);
+			return -1;
+		}
+	}
+	flight_forget(&c, -1);
+	flight_land(&req[0]);
+	flight_land(&req[HDD_FLIGHT_FOLLOWERS + 1]);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddClientUnitTest
+// Description  : checks how the client spreads blocks over shards, copies
+//                them to replicas and hedges reads of them, and shares
+//                identical reads
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddClientUnitTest(void)
+{
+	if (client_utest_shards() == -1 || client_utest_replicas() == -1 || client_utest_flights() == -1)
+		return -1;
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_CLIENT_UTEST : shard routing, replica staleness, hedging and coalescing checked");
+	return 0;
+}
@@ -0,0 +1,425 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_crc.c
+//  Description    : This is the implementation of the CRC32C block checksums.
+//                   The hardware version runs three interleaved crc32
+//                   instruction streams and merges them with precomputed
+//                   "zeros" operators; the portable version is slicing-by-8.
+//
+//  Author         :
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Project Includes
+#include <hdd_crc.h>
+#include <hdd_driver.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_CRC_POLY 0x82f63b78          // CRC-32C polynomial (reflected)
+#define HDD_CRC_LONG 8192                // Interleaved stream length (long)
+#define HDD_CRC_SHORT 256                // Interleaved stream length (short)
+#define HDD_CRC_BENCH_BYTES (64 << 20)   // Bytes to checksum per benchmark row
+
+// Type for a checksum implementation
+typedef uint32_t (*HddCrcFunction)(uint32_t crc, const void *buf, size_t len);
+
+//
+// Global data
+
+static pthread_once_t hdd_crc_once = PTHREAD_ONCE_INIT;   // Builds the tables, once
+static uint32_t hdd_crc_table[8][256];       // Slicing-by-8 tables
+static uint32_t hdd_crc_long[4][256];        // Shift operator over HDD_CRC_LONG zeros
+static uint32_t hdd_crc_short[4][256];       // Shift operator over HDD_CRC_SHORT zeros
+static HddCrcFunction hdd_crc_impl = NULL;   // Implementation picked at initialization
+
+//
+// Local functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gf2_matrix_times / gf2_matrix_square
+// Description  : multiply a vector (or square a matrix) over GF(2), used to
+//                build the operators that append runs of zeros to a CRC
+//
+// Inputs       : mat - 32x32 bit matrix, vec - 32 bit vector
+// Outputs      : the product
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_crc_zeros
+// Description  : builds the byte-wise tables for the operator that shifts a
+//                CRC over "len" zero bytes (len must be a power of two)
+//
+// Inputs       : zeros - the tables to fill, len - number of zero bytes
+// Outputs      : none
+
+static void hdd_crc_zeros(uint32_t zeros[][256], size_t len) {
+	uint32_t even[32], odd[32], row = 1;
+	uint32_t *op = even;
+
+	// Operator for one zero bit, then two and four zero bits
+	odd[0] = HDD_CRC_POLY;
+	for (int n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	// Keep squaring (one zero byte, two, four, ...) until len is used up
+	for (;;) {
+		gf2_matrix_square(even, odd);
+		op = even;
+		len >>= 1;
+		if (len == 0)
+			break;
+		gf2_matrix_square(odd, even);
+		op = odd;
+		len >>= 1;
+		if (len == 0)
+			break;
+	}
+
+	for (int n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, (uint32_t)n << 24);
+	}
+}
+
+static inline uint32_t hdd_crc_shift(uint32_t zeros[][256], uint32_t crc) {
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+	       zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_crc32c_bytewise
+// Description  : reference one-table, one-byte-at-a-time implementation
+//
+// Inputs       : crc - running checksum, buf - data, len - bytes
+// Outputs      : the extended checksum
+
+static uint32_t hdd_crc32c_bytewise(uint32_t crc, const void *buf, size_t len) {
+	const unsigned char *next = buf;
+
+	crc = ~crc;
+	while (len--)
+		crc = hdd_crc_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_crc32c_sw
+// Description  : portable slicing-by-8 implementation
+//
+// Inputs       : crc - running checksum, buf - data, len - bytes
+// Outputs      : the extended checksum
+
+static uint32_t hdd_crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+	const unsigned char *next = buf;
+	uint64_t word;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)next & 7)) {
+		crc = hdd_crc_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&word, next, sizeof(word));
+		word ^= crc;
+		crc = hdd_crc_table[7][word & 0xff] ^
+		      hdd_crc_table[6][(word >> 8) & 0xff] ^
+		      hdd_crc_table[5][(word >> 16) & 0xff] ^
+		      hdd_crc_table[4][(word >> 24) & 0xff] ^
+		      hdd_crc_table[3][(word >> 32) & 0xff] ^
+		      hdd_crc_table[2][(word >> 40) & 0xff] ^
+		      hdd_crc_table[1][(word >> 48) & 0xff] ^
+		      hdd_crc_table[0][word >> 56];
+		next += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = hdd_crc_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_crc32c_hw
+// Description  : SSE4.2 implementation, three crc32 streams in parallel to
+//                hide the instruction latency, merged with the shift tables
+//
+// Inputs       : crc - running checksum, buf - data, len - bytes
+// Outputs      : the extended checksum
+
+__attribute__((target("sse4.2")))
+static uint32_t hdd_crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+	const unsigned char *next = buf, *end;
+	uint64_t crc0, crc1, crc2, w0, w1, w2;
+
+	crc0 = (uint32_t)~crc;
+	while (len && ((uintptr_t)next & 7)) {
+		crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+		len--;
+	}
+
+	// Three streams of HDD_CRC_LONG bytes, then of HDD_CRC_SHORT bytes
+	while (len >= HDD_CRC_LONG * 3) {
+		crc1 = crc2 = 0;
+		end = next + HDD_CRC_LONG;
+		do {
+			memcpy(&w0, next, 8);
+			memcpy(&w1, next + HDD_CRC_LONG, 8);
+			memcpy(&w2, next + HDD_CRC_LONG * 2, 8);
+			crc0 = _mm_crc32_u64(crc0, w0);
+			crc1 = _mm_crc32_u64(crc1, w1);
+			crc2 = _mm_crc32_u64(crc2, w2);
+			next += 8;
+		} while (next < end);
+		crc0 = hdd_crc_shift(hdd_crc_long, (uint32_t)crc0) ^ crc1;
+		crc0 = hdd_crc_shift(hdd_crc_long, (uint32_t)crc0) ^ crc2;
+		next += HDD_CRC_LONG * 2;
+		len -= HDD_CRC_LONG * 3;
+	}
+	while (len >= HDD_CRC_SHORT * 3) {
+		crc1 = crc2 = 0;
+		end = next + HDD_CRC_SHORT;
+		do {
+			memcpy(&w0, next, 8);
+			memcpy(&w1, next + HDD_CRC_SHORT, 8);
+			memcpy(&w2, next + HDD_CRC_SHORT * 2, 8);
+			crc0 = _mm_crc32_u64(crc0, w0);
+			crc1 = _mm_crc32_u64(crc1, w1);
+			crc2 = _mm_crc32_u64(crc2, w2);
+			next += 8;
+		} while (next < end);
+		crc0 = hdd_crc_shift(hdd_crc_short, (uint32_t)crc0) ^ crc1;
+		crc0 = hdd_crc_shift(hdd_crc_short, (uint32_t)crc0) ^ crc2;
+		next += HDD_CRC_SHORT * 2;
+		len -= HDD_CRC_SHORT * 3;
+	}
+
+	// Whatever is left, one stream
+	while (len >= 8) {
+		memcpy(&w0, next, 8);
+		crc0 = _mm_crc32_u64(crc0, w0);
+		next += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+	return ~(uint32_t)crc0;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_crc_init
+// Description  : builds the tables and picks the implementation for this CPU
+//
+// Inputs       : none
+// Outputs      : none
+
+static void hdd_crc_init(void) {
+	uint32_t crc;
+
+	for (int n = 0; n < 256; n++) {
+		crc = n;
+		for (int k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ HDD_CRC_POLY : crc >> 1;
+		hdd_crc_table[0][n] = crc;
+	}
+	for (int n = 0; n < 256; n++) {
+		crc = hdd_crc_table[0][n];
+		for (int k = 1; k < 8; k++) {
+			crc = hdd_crc_table[0][crc & 0xff] ^ (crc >> 8);
+			hdd_crc_table[k][n] = crc;
+		}
+	}
+	hdd_crc_zeros(hdd_crc_long, HDD_CRC_LONG);
+	hdd_crc_zeros(hdd_crc_short, HDD_CRC_SHORT);
+
+	hdd_crc_impl = hdd_crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		hdd_crc_impl = hdd_crc32c_hw;
+#endif
+}
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_crc32c
+// Description  : extends a CRC32C over a buffer
+//
+// Inputs       : crc - running checksum (0 to start), buf - data, len - bytes
+// Outputs      : the extended checksum
+
+uint32_t hdd_crc32c(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&hdd_crc_once, hdd_crc_init);
+	return hdd_crc_impl(crc, buf, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddCrcUnitTest
+// Description  : checks every implementation against the standard check value
+//                and against each other over random lengths and alignments
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddCrcUnitTest(void) {
+
+	// Local variables
+	unsigned char *buf;
+	uint32_t len, off, expected, crc;
+	HddCrcFunction impls[3];
+	int nimpls = 0, i, j;
+
+	pthread_once(&hdd_crc_once, hdd_crc_init);
+	impls[nimpls++] = hdd_crc32c_sw;
+	impls[nimpls++] = hdd_crc32c;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		impls[nimpls++] = hdd_crc32c_hw;
+#endif
+
+	// Standard check value for "123456789"
+	for (j = 0; j < nimpls; j++) {
+		if (impls[j](0, "123456789", 9) != 0xe3069283) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CRC_UNIT_TEST : bad check value [impl %d]", j);
+			return(-1);
+		}
+	}
+
+	// Random buffers, lengths and alignments, all must match the reference
+	buf = malloc(HDD_MAX_BLOCK_SIZE + 8);
+	for (i = 0; i < HDD_MAX_BLOCK_SIZE + 8; i++)
+		buf[i] = getRandomValue(0, 0xff);
+	for (i = 0; i < 256; i++) {
+		len = (i < 128) ? getRandomValue(0, 4 * HDD_CRC_SHORT) : getRandomValue(0, HDD_MAX_BLOCK_SIZE);
+		off = getRandomValue(0, 7);
+		expected = hdd_crc32c_bytewise(0, &buf[off], len);
+		for (j = 0; j < nimpls; j++) {
+			if (impls[j](0, &buf[off], len) != expected) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_CRC_UNIT_TEST : mismatch [impl %d, len %u, off %u]", j, len, off);
+				free(buf);
+				return(-1);
+			}
+		}
+
+		// Chaining two pieces must equal one pass
+		crc = hdd_crc32c(hdd_crc32c(0, &buf[off], len / 3), &buf[off + len / 3], len - len / 3);
+		if (crc != expected) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_CRC_UNIT_TEST : chained mismatch [len %u]", len);
+			free(buf);
+			return(-1);
+		}
+	}
+	free(buf);
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_CRC_UNIT_TEST : checksums verified.");
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddCrcBenchmark
+// Description  : times each checksum implementation (and the gcrypt SHA-1
+//                signature it replaces) over small to maximum block sizes
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddCrcBenchmark(void) {
+
+	// Local variables
+	const uint32_t sizes[] = { 64, 4096, 65536, HDD_MAX_BLOCK_SIZE };
+	const char *names[] = { "bytewise", "slicing-by-8", "sse4.2", "sha1" };
+	unsigned char *buf, sig[64];
+	uint32_t sigsz, sink = 0;
+	struct timespec start, stop;
+	double secs;
+	long iters;
+	int i, j;
+
+	pthread_once(&hdd_crc_once, hdd_crc_init);
+	buf = malloc(HDD_MAX_BLOCK_SIZE);
+	for (i = 0; i < HDD_MAX_BLOCK_SIZE; i++)
+		buf[i] = getRandomValue(0, 0xff);
+
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_CRC_BENCH : %-12s %10s %12s %12s", "impl", "size", "MB/s", "ns/block");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		iters = HDD_CRC_BENCH_BYTES / sizes[i];
+		for (j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+#if defined(__x86_64__)
+			if ((j == 2) && !__builtin_cpu_supports("sse4.2"))
+				continue;
+#else
+			if (j == 2)
+				continue;
+#endif
+			// SHA-1 is far slower, a fraction of the bytes is enough
+			long n = (j == 3) ? iters / 16 + 1 : iters;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (long k = 0; k < n; k++) {
+				switch (j) {
+				case 0: sink += hdd_crc32c_bytewise(0, buf, sizes[i]); break;
+				case 1: sink += hdd_crc32c_sw(0, buf, sizes[i]); break;
+#if defined(__x86_64__)
+				case 2: sink += hdd_crc32c_hw(0, buf, sizes[i]); break;
+#endif
+				case 3:
+					sigsz = sizeof(sig);
+					generate_md5_signature(buf, sizes[i], sig, &sigsz);
+					sink += sig[0];
+					break;
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+			secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+			hdd_log(LOG_OUTPUT_LEVEL, "HDD_CRC_BENCH : %-12s %10u %12.1f %12.0f", names[j], sizes[i],
+					((double)sizes[i] * n) / secs / 1e6, secs * 1e9 / n);
+		}
+	}
+	free(buf);
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_CRC_BENCH : done [%x]", sink);
+	return(0);
+}
@@ -0,0 +1,37 @@
+#ifndef HDD_CRC_INCLUDED
+#define HDD_CRC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_crc.h
+//  Description    : This is the header file for the CRC32C (Castagnoli)
+//                   block checksums used to verify HDD block integrity
+//                   end-to-end between the client and the server.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdint.h>
+#include <stddef.h>
+
+// Defines
+#define HDD_CRC_SIZE sizeof(uint32_t)  // Size of the checksum trailer on the wire
+
+//
+// Functional Prototypes
+
+uint32_t hdd_crc32c(uint32_t crc, const void *buf, size_t len);
+	// Extend the CRC32C "crc" (0 to start) over "len" bytes of "buf", using
+	// the SSE4.2 crc32 instruction when the CPU has it, tables otherwise
+
+//
+// Unit testing and benchmarking for the module
+
+int hddCrcUnitTest(void);
+	// Check the hardware and table implementations against known values
+
+int hddCrcBenchmark(void);
+	// Compare the throughput of the checksum implementations
+
+#endif
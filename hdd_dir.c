@@ -0,0 +1,1070 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_dir.c
+//  Description    : This is the HDD directory, a B+tree mapping file names to
+//                   their blocks.  Leaf pages hold the entries, interior pages
+//                   the separating names and the blocks of their children.
+//                   Pages are read when a lookup first needs them and changed
+//                   in memory; a flush writes every changed page to a new
+//                   block (children before parents), so the tree on the device
+//                   only changes when the meta block is pointed at the new
+//                   root.  Pages are encoded with the names front-coded
+//                   against the one before and the numbers as varints.
+//
+//  Author         :
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+// Project Includes
+#include <hdd_dir.h>
+#include <hdd_driver.h>
+#include <hdd_file_io.h>
+#include <hdd_network.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+#include <hdd_log.h>
+
+// Defines
+#define HDD_DIR_PAGE_MAX 32768          // room for the largest encoded page
+#define HDD_DIR_LEAF 'L'                // first byte of a leaf page
+#define HDD_DIR_INTERIOR 'I'            // first byte of an interior page
+#define HDD_DIR_PACKED_LEAF 'P'         // first byte of a leaf page with packed files
+#define HDD_DIR_DELETE_DEPTH 8          // deletes kept on the wire at once
+#define HDD_DIR_BENCH_FILES 1000000     // files the benchmark creates
+#define HDD_DIR_UTEST_FILES 20000       // names the unit test puts
+
+// A directory page in memory
+typedef struct HddDirPage {
+	uint32_t bid;                                // block holding the page (0 if never written)
+	uint8_t  leaf;                               // entries (leaf) or separators and children
+	uint8_t  dirty;                              // changed since it was written
+	uint8_t  referenced;                         // used since the last cache trim
+	int      nkeys;                              // keys in the page
+	char    *keys[HDD_DIR_ORDER + 1];            // names, in order
+	HddDirEntry entries[HDD_DIR_ORDER + 1];      // leaf: the files
+	uint32_t child_bid[HDD_DIR_ORDER + 2];       // interior: blocks of the children
+	struct HddDirPage *child[HDD_DIR_ORDER + 2]; // interior: children in memory (or NULL)
+} HddDirPage;
+
+// A directory: the tree as far as it has been read, and the blocks a flush
+// left to delete (one per volume, see hdd_dir_use)
+struct HddDir {
+	HddDirPage *root;                 // root page, once read
+	uint32_t root_bid;                // block holding it
+	uint32_t files;                   // entries in the tree
+	uint32_t *freed;                  // blocks of replaced pages, deleted on release
+	uint32_t nfreed;                  // how many there are
+	uint32_t maxfreed;                // and room for
+	uint32_t leaves;                  // leaf pages in memory
+	uint32_t trim_at;                 // leaves in memory that start a trim
+	uint8_t  buf[HDD_DIR_PAGE_MAX];   // page being read or written
+	HddDirStats stats;                // counters
+};
+
+//
+// Global data
+
+static HddDir dir_default = { .trim_at = HDD_DIR_CACHE_PAGES };   // the default volume's
+static __thread HddDir *dir = &dir_default;                      // the one calls work on
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_put_varint / hdd_get_varint
+// Description  : LEB128 encoding of the metadata numbers
+//
+// Inputs       : buf - the bytes, pos - where the value goes (is), value
+//                len - bytes in buf
+// Outputs      : position after the value / the value or -1 past the end
+
+uint32_t hdd_put_varint(uint8_t *buf, uint32_t pos, uint32_t value) {
+	while (value >= 0x80) {
+		buf[pos++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buf[pos++] = value;
+	return(pos);
+}
+
+int64_t hdd_get_varint(const uint8_t *buf, uint32_t len, uint32_t *pos) {
+	uint32_t value = 0;
+	int shift;
+
+	for (shift = 0; (shift < 35) && (*pos < len); shift += 7) {
+		uint8_t byte = buf[(*pos)++];
+		value |= (uint32_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			return(value);
+		}
+	}
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_new_page / dir_free_page
+// Description  : make an empty page, free a page (and its children in memory)
+//
+// Inputs       : leaf - the kind of page, page - the page
+// Outputs      : the page or NULL / none
+
+static HddDirPage *dir_new_page(int leaf) {
+	HddDirPage *page = calloc(1, sizeof(HddDirPage));
+
+	if (page != NULL) {
+		page->leaf = leaf;
+		dir->stats.cached_pages++;
+		if (leaf) {
+			dir->leaves++;
+		}
+	}
+	return(page);
+}
+
+static void dir_free_page(HddDirPage *page) {
+	int i;
+
+	if (!page->leaf) {
+		for (i = 0; i <= page->nkeys; i++) {
+			if (page->child[i] != NULL) {
+				dir_free_page(page->child[i]);
+			}
+		}
+	} else {
+		dir->leaves--;
+	}
+	for (i = 0; i < page->nkeys; i++) {
+		free(page->keys[i]);
+	}
+	dir->stats.cached_pages--;
+	free(page);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_encode / dir_decode
+// Description  : convert a page to (from) the bytes stored in its block: the
+//                kind, the key count, (the first child,) then per key the
+//                length shared with the previous key, the rest of it and the
+//                entry (the child after it); a leaf holding a packed file
+//                is a packed leaf, whose entries also have the offset
+//
+// Inputs       : page - the page, buf/len - the bytes
+// Outputs      : encoded length / the new page or NULL if damaged
+
+static uint32_t dir_encode(HddDirPage *page, uint8_t *buf) {
+	uint32_t pos = 0, shared, rest;
+	const char *prev = "";
+	int i, packed = 0;
+
+	for (i = 0; page->leaf && (i < page->nkeys); i++) {
+		packed |= (page->entries[i].offset != 0);
+	}
+	buf[pos++] = page->leaf ? (packed ? HDD_DIR_PACKED_LEAF : HDD_DIR_LEAF) : HDD_DIR_INTERIOR;
+	pos = hdd_put_varint(buf, pos, page->nkeys);
+	if (!page->leaf) {
+		pos = hdd_put_varint(buf, pos, page->child_bid[0]);
+	}
+
+	for (i = 0; i < page->nkeys; i++) {
+		for (shared = 0; prev[shared] && (prev[shared] == page->keys[i][shared]); shared++);
+		rest = strlen(page->keys[i]) - shared;
+		pos = hdd_put_varint(buf, pos, shared);
+		pos = hdd_put_varint(buf, pos, rest);
+		memcpy(&buf[pos], &page->keys[i][shared], rest);
+		pos += rest;
+		if (page->leaf) {
+			pos = hdd_put_varint(buf, pos, page->entries[i].bid);
+			pos = hdd_put_varint(buf, pos, page->entries[i].size);
+			pos = hdd_put_varint(buf, pos, page->entries[i].capacity);
+			if (packed) {
+				pos = hdd_put_varint(buf, pos, page->entries[i].offset);
+			}
+		} else {
+			pos = hdd_put_varint(buf, pos, page->child_bid[i + 1]);
+		}
+		prev = page->keys[i];
+	}
+	return(pos);
+}
+
+static HddDirPage *dir_decode(const uint8_t *buf, uint32_t len) {
+	char name[MAX_FILENAME_LENGTH] = "";
+	int64_t nkeys, shared, rest, v[4] = { 0 };
+	uint32_t pos = 1;
+	HddDirPage *page;
+	int i, j, values;
+
+	if ((len < 2) || ((buf[0] != HDD_DIR_LEAF) && (buf[0] != HDD_DIR_PACKED_LEAF) && (buf[0] != HDD_DIR_INTERIOR)) ||
+			((nkeys = hdd_get_varint(buf, len, &pos)) < 0) || (nkeys > HDD_DIR_ORDER) ||
+			((page = dir_new_page(buf[0] != HDD_DIR_INTERIOR)) == NULL)) {
+		return(NULL);
+	}
+	values = (buf[0] == HDD_DIR_PACKED_LEAF) ? 4 : (page->leaf ? 3 : 1);
+	if (!page->leaf) {
+		if ((v[0] = hdd_get_varint(buf, len, &pos)) < 0) {
+			dir_free_page(page);
+			return(NULL);
+		}
+		page->child_bid[0] = v[0];
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		if (((shared = hdd_get_varint(buf, len, &pos)) < 0) || (shared > strlen(name)) ||
+				((rest = hdd_get_varint(buf, len, &pos)) < 0) || (shared + rest >= MAX_FILENAME_LENGTH) ||
+				(rest > len - pos)) {
+			break;
+		}
+		memcpy(&name[shared], &buf[pos], rest);
+		name[shared + rest] = '\0';
+		pos += rest;
+		for (j = 0; j < values; j++) {
+			if ((v[j] = hdd_get_varint(buf, len, &pos)) < 0) {
+				break;
+			}
+		}
+		if (j < values) {
+			break;
+		}
+		page->keys[i] = strdup(name);
+		page->nkeys++;
+		if (page->leaf) {
+			page->entries[i].bid = v[0];
+			page->entries[i].size = v[1];
+			page->entries[i].capacity = v[2];
+			page->entries[i].offset = v[3];
+		} else {
+			page->child_bid[i + 1] = v[0];
+		}
+	}
+
+	if (page->nkeys != nkeys) {
+		dir_free_page(page);
+		return(NULL);
+	}
+	return(page);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_load / dir_child
+// Description  : read a page from its block / get a child of an interior
+//                page, reading it if it isn't in memory
+//
+// Inputs       : bid - the block, page - the parent, i - which child
+// Outputs      : the page or NULL on failure
+
+static HddDirPage *dir_load(uint32_t bid) {
+	HddBitCmd read = construct(bid, 0, 0, HDD_DIR_PAGE_MAX, HDD_BLOCK_READ);
+	HddBitResp resp = hdd_block_operation(read, dir->buf);
+	HddDirPage *page;
+
+	if (get_response(resp) == 1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR : failed reading directory page %u", bid);
+		return(NULL);
+	}
+	if ((page = dir_decode(dir->buf, (resp >> 36) & 67108863)) == NULL) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR : damaged directory page %u", bid);
+		return(NULL);
+	}
+	page->bid = bid;
+	dir->stats.page_loads++;
+	return(page);
+}
+
+static HddDirPage *dir_child(HddDirPage *page, int i) {
+	if (page->child[i] == NULL) {
+		page->child[i] = dir_load(page->child_bid[i]);
+	}
+	return(page->child[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_search
+// Description  : find where a name is (or goes) in a page: in a leaf, the
+//                first key not below it; in an interior page, the child
+//                whose keys it falls among (the number of keys not above it)
+//
+// Inputs       : page - the page, name - the name
+// Outputs      : the position
+
+static int dir_search(HddDirPage *page, const char *name) {
+	int lo = 0, hi = page->nkeys, mid, cmp;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		cmp = strcmp(page->keys[mid], name);
+		if ((cmp < 0) || (!page->leaf && (cmp == 0))) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return(lo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_trim
+// Description  : drop the clean leaves not used since the last trim once
+//                there are too many in memory (interior pages stay)
+//
+// Inputs       : none
+// Outputs      : none
+
+static void dir_trim_page(HddDirPage *page) {
+	HddDirPage *child;
+	int i;
+
+	for (i = 0; i <= page->nkeys; i++) {
+		if ((child = page->child[i]) == NULL) {
+			continue;
+		}
+		if (!child->leaf) {
+			dir_trim_page(child);
+		} else if (!child->dirty && !child->referenced) {
+			dir_free_page(child);
+			page->child[i] = NULL;
+			dir->stats.page_evictions++;
+		} else {
+			child->referenced = 0;
+		}
+	}
+}
+
+static void dir_trim(void) {
+	if ((dir->leaves <= dir->trim_at) || (dir->root == NULL) || dir->root->leaf) {
+		return;
+	}
+	dir_trim_page(dir->root);
+	dir->trim_at = dir->leaves + HDD_DIR_CACHE_PAGES / 4;   // don't walk the tree on every lookup
+	if (dir->trim_at < HDD_DIR_CACHE_PAGES) {
+		dir->trim_at = HDD_DIR_CACHE_PAGES;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_get_root
+// Description  : the root page, read if need be (or made, for a new tree)
+//
+// Inputs       : create - make an empty root if the directory is empty
+// Outputs      : the root or NULL (empty, or on failure)
+
+static HddDirPage *dir_get_root(int create) {
+	if (dir->root == NULL) {
+		if (dir->root_bid != 0) {
+			dir->root = dir_load(dir->root_bid);
+		} else if (create && ((dir->root = dir_new_page(1)) != NULL)) {
+			dir->root->dirty = 1;
+		}
+	}
+	return(dir->root);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_reset
+// Description  : forget the cached directory, starting over from a root
+//
+// Inputs       : root - block of the root page (0 if empty), count - files
+// Outputs      : none
+
+void hdd_dir_reset(uint32_t root, uint32_t count) {
+	if (dir->root != NULL) {
+		dir_free_page(dir->root);
+	}
+	dir->root = NULL;
+	dir->root_bid = root;
+	dir->files = count;
+	dir->nfreed = 0;
+	dir->trim_at = HDD_DIR_CACHE_PAGES;
+	dir->stats.height = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_new / hdd_dir_free / hdd_dir_use
+// Description  : make a directory for a volume, free one (and its cached
+//                pages), make one the directory this thread's calls work on
+//
+// Inputs       : d - the directory (NULL for the default one)
+// Outputs      : the new directory or NULL / none / the one used before
+
+HddDir *hdd_dir_new(void) {
+	HddDir *d = calloc(1, sizeof(HddDir));
+
+	if (d != NULL) {
+		d->trim_at = HDD_DIR_CACHE_PAGES;
+	}
+	return(d);
+}
+
+void hdd_dir_free(HddDir *d) {
+	HddDir *before = hdd_dir_use(d);
+
+	hdd_dir_reset(0, 0);
+	free(dir->freed);
+	hdd_dir_use(before);
+	free(d);
+}
+
+HddDir *hdd_dir_use(HddDir *d) {
+	HddDir *before = dir;
+
+	dir = (d != NULL) ? d : &dir_default;
+	return(before);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_find
+// Description  : look a file up by name
+//
+// Inputs       : name - the file, entry - where its entry goes
+// Outputs      : 1 if found, 0 if not, -1 on failure
+
+int hdd_dir_find(const char *name, HddDirEntry *entry) {
+	HddDirPage *page;
+	uint32_t levels = 1;
+	int i;
+
+	dir_trim();
+	dir->stats.lookups++;
+	if ((page = dir_get_root(0)) == NULL) {
+		return((dir->root_bid != 0) ? -1 : 0);
+	}
+
+	while (!page->leaf) {
+		dir->stats.page_visits++;
+		page->referenced = 1;
+		if ((page = dir_child(page, dir_search(page, name))) == NULL) {
+			return(-1);
+		}
+		levels++;
+	}
+	dir->stats.page_visits++;
+	dir->stats.height = levels;
+	page->referenced = 1;
+
+	i = dir_search(page, name);
+	if ((i < page->nkeys) && (strcmp(page->keys[i], name) == 0)) {
+		*entry = page->entries[i];
+		return(1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_walk
+// Description  : visit every file in name order; leaves read only for the
+//                walk are dropped again once visited, so walking a large
+//                directory doesn't fill the cache
+//
+// Inputs       : visit - called per file, arg - passed to it
+// Outputs      : 0 at the end, visit's stop value, -1 on failure
+
+static int dir_walk_page(HddDirPage *page, HddDirVisit visit, void *arg) {
+	HddDirPage *child;
+	int i, loaded, r;
+
+	dir->stats.page_visits++;
+	if (page->leaf) {
+		for (i = 0; i < page->nkeys; i++) {
+			if ((r = visit(page->keys[i], &page->entries[i], arg)) != 0) {
+				return(r);
+			}
+		}
+		return(0);
+	}
+
+	for (i = 0; i <= page->nkeys; i++) {
+		loaded = (page->child[i] == NULL);
+		if ((child = dir_child(page, i)) == NULL) {
+			return(-1);
+		}
+		r = dir_walk_page(child, visit, arg);
+		if (loaded && child->leaf && !child->dirty) {
+			dir_free_page(child);
+			page->child[i] = NULL;
+		}
+		if (r != 0) {
+			return(r);
+		}
+	}
+	return(0);
+}
+
+int hdd_dir_walk(HddDirVisit visit, void *arg) {
+	HddDirPage *root;
+
+	if ((root = dir_get_root(0)) == NULL) {
+		return((dir->root_bid != 0) ? -1 : 0);
+	}
+	return(dir_walk_page(root, visit, arg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_insert
+// Description  : add or change an entry below a page, splitting pages that
+//                overflow (the new right half and the key that separates it
+//                are handed back for the parent)
+//
+// Inputs       : page - the page, name/entry - the file
+//                up_key/up_page - where a split is handed back
+// Outputs      : 1 if something changed, 0 if not, -1 on failure
+
+static int dir_insert(HddDirPage *page, const char *name, const HddDirEntry *entry,
+		char **up_key, HddDirPage **up_page) {
+	HddDirPage *child, *right, *split;
+	char *key;
+	int i, mid, r;
+
+	*up_page = NULL;
+	dir->stats.page_visits++;
+	page->referenced = 1;
+	i = dir_search(page, name);
+
+	if (page->leaf) {
+
+		// Change the entry in place, or make room for it
+		if ((i < page->nkeys) && (strcmp(page->keys[i], name) == 0)) {
+			if (memcmp(&page->entries[i], entry, sizeof(HddDirEntry)) == 0) {
+				return(0);
+			}
+			page->entries[i] = *entry;
+			page->dirty = 1;
+			return(1);
+		}
+		memmove(&page->keys[i + 1], &page->keys[i], (page->nkeys - i) * sizeof(char *));
+		memmove(&page->entries[i + 1], &page->entries[i], (page->nkeys - i) * sizeof(HddDirEntry));
+		page->keys[i] = strdup(name);
+		page->entries[i] = *entry;
+		page->nkeys++;
+		page->dirty = 1;
+		dir->files++;
+
+		// Full, the upper half moves to a new leaf
+		if (page->nkeys > HDD_DIR_ORDER) {
+			if ((right = dir_new_page(1)) == NULL) {
+				return(-1);
+			}
+			mid = page->nkeys / 2;
+			right->nkeys = page->nkeys - mid;
+			memcpy(right->keys, &page->keys[mid], right->nkeys * sizeof(char *));
+			memcpy(right->entries, &page->entries[mid], right->nkeys * sizeof(HddDirEntry));
+			page->nkeys = mid;
+			right->dirty = 1;
+			*up_key = strdup(right->keys[0]);
+			*up_page = right;
+		}
+		return(1);
+	}
+
+	// Interior page, go down to the child that covers the name
+	if ((child = dir_child(page, i)) == NULL) {
+		return(-1);
+	}
+	if ((r = dir_insert(child, name, entry, &key, &split)) <= 0) {
+		return(r);
+	}
+	page->dirty = 1;    // the child will move when it is written
+	if (split == NULL) {
+		return(1);
+	}
+
+	// The child split, add the new one after it
+	memmove(&page->keys[i + 1], &page->keys[i], (page->nkeys - i) * sizeof(char *));
+	memmove(&page->child[i + 2], &page->child[i + 1], (page->nkeys - i) * sizeof(HddDirPage *));
+	memmove(&page->child_bid[i + 2], &page->child_bid[i + 1], (page->nkeys - i) * sizeof(uint32_t));
+	page->keys[i] = key;
+	page->child[i + 1] = split;
+	page->child_bid[i + 1] = 0;
+	page->nkeys++;
+
+	// Full, the middle key moves up and the keys after it to a new page
+	if (page->nkeys > HDD_DIR_ORDER) {
+		if ((right = dir_new_page(0)) == NULL) {
+			return(-1);
+		}
+		mid = page->nkeys / 2;
+		right->nkeys = page->nkeys - mid - 1;
+		memcpy(right->keys, &page->keys[mid + 1], right->nkeys * sizeof(char *));
+		memcpy(right->child, &page->child[mid + 1], (right->nkeys + 1) * sizeof(HddDirPage *));
+		memcpy(right->child_bid, &page->child_bid[mid + 1], (right->nkeys + 1) * sizeof(uint32_t));
+		memset(&page->child[mid + 1], 0x0, (right->nkeys + 1) * sizeof(HddDirPage *));
+		page->nkeys = mid;
+		right->dirty = 1;
+		*up_key = page->keys[mid];
+		*up_page = right;
+	}
+	return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_put
+// Description  : add a file to the directory or change its entry
+//
+// Inputs       : name - the file, entry - its entry
+// Outputs      : 0 if successful, -1 on failure
+
+int hdd_dir_put(const char *name, const HddDirEntry *entry) {
+	HddDirPage *root, *split;
+	char *key;
+
+	dir_trim();
+	dir->stats.lookups++;
+	if (((root = dir_get_root(1)) == NULL) || (dir_insert(root, name, entry, &key, &split) == -1)) {
+		return(-1);
+	}
+
+	// The root split, the tree gets a level taller
+	if (split != NULL) {
+		if ((dir->root = dir_new_page(0)) == NULL) {
+			dir->root = root;
+			return(-1);
+		}
+		dir->root->keys[0] = key;
+		dir->root->child[0] = root;
+		dir->root->child_bid[0] = root->bid;
+		dir->root->child[1] = split;
+		dir->root->nkeys = 1;
+		dir->root->dirty = 1;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_flush
+// Description  : write the changed pages to new blocks, children first so
+//                every parent is written with its children's new blocks
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 on failure
+
+static int dir_write(HddDirPage *page) {
+	HddBitResp resp;
+	uint32_t len;
+	int i;
+
+	if (!page->dirty) {
+		return(0);
+	}
+
+	if (!page->leaf) {
+		for (i = 0; i <= page->nkeys; i++) {
+			if (page->child[i] != NULL) {
+				if (dir_write(page->child[i])) {
+					return(-1);
+				}
+				page->child_bid[i] = page->child[i]->bid;
+			}
+		}
+	}
+
+	// Room to note the old block first, so a failure leaves nothing behind
+	if ((page->bid != 0) && (dir->nfreed == dir->maxfreed)) {
+		uint32_t max = (dir->maxfreed == 0) ? 64 : dir->maxfreed * 2;
+		uint32_t *freed = realloc(dir->freed, max * sizeof(uint32_t));
+		if (freed == NULL) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR : no memory to retire directory page %u", page->bid);
+			return(-1);
+		}
+		dir->freed = freed;
+		dir->maxfreed = max;
+	}
+
+	len = dir_encode(page, dir->buf);
+	resp = hdd_block_operation(construct(0, 0, 0, len, HDD_BLOCK_CREATE), dir->buf);
+	if (get_response(resp) == 1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR : failed writing directory page [%u bytes]", len);
+		return(-1);
+	}
+
+	// The old block goes once nothing points at it
+	if (page->bid != 0) {
+		dir->freed[dir->nfreed++] = page->bid;
+	}
+	page->bid = get_bid(resp);
+	page->dirty = 0;
+	dir->stats.page_writes++;
+	return(0);
+}
+
+int hdd_dir_flush(void) {
+	if ((dir->root == NULL) || !dir->root->dirty) {
+		return(0);
+	}
+	if (dir_write(dir->root)) {
+		return(-1);
+	}
+	dir->root_bid = dir->root->bid;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_release
+// Description  : delete the blocks of the pages the flushes replaced (a few
+//                at a time on the wire), then trim the page cache
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if any delete failed
+
+int hdd_dir_release(void) {
+	HddClientRequest reqs[HDD_DIR_DELETE_DEPTH];
+	int posted[HDD_DIR_DELETE_DEPTH] = { 0 };
+	int failed = 0;
+	uint32_t i, slot;
+
+	for (i = 0; i < dir->nfreed + HDD_DIR_DELETE_DEPTH; i++) {
+		slot = i % HDD_DIR_DELETE_DEPTH;
+		if (posted[slot]) {
+			failed |= get_response(hdd_client_wait(&reqs[slot]));
+			posted[slot] = 0;
+		}
+		if (i < dir->nfreed) {
+			memset(&reqs[slot], 0x0, sizeof(HddClientRequest));
+			reqs[slot].cmd = construct(dir->freed[i], 0, 0, 0, HDD_BLOCK_DELETE);
+			if (hdd_client_post(&reqs[slot]) == -1) {
+				failed = 1;
+			} else {
+				posted[slot] = 1;
+			}
+		}
+	}
+	if (failed) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR : failed deleting replaced directory pages");
+	}
+
+	dir->stats.page_frees += dir->nfreed;
+	dir->nfreed = 0;
+	dir_trim();
+	return(failed ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_dir_root / hdd_dir_count / hdd_dir_dirty / hdd_dir_stats
+// Description  : directory state for the meta block, and its counters
+//
+// Inputs       : stats - where the counters go
+// Outputs      : see hdd_dir.h
+
+uint32_t hdd_dir_root(void) {
+	return(dir->root_bid);
+}
+
+uint32_t hdd_dir_count(void) {
+	return(dir->files);
+}
+
+int hdd_dir_dirty(void) {
+	return((dir->root != NULL) && dir->root->dirty);
+}
+
+void hdd_dir_stats(HddDirStats *stats) {
+	*stats = dir->stats;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddDirBenchmark
+// Description  : create a million (empty) files, then time a mount and
+//                opening every one of them again in a scattered order
+//                (this formats the device)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddDirBenchmark(void) {
+
+	// Local variables
+	char name[MAX_FILENAME_LENGTH];
+	struct timespec start, stop;
+	HddDirStats before, after;
+	uint32_t i, n = HDD_DIR_BENCH_FILES;
+	double secs;
+	int16_t fh;
+
+	if (hdd_format()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : format failed.");
+		return(-1);
+	}
+
+	// Create the files, then save it all
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "bench/%07u.dat", i);
+		if (((fh = hdd_open(name)) == -1) || hdd_close(fh)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : create of [%s] failed.", name);
+			return(-1);
+		}
+	}
+	if (hdd_unmount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : unmount failed.");
+		return(-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_DIR_BENCH : created %u files in %.2fs (%.0f files/s)", n, secs, n / secs);
+
+	// Mounting reads the meta block and the journal, not the directory
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (hdd_mount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : mount failed.");
+		return(-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	hdd_dir_stats(&before);
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_DIR_BENCH : mount took %.3fms, %u directory pages in memory", secs * 1e3, before.cached_pages);
+
+	// Open them all again, scattered over the directory (odd multiplier mod n)
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "bench/%07u.dat", (uint32_t)(((uint64_t)i * 2654435761u) % n));
+		if (((fh = hdd_open(name)) == -1) || hdd_close(fh)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : open of [%s] failed.", name);
+			return(-1);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	hdd_dir_stats(&after);
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_DIR_BENCH : opened %u files in %.2fs (%.0f opens/s)", n, secs, n / secs);
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_DIR_BENCH : %.2f pages per open (height %u), %llu pages read, %llu evicted, %u in memory",
+			(double)(after.page_visits - before.page_visits) / (after.lookups - before.lookups), after.height,
+			(unsigned long long)(after.page_loads - before.page_loads),
+			(unsigned long long)(after.page_evictions - before.page_evictions), after.cached_pages);
+
+	if (hdd_dir_count() != n) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : directory holds %u files, not %u.", hdd_dir_count(), n);
+		return(-1);
+	}
+	if (hdd_unmount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_BENCH : unmount failed.");
+		return(-1);
+	}
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_utest_name/dir_utest_entry
+// Description  : the unit test's name number i (a few letters from a small
+//                alphabet, so names share prefixes, then the number), and
+//                what it stores under it at version v
+//
+// Inputs       : name - where the name goes, i - its number, v - its version
+// Outputs      : none
+
+static void dir_utest_name(char *name, uint32_t i) {
+	uint32_t len = (i * 2654435761u) % 48, k;
+
+	for (k = 0; k < len; k++) {
+		name[k] = 'a' + ((i + 7) * (k + 3) * 40503u >> 5) % 3;
+	}
+	snprintf(&name[len], MAX_FILENAME_LENGTH - len, "#%u", i);
+}
+
+static void dir_utest_entry(HddDirEntry *entry, uint32_t i, uint8_t v) {
+	entry->bid = i + 1;
+	entry->size = i * v;
+	entry->capacity = i * v + v;
+	entry->offset = (i % 4 == 0) ? (i % 4096) + v : 0;   // some packed
+}
+
+// What a walk of the directory is checked against
+typedef struct {
+	const uint8_t *version;             // each name's version, 0 if not put
+	uint32_t seen;                      // names walked so far
+	char prev[MAX_FILENAME_LENGTH];     // the last of them
+} HddDirUtestWalk;
+
+static int dir_utest_visit(const char *name, const HddDirEntry *entry, void *arg) {
+	HddDirUtestWalk *w = arg;
+	HddDirEntry expect;
+	const char *num = strrchr(name, '#');
+	uint32_t i = (num != NULL) ? strtoul(num + 1, NULL, 10) : HDD_DIR_UTEST_FILES;
+
+	if ((w->seen > 0) && (strcmp(w->prev, name) >= 0)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : walk gave [%s] after [%s]", name, w->prev);
+		return(-1);
+	}
+	if ((i >= HDD_DIR_UTEST_FILES) || (w->version[i] == 0)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : walk gave [%s], which was never put", name);
+		return(-1);
+	}
+	dir_utest_entry(&expect, i, w->version[i]);
+	if (memcmp(entry, &expect, sizeof(HddDirEntry)) != 0) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : walk gave the wrong entry for [%s]", name);
+		return(-1);
+	}
+	strcpy(w->prev, name);
+	w->seen++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dir_utest_check
+// Description  : checks every name's lookup, the count and a walk against
+//                the versions put
+//
+// Inputs       : version - each name's version (0 if not put), count - names put
+// Outputs      : 0 if they all match, -1 if not
+
+static int dir_utest_check(const uint8_t *version, uint32_t count) {
+
+	// Local variables
+	char name[MAX_FILENAME_LENGTH];
+	HddDirEntry entry, expect;
+	HddDirUtestWalk w = { .version = version };
+	uint32_t i;
+	int found;
+
+	if (hdd_dir_count() != count) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : directory holds %u files, not %u", hdd_dir_count(), count);
+		return(-1);
+	}
+
+	for (i = 0; i < HDD_DIR_UTEST_FILES; i++) {
+		dir_utest_name(name, i);
+		if ((found = hdd_dir_find(name, &entry)) != (version[i] != 0)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : find of [%s] returned %d", name, found);
+			return(-1);
+		}
+		dir_utest_entry(&expect, i, version[i]);
+		if (found && (memcmp(&entry, &expect, sizeof(HddDirEntry)) != 0)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : find of [%s] returned the wrong entry", name);
+			return(-1);
+		}
+
+		name[strcspn(name, "#")] = '\0';   // its letters alone are never a name
+		if ((found = hdd_dir_find(name, &entry)) != 0) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : find of absent [%s] returned %d", name, found);
+			return(-1);
+		}
+	}
+
+	if ((hdd_dir_walk(dir_utest_visit, &w) != 0) || (w.seen != count)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : walk failed after %u of %u files", w.seen, count);
+		return(-1);
+	}
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddDirUnitTest
+// Description  : put names in a scattered order (and change their entries),
+//                checking lookups and walks against what was put, then again
+//                after flushes and starting over from the root on the device
+//                (this formats the device)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddDirUnitTest(void) {
+
+	// Local variables
+	char name[MAX_FILENAME_LENGTH];
+	HddDirEntry entry;
+	uint8_t *version;
+	uint32_t count = 0, i, k, root;
+
+	if (hdd_format()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : format failed.");
+		return(-1);
+	}
+	if ((version = calloc(HDD_DIR_UTEST_FILES, sizeof(uint8_t))) == NULL) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : out of memory.");
+		return(-1);
+	}
+
+	// Three quarters of the names, in a scattered order and some put again
+	for (k = 0; k < HDD_DIR_UTEST_FILES; k++) {
+		i = getRandomValue(0, HDD_DIR_UTEST_FILES * 3 / 4 - 1);
+		count += (version[i] == 0);
+		version[i] = (version[i] == 0xff) ? 1 : version[i] + 1;
+		dir_utest_name(name, i);
+		dir_utest_entry(&entry, i, version[i]);
+		if (hdd_dir_put(name, &entry)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : put of [%s] failed.", name);
+			free(version);
+			return(-1);
+		}
+	}
+	if (dir_utest_check(version, count)) {
+		free(version);
+		return(-1);
+	}
+
+	// Write them out and start over from the root on the device
+	if (hdd_dir_flush() || hdd_dir_dirty()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : flush failed.");
+		free(version);
+		return(-1);
+	}
+	root = hdd_dir_root();
+	hdd_dir_reset(root, count);
+	if (dir_utest_check(version, count)) {
+		free(version);
+		return(-1);
+	}
+
+	// The rest of the names and more changes, over pages read back
+	for (k = 0; k < HDD_DIR_UTEST_FILES / 2; k++) {
+		i = (k < HDD_DIR_UTEST_FILES / 4) ? HDD_DIR_UTEST_FILES * 3 / 4 + k : getRandomValue(0, HDD_DIR_UTEST_FILES - 1);
+		count += (version[i] == 0);
+		version[i] = (version[i] == 0xff) ? 1 : version[i] + 1;
+		dir_utest_name(name, i);
+		dir_utest_entry(&entry, i, version[i]);
+		if (hdd_dir_put(name, &entry)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : put of [%s] failed.", name);
+			free(version);
+			return(-1);
+		}
+	}
+	if (hdd_dir_flush() || (hdd_dir_root() == root)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : second flush failed.");
+		free(version);
+		return(-1);
+	}
+	hdd_dir_release();
+	if (dir_utest_check(version, count)) {
+		free(version);
+		return(-1);
+	}
+	hdd_dir_reset(hdd_dir_root(), count);
+	if (dir_utest_check(version, count)) {
+		free(version);
+		return(-1);
+	}
+	free(version);
+
+	// Leave an empty device behind
+	if (hdd_format() || hdd_unmount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_DIR_UTEST : cleanup failed.");
+		return(-1);
+	}
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_DIR_UTEST : %u files checked", count);
+	return(0);
+}
@@ -0,0 +1,110 @@
+#ifndef HDD_DIR_INCLUDED
+#define HDD_DIR_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_dir.h
+//  Description    : This is the header file for the HDD directory, a B+tree
+//                   of file names stored across metadata blocks whose pages
+//                   are read on demand and written copy-on-write.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#define HDD_DIR_ORDER 128           // most keys in a directory page
+#define HDD_DIR_CACHE_PAGES 4096    // leaf pages kept in memory before evicting clean ones
+
+// What the directory knows about a file
+typedef struct {
+	uint32_t bid;         // block holding the file data (0 if none yet)
+	uint32_t size;        // bytes of data in the file
+	uint32_t capacity;    // bytes allocated in its block (>= size)
+	uint32_t offset;      // where the data starts in a shared pack block (0 if the block is its own)
+} HddDirEntry;
+
+// A directory (each volume has its own, see hdd_dir_use)
+typedef struct HddDir HddDir;
+
+// Called for each file of a walk, non-zero stops it
+typedef int (*HddDirVisit)(const char *name, const HddDirEntry *entry, void *arg);
+
+// Directory counters (see hdd_dir_stats)
+typedef struct {
+	uint64_t lookups;         // finds and puts
+	uint64_t page_visits;     // pages walked through by them
+	uint64_t page_loads;      // pages read from the device
+	uint64_t page_writes;     // pages written by flushes
+	uint64_t page_frees;      // replaced pages deleted after a flush
+	uint64_t page_evictions;  // clean leaves dropped from memory
+	uint32_t cached_pages;    // pages in memory now
+	uint32_t height;          // levels in the tree
+} HddDirStats;
+
+//
+// Functional Prototypes
+
+HddDir *hdd_dir_new(void);
+	// A new directory (for a volume), empty until reset; NULL if out of memory
+
+void hdd_dir_free(HddDir *dir);
+	// Free a directory from hdd_dir_new and the pages it has cached
+
+HddDir *hdd_dir_use(HddDir *dir);
+	// Have the calling thread's directory calls work on "dir" (NULL for the
+	// default volume's), returning the one they worked on before
+
+void hdd_dir_reset(uint32_t root, uint32_t count);
+	// Forget the cached directory and start from the page in block "root"
+	// (0 for an empty directory) holding "count" files; nothing is read yet
+
+int hdd_dir_find(const char *name, HddDirEntry *entry);
+	// Look "name" up, 1 (and the entry) if found, 0 if not, -1 on failure
+
+int hdd_dir_put(const char *name, const HddDirEntry *entry);
+	// Add "name" or change its entry, 0 if successful, -1 on failure
+
+int hdd_dir_walk(HddDirVisit visit, void *arg);
+	// Call "visit" for every file in name order (the directory must not be
+	// changed meanwhile), 0 at the end, visit's non-zero return if it
+	// stopped the walk, -1 on failure
+
+int hdd_dir_flush(void);
+	// Write the pages changed since the last flush to new blocks, 0 if
+	// successful, -1 on failure
+
+int hdd_dir_release(void);
+	// Delete the blocks of the pages the flushes replaced (once the meta
+	// block points at the new root) and trim the page cache
+
+uint32_t hdd_dir_root(void);
+	// Block holding the root page as of the last flush (0 if empty)
+
+uint32_t hdd_dir_count(void);
+	// Number of files in the directory
+
+int hdd_dir_dirty(void);
+	// Whether there are changes the last flush didn't write
+
+void hdd_dir_stats(HddDirStats *stats);
+	// Copies out the directory counters
+
+uint32_t hdd_put_varint(uint8_t *buf, uint32_t pos, uint32_t value);
+	// Encode "value" (LEB128) at buf[pos], returning the position after it
+
+int64_t hdd_get_varint(const uint8_t *buf, uint32_t len, uint32_t *pos);
+	// Decode the value at buf[*pos] and step past it, -1 past "len"
+
+//
+// Unit testing and benchmarking for the module
+
+int hddDirUnitTest(void);
+	// Check lookups and walks against what was put, before and after flushes
+
+int hddDirBenchmark(void);
+	// Create and open a million files, timing mount and lookups
+
+#endif
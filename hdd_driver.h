@@ -35,9 +35,37 @@ typedef enum {
     HDD_META_BLOCK = 1,     // Flag indicating that block is the "meta block"
     HDD_FORMAT = 2,         // Flag indicating device should be formatted--used with HDD_DEVICE
     HDD_SAVE_AND_CLOSE = 3, // Flag indicating device info to save in hdd_content.svd and close HDD interface--used with HDD_DEVICE
-    HDD_INIT = 4            // Flag to initialize the device
+    HDD_INIT = 4,           // Flag to initialize the device
+    HDD_RANGE = 5,          // Flag indicating the command addresses part of a block: the
+                            //   32-bit byte offset (network order) follows the header and
+                            //   Block Size is the length (needs HDD_CAP_RANGE_READ for
+                            //   READ, HDD_CAP_RANGE_WRITE for OVERWRITE)
+    HDD_RESIZE = 6          // Flag making an OVERWRITE (with no payload) set the block's
+                            //   size to Block Size, zero filling (needs HDD_CAP_RESIZE)
 }   HDD_FLAG_TYPES;
 
+// These are the optional protocol extensions (capabilities).  A client offers
+// them as a mask in the Block field of its HDD_INIT command and the server
+// grants a subset in the Block Size field of the response; servers without
+// extensions echo the command back, granting none.
+typedef enum {
+    HDD_CAP_CHECKSUM = 1,   // CREATE/OVERWRITE payloads and successful READ responses
+                            //   are followed by the CRC32C of the block (network order)
+    HDD_CAP_RANGE_READ = 2, // READ accepts HDD_RANGE; the response size is the number of
+                            //   bytes returned (short at the end of the block)
+    HDD_CAP_RANGE_WRITE = 4,// OVERWRITE accepts HDD_RANGE; the payload replaces that many
+                            //   bytes at the offset, which must lie inside the block
+    HDD_CAP_RESIZE = 8,     // OVERWRITE accepts HDD_RESIZE, and a ranged OVERWRITE may run
+                            //   past the end of the block (from an offset no later than
+                            //   its end), growing it in place; the block keeps its ID
+    HDD_CAP_NAMESPACE = 16  // HDD_META_BLOCK commands name a namespace (1 to
+                            //   HDD_MAX_NAMESPACE) in their Block field, each with a meta
+                            //   block of its own (0 is the device's); FORMAT naming one
+                            //   drops just its meta block
+}   HDD_CAP_TYPES;
+
+#define HDD_MAX_NAMESPACE 4095   // namespaces are numbered below the first block ID servers hand out
+
 // HDD block ID type (unique to each block)
 typedef uint32_t HddBlockID;
 
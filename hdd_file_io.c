@@ -9,18 +9,45 @@
 
 // Includes
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 // Project Includes
 #include <hdd_file_io.h>
 #include <hdd_driver.h>
 #include <cmpsc311_log.h>
+#include <hdd_log.h>
 #include <cmpsc311_util.h>
 #include <hdd_network.h>
+#include <hdd_crc.h>
+#include <hdd_dir.h>
+#include <hdd_pool.h>
 
 // Defines
 #define CIO_UNIT_TEST_MAX_WRITE_SIZE 1024
 #define HDD_IO_UNIT_TEST_ITERATIONS 10240
+#define HDD_JOURNAL_UTEST_FILES 256      // files the journal unit test writes
+#define HDD_JOURNAL_UTEST_SIZE 4096      // how large they get before the crash (some are packed)
+#define HDD_JOURNAL_UTEST_ROOM 16384     // and room for growing one past its block
+#define HDD_JOURNAL_UTEST_WRITES 3000    // writes before the crash (at least)
+#define HDD_JOURNAL_UTEST_SYNC 40        // writes between syncs
+#define HDD_SPARSE_UTEST_CHUNKS 40       // chunks the sparse unit test's file spans (past a block)
+#define HDD_SPARSE_UTEST_WRITES 24       // writes to it between reopens
+#define HDD_SPARSE_UTEST_MAX_WRITE 20000 // largest of them
+#define HDD_SPARSE_UTEST_SEEKS 200       // seeks checked each time
+#define HDD_RA_MIN_WINDOW 4096           // smallest read sent to the server (bytes)
+#define HDD_RA_MAX_WINDOW (256*1024)     // largest readahead window (bytes)
+#define HDD_GROW_CAPACITY(c) ((c) + (c) / 2)   // block growth when a write runs past the capacity
+#define HDD_META_MAGIC "HDDM"            // start of a compact meta block
+#define HDD_META_VERSION 1               // version of the compact meta block encoding
+#define HDD_META_MIN_CAPACITY 256        // smallest meta block (bytes)
+#define HDD_JOURNAL_CAPACITY 16384       // size of the metadata journal block (bytes)
+#define HDD_JOURNAL_GROUP 32             // records committed to the journal together
+#define HDD_JOURNAL_BATCH_MAX (HDD_JOURNAL_GROUP * (MAX_FILENAME_LENGTH + 24))
+#define HDD_SPARSE_MAP_MIN 256           // smallest sparse map block (bytes)
+#define HDD_SPARSE_MAP_ENTRY 20          // most bytes a chunk takes in a map block
 
 
 // Type for UNIT test interface
@@ -32,21 +59,164 @@ typedef enum {
 } HDD_UNIT_TEST_TYPE;
 
 char *cio_utest_buffer = NULL;  // Unit test buffer
-// Global data structure to keep track of file data
+// Global data structure to keep track of the open files: their directory
+// entries, shared by every handle open on the file
+
+typedef struct  {
+        uint32_t bid;
+        uint32_t size;        // bytes of data in the file
+        uint32_t capacity;    // bytes allocated in its block (>= size), HDD_SPARSE_CAPACITY if sparse
+        uint32_t offset;      // where its slice starts in a pack block, 0 if the block is its own
+        int handles;          // handles open on the file, 0 if the entry is free
+        char name[MAX_FILENAME_LENGTH];
+} File; 
+
+// The handle table: what hdd_open returns indexes it, each handle with its own
+// position in the file (8 bytes each, so the hot fields share cache lines)
+
+#define HDD_HANDLE_OPEN 0x1      // handle is in use
+
+typedef struct  {
+        uint32_t loc;         // seek position
+        uint16_t file;        // entry in files[]
+        uint16_t flags;       // HDD_HANDLE_*
+} Handle;
+
+// The meta block holds the magic, the version and varints for the journal's
+// bid and epoch, the block of the directory's root page (see hdd_dir.c) and
+// the number of files in it.  Version 0 is the original layout, an array of
+// MAX_HDD_FILEDESCR of these (mounting one writes the directory out and the
+// meta block over it in the compact encoding):
 
 typedef struct  {
         uint32_t loc;
         uint32_t bid;
-        //uint16_t fh;
         char name[MAX_FILENAME_LENGTH];
         int open;
         uint32_t size;
-} File; 
-
- File files[MAX_HDD_FILEDESCR];  // array of file objects
+} FileV0;
 
-int init = 1;     // flag for initialization
+// Changes to the directory between meta block writes are appended to a journal
+// block as records (a CREATE with the name, or an UPDATE with the name, bid,
+// size and capacity, and the offset too for a packed file, all varints with
+// the name after its length), committed in batches of a 12 byte header
+// (records length, epoch, CRC32C of the records) and the records.
+// Mount replays the batches of the epoch in the meta block; a checkpoint
+// writes the directory and the meta block with the next epoch, retiring them.
 
+typedef enum {
+        HDD_JREC_CREATE = 1,
+        HDD_JREC_UPDATE = 2,
+        HDD_JREC_UPDATE_PACKED = 3,   // how an UPDATE of a packed file is written
+} HDD_JOURNAL_RECORD_TYPE;
+
+typedef struct {
+        uint32_t bid;           // journal block, 0 until the first commit
+        uint32_t epoch;         // epoch of the batches since the last checkpoint
+        uint32_t tail;          // where the next batch goes
+        uint8_t *image;         // what the journal block holds (in the volume's tables)
+        uint8_t *pending;       // records not yet committed (in the volume's tables)
+        uint32_t plen;          // bytes in pending
+        int      precords;      // records in pending
+        int      last_fi;       // file of the last record in pending if an UPDATE, else -1
+        uint32_t last_pos;      // where that record starts
+        int      overflow;      // records didn't fit in pending, only a checkpoint has them
+} Journal;
+
+static void journal_record(int fi, HDD_JOURNAL_RECORD_TYPE type);
+
+// Small files are packed: each gets a slice of a shared pack block, cut from
+// its end (the block grows as slices are written), and moves to a block of
+// its own once it outgrows HDD_PACK_THRESHOLD.  Slices left behind by a move
+// are not reused, and each mount starts a new pack block.
+
+typedef struct {
+        uint32_t bid;           // pack block slices are cut from, 0 if none yet
+        uint32_t used;          // bytes of it cut so far
+} Pack;
+
+// A file written with a hole of a chunk or more, or past what one block
+// holds, goes sparse: its entry's bid is a map block listing the chunks that
+// hold data, each HDD_SPARSE_CHUNK bytes of the file with the written bytes
+// of it (from the first to the last) in a block of their own.  Holes are
+// neither stored nor sent.  The map is read when first needed and written
+// back when the last handle closes, and at sync and unmount.  Map blocks
+// hold the magic, a varint count, then for each chunk varints for its index
+// (the distance from the previous one after the first), start, length and bid.
+
+typedef struct {
+        HddSparseChunk *chunks; // the chunks holding data, by index
+        uint32_t count;         // how many there are
+        uint32_t max;           // and room for
+        uint32_t capacity;      // size of the map block, 0 if there is none yet
+        int      loaded;        // the map has been read (or made)
+        int      dirty;         // changed since the map block was written
+} SparseMap;
+
+#define HDD_FILE_SPARSE(f) ((f)->capacity == HDD_SPARSE_CAPACITY)
+
+// Readahead state per file handle (kept beside files[], not saved in the meta block)
+
+typedef struct {
+        uint32_t last_loc;      // where the previous read started
+        uint32_t last_end;      // where the previous read ended
+        int64_t  last_delta;    // distance between the previous two read positions
+        int      strided;       // reads are a fixed distance apart (not back to back)
+        uint32_t window;        // readahead window, 0 when backed off
+        char    *buf;           // bytes of the block held locally
+        uint32_t start;         // block offset of buf
+        uint32_t len;           // bytes in buf
+        int      pending;       // a prefetch is on the wire
+        HddClientRequest req;   // the prefetch
+        char    *pbuf;          // where the prefetch lands
+        uint32_t pstart;        // block offset of the prefetch
+} Readahead;
+
+// What a volume keeps per file and per handle, and its journal's buffers:
+// a volume reserves the whole of it, but as a mapping the pages of which
+// are only backed once touched, so it costs just the entries it has used
+// (and entries never move, as growing them would)
+
+typedef struct {
+        File      files[MAX_HDD_FILEDESCR];
+        Handle    handles[MAX_HDD_FILEDESCR];
+        SparseMap sparse[MAX_HDD_FILEDESCR];
+        Readahead readahead[MAX_HDD_FILEDESCR];
+        uint8_t   image[HDD_JOURNAL_CAPACITY];
+        uint8_t   pending[HDD_JOURNAL_BATCH_MAX];
+} VolumeTables;
+
+// A volume: a server's filesystem as mounted, with everything above that
+// describes it.  The calling thread works on "vol", the default volume that
+// hdd_open() and the rest use unless an hdd_volume_* call switched it (along
+// with the directory and the connection the volume's requests go over).
+
+struct HddVolume {
+        VolumeTables *tables;                  // where the arrays below are, NULL until first mounted or opened on
+        File    *files;                        // array of file objects
+        int      files_top;                    // entries below this may be in use
+        Handle  *handles;                      // array of file handles
+        int      handles_top;                  // handles below this may be in use
+        int      init;                         // flag for initialization
+        int      meta_dirty;                   // the directory changed since the meta block was written
+        uint32_t meta_capacity;                // size of the meta block on the device
+        Journal  journal;                      // the metadata journal
+        Pack     pack;                         // the pack block being filled
+        uint32_t *retired;                     // blocks replaced, to delete once nothing durable names them
+        uint32_t nretired;                     // how many there are
+        uint32_t maxretired;                   // and room for
+        SparseMap *sparse;                     // chunk maps of the sparse files, by entry in files[]
+        Readahead *readahead;                  // readahead state per file handle
+        HddReadaheadStats ra_stats;            // readahead/prefetch counters
+        HddDir  *dir;                          // its directory, NULL for the default one
+        HddConnection *conn;                   // its connection, NULL for the thread's own
+        HddConnection own;                     // the connection of a volume made by hdd_volume_mount
+        char    *address;                      // the server's address (a copy)
+        uint32_t ns;                           // its namespace on the server, 0 for the device's own
+};
+
+static HddVolume default_volume = { .init = 1 };   // what hdd_open() and the rest use
+static __thread HddVolume *vol = &default_volume;  // the calling thread's volume
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -105,427 +275,2746 @@ uint32_t get_bid(uint64_t response)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
 
+//  block_prepare: checksums the payload of a CREATE/OVERWRITE request
+//                 (if the server keeps checksums)
 
-//
-// Implementation
+static void block_prepare(HddClientRequest *req)
+{
+    int op = (req->cmd >> 62);
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_format
-// Description  : Initializes device if necessary, deletes all blocks, creates meta block
-//
-// Inputs       : void
-// Outputs      : 0 on success, -1 on failure
-//
-uint16_t hdd_format(void) {
-	
-	if (init != 0)     // initialize device if needed
-	{
-		HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
-		HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+    if ((op == HDD_BLOCK_CREATE || op == HDD_BLOCK_OVERWRITE) &&
+        (hdd_client_capabilities() & HDD_CAP_CHECKSUM))
+        req->crc = hdd_crc32c(0, req->buf, (req->cmd >> 36) & 67108863);   // checksum what we send
+}
 
-		init = get_response(init_resp);
-	}
-             
+///////////////////////////////////////////////////////////////////////////////
 
-        if (init != 0)               // make sure init was successful
-        	return -1;
+//  block_verify: checks the data of a completed READ request against the
+//                checksum the server returned with it
 
-    // send format request //
-    
-    HddBitCmd format = construct(0, 0, HDD_FORMAT, 0, HDD_DEVICE);
-    HddBitResp format_resp = hdd_client_operation(format, NULL);
+static uint64_t block_verify(HddClientRequest *req)
+{
+    uint64_t response = req->resp;
 
-    if (get_response(format_resp) == 1)  // make sure format request was successful
+    if ((req->cmd >> 62) == HDD_BLOCK_READ && get_response(response) == 0 &&
+        (hdd_client_capabilities() & HDD_CAP_CHECKSUM))
+    {
+        uint32_t size = (response >> 36) & 67108863;
+
+        if (hdd_crc32c(0, req->buf, size) != req->crc)    // compare with the stored checksum
+        {
+            hdd_log(LOG_ERROR_LEVEL, "HDD_IO : checksum mismatch on block %u [%u bytes]", get_bid(response), size);
+            response |= ((uint64_t)1 << 32);    // report as a failed read
+        }
+    }
+
+    return response;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  hdd_block_operation: sends a command that moves block data, checksumming
+//                       the payload of CREATE/OVERWRITE and verifying the
+//                       checksum returned with a READ (if the server keeps them)
+
+uint64_t hdd_block_operation(uint64_t command, void *buf)
+{
+    HddClientRequest req = { .cmd = command, .buf = buf };
+
+    block_prepare(&req);
+    hdd_client_request(&req);
+
+    return block_verify(&req);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  block_load: reads the file's data into buf (room for its capacity): all of
+//              its own block, or its slice of a pack block (out of the whole
+//              pack block if the server can't read ranges)
+
+static int block_load(File *file, char *buf)
+{
+    if (file->offset == 0)
+    {
+        HddBitCmd read = construct(file->bid, 0, 0, file->capacity, HDD_BLOCK_READ);
+
+        return (get_response(hdd_block_operation(read, buf)) == 1) ? -1 : 0;
+    }
+
+    if (file->size == 0)
+        return 0;
+
+    if (hdd_client_capabilities() & HDD_CAP_RANGE_READ)
+    {
+        HddClientRequest req = { .buf = buf, .offset = file->offset };
+
+        req.cmd = construct(file->bid, 0, HDD_RANGE, file->size, HDD_BLOCK_READ);
+        hdd_client_request(&req);
+        return (get_response(block_verify(&req)) == 1) ? -1 : 0;
+    }
+
+    char *packbuf = hdd_pool_alloc(HDD_PACK_BLOCK_SIZE);
+    HddBitCmd read = construct(file->bid, 0, 0, HDD_PACK_BLOCK_SIZE, HDD_BLOCK_READ);
+    HddBitResp resp = hdd_block_operation(read, packbuf);
+
+    if (get_response(resp) == 1 || file->offset + file->size > ((resp >> 36) & 67108863))
+    {
+        hdd_pool_free(packbuf);
+        return -1;
+    }
+
+    memcpy(buf, &packbuf[file->offset], file->size);
+    hdd_pool_free(packbuf);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  pack_fits: whether a file needing capacity bytes goes in a slice (it
+//             must be empty or packed already, and the server must be able
+//             to read, write and grow the pack block a range at a time)
+
+static int pack_fits(File *file, uint32_t capacity)
+{
+    uint32_t needed = HDD_CAP_RANGE_READ | HDD_CAP_RANGE_WRITE | HDD_CAP_RESIZE;
+
+    return (capacity <= HDD_PACK_THRESHOLD && (file->bid == 0 || file->offset != 0) &&
+            (hdd_client_capabilities() & needed) == needed);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  pack_slice: moves the file to a new slice of capacity bytes holding buf,
+//              cut from the end of the pack block (a new one once it is full)
+
+static int pack_slice(int fi, uint32_t capacity, char *buf)
+{
+    File *file = &vol->files[fi];
+    HddClientRequest req = { .buf = buf };
+
+    if (vol->pack.bid == 0 || vol->pack.used + capacity > HDD_PACK_BLOCK_SIZE)
+    {
+        char magic[] = HDD_PACK_MAGIC;
+        HddBitCmd create = construct(0, 0, 0, HDD_PACK_HEADER, HDD_BLOCK_CREATE);
+
+        hdd_client_place(file->name);   // (the shard of the file that starts it)
+        HddBitResp create_resp = hdd_block_operation(create, magic);
+
+        if (get_response(create_resp) == 1)
+            return -1;
+        vol->pack.bid = get_bid(create_resp);
+        vol->pack.used = HDD_PACK_HEADER;
+    }
+
+    req.cmd = construct(vol->pack.bid, 0, HDD_RANGE, capacity, HDD_BLOCK_OVERWRITE);   // grows the pack block
+    req.offset = vol->pack.used;
+    block_prepare(&req);
+    if (get_response(hdd_client_request(&req)) == 1)
+    {
+        vol->pack.bid = 0;    // its end is in doubt, cut no more from it
         return -1;
+    }
+
+    file->bid = vol->pack.bid;
+    file->offset = vol->pack.used;
+    file->capacity = capacity;
+    vol->pack.used += capacity;
+    journal_record(fi, HDD_JREC_UPDATE);
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  block_retire: notes a block a file no longer uses, to be deleted by
+//                block_release (until then the directory the journal or the
+//                meta block has on the device may still name it; a block
+//                that can't be noted leaks)
+
+static void block_retire(uint32_t bid)
+{
+    uint32_t *more;
+
+    if (vol->nretired == vol->maxretired)
+    {
+        more = realloc(vol->retired, sizeof(uint32_t) * (vol->maxretired ? vol->maxretired * 2 : 64));
+        if (more == NULL)
+        {
+            hdd_log(LOG_ERROR_LEVEL, "HDD_IO : block %u leaked, no room to retire it", bid);
+            return;
+        }
+        vol->retired = more;
+        vol->maxretired = vol->maxretired ? vol->maxretired * 2 : 64;
+    }
+
+    vol->retired[vol->nretired++] = bid;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  block_release: deletes the retired blocks, once the journal commit (or
+//                 checkpoint) recording what replaced them is done; not
+//                 while a sparse map is unwritten, as it may name replaced
+//                 chunks (failures just leak blocks)
+
+static void block_release(void)
+{
+    for (int i = 0; i < vol->files_top; i++)
+    {
+        if (vol->sparse[i].dirty)
+            return;
+    }
+
+    for (uint32_t i = 0; i < vol->nretired; i++)
+    {
+        HddBitCmd delete = construct(vol->retired[i], 0, 0, 0, HDD_BLOCK_DELETE);
+
+        if (get_response(hdd_client_operation(delete, NULL)) == 1)
+            hdd_log(LOG_ERROR_LEVEL, "HDD_IO : retired block %u was not deleted", vol->retired[i]);
+    }
+    vol->nretired = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  block_resize: gives the file a block of capacity bytes holding its data,
+//                writing count bytes of data at the seek position on the way
+//                (grown in place if the server can, else copied to a new
+//                block, or to a new slice while the file is small enough to
+//                be packed)
+
+static int block_resize(int16_t fh, uint32_t capacity, void *data, uint32_t count)
+{
+    File *file = &vol->files[vol->handles[fh].file];
+    uint32_t loc = vol->handles[fh].loc;
+
+    if (file->bid != 0 && file->offset == 0 && (hdd_client_capabilities() & HDD_CAP_RESIZE))
+    {
+        HddClientRequest resize = { 0 }, write = { .buf = data, .offset = loc };
+
+        resize.cmd = construct(file->bid, 0, HDD_RESIZE, capacity, HDD_BLOCK_OVERWRITE);
+        if (hdd_client_post(&resize) == -1)
+            return -1;
+
+        if (count > 0)    // the new bytes follow without waiting for the resize
+        {
+            write.cmd = construct(file->bid, 0, HDD_RANGE, count, HDD_BLOCK_OVERWRITE);
+            block_prepare(&write);
+            hdd_client_request(&write);
+        }
+
+        if (get_response(hdd_client_wait(&resize)) == 1)
+            return -1;
+        file->capacity = capacity;
+        journal_record(vol->handles[fh].file, HDD_JREC_UPDATE);
 
-    // clear array //
+        return (count > 0 && get_response(write.resp) == 1) ? -1 : 0;
+    }
+
+    char *newbuf = hdd_pool_calloc(capacity);   // new block, zero filled past the data
 
-    for (int i = 0; i < MAX_HDD_FILEDESCR; i++)
+    if (file->bid != 0 && block_load(file, newbuf) == -1)   // old data first
     {
-    	files[i].loc = 0;
-    	files[i].bid = 0;
-    	strcpy(files[i].name, " ");
-    	files[i].open = 0;
-    	files[i].size = 0;
+        hdd_pool_free(newbuf);
+        return -1;
     }
 
-    // create meta block //
+    if (count > 0)
+        memcpy(&newbuf[loc], data, count);   // then the new data
+
+    if (pack_fits(file, capacity))
+    {
+        int r = pack_slice(vol->handles[fh].file, capacity, newbuf);
+
+        hdd_pool_free(newbuf);
+        return r;
+    }
 
-    HddBitCmd create_meta = construct(0, 0, HDD_META_BLOCK, MAX_HDD_FILEDESCR*sizeof(File), HDD_BLOCK_CREATE);
+    HddBitCmd create = construct(0, 0, 0, capacity, HDD_BLOCK_CREATE);
 
-    HddBitResp meta_resp = hdd_client_operation(create_meta, files); // pass array of files, save to meta block
+    hdd_client_place(file->name);   // its shard, when sharded
+    HddBitResp create_resp = hdd_block_operation(create, newbuf);
 
-    if (get_response(meta_resp) == 1)  // make sure format request was successful
+    hdd_pool_free(newbuf);
+    if (get_response(create_resp) == 1)
         return -1;
 
-    return 0; 
+    uint32_t old = (file->offset == 0) ? file->bid : 0;   // a slice stays behind in its pack block
+
+    file->bid = get_bid(create_resp);
+    file->offset = 0;
+    file->capacity = capacity;
+    journal_record(vol->handles[fh].file, HDD_JREC_UPDATE);
+    if (old != 0)
+        block_retire(old);    // deleted once the record is committed
+
+    return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_mount
-// Description  : intitializes device if needed, reads data from meta block
-//
-// Inputs       : none
-// Outputs      : 0 on success, -1 on failure
-//
-uint16_t hdd_mount(void) {
-	
-	if (init != 0)     // initialize device if needed
-	{
-		HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
-		HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+///////////////////////////////////////////////////////////////////////////////
 
-		init = get_response(init_resp);
-	}
-        if (init != 0)               // make sure init was successful
-        	return -1;
+//  hdd_sparse_decode: lists the chunks in a sparse file's map block (see
+//                     SparseMap), as an array to free()
 
-    // read from meta block into data structure //
+int hdd_sparse_decode(const uint8_t *buf, uint32_t len, HddSparseChunk **chunks, uint32_t *count)
+{
+    uint32_t pos = 4;
+    int64_t n, delta, start, length, bid, index = 0;
 
-    HddBitCmd read_meta = construct(0, 0, HDD_META_BLOCK, MAX_HDD_FILEDESCR*sizeof(File), HDD_BLOCK_READ );
-    
-    HddBitResp read_resp = hdd_client_operation(read_meta, files);
+    *chunks = NULL;
+    *count = 0;
 
-    if (get_response(read_resp) == 1)  // make sure read was successful
-    	return -1;
+    if (len < 4 || memcmp(buf, HDD_SPARSE_MAGIC, 4) != 0 || (n = hdd_get_varint(buf, len, &pos)) < 0 ||
+        n > (len - pos) / 4)    // (four varints a chunk, a byte at least each)
+        return -1;
+
+    if (n > 0 && (*chunks = malloc(sizeof(HddSparseChunk) * n)) == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if ((delta = hdd_get_varint(buf, len, &pos)) < 0 || (i > 0 && delta == 0) ||
+            (index += delta) > UINT32_MAX / HDD_SPARSE_CHUNK ||
+            (start = hdd_get_varint(buf, len, &pos)) < 0 || (length = hdd_get_varint(buf, len, &pos)) <= 0 ||
+            start + length > HDD_SPARSE_CHUNK || (bid = hdd_get_varint(buf, len, &pos)) <= 0)
+        {
+            free(*chunks);
+            *chunks = NULL;
+            return -1;
+        }
+
+        (*chunks)[i].index = index;
+        (*chunks)[i].start = start;
+        (*chunks)[i].length = length;
+        (*chunks)[i].bid = bid;
+    }
 
+    *count = n;
     return 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_unmount
-// Description  : saves current state of data structure to meta block, closes the device
-//
-// Inputs       : none
-// Outputs      : 0 on success, -1 on failure
-//
-uint16_t hdd_unmount(void) {
+//  sparse_encode: writes the map of a sparse file into buf (room for
+//                 HDD_SPARSE_MAP_ENTRY bytes a chunk and 9 more), returning
+//                 its length
 
-	// save data to meta block //
+static uint32_t sparse_encode(SparseMap *map, uint8_t *buf)
+{
+    uint32_t pos, prev = 0;
 
-	HddBitCmd save_meta = construct(0, 0, HDD_META_BLOCK, MAX_HDD_FILEDESCR*sizeof(File), HDD_BLOCK_OVERWRITE);
-    
-    HddBitResp save_meta_resp = hdd_client_operation(save_meta, files);	
+    memcpy(buf, HDD_SPARSE_MAGIC, 4);
+    pos = hdd_put_varint(buf, 4, map->count);
+    for (uint32_t i = 0; i < map->count; i++)
+    {
+        pos = hdd_put_varint(buf, pos, map->chunks[i].index - prev);
+        pos = hdd_put_varint(buf, pos, map->chunks[i].start);
+        pos = hdd_put_varint(buf, pos, map->chunks[i].length);
+        pos = hdd_put_varint(buf, pos, map->chunks[i].bid);
+        prev = map->chunks[i].index;
+    }
 
-    if (get_response(save_meta_resp) == 1)  // make sure save was successful
-    	return -1;
+    return pos;
+}
 
-    // save and close device // 
+///////////////////////////////////////////////////////////////////////////////
 
-    HddBitCmd save_close = construct(0, 0, HDD_SAVE_AND_CLOSE, 0, HDD_DEVICE);
-    
-    HddBitResp save_close_resp = hdd_client_operation(save_close, NULL);	
+//  sparse_drop: forgets the map of a file (without writing it)
 
-    if (get_response(save_close_resp) == 1)  // make sure save/close was successful
-    	return -1;
+static void sparse_drop(int fi)
+{
+    free(vol->sparse[fi].chunks);
+    memset(&vol->sparse[fi], 0x0, sizeof(SparseMap));
+}
+
+///////////////////////////////////////////////////////////////////////////////
 
-    init = 1;   //uninitialize
+//  sparse_load: the map of a sparse file, read from its map block the first
+//               time; NULL if it can't be read
 
-    return 0;	
+static SparseMap *sparse_load(int fi)
+{
+    File *file = &vol->files[fi];
+    SparseMap *map = &vol->sparse[fi];
+
+    if (map->loaded)
+        return map;
+
+    uint8_t *buf = hdd_pool_alloc(HDD_MAX_BLOCK_SIZE);   // the server says how much there is
+    HddBitCmd read = construct(file->bid, 0, 0, HDD_MAX_BLOCK_SIZE, HDD_BLOCK_READ);
+    HddBitResp resp = hdd_block_operation(read, buf);
+    uint32_t len = (resp >> 36) & 67108863;
+
+    if (get_response(resp) == 1 || hdd_sparse_decode(buf, len, &map->chunks, &map->count) == -1)
+    {
+        hdd_log(LOG_ERROR_LEVEL, "HDD_IO : map block %u of [%s] is unreadable", file->bid, file->name);
+        hdd_pool_free(buf);
+        return NULL;
+    }
+
+    hdd_pool_free(buf);
+    map->max = map->count;
+    map->capacity = len;
+    map->loaded = 1;
+    map->dirty = 0;
+    return map;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//
-// Function     : hdd_open
-// Description  : initializes driver, opens a file, and sets needed metadata
-//
-// Inputs       : filename
-// Outputs      : unique integer file handle
-//
-int16_t hdd_open(char *path) {
-	
-    if (init != 0)     // initialize device if needed
-	{
-		HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
-		HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+///////////////////////////////////////////////////////////////////////////////
 
-		init = get_response(init_resp);
-	}
-        if (init != 0)               // make sure init was successful
-        	return -1;
+//  sparse_save: writes the map of a sparse file if it changed, in place
+//               while it fits its block, else to a new block with room to
+//               spare (the old one deleted)
+
+static int sparse_save(int fi)
+{
+    File *file = &vol->files[fi];
+    SparseMap *map = &vol->sparse[fi];
+    uint32_t room = HDD_GROW_CAPACITY(9 + map->count * HDD_SPARSE_MAP_ENTRY), len, capacity, old;
+    HddBitResp resp;
+    uint8_t *buf;
+
+    if (!map->dirty)
+        return 0;    // nothing to send
+
+    if (room < map->capacity)
+        room = map->capacity;
+    if (room < HDD_SPARSE_MAP_MIN)
+        room = HDD_SPARSE_MAP_MIN;
+    buf = hdd_pool_calloc(room);
+    len = sparse_encode(map, buf);
+
+    if (len <= map->capacity)
+    {
+        HddClientRequest req = { .buf = buf };
+
+        if (hdd_client_capabilities() & HDD_CAP_RANGE_WRITE)   // just the map, the rest is stale
+            req.cmd = construct(file->bid, 0, HDD_RANGE, len, HDD_BLOCK_OVERWRITE);
+        else
+            req.cmd = construct(file->bid, 0, 0, map->capacity, HDD_BLOCK_OVERWRITE);
+
+        block_prepare(&req);
+        resp = hdd_client_request(&req);
+        hdd_pool_free(buf);
+        if (get_response(resp) == 1)
+            return -1;
+    }
+    else
+    {
+        capacity = HDD_GROW_CAPACITY(len);
+        if (capacity < HDD_SPARSE_MAP_MIN)
+            capacity = HDD_SPARSE_MAP_MIN;
+        if (capacity > HDD_MAX_BLOCK_SIZE)
+            capacity = HDD_MAX_BLOCK_SIZE;
+        if (len > capacity)
+        {
+            hdd_log(LOG_ERROR_LEVEL, "HDD_IO : map of [%s] outgrew a block [%u bytes]", file->name, len);
+            hdd_pool_free(buf);
+            return -1;
+        }
+
+        HddBitCmd create = construct(0, 0, 0, capacity, HDD_BLOCK_CREATE);
+
+        hdd_client_place(file->name);   // its shard, when sharded
+        resp = hdd_block_operation(create, buf);
+        hdd_pool_free(buf);
+        if (get_response(resp) == 1)
+            return -1;
+
+        old = (map->capacity != 0) ? file->bid : 0;
+        file->bid = get_bid(resp);
+        map->capacity = capacity;
+        journal_record(fi, HDD_JREC_UPDATE);
+        if (old != 0)
+            block_retire(old);    // deleted once the record is committed
+    }
+
+    map->dirty = 0;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_save_all: writes the changed maps of the open sparse files
+
+static int sparse_save_all(void)
+{
+    int r = 0;
+
+    for (int i = 0; i < vol->files_top; i++)
+    {
+        if (vol->files[i].handles > 0 && vol->sparse[i].dirty && sparse_save(i) == -1)
+            r = -1;
+    }
+
+    return r;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_find: the chunk of a map with an index, NULL if it is a hole;
+//               pos is where it is, or would go
+
+static HddSparseChunk *sparse_find(SparseMap *map, uint32_t index, uint32_t *pos)
+{
+    uint32_t lo = 0, hi = map->count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (map->chunks[mid].index < index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *pos = lo;
+    return (lo < map->count && map->chunks[lo].index == index) ? &map->chunks[lo] : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_chunk_read: reads count bytes at off of a chunk's data into buf
+
+static int sparse_chunk_read(HddSparseChunk *chunk, uint32_t off, char *buf, uint32_t count)
+{
+    if (hdd_client_capabilities() & HDD_CAP_RANGE_READ)
+    {
+        HddClientRequest req = { .buf = buf, .offset = off };
+
+        req.cmd = construct(chunk->bid, 0, HDD_RANGE, count, HDD_BLOCK_READ);
+        hdd_client_request(&req);
+
+        uint64_t response = block_verify(&req);
+
+        return (get_response(response) == 1 || ((response >> 36) & 67108863) != count) ? -1 : 0;
+    }
+
+    char *blockbuf = hdd_pool_alloc(chunk->length);
+    HddBitCmd read = construct(chunk->bid, 0, 0, chunk->length, HDD_BLOCK_READ);
+
+    if (get_response(hdd_block_operation(read, blockbuf)) == 1)
+    {
+        hdd_pool_free(blockbuf);
+        return -1;
+    }
+
+    memcpy(buf, &blockbuf[off], count);
+    hdd_pool_free(blockbuf);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_chunk_write: writes count bytes of data at off of a chunk of the
+//                      file: a new block for a hole, else in place if the
+//                      server can patch (and grow) the chunk's block, else a
+//                      copy of it with the new bytes added
+
+static int sparse_chunk_write(int fi, uint32_t index, uint32_t off, const char *data, uint32_t count)
+{
+    File *file = &vol->files[fi];
+    SparseMap *map = &vol->sparse[fi];
+    uint32_t caps = hdd_client_capabilities(), grow = HDD_CAP_RANGE_WRITE | HDD_CAP_RESIZE, pos;
+    HddSparseChunk *chunk = sparse_find(map, index, &pos);
+    HddBitResp resp;
+
+    if (chunk == NULL)    // a hole, just the new bytes go in a block of their own
+    {
+        HddBitCmd create = construct(0, 0, 0, count, HDD_BLOCK_CREATE);
+
+        if (map->count == map->max)
+        {
+            uint32_t max = (map->max == 0) ? 16 : map->max * 2;
+            HddSparseChunk *chunks = realloc(map->chunks, sizeof(HddSparseChunk) * max);
+
+            if (chunks == NULL)
+                return -1;
+            map->chunks = chunks;
+            map->max = max;
+        }
+
+        hdd_client_place(file->name);   // its shard, when sharded
+        resp = hdd_block_operation(create, (void *)data);
+        if (get_response(resp) == 1)
+            return -1;
+
+        memmove(&map->chunks[pos + 1], &map->chunks[pos], sizeof(HddSparseChunk) * (map->count - pos));
+        map->chunks[pos].index = index;
+        map->chunks[pos].start = off;
+        map->chunks[pos].length = count;
+        map->chunks[pos].bid = get_bid(resp);
+        map->count++;
+        map->dirty = 1;
+        return 0;
+    }
+
+    uint32_t end = chunk->start + chunk->length;
+
+    if (off >= chunk->start && off + count <= end && (caps & HDD_CAP_RANGE_WRITE))   // inside it
+    {
+        HddClientRequest req = { .buf = (void *)data, .offset = off - chunk->start };
+
+        req.cmd = construct(chunk->bid, 0, HDD_RANGE, count, HDD_BLOCK_OVERWRITE);
+        block_prepare(&req);
+        return (get_response(hdd_client_request(&req)) == 1) ? -1 : 0;
+    }
+
+    if (off >= chunk->start && (caps & grow) == grow)    // past its end, zero filled up to the new bytes
+    {
+        HddClientRequest resize = { 0 }, write = { .buf = (void *)data, .offset = off - chunk->start };
+
+        if (off > end)
+        {
+            resize.cmd = construct(chunk->bid, 0, HDD_RESIZE, off - chunk->start, HDD_BLOCK_OVERWRITE);
+            if (hdd_client_post(&resize) == -1)
+                return -1;
+        }
+
+        write.cmd = construct(chunk->bid, 0, HDD_RANGE, count, HDD_BLOCK_OVERWRITE);
+        block_prepare(&write);
+        hdd_client_request(&write);
+
+        if ((off > end && get_response(hdd_client_wait(&resize)) == 1) || get_response(write.resp) == 1)
+            return -1;
+
+        chunk->length = off + count - chunk->start;
+        map->dirty = 1;
+        return 0;
+    }
+
+    // Read it, add the new bytes (and the zeros between), write it back
+    uint32_t nstart = (off < chunk->start) ? off : chunk->start;
+    uint32_t nend = (off + count > end) ? off + count : end;
+    char *buf = hdd_pool_calloc(nend - nstart);
+    HddBitCmd read = construct(chunk->bid, 0, 0, chunk->length, HDD_BLOCK_READ);
+
+    if (get_response(hdd_block_operation(read, &buf[chunk->start - nstart])) == 1)
+    {
+        hdd_pool_free(buf);
+        return -1;
+    }
+    memcpy(&buf[off - nstart], data, count);
+
+    if (nstart == chunk->start && nend == end)   // the same size, overwrite it
+    {
+        HddBitCmd overwrite = construct(chunk->bid, 0, 0, chunk->length, HDD_BLOCK_OVERWRITE);
+
+        resp = hdd_block_operation(overwrite, buf);
+        hdd_pool_free(buf);
+        return (get_response(resp) == 1) ? -1 : 0;
+    }
+
+    HddBitCmd create = construct(0, 0, 0, nend - nstart, HDD_BLOCK_CREATE);
+
+    hdd_client_place(file->name);
+    resp = hdd_block_operation(create, buf);
+    hdd_pool_free(buf);
+    if (get_response(resp) == 1)
+        return -1;
+
+    block_retire(chunk->bid);    // deleted once the map naming the new one is written
+
+    chunk->bid = get_bid(resp);
+    chunk->start = nstart;
+    chunk->length = nend - nstart;
+    map->dirty = 1;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_write: writes count bytes of data at the seek position of a
+//                handle on a sparse file, a chunk at a time
+
+static int sparse_write(int16_t fh, const char *data, uint32_t count)
+{
+    int fi = vol->handles[fh].file;
+    uint32_t loc = vol->handles[fh].loc, done = 0;
+
+    if (sparse_load(fi) == NULL)
+        return -1;
+
+    while (done < count)
+    {
+        uint32_t at = loc + done, off = at % HDD_SPARSE_CHUNK;
+        uint32_t n = (HDD_SPARSE_CHUNK - off < count - done) ? HDD_SPARSE_CHUNK - off : count - done;
+
+        if (sparse_chunk_write(fi, at / HDD_SPARSE_CHUNK, off, &data[done], n) == -1)
+            return -1;
+        done += n;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_read: reads count bytes at the seek position of a handle on a
+//               sparse file into data (all inside the file), zeros for the
+//               holes, just the bytes stored from each chunk
+
+static int sparse_read(int16_t fh, char *data, uint32_t count)
+{
+    SparseMap *map = sparse_load(vol->handles[fh].file);
+    uint32_t loc = vol->handles[fh].loc, done = 0, pos;
+
+    if (map == NULL)
+        return -1;
+
+    memset(data, 0x0, count);
+    while (done < count)
+    {
+        uint32_t at = loc + done, base = at - at % HDD_SPARSE_CHUNK;
+        uint32_t n = (base + HDD_SPARSE_CHUNK - at < count - done) ? base + HDD_SPARSE_CHUNK - at : count - done;
+        HddSparseChunk *chunk = sparse_find(map, at / HDD_SPARSE_CHUNK, &pos);
+
+        if (chunk != NULL)
+        {
+            uint32_t from = base + chunk->start, to = from + chunk->length;   // its data
+
+            if (from < at)
+                from = at;
+            if (to > at + n)
+                to = at + n;
+            if (from < to && sparse_chunk_read(chunk, from - base - chunk->start, &data[from - loc], to - from) == -1)
+                return -1;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_free: retires the blocks of a sparse file, its chunks and its map,
+//               to be deleted once the record replacing them is committed
+//               (the map must be readable)
+
+static int sparse_free(int fi)
+{
+    File *file = &vol->files[fi];
+    SparseMap *map = sparse_load(fi);
+
+    if (map == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < map->count; i++)
+        block_retire(map->chunks[i].bid);
+
+    block_retire(file->bid);
+    sparse_drop(fi);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  sparse_convert: makes the file of a handle sparse, its data (but for
+//                  runs of zeros at the ends of chunks) copied to chunks
+//                  and its block deleted once the map is written
+
+static int sparse_convert(int16_t fh)
+{
+    int fi = vol->handles[fh].file;
+    File *file = &vol->files[fi];
+    File dense = *file;
+
+    sparse_drop(fi);
+    vol->sparse[fi].loaded = 1;
+    vol->sparse[fi].dirty = 1;
+
+    if (file->bid != 0 && file->size > 0)
+    {
+        char *buf = hdd_pool_alloc(file->capacity);
+        int r = block_load(file, buf);
+
+        for (uint32_t base = 0; base < file->size && r == 0; base += HDD_SPARSE_CHUNK)
+        {
+            uint32_t first = base, last = (file->size - base < HDD_SPARSE_CHUNK) ? file->size : base + HDD_SPARSE_CHUNK;
+
+            while (first < last && buf[first] == 0)
+                first++;
+            while (last > first && buf[last - 1] == 0)
+                last--;
+            if (first < last)
+                r = sparse_chunk_write(fi, base / HDD_SPARSE_CHUNK, first - base, &buf[first], last - first);
+        }
+
+        hdd_pool_free(buf);
+        if (r == -1)
+        {
+            sparse_drop(fi);    // (the chunks made so far leak)
+            return -1;
+        }
+    }
+
+    file->bid = 0;        // the map gets a block of its own
+    file->offset = 0;
+    file->capacity = HDD_SPARSE_CAPACITY;
+    if (sparse_save(fi) == -1)
+    {
+        *file = dense;
+        sparse_drop(fi);
+        return -1;
+    }
+
+    if (dense.bid != 0 && dense.offset == 0)    // a slice stays behind in its pack block
+        block_retire(dense.bid);
+
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_holds: whether the locally held bytes cover [loc, loc+count)
+
+static int ra_holds(Readahead *ra, uint32_t loc, uint32_t count)
+{
+    return (ra->buf != NULL && loc >= ra->start && loc + count <= ra->start + ra->len);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_collect: waits for the handle's prefetch and adds it to the held bytes,
+//              keeping what is held from loc onward when the two are adjacent
+
+static int ra_collect(int16_t fh, uint32_t loc)
+{
+    Readahead *ra = &vol->readahead[fh];
+    uint64_t response;
+
+    ra->pending = 0;
+    hdd_client_wait(&ra->req);
+    response = block_verify(&ra->req);
+
+    if (get_response(response) == 1)
+    {
+        hdd_pool_free(ra->pbuf);
+        ra->pbuf = NULL;
+        return -1;
+    }
+
+    uint32_t plen = (response >> 36) & 67108863;   // may be short at the end of the block
+
+    if (ra->buf != NULL && ra->pstart == ra->start + ra->len && loc >= ra->start && loc < ra->pstart)
+    {
+        uint32_t keep = ra->pstart - loc;       // held bytes still ahead of the reader
+        char *merged = hdd_pool_alloc(keep + plen);
+
+        memcpy(merged, &ra->buf[loc - ra->start], keep);
+        memcpy(&merged[keep], ra->pbuf, plen);
+        hdd_pool_free(ra->buf);
+        hdd_pool_free(ra->pbuf);
+        ra->buf = merged;
+        ra->start = loc;
+        ra->len = keep + plen;
+    }
+    else
+    {
+        hdd_pool_free(ra->buf);
+        ra->buf = ra->pbuf;
+        ra->start = ra->pstart;
+        ra->len = plen;
+    }
+
+    ra->pbuf = NULL;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_drop: forgets the held bytes of a handle (after a write, close or
+//           remount), collecting any prefetch still on the wire
+
+static void ra_drop(int16_t fh)
+{
+    Readahead *ra = &vol->readahead[fh];
+
+    if (ra->pending)
+    {
+        ra->pending = 0;
+        hdd_client_wait(&ra->req);
+        vol->ra_stats.prefetch_wasted++;
+    }
+
+    hdd_pool_free(ra->pbuf);
+    hdd_pool_free(ra->buf);
+    ra->pbuf = NULL;
+    ra->buf = NULL;
+    ra->start = ra->len = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_reset: drops the held bytes and forgets the access pattern of a handle,
+//            or of every handle if fh is -1
+
+static void ra_reset(int16_t fh)
+{
+    for (int i = 0; i < vol->handles_top; i++)   // (handles above were never used)
+    {
+        if (fh == -1 || fh == i)
+        {
+            ra_drop(i);
+            vol->readahead[i].last_loc = vol->readahead[i].last_end = 0;
+            vol->readahead[i].last_delta = 0;
+            vol->readahead[i].strided = 0;
+            vol->readahead[i].window = 0;
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_drop_file: forgets the held bytes of every handle on the file of fh
+//                (all of them are stale once one of them writes)
+
+static void ra_drop_file(int16_t fh)
+{
+    uint16_t fi = vol->handles[fh].file;
+
+    if (vol->files[fi].handles == 1)
+    {
+        ra_drop(fh);
+        return;
+    }
+
+    for (int i = 0; i < vol->handles_top; i++)
+    {
+        if ((vol->handles[i].flags & HDD_HANDLE_OPEN) && vol->handles[i].file == fi)
+            ra_drop(i);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_fill: reads [loc, loc+len) of the file synchronously into the held
+//           bytes (the whole block, or slice, if the server can't read ranges)
+
+static int ra_fill(int16_t fh, uint32_t loc, uint32_t len)
+{
+    Readahead *ra = &vol->readahead[fh];
+    File *file = &vol->files[vol->handles[fh].file];
+    HddClientRequest req = { 0 };
+
+    if (hdd_client_capabilities() & HDD_CAP_RANGE_READ)
+    {
+        if (len > file->size - loc)
+            len = file->size - loc;
+        req.cmd = construct(file->bid, 0, HDD_RANGE, len, HDD_BLOCK_READ);
+        req.offset = file->offset + loc;
+    }
+    else if (file->offset != 0)
+    {
+        char *buf = hdd_pool_alloc(file->capacity);
+
+        if (block_load(file, buf) == -1)
+        {
+            hdd_pool_free(buf);
+            return -1;
+        }
+
+        hdd_pool_free(ra->buf);
+        ra->buf = buf;
+        ra->start = 0;
+        ra->len = file->size;
+        return 0;
+    }
+    else
+    {
+        loc = 0;
+        len = file->capacity;
+        req.cmd = construct(file->bid, 0, 0, len, HDD_BLOCK_READ);   // command to read data from block
+    }
+
+    req.buf = hdd_pool_alloc(len);
+    hdd_client_request(&req);
+
+    uint64_t response = block_verify(&req);
+
+    if (get_response(response) == 1)
+    {
+        hdd_pool_free(req.buf);  // failure if R = -1
+        return -1;
+    }
+
+    hdd_pool_free(ra->buf);
+    ra->buf = req.buf;
+    ra->start = loc;
+    ra->len = (response >> 36) & 67108863;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  ra_prefetch: posts a read of the next window if the access pattern says
+//               where the next read will be and it isn't held already
+
+static void ra_prefetch(int16_t fh, uint32_t loc, uint32_t count)
+{
+    Readahead *ra = &vol->readahead[fh];
+    File *file = &vol->files[vol->handles[fh].file];
+    int64_t next;
+    uint32_t pstart, plen;
+
+    if (ra->window == 0 || ra->pending || !(hdd_client_capabilities() & HDD_CAP_RANGE_READ))
+        return;
+
+    next = ra->strided ? (int64_t)loc + ra->last_delta : (int64_t)loc + count;   // predicted next read
+    if (next < 0 || next >= file->size)
+        return;
+    if (count > file->size - next)
+        count = file->size - next;
+    if (ra_holds(ra, next, count))
+        return;
+
+    // Continue from the end of what is held if the next read starts inside it
+    pstart = (ra->buf != NULL && next >= ra->start && next < ra->start + ra->len) ? ra->start + ra->len : next;
+    plen = file->size - pstart;
+    if (plen > ra->window)
+        plen = ra->window;
+    if (ra->strided && (ra->last_delta > ra->window || -ra->last_delta > ra->window) && plen > count)
+        plen = count;    // strides wider than the window: just the next read
+
+    ra->pbuf = hdd_pool_alloc(plen);
+    ra->pstart = pstart;
+    memset(&ra->req, 0x0, sizeof(ra->req));
+    ra->req.cmd = construct(file->bid, 0, HDD_RANGE, plen, HDD_BLOCK_READ);
+    ra->req.offset = file->offset + pstart;
+    ra->req.buf = ra->pbuf;
+
+    if (hdd_client_post(&ra->req) == -1)
+    {
+        hdd_pool_free(ra->pbuf);
+        ra->pbuf = NULL;
+        return;
+    }
+
+    ra->pending = 1;
+    vol->ra_stats.prefetches++;
+    vol->ra_stats.prefetch_bytes += plen;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  hdd_readahead_stats: copies out the readahead/prefetch counters
+
+void hdd_readahead_stats(HddReadaheadStats *stats)
+{
+    *stats = vol->ra_stats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  files_clear: marks every entry of files[] and handles[] unused (and
+//               forgets the maps of sparse files)
+
+static void files_clear(void)
+{
+    for (int i = 0; i < vol->files_top; i++)
+        sparse_drop(i);
+    if (vol->tables != NULL)
+    {
+        memset(vol->files, 0x0, vol->files_top * sizeof(File));
+        memset(vol->handles, 0x0, vol->handles_top * sizeof(Handle));
+    }
+    vol->files_top = 0;
+    vol->handles_top = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  volume_tables: reserves the volume's tables if it has none yet (see
+//                 VolumeTables), returning -1 if they can't be mapped
+
+static int volume_tables(void)
+{
+    VolumeTables *t;
+
+    if (vol->tables != NULL)
+        return 0;
+
+    t = mmap(NULL, sizeof(VolumeTables), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (t == MAP_FAILED)
+        return -1;
+
+    vol->tables = t;
+    vol->files = t->files;
+    vol->handles = t->handles;
+    vol->sparse = t->sparse;
+    vol->readahead = t->readahead;
+    vol->journal.image = t->image;
+    vol->journal.pending = t->pending;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  handle_file: the file a handle is open on, NULL if it isn't a handle in use
+
+static File *handle_file(int16_t fh)
+{
+    if (fh < 0 || fh >= vol->handles_top || !(vol->handles[fh].flags & HDD_HANDLE_OPEN))
+        return NULL;
+
+    return &vol->files[vol->handles[fh].file];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  meta_encode: writes the meta block into buf, returning its length
+
+static uint32_t meta_encode(uint8_t *buf)
+{
+    uint32_t pos;
+
+    memcpy(buf, HDD_META_MAGIC, 4);
+    pos = hdd_put_varint(buf, 4, HDD_META_VERSION);
+    pos = hdd_put_varint(buf, pos, vol->journal.bid);
+    pos = hdd_put_varint(buf, pos, vol->journal.epoch);
+    pos = hdd_put_varint(buf, pos, hdd_dir_root());
+    pos = hdd_put_varint(buf, pos, hdd_dir_count());
+
+    return pos;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  meta_decode: sets up the directory and journal from the len bytes of a
+//               meta block, the original layout (whose files go into the
+//               directory) or the compact one; the version, or -1 if it is
+//               neither or is damaged
+
+static int meta_decode(const uint8_t *buf, uint32_t len)
+{
+    uint32_t pos = 4;
+    int64_t count, jbid, jepoch, root;
+    char name[MAX_FILENAME_LENGTH];
+    HddDirEntry entry = { 0 };
+
+    files_clear();
+    hdd_dir_reset(0, 0);
+
+    if (len == MAX_HDD_FILEDESCR*sizeof(FileV0) && memcmp(buf, HDD_META_MAGIC, 4) != 0)   // version 0
+    {
+        const FileV0 *old = (const FileV0 *)buf;
+
+        for (int i = 0; i < MAX_HDD_FILEDESCR; i++)
+        {
+            memcpy(name, old[i].name, MAX_FILENAME_LENGTH);
+            name[MAX_FILENAME_LENGTH - 1] = '\0';
+            entry.bid = old[i].bid;
+            entry.size = old[i].size;
+            entry.capacity = old[i].size;   // its block was exactly the data
+            if (strcmp(name, " ") != 0 && hdd_dir_put(name, &entry) == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    if (len < 4 || memcmp(buf, HDD_META_MAGIC, 4) != 0 ||
+        hdd_get_varint(buf, len, &pos) != HDD_META_VERSION ||
+        (jbid = hdd_get_varint(buf, len, &pos)) < 0 ||
+        (jepoch = hdd_get_varint(buf, len, &pos)) < 0 ||
+        (root = hdd_get_varint(buf, len, &pos)) < 0 ||
+        (count = hdd_get_varint(buf, len, &pos)) < 0)
+    {
+        hdd_log(LOG_ERROR_LEVEL, "HDD_IO : unrecognized meta block [%u bytes]", len);
+        return -1;
+    }
+
+    vol->journal.bid = jbid;
+    vol->journal.epoch = jepoch;
+    hdd_dir_reset(root, count);    // pages are read as they are needed
+
+    return HDD_META_VERSION;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  meta_save: writes the meta block if the directory changed, over the old
+//             one in place (the encoding is a few varints, so it always
+//             fits, even in the start of a version 0 block), or as a new
+//             one if FORMAT left none
+
+static int meta_save(void)
+{
+    uint8_t *buf;
+    uint32_t len;
+    HddBitResp resp;
+
+    if (!vol->meta_dirty)
+        return 0;    // nothing to send
+
+    buf = hdd_pool_calloc((vol->meta_capacity > HDD_META_MIN_CAPACITY) ? vol->meta_capacity : HDD_META_MIN_CAPACITY);
+    len = meta_encode(buf);
+
+    if (vol->meta_capacity == 0)
+    {
+        HddBitCmd create_meta = construct(vol->ns, 0, HDD_META_BLOCK, HDD_META_MIN_CAPACITY, HDD_BLOCK_CREATE);
+
+        resp = hdd_block_operation(create_meta, buf);
+        if (get_response(resp) == 0)
+            vol->meta_capacity = HDD_META_MIN_CAPACITY;
+    }
+    else if (len <= vol->meta_capacity)
+    {
+        HddBitCmd save_meta = construct(vol->ns, 0, HDD_META_BLOCK, vol->meta_capacity, HDD_BLOCK_OVERWRITE);
+
+        resp = hdd_block_operation(save_meta, buf);
+    }
+    else
+    {
+        hdd_log(LOG_ERROR_LEVEL, "HDD_IO : meta block of %u bytes too small [%u needed]", vol->meta_capacity, len);
+        resp = (HddBitResp)1 << 32;
+    }
+
+    hdd_pool_free(buf);
+    if (get_response(resp) == 1)
+        return -1;
+
+    vol->meta_dirty = 0;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  journal_reset: forgets the journal (and anything not yet committed to it)
+
+static void journal_reset(void)
+{
+    vol->journal.bid = 0;
+    vol->journal.epoch = 0;
+    vol->journal.tail = 0;
+    vol->journal.plen = 0;
+    vol->journal.precords = 0;
+    vol->journal.last_fi = -1;
+    vol->journal.overflow = 0;
+    vol->nretired = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  journal_checkpoint: writes the changed directory pages, then the meta
+//                      block pointing at them with the next epoch, which
+//                      retires everything in the journal
+
+static int journal_checkpoint(void)
+{
+    if (hdd_dir_flush() == -1)
+        return -1;
+
+    vol->journal.epoch++;
+    vol->meta_dirty = 1;
+
+    if (meta_save() == -1)
+    {
+        vol->journal.epoch--;    // the journal still holds what the meta block doesn't
+        return -1;
+    }
+
+    hdd_dir_release();      // the pages the flush replaced (failures just leak blocks)
+    block_release();        // and the blocks files replaced
+
+    vol->journal.tail = 0;
+    vol->journal.plen = 0;
+    vol->journal.precords = 0;
+    vol->journal.last_fi = -1;
+    vol->journal.overflow = 0;
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  journal_commit: appends the pending records to the journal block as one
+//                  batch, checkpointing instead when there is no room (or
+//                  no journal block yet, or records that didn't fit)
+
+static int journal_commit(void)
+{
+    uint32_t batch = 12 + vol->journal.plen, crc;
+    HddClientRequest req = { 0 };
+
+    if (vol->journal.plen == 0)
+    {
+        block_release();    // all committed, so just the maps may have named them
+        return 0;
+    }
+
+    if (vol->journal.bid == 0)   // first commit, make the journal block
+    {
+        memset(vol->journal.image, 0x0, HDD_JOURNAL_CAPACITY);
+
+        HddBitCmd create = construct(0, 0, 0, HDD_JOURNAL_CAPACITY, HDD_BLOCK_CREATE);
+        HddBitResp create_resp = hdd_block_operation(create, vol->journal.image);
+
+        if (get_response(create_resp) == 1)
+            return -1;
+        vol->journal.bid = get_bid(create_resp);
+        return journal_checkpoint();    // the meta block has to point at it
+    }
+
+    if (vol->journal.overflow || vol->journal.tail + batch > HDD_JOURNAL_CAPACITY)
+        return journal_checkpoint();    // full, start over
+
+    crc = hdd_crc32c(0, vol->journal.pending, vol->journal.plen);
+    memcpy(&vol->journal.image[vol->journal.tail], &vol->journal.plen, 4);
+    memcpy(&vol->journal.image[vol->journal.tail + 4], &vol->journal.epoch, 4);
+    memcpy(&vol->journal.image[vol->journal.tail + 8], &crc, 4);
+    memcpy(&vol->journal.image[vol->journal.tail + 12], vol->journal.pending, vol->journal.plen);
+
+    if (hdd_client_capabilities() & HDD_CAP_RANGE_WRITE)   // just the batch
+    {
+        req.cmd = construct(vol->journal.bid, 0, HDD_RANGE, batch, HDD_BLOCK_OVERWRITE);
+        req.buf = &vol->journal.image[vol->journal.tail];
+        req.offset = vol->journal.tail;
+    }
+    else
+    {
+        req.cmd = construct(vol->journal.bid, 0, 0, HDD_JOURNAL_CAPACITY, HDD_BLOCK_OVERWRITE);
+        req.buf = vol->journal.image;
+    }
+
+    block_prepare(&req);
+    if (get_response(hdd_client_request(&req)) == 1)
+        return -1;
+
+    vol->journal.tail += batch;
+    vol->journal.plen = 0;
+    vol->journal.precords = 0;
+    vol->journal.last_fi = -1;
+    block_release();    // nothing durable names the blocks replaced before it now
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  journal_record: puts an open file's metadata in the directory and notes
+//                  the change, committing the pending records once there
+//                  are enough of them (back to back UPDATEs of a file keep
+//                  only the last); records that fail to commit stay
+//                  pending for the next try, and once they fill it a
+//                  checkpoint is forced (or, failing that, left for the
+//                  next commit to do)
+
+static void journal_record(int fi, HDD_JOURNAL_RECORD_TYPE type)
+{
+    HddDirEntry entry = { vol->files[fi].bid, vol->files[fi].size, vol->files[fi].capacity, vol->files[fi].offset };
+    int packed = (type == HDD_JREC_UPDATE && vol->files[fi].offset != 0);
+    uint32_t namelen = strlen(vol->files[fi].name);
+    uint8_t *rec;
+
+    if (hdd_dir_put(vol->files[fi].name, &entry) == -1)
+        hdd_log(LOG_ERROR_LEVEL, "HDD_IO : directory update of [%s] failed", vol->files[fi].name);
+    vol->meta_dirty = 1;
+
+    if (vol->journal.overflow || vol->journal.plen + MAX_FILENAME_LENGTH + 24 > HDD_JOURNAL_BATCH_MAX)
+    {
+        // Commits keep failing, so the directory itself has to be written
+        if (journal_checkpoint() == 0)
+            return;    // and it has this change too
+
+        vol->journal.overflow = 1;
+        hdd_log(LOG_ERROR_LEVEL, "HDD_IO : metadata checkpoint failed, [%s] waits for the next one", vol->files[fi].name);
+        return;
+    }
+
+    if (type == HDD_JREC_UPDATE && vol->journal.last_fi == fi)
+    {
+        vol->journal.plen = vol->journal.last_pos;    // replaces the last one
+        vol->journal.precords--;
+    }
+
+    vol->journal.last_pos = vol->journal.plen;
+    vol->journal.last_fi = (type == HDD_JREC_UPDATE) ? fi : -1;
+
+    rec = vol->journal.pending;
+    vol->journal.plen = hdd_put_varint(rec, vol->journal.plen, packed ? HDD_JREC_UPDATE_PACKED : type);
+    vol->journal.plen = hdd_put_varint(rec, vol->journal.plen, namelen);
+    memcpy(&rec[vol->journal.plen], vol->files[fi].name, namelen);
+    vol->journal.plen += namelen;
+    if (type == HDD_JREC_UPDATE)
+    {
+        vol->journal.plen = hdd_put_varint(rec, vol->journal.plen, vol->files[fi].bid);
+        vol->journal.plen = hdd_put_varint(rec, vol->journal.plen, vol->files[fi].size);
+        vol->journal.plen = hdd_put_varint(rec, vol->journal.plen, vol->files[fi].capacity);
+        if (packed)
+            vol->journal.plen = hdd_put_varint(rec, vol->journal.plen, vol->files[fi].offset);
+    }
+
+    if (++vol->journal.precords >= HDD_JOURNAL_GROUP && journal_commit() == -1)
+        hdd_log(LOG_ERROR_LEVEL, "HDD_IO : metadata journal commit failed, %d records pending", vol->journal.precords);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+//  journal_replay: reads the journal block and applies the batches of the
+//                  current epoch to the directory, returning the number of
+//                  records applied (-1 on failure)
+
+static int journal_replay(void)
+{
+    uint32_t pos = 0, len, epoch, crc;
+    int64_t type, namelen, bid, size, capacity, offset = 0;
+    char name[MAX_FILENAME_LENGTH];
+    HddDirEntry entry;
+    int records = 0;
+
+    if (vol->journal.bid == 0)
+        return 0;
+
+    HddBitCmd read = construct(vol->journal.bid, 0, 0, HDD_JOURNAL_CAPACITY, HDD_BLOCK_READ);
+
+    if (get_response(hdd_block_operation(read, vol->journal.image)) == 1)
+        return -1;
+
+    while (pos + 12 <= HDD_JOURNAL_CAPACITY)
+    {
+        memcpy(&len, &vol->journal.image[pos], 4);
+        memcpy(&epoch, &vol->journal.image[pos + 4], 4);
+        memcpy(&crc, &vol->journal.image[pos + 8], 4);
+
+        if (len == 0 || len > HDD_JOURNAL_CAPACITY - pos - 12 || epoch != vol->journal.epoch ||
+            hdd_crc32c(0, &vol->journal.image[pos + 12], len) != crc)
+            break;    // end of the journal (or a batch that never made it)
+
+        const uint8_t *rec = &vol->journal.image[pos + 12];
+        uint32_t rpos = 0;
+
+        while (rpos < len)
+        {
+            if ((type = hdd_get_varint(rec, len, &rpos)) != HDD_JREC_CREATE && type != HDD_JREC_UPDATE &&
+                type != HDD_JREC_UPDATE_PACKED)
+                return -1;
+
+            if ((namelen = hdd_get_varint(rec, len, &rpos)) <= 0 ||
+                namelen >= MAX_FILENAME_LENGTH || namelen > len - rpos)
+                return -1;
+            memcpy(name, &rec[rpos], namelen);
+            name[namelen] = '\0';
+            rpos += namelen;
+
+            if (type == HDD_JREC_CREATE)
+            {
+                int found = hdd_dir_find(name, &entry);
+
+                memset(&entry, 0x0, sizeof(entry));
+                if (found == -1 || (found == 0 && hdd_dir_put(name, &entry) == -1))
+                    return -1;
+            }
+            else if ((bid = hdd_get_varint(rec, len, &rpos)) >= 0 &&
+                     (size = hdd_get_varint(rec, len, &rpos)) >= 0 &&
+                     (capacity = hdd_get_varint(rec, len, &rpos)) >= 0 &&
+                     (type != HDD_JREC_UPDATE_PACKED || (offset = hdd_get_varint(rec, len, &rpos)) > 0) &&
+                     name[0] != '\0')
+            {
+                entry.bid = bid;
+                entry.size = size;
+                entry.capacity = capacity;
+                entry.offset = (type == HDD_JREC_UPDATE_PACKED) ? offset : 0;
+                if (hdd_dir_put(name, &entry) == -1)
+                    return -1;
+            }
+            else
+            {
+                hdd_log(LOG_ERROR_LEVEL, "HDD_IO : damaged journal record at %u", pos + 12 + rpos);
+                return -1;
+            }
+            records++;
+        }
+
+        pos += 12 + len;
+    }
+
+    vol->journal.tail = pos;
+    return records;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_sync
+// Description  : commits the metadata changes made so far to the journal
+//
+// Inputs       : none
+// Outputs      : 0 on success, -1 on failure
+//
+int32_t hdd_sync(void) {
+
+    if (vol->init != 0)
+        return -1;      // nothing mounted
+
+    if (sparse_save_all() == -1)
+        return -1;      // the maps of sparse files go first, the journal may name their blocks
+
+    return journal_commit();
+}
+
+
+
+//
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_format
+// Description  : Initializes device if necessary, deletes all blocks, creates meta block
+//
+// Inputs       : void
+// Outputs      : 0 on success, -1 on failure
+//
+uint16_t hdd_format(void) {
+	
+	if (volume_tables() == -1)
+		return -1;
+
+	if (vol->init != 0)     // initialize device if needed
+	{
+		HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
+		HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+
+		vol->init = get_response(init_resp);
+	}
+             
+
+        if (vol->init != 0)               // make sure init was successful
+        	return -1;
+
+    if (vol->ns != 0 && !(hdd_client_capabilities() & HDD_CAP_NAMESPACE))
+    	return -1;         // the server keeps just the one filesystem
+
+    // send format request (of just the namespace, if the volume is in one) //
+    
+    HddBitCmd format = construct(vol->ns, 0, HDD_FORMAT, 0, HDD_DEVICE);
+    HddBitResp format_resp = hdd_client_operation(format, NULL);
+
+    if (get_response(format_resp) == 1)  // make sure format request was successful
+        return -1;
+
+    // clear array, create a meta block for it //
+
+    ra_reset(-1);
+    files_clear();
+    journal_reset();
+    hdd_dir_reset(0, 0);
+    vol->pack.bid = 0;
+
+    vol->meta_capacity = 0;       // FORMAT dropped the old one
+    vol->meta_dirty = 1;
+    if (meta_save() == -1)  // make sure the meta block was created
+        return -1;
+
+    return 0; 
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_mount
+// Description  : intitializes device if needed, reads data from meta block
+//
+// Inputs       : none
+// Outputs      : 0 on success, -1 on failure
+//
+uint16_t hdd_mount(void) {
+	
+	if (volume_tables() == -1)
+		return -1;
+
+	if (vol->init != 0)     // initialize device if needed
+	{
+		HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
+		HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+
+		vol->init = get_response(init_resp);
+	}
+        if (vol->init != 0)               // make sure init was successful
+        	return -1;
+
+    if (vol->ns != 0 && !(hdd_client_capabilities() & HDD_CAP_NAMESPACE))
+    	return -1;         // the server keeps just the one filesystem
+
+    // read from meta block into data structure //
+
+    ra_reset(-1);
+    journal_reset();
+    vol->pack.bid = 0;
+
+    uint8_t *buf = hdd_pool_alloc(HDD_MAX_BLOCK_SIZE);   // the server says how much there is
+    HddBitCmd read_meta = construct(vol->ns, 0, HDD_META_BLOCK, HDD_MAX_BLOCK_SIZE, HDD_BLOCK_READ);
+    
+    HddBitResp read_resp = hdd_block_operation(read_meta, buf);
+
+    if (get_response(read_resp) == 1)  // make sure read was successful
+    {
+    	hdd_pool_free(buf);
+    	return -1;
+    }
+
+    vol->meta_capacity = (read_resp >> 36) & 67108863;
+    int version = meta_decode(buf, vol->meta_capacity);
+
+    hdd_pool_free(buf);
+    if (version == -1)
+    	return -1;
+
+    // then whatever changed since, from the journal //
+
+    int replayed = journal_replay();
+
+    if (replayed == -1)
+    	return -1;
+
+    if (replayed > 0)
+    	vol->meta_dirty = 1;    // the meta block is behind the journal
+
+    if (version == 0 && journal_checkpoint() == -1)
+    	return -1;         // write the directory out now, in the compact encoding
+
+    return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_unmount
+// Description  : saves current state of data structure to meta block, closes the device
+//
+// Inputs       : none
+// Outputs      : 0 on success, -1 on failure
+//
+uint16_t hdd_unmount(void) {
+
+	// save data to meta block //
+
+	ra_reset(-1);    // nothing may be left on the wire
+
+    if (sparse_save_all() == -1)
+    	return -1;
+
+    if (vol->meta_dirty)    // make sure the changes are saved, to the journal or meta block
+    {
+    	int r;
+
+    	if (vol->journal.bid == 0 || vol->journal.tail + 12 + vol->journal.plen > HDD_JOURNAL_CAPACITY / 2)
+    		r = journal_checkpoint();
+    	else
+    		r = journal_commit();
+
+    	if (r == -1)
+    		return -1;
+    }
+    block_release();    // chunks replaced under maps just written
+
+    // save and close device // 
+
+    HddBitCmd save_close = construct(0, 0, HDD_SAVE_AND_CLOSE, 0, HDD_DEVICE);
+    
+    HddBitResp save_close_resp = hdd_client_operation(save_close, NULL);	
+
+    if (get_response(save_close_resp) == 1)  // make sure save/close was successful
+    	return -1;
+
+    vol->init = 1;   //uninitialize
+
+    return 0;	
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_open
+// Description  : initializes driver, opens a file, and sets needed metadata
+//
+// Inputs       : filename
+// Outputs      : unique integer file handle
+//
+int16_t hdd_open(char *path) {
+	
+    if (volume_tables() == -1)
+        return -1;
+
+    if (vol->init != 0)     // initialize device if needed
+	{
+		HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
+		HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+
+		vol->init = get_response(init_resp);
+	}
+        if (vol->init != 0)               // make sure init was successful
+        	return -1;
+
+        if (strlen(path) == 0 || strlen(path) >= MAX_FILENAME_LENGTH) // make sure filename fits
+        	return -1;
+
+        int16_t fh = -1, fi = -1, free_fi = -1;
+
+        for (int i = 0; i < vol->handles_top && fh == -1; i++)   // find a free handle
+        {
+        	if (!(vol->handles[i].flags & HDD_HANDLE_OPEN))
+        		fh = i;
+        }
+
+        if (fh == -1)
+        {
+        	if (vol->handles_top == MAX_HDD_FILEDESCR)  // make sure there's a free handle
+        		return -1;
+        	fh = vol->handles_top;
+        }
+
+        for (int i = 0; i < vol->files_top; i++)   // is the file open already?
+        {
+        	if (vol->files[i].handles == 0)
+        	{
+        		if (free_fi == -1)
+        			free_fi = i;
+        	}
+        	else if (strcmp(vol->files[i].name, path) == 0)
+        	{
+        		fi = i;
+        		break;
+        	}
+        }
+
+        if (fi == -1)   // no, look it up in the directory
+        {
+        	HddDirEntry entry;
+        	int found = hdd_dir_find(path, &entry);
+
+        	if (found == -1)
+        		return -1;
+
+        	fi = (free_fi != -1) ? free_fi : vol->files_top++;   // one per handle at most, so it fits
+        	strcpy(vol->files[fi].name, path);     // set file metadata
+
+        	if (found == 0)   // file doesn't exist
+        	{
+        		vol->files[fi].bid = 0;
+        		vol->files[fi].size = 0;
+        		vol->files[fi].capacity = 0;
+        		vol->files[fi].offset = 0;
+        		journal_record(fi, HDD_JREC_CREATE);
+        	}
+
+        	else // file already exists
+        	{
+        		vol->files[fi].bid = entry.bid;
+        		vol->files[fi].size = entry.size;
+        		vol->files[fi].capacity = entry.capacity;
+        		vol->files[fi].offset = entry.offset;
+        	}
+        }
+
+        vol->files[fi].handles++;
+        vol->handles[fh].loc = 0;
+        vol->handles[fh].file = fi;
+        vol->handles[fh].flags = HDD_HANDLE_OPEN;
+        if (fh == vol->handles_top)
+        	vol->handles_top++;
+
+    return fh;                        // return the file handle
+}
+
+
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_close
+// Description  : closes a file handle (the file stays open while others are)
+//
+// Inputs       : file handle
+// Outputs      : -1 on failure, 0 on success
+//
+int16_t hdd_close(int16_t fh) {
+	
+       File *file = handle_file(fh);
+
+       if (file == NULL)
+       {
+          return -1;       // error if file not open
+       }
+
+       if (file->handles == 1 && sparse_save(vol->handles[fh].file) == -1)
+          return -1;       // the handle stays open while the map isn't written
+
+       ra_reset(fh);         // drop anything read ahead
+       vol->handles[fh].flags = 0;    // close the handle
+       vol->handles[fh].loc = 0;      // reset seek
+
+       if (--file->handles == 0)
+       {
+          sparse_drop(vol->handles[fh].file);
+          if (vol->journal.last_fi == vol->handles[fh].file)
+             vol->journal.last_fi = -1;  // the entry's next file mustn't fold into its records
+       }
+
+       return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_read
+// Description  : reads a count number of bytes from current seek position, 
+//                places them in data buffer
+//
+// Inputs       : file handle, data buffer, byte count
+// Outputs      : -1 on failure, # of bytes read on success
+//
+int32_t hdd_read(int16_t fh, void * data, int32_t count) {
+
+	    if (vol->init != 0)     // initialize device if needed
+	    {
+		    HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
+		    HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+
+		    vol->init = get_response(init_resp);
+	    }
+
+         File *file = handle_file(fh);
+
+         if (file == NULL)
+            return -1;     // error if file not open
+
+         Readahead *ra = &vol->readahead[fh];
+         uint32_t loc = vol->handles[fh].loc;
+
+//     if count is greater than bytes available, just read what's available
+
+         if (loc >= file->size)
+            return 0;     // at or past the end
+
+         if (count > file->size - loc)
+            count = file->size - loc;
+
+         if (count <= 0)
+            return 0;
+
+//     a sparse file reads what each chunk stores, zeros for the holes
+
+         if (HDD_FILE_SPARSE(file))
+         {
+            vol->ra_stats.reads++;
+            if (sparse_read(fh, data, count) == -1)
+               return -1;
+            vol->handles[fh].loc += count;
+            return count;
+         }
+
+//     classify the access: back to back, a fixed stride apart, or random
+
+         int64_t delta = (int64_t)loc - ra->last_loc;
+
+         if (loc == ra->last_end || (delta != 0 && delta == ra->last_delta))
+         {
+            ra->strided = (loc != ra->last_end);
+            ra->window = (ra->window == 0) ? HDD_RA_MIN_WINDOW : ra->window * 2;   // grow while the pattern holds
+            if (ra->window > HDD_RA_MAX_WINDOW)
+               ra->window = HDD_RA_MAX_WINDOW;
+         }
+         else
+         {
+            ra->strided = 0;
+            ra->window = 0;       // random, back off
+         }
+
+         ra->last_delta = delta;
+         ra->last_loc = loc;
+         ra->last_end = loc + count;
+         vol->ra_stats.reads++;
+
+//     serve from the held bytes, else from the prefetch, else from the server
+
+         if (ra_holds(ra, loc, count))
+         {
+            vol->ra_stats.hits++;
+         }
+         else
+         {
+            int collected = ra->pending;
+
+            if (collected && ra_collect(fh, loc) == -1)
+               return -1;
+
+            if (ra_holds(ra, loc, count))
+            {
+               vol->ra_stats.hits++;
+               vol->ra_stats.prefetch_hits++;
+            }
+            else
+            {
+               uint32_t len = (count > ra->window) ? count : ra->window;
+
+               if (len < HDD_RA_MIN_WINDOW)
+                  len = HDD_RA_MIN_WINDOW;
+
+               if (collected)
+                  vol->ra_stats.prefetch_wasted++;   // it went somewhere else
+               vol->ra_stats.misses++;
+               if (ra_fill(fh, loc, len) == -1)
+                  return -1;
+            }
+         }
+
+         memcpy(data, &ra->buf[loc - ra->start], count);
+         vol->handles[fh].loc += count;    // update position
+
+         ra_prefetch(fh, loc, count);  // get the next window on its way
+         return count;                 // return bytes read
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_write
+// Description  : writes count bytes from data buffer at file's seek position
+//
+// Inputs       : file handle, data buffer, byte count
+// Outputs      : -1 on failure, number of bytes written on success
+//
+int32_t hdd_write(int16_t fh, void *data, int32_t count) {
+
+      File *file = handle_file(fh);
+
+      if (file == NULL)
+         return -1;    // error if file not open
+
+      uint32_t loc = vol->handles[fh].loc;
+
+      if (count < 0 || (uint32_t)count > UINT32_MAX - loc)
+         return -1;    // past the largest file
+
+      ra_drop_file(fh);   // held bytes are stale once the block changes
+
+      uint32_t end = loc + count;
+
+//       A write leaving a hole of a chunk or more, or running past what a block
+//       holds, makes the file sparse; a sparse file is written a chunk at a time
+
+      if (!HDD_FILE_SPARSE(file) && ((loc > file->size && loc - file->size >= HDD_SPARSE_CHUNK) ||
+          end > HDD_MAX_BLOCK_SIZE) && sparse_convert(fh) == -1)
+         return -1;
+
+      if (HDD_FILE_SPARSE(file))
+      {
+         if (sparse_write(fh, data, count) == -1)
+            return -1;
+      }
+
+//       Case for a previously non-existent block, or one too small for the new data:
+//       reallocate with room to spare so the next appends are in-place writes
+//       (a shorter hole stays in the block, zero filled)
+
+      else if (file->bid == 0 || end > file->capacity)
+      {
+         uint32_t capacity = HDD_GROW_CAPACITY(file->capacity);
+
+         if (capacity > HDD_MAX_BLOCK_SIZE)
+            capacity = HDD_MAX_BLOCK_SIZE;
+         if (capacity < end)
+            capacity = end;
+
+         if (block_resize(fh, capacity, data, count) == -1)
+            return -1;   // error
+      }
+
+//       if the server can patch the block itself, send just the new bytes
+
+      else if (hdd_client_capabilities() & HDD_CAP_RANGE_WRITE)
+      {
+         HddClientRequest req = { .buf = data, .offset = file->offset + vol->handles[fh].loc };
+         req.cmd = construct(file->bid, 0, HDD_RANGE, count, HDD_BLOCK_OVERWRITE);
+
+         block_prepare(&req);
+         if (get_response(hdd_client_request(&req)) == 1)
+            return -1;      // check for error
+      }
+
+      else    // read the block, add the new data, overwrite it
+      {
+         uint32_t blocksize = (file->offset != 0) ? HDD_PACK_BLOCK_SIZE : file->capacity;   // a pack block is no bigger
+         char *oldbuf = hdd_pool_alloc(blocksize); // create buffer for old data
+         HddBitCmd command4 = construct(file->bid, 0, 0, blocksize, HDD_BLOCK_READ); 
+         HddBitResp response4 = hdd_block_operation(command4, oldbuf); // read old data into buffer
+
+         blocksize = (response4 >> 36) & 67108863;
+         if (get_response(response4) == 1 || file->offset + end > blocksize)
+         {
+             hdd_pool_free(oldbuf);
+             return -1;      // error
+         }
+
+         memcpy(&oldbuf[file->offset + vol->handles[fh].loc], data, count); // add new data to buffer
+
+         HddBitCmd command5 = construct(file->bid, 0, 0, blocksize, HDD_BLOCK_OVERWRITE);
+         HddBitResp response5 = hdd_block_operation(command5, oldbuf); // overwrite block to include new data
+
+         hdd_pool_free(oldbuf);    // free memory
+       
+         if (get_response(response5) == 1)
+            return -1;      // check for error
+      }
+
+      if (end > file->size)
+      {
+         file->size = end;   // file grew
+         journal_record(vol->handles[fh].file, HDD_JREC_UPDATE);
+      }
+      vol->handles[fh].loc = end;     // update seek position
+
+      return count;              // return bytes written
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_adopt
+// Description  : makes a block the caller created the file's contents,
+//                retiring the block it had (or the blocks, if sparse) until
+//                the record naming the new one is committed, or leaving its
+//                slice behind
+//                (for bulk imports, which keep their creates on the wire
+//                and hand the blocks over later)
+//
+// Inputs       : file handle, block ID (0 for no data), bytes of data in it
+// Outputs      : -1 on failure, 0 on success
+//
+int32_t hdd_adopt(int16_t fh, uint32_t bid, uint32_t size) {
+
+      File *file = handle_file(fh);
+      uint32_t old = 0;
+
+      if (file == NULL || size > HDD_MAX_BLOCK_SIZE || (bid == 0 && size != 0))
+         return -1;       // error if file not open or the block can't be its
+
+      ra_drop_file(fh);
+
+      if (HDD_FILE_SPARSE(file))
+      {
+         if (sparse_free(vol->handles[fh].file) == -1)
+            return -1;    // its map can't be read, so neither can its chunks be found
+      }
+
+      else if (file->bid != 0 && file->offset == 0 && file->bid != bid)
+         old = file->bid;
+
+      file->bid = bid;
+      file->offset = 0;
+      file->size = size;
+      file->capacity = size;
+      journal_record(vol->handles[fh].file, HDD_JREC_UPDATE);
+      if (old != 0)
+         block_retire(old);    // deleted once the record is committed
+
+      if (vol->handles[fh].loc > size)
+         vol->handles[fh].loc = size;
+
+      return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_fallocate
+// Description  : makes sure the file's block has room for at least bytes
+//                bytes, so writes up to there don't need to reallocate it
+//
+// Inputs       : file handle, bytes to allocate
+// Outputs      : -1 on failure, 0 on success
+//
+int32_t hdd_fallocate(int16_t fh, uint32_t bytes) {
+
+      File *file = handle_file(fh);
+
+      if (file == NULL)
+         return -1;       // error if file not open
+
+      if (HDD_FILE_SPARSE(file) || (file->bid != 0 && bytes <= file->capacity))
+         return 0;        // already there (a sparse file's chunks are made as they are written)
+
+      if (bytes > HDD_MAX_BLOCK_SIZE)
+         return -1;       // too big for a block
+
+      ra_drop_file(fh);
+      return block_resize(fh, bytes, NULL, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_seek
+// Description  : changes seek position of file (past its end too, writing
+//                there leaves a hole that reads as zeros)
+//
+// Inputs       : file handle, new position
+// Outputs      : -1 on failure, 0 on success
+//
+int32_t hdd_seek(int16_t fh, uint32_t loc) {
+
+	    if (vol->init != 0)     // initialize device if needed
+	    {
+		    HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
+		    HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+
+		    vol->init = get_response(init_resp);
+	    }
+
+        File *file = handle_file(fh);
+
+        if (file == NULL)
+        {
+           return -1;        // check handle
+        }
+
+        vol->handles[fh].loc = loc;   // update seek position
+
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_seek_data
+// Description  : seeks to the first byte of data (HDD_SEEK_DATA) or of a
+//                hole (HDD_SEEK_HOLE) at or after a position, as lseek's
+//                SEEK_DATA and SEEK_HOLE: the end of the file counts as a
+//                hole, and a dense file is all data
+//
+// Inputs       : file handle, position, HDD_SEEK_DATA or HDD_SEEK_HOLE
+// Outputs      : the new position, -1 if there is none (or on failure)
+//
+int64_t hdd_seek_data(int16_t fh, uint32_t loc, int whence) {
+
+        File *file = handle_file(fh);
+        int64_t at = loc;
+
+        if (file == NULL || (whence != HDD_SEEK_DATA && whence != HDD_SEEK_HOLE) || loc >= file->size)
+        {
+           return -1;        // check handle, and that there is something from loc on
+        }
+
+        if (HDD_FILE_SPARSE(file))
+        {
+           SparseMap *map = sparse_load(vol->handles[fh].file);
+           uint32_t pos;
+           int found = 0;
+
+           if (map == NULL)
+              return -1;
+
+           sparse_find(map, loc / HDD_SPARSE_CHUNK, &pos);    // chunks before loc's don't matter
+           for (; pos < map->count && !found; pos++)
+           {
+              int64_t from = (int64_t)map->chunks[pos].index * HDD_SPARSE_CHUNK + map->chunks[pos].start;
+              int64_t to = from + map->chunks[pos].length;
+
+              if (to <= at)
+                 continue;       // data of loc's chunk, but before loc
+              if (whence == HDD_SEEK_DATA)
+              {
+                 at = (from > at) ? from : at;
+                 found = 1;
+              }
+              else if (from > at)
+                 found = 1;      // a hole before the next data
+              else
+                 at = to;        // data up to there, then maybe more right after
+           }
+
+           if (whence == HDD_SEEK_DATA && !found)
+              return -1;         // nothing but holes to the end
+        }
+        else if (whence == HDD_SEEK_HOLE)
+        {
+           at = file->size;
+        }
+
+        if (at > file->size)
+           at = file->size;
+        vol->handles[fh].loc = at;   // update seek position
+
+        return at;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Volumes: each call below makes "v" the calling thread's volume (and its
+// directory and connection those of the thread), does what the plain call
+// does, and switches back
+
+typedef struct {
+        HddVolume     *vol;     // the thread's volume before
+        HddDir        *dir;     // its directory before
+        HddConnection *conn;    // its connection before
+} VolumeSaved;
+
+static void volume_enter(HddVolume *v, VolumeSaved *saved) {
+        saved->vol = vol;
+        saved->dir = hdd_dir_use(v->dir);
+        saved->conn = hdd_client_use(v->conn);
+        vol = v;
+}
+
+static void volume_leave(VolumeSaved *saved) {
+        vol = saved->vol;
+        hdd_dir_use(saved->dir);
+        hdd_client_use(saved->conn);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : volume_new
+// Description  : makes an unmounted volume on the server at addr:port
+//
+// Inputs       : addr - server address (NULL for the default), port - server
+//                port (0 for the default)
+// Outputs      : the volume, NULL if out of memory
+//
+static HddVolume *volume_new(const char *addr, unsigned short port) {
+
+        HddVolume *v = calloc(1, sizeof(HddVolume));
+
+        if (v == NULL)
+            return NULL;
+
+        v->init = 1;
+        v->own = (HddConnection)HDD_CONNECTION_INIT;
+        v->own.port = port;
+        v->conn = &v->own;
+
+        if ((addr != NULL && (v->address = strdup(addr)) == NULL) || (v->dir = hdd_dir_new()) == NULL)
+        {
+            free(v->address);
+            free(v);
+            return NULL;
+        }
+        v->own.address = v->address;
+
+        return v;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : volume_free
+// Description  : drops a volume, closing its connection if still open
+//
+// Inputs       : v - the volume
+// Outputs      : none
+//
+static void volume_free(HddVolume *v) {
+
+        VolumeSaved saved;
+
+        volume_enter(v, &saved);
+        ra_reset(-1);
+        files_clear();             // (the maps of its sparse files)
+        hdd_client_disconnect();   // (nothing if unmounted)
+        volume_leave(&saved);
+
+        hdd_dir_free(v->dir);
+        if (v->tables != NULL)
+            munmap(v->tables, sizeof(VolumeTables));
+        free(v->retired);
+        free(v->address);
+        free(v);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : volume_open
+// Description  : connects to the server at addr:port and mounts a filesystem
+//                on it, formatting it first if asked
+//
+// Inputs       : addr - server address (NULL for the default), port - server
+//                port (0 for the default), ns - namespace (0 for the
+//                device's own), format - format first
+// Outputs      : the volume, NULL on failure
+//
+static HddVolume *volume_open(const char *addr, unsigned short port, uint32_t ns, int format) {
+
+        HddVolume *v = volume_new(addr, port);
+        VolumeSaved saved;
+        uint16_t r;
+
+        if (v == NULL)
+            return NULL;
+
+        v->ns = ns;
+        volume_enter(v, &saved);
+        r = format ? hdd_format() : 0;
+        if (r == 0)
+            r = hdd_mount();
+        volume_leave(&saved);
+
+        if (r != 0)
+        {
+            volume_free(v);
+            return NULL;
+        }
+
+        return v;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_volume_mount, hdd_volume_format, hdd_volume_namespace
+// Description  : connects to the server at addr:port and mounts its
+//                filesystem (or that of a namespace on it), formatting it
+//                first for hdd_volume_format (and if asked)
+//
+// Inputs       : addr - server address (NULL for the default), port - server
+//                port (0 for the default), then the namespace and whether to
+//                format it
+// Outputs      : the volume, NULL on failure
+//
+HddVolume *hdd_volume_mount(const char *addr, unsigned short port) {
+        return volume_open(addr, port, 0, 0);
+}
+
+HddVolume *hdd_volume_format(const char *addr, unsigned short port) {
+        return volume_open(addr, port, 0, 1);
+}
+
+HddVolume *hdd_volume_namespace(const char *addr, unsigned short port, uint32_t ns, int format) {
+        if (ns == 0 || ns > HDD_MAX_NAMESPACE)
+            return NULL;
+        return volume_open(addr, port, ns, format);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_volume_unmount
+// Description  : unmounts the volume (as hdd_unmount) and frees it, even if
+//                the unmount failed
+//
+// Inputs       : v - the volume
+// Outputs      : 0 on success, -1 on failure
+//
+int hdd_volume_unmount(HddVolume *v) {
+
+        VolumeSaved saved;
+        uint16_t r;
+
+        volume_enter(v, &saved);
+        r = hdd_unmount();
+        volume_leave(&saved);
+
+        volume_free(v);
+
+        return (r == 0) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_volume_open, hdd_volume_close, hdd_volume_read,
+//                hdd_volume_write, hdd_volume_seek, hdd_volume_seek_data,
+//                hdd_volume_sync, hdd_volume_adopt, hdd_volume_fallocate,
+//                hdd_volume_map
+// Description  : the interface functions, on the volume "v" (its handles are
+//                its own, not those of the default volume)
+//
+// Inputs       : v - the volume, then as the plain call
+// Outputs      : as the plain call
+//
+int16_t hdd_volume_open(HddVolume *v, char *path) {
+        VolumeSaved saved;
+        int16_t r;
+
+        volume_enter(v, &saved);
+        r = hdd_open(path);
+        volume_leave(&saved);
+        return r;
+}
+
+int16_t hdd_volume_close(HddVolume *v, int16_t fh) {
+        VolumeSaved saved;
+        int16_t r;
+
+        volume_enter(v, &saved);
+        r = hdd_close(fh);
+        volume_leave(&saved);
+        return r;
+}
+
+int32_t hdd_volume_read(HddVolume *v, int16_t fh, void *data, int32_t count) {
+        VolumeSaved saved;
+        int32_t r;
+
+        volume_enter(v, &saved);
+        r = hdd_read(fh, data, count);
+        volume_leave(&saved);
+        return r;
+}
 
-        if (strlen(path) <= 0 || strlen(path) > MAX_HDD_FILEDESCR) // make sure filename is within range
-        	return -1;
+int32_t hdd_volume_write(HddVolume *v, int16_t fh, void *data, int32_t count) {
+        VolumeSaved saved;
+        int32_t r;
 
-        uint16_t fh = 0;
+        volume_enter(v, &saved);
+        r = hdd_write(fh, data, count);
+        volume_leave(&saved);
+        return r;
+}
 
-        for (int i = 0; i < MAX_HDD_FILEDESCR; i++) //search the array of structs for the file
-        {
-        	if (strcmp(files[fh].name, path) != 0)
-        		fh++;
-        }
+int32_t hdd_volume_seek(HddVolume *v, int16_t fh, uint32_t loc) {
+        VolumeSaved saved;
+        int32_t r;
 
-        if (fh == MAX_HDD_FILEDESCR)   // file doesn't exist
-        {
-        	fh = 0;
+        volume_enter(v, &saved);
+        r = hdd_seek(fh, loc);
+        volume_leave(&saved);
+        return r;
+}
 
-        	while (strcmp(files[fh].name, " ") != 0) // find available spot in array of files
-        		fh++;
+int64_t hdd_volume_seek_data(HddVolume *v, int16_t fh, uint32_t loc, int whence) {
+        VolumeSaved saved;
+        int64_t r;
 
-        	if (fh == MAX_HDD_FILEDESCR)  // make sure file array isn't full 
-        		return -1;
+        volume_enter(v, &saved);
+        r = hdd_seek_data(fh, loc, whence);
+        volume_leave(&saved);
+        return r;
+}
 
-        	files[fh].loc = 0;
-        	files[fh].bid = 0;
-        	strcpy(files[fh].name, path);     // set file metadata
-        	files[fh].open = 1;
-        	files[fh].size = 0;
-        }
+int32_t hdd_volume_sync(HddVolume *v) {
+        VolumeSaved saved;
+        int32_t r;
 
-        else // file already exists
-        {
-        	if (files[fh].open == 1)   // make sure file isn't already open
-        		return -1;
+        volume_enter(v, &saved);
+        r = hdd_sync();
+        volume_leave(&saved);
+        return r;
+}
 
-        	files[fh].loc = 0;         // set position to 0
-        	files[fh].open = 1;       // open the file
-        }
+int32_t hdd_volume_adopt(HddVolume *v, int16_t fh, uint32_t bid, uint32_t size) {
+        VolumeSaved saved;
+        int32_t r;
 
-    return fh;                        // return the file handle
+        volume_enter(v, &saved);
+        r = hdd_adopt(fh, bid, size);
+        volume_leave(&saved);
+        return r;
 }
 
+int32_t hdd_volume_fallocate(HddVolume *v, int16_t fh, uint32_t bytes) {
+        VolumeSaved saved;
+        int32_t r;
 
+        volume_enter(v, &saved);
+        r = hdd_fallocate(fh, bytes);
+        volume_leave(&saved);
+        return r;
+}
 
+void *hdd_volume_map(HddVolume *v, int16_t fh, uint32_t *len) {
+        VolumeSaved saved;
+        void *r;
 
+        volume_enter(v, &saved);
+        r = hdd_map(fh, len);
+        volume_leave(&saved);
+        return r;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_close
-// Description  : closes file and deletes all its data
+// Function     : hdd_volume_use
+// Description  : makes "v" the calling thread's volume, with its directory
+//                and connection, until switched again (a scheduler running
+//                several callers on one thread swaps theirs in and out, as
+//                one may be part way through an hdd_volume_* call)
 //
-// Inputs       : file handle
-// Outputs      : -1 on failure, 0 on success
+// Inputs       : v - the volume (NULL for the default one)
+// Outputs      : the volume before (NULL if the default one)
 //
-int16_t hdd_close(int16_t fh) {
-	
+HddVolume *hdd_volume_use(HddVolume *v) {
 
-       if (files[fh].open == 0)
-       {
-          return -1;       // error if file not open
-       }
+        HddVolume *before = vol;
 
-       files[fh].open = 0;    // close the file
-       files[fh].loc = 0;    // reset seek
+        if (v == NULL)
+            v = &default_volume;
+        hdd_dir_use(v->dir);
+        hdd_client_use(v->conn);
+        vol = v;
 
-       return 0;
+        return (before == &default_volume) ? NULL : before;
 }
 
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_read
-// Description  : reads a count number of bytes from current seek position, 
-//                places them in data buffer
-//
-// Inputs       : file handle, data buffer, byte count
-// Outputs      : -1 on failure, # of bytes read on success
-//
-int32_t hdd_read(int16_t fh, void * data, int32_t count) {
-
-	    if (init != 0)     // initialize device if needed
-	    {
-		    HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
-		    HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+// Local views of files (hdd_map): the view and a twin of it are anonymous
+// mappings the size of the file, so pages never loaded cost no memory.
+// The view's pages stay inaccessible until hdd_map_touch reads them into
+// both (a run of them at a time), so using one never read faults rather
+// than reading zeros or losing what is stored there.  hdd_msync compares
+// each loaded page with its twin and writes back just the bytes that
+// changed (runs of them, merged when close together, or all in one if the
+// server can't write ranges anyway), then brings the twin up to date.  The
+// live views are kept on a list to check addresses against.
+
+#define HDD_MAP_MERGE 64       // changed runs closer than this are written back as one
+
+typedef struct Mapping {
+        char      *view;        // what hdd_map returned
+        HddVolume *vol;         // the volume the file is on
+        int16_t    fh;          // the handle the view was made through
+        uint32_t   len;         // bytes of the file in the view (its size then)
+        uint32_t   pages;       // pages in the view
+        size_t     span;        // bytes mapped for it (a page at least)
+        char      *twin;        // what each loaded page held when read or last written back
+        uint8_t   *loaded;      // a bit per page, set once it is read
+        struct Mapping *next;   // the next live view
+} Mapping;
+
+static Mapping *maps = NULL;                                // the live views
+static pthread_mutex_t maps_lock = PTHREAD_MUTEX_INITIALIZER;   // guards the list
 
-		    init = get_response(init_resp);
-	    }
+///////////////////////////////////////////////////////////////////////////////
 
-	
-         char *buf = malloc(files[fh].size); // create buffer for data 
-         HddBitCmd command6 = construct(files[fh].bid, 0, 0, files[fh].size, HDD_BLOCK_READ);   // command to read data from block 
+//  map_find: the bookkeeping of a view, NULL if addr isn't one
 
-         HddBitResp response6 = hdd_client_operation(command6, buf);  // read data into buffer
+static Mapping *map_find(void *addr)
+{
+    Mapping *m;
 
-         if (get_response(response6) == 1)
-         {
-             free(buf);           // failure if R = -1
-             return -1;
-         }
+    pthread_mutex_lock(&maps_lock);
+    for (m = maps; m != NULL && m->view != (char *)addr; m = m->next);
+    pthread_mutex_unlock(&maps_lock);
 
-//     if count is greater than bytes available, just read what's available
+    return (addr == NULL) ? NULL : m;
+}
 
-         if (count > files[fh].size - files[fh].loc)
-         {
-            memcpy(data, &buf[files[fh].loc], files[fh].size - files[fh].loc);        
-         }
-   
-//     otherwise read count bytes
+///////////////////////////////////////////////////////////////////////////////
 
-         else
-         {
-            memcpy(data,&buf[files[fh].loc], count);
-         }
+//  map_io: reads or writes count bytes at off of the mapped file through its
+//          handle, leaving the handle's position where it was
 
-         free(buf);    // free memory
+static int map_io(Mapping *m, uint32_t off, char *buf, uint32_t count, int write)
+{
+    uint32_t loc = vol->handles[m->fh].loc;
+    int32_t r;
 
-         if (count > files[fh].size - files[fh].loc)
-         {
-             int bytes = files[fh].size - files[fh].loc;
-             files[fh].loc = files[fh].size;  // return bytes read and update seek position
-             return bytes;
-         }
+    vol->handles[m->fh].loc = off;
+    r = write ? hdd_write(m->fh, buf, count) : hdd_read(m->fh, buf, count);
+    vol->handles[m->fh].loc = loc;
 
-         else
-         {
-            files[fh].loc += count;
-            return count;        // return bytes read and update position
-         }
+    return (r == (int32_t)count) ? 0 : -1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_write
-// Description  : writes count bytes from data buffer at file's seek position
+// Function     : hdd_map
+// Description  : makes a local view of the file a handle is open on (no
+//                page is read, or may be used, until hdd_map_touch asks for it)
 //
-// Inputs       : file handle, data buffer, byte count
-// Outputs      : -1 on failure, number of bytes written on success
+// Inputs       : file handle, where the length of the view goes
+// Outputs      : the view, NULL on failure
 //
-int32_t hdd_write(int16_t fh, void *data, int32_t count) {
+void *hdd_map(int16_t fh, uint32_t *len) {
 
-//       Case for previously non-existent block
-	
-      if (files[fh].bid == 0)
-      {
-         HddBitCmd  command = construct( 0, 0, 0, count, HDD_BLOCK_CREATE);
-         HddBitResp response = hdd_client_operation(command, data);  // create new block, write data to it
- 
-         int r = get_response(response);
-         
-         if (r == 0)
-         {
-            files[fh].loc = count;
-            files[fh].bid = get_bid(response); // if successful command, update file info and return count
-            files[fh].size = count;
- 
-            return count;
-         }
-         
-         else
-         {
-           
-             return -1;   // error
-         }
-      }  
-      else    // if block already exists
-      {
-
-             // if block is too small to hold old + new data:
-
-         if ((files[fh].loc + count) > files[fh].size)
-         {
-            char *oldbuf = malloc(files[fh].size); // buffer to hold old data
-            HddBitCmd command2 = construct(files[fh].bid, 0, 0, files[fh].size, HDD_BLOCK_READ);
-            HddBitResp response2 = hdd_client_operation(command2, oldbuf);  // read old data into buffer
+        File *file = handle_file(fh);
+        Mapping *m;
 
-            if ((get_response(response2)) == 1)
-            {
-                free(oldbuf);
-                return -1;         // error
-            }
+        if (file == NULL || (m = calloc(1, sizeof(Mapping))) == NULL)
+            return NULL;
 
-            char *newbuf = malloc(files[fh].loc + count);  // buffer to hold new data+ old data
-            memcpy(newbuf, oldbuf, files[fh].size); // copy old data into buffer
-           memcpy(&newbuf[files[fh].loc], data, count);   // copy new data into buffer
+        m->vol = vol;
+        m->fh = fh;
+        m->len = file->size;
+        m->pages = (uint32_t)(((uint64_t)m->len + HDD_MAP_PAGE - 1) / HDD_MAP_PAGE);
+        m->span = (size_t)((m->pages == 0) ? 1 : m->pages) * HDD_MAP_PAGE;   // (an address even if empty)
+        m->view = mmap(NULL, m->span, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        m->twin = (m->pages == 0) ? NULL : mmap(NULL, (size_t)m->pages * HDD_MAP_PAGE, PROT_READ|PROT_WRITE,
+                                                MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        m->loaded = calloc(m->pages / 8 + 1, 1);
 
+        if (m->view == MAP_FAILED || m->twin == MAP_FAILED || m->loaded == NULL)
+        {
+            if (m->view != MAP_FAILED)
+                munmap(m->view, m->span);
+            if (m->twin != NULL && m->twin != MAP_FAILED)
+                munmap(m->twin, (size_t)m->pages * HDD_MAP_PAGE);
+            free(m->loaded);
+            free(m);
+            return NULL;
+        }
 
-            HddBitCmd command3 = construct(0, 0, 0, (files[fh].loc + count), HDD_BLOCK_CREATE);
+        pthread_mutex_lock(&maps_lock);
+        m->next = maps;
+        maps = m;
+        pthread_mutex_unlock(&maps_lock);
+        *len = m->len;
 
-            HddBitResp response3 = hdd_client_operation(command3, newbuf);  // create new block for all the data
+        return m->view;
+}
 
-            if (get_response(response3) == 1)
-            {
-               return -1;     // error
-            }
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_map_touch
+// Description  : reads the pages of a view covering a range that aren't
+//                loaded yet, each run of them in one read
+//
+// Inputs       : the view, offset and length of the range
+// Outputs      : -1 on failure, 0 on success
+//
+int32_t hdd_map_touch(void *addr, uint32_t off, uint32_t len) {
 
-            HddBitCmd delete = construct(files[fh].bid, 0, 0, 0, HDD_BLOCK_DELETE);   // delete the file
-            HddBitResp delete_resp = hdd_client_operation(delete, NULL);
+        Mapping *m = map_find(addr);
+        VolumeSaved saved;
+        uint32_t page, last, run;
+        int r = 0;
 
-            if (get_response(delete_resp) == 1)   // make sure delete was succesful
-            	return -1;
-     
-            free(oldbuf);
-            free(newbuf);       // free memory
+        if (m == NULL || off > m->len || len > m->len - off)
+            return -1;       // not a view, or not inside it
+        if (len == 0)
+            return 0;
 
+        volume_enter(m->vol, &saved);
+        last = (off + len - 1) / HDD_MAP_PAGE;
+        for (page = off / HDD_MAP_PAGE; page <= last && r == 0; page += run)
+        {
+            for (run = 0; page + run <= last && !(m->loaded[(page + run) / 8] & (1 << ((page + run) % 8))); run++);
 
-            files[fh].size = files[fh].loc + count;
-            files[fh].loc += count;
-            files[fh].bid = get_bid(response3);   // update file info
-            
-         
-            return count;                    // return bytes written
-         }
+            if (run == 0)
+            {
+                run = 1;     // loaded already
+                continue;
+            }
 
-         else   
-                     // if new data will fit into buffer
-         {
-            char *oldbuf = malloc(files[fh].size); // create buffer for old data
-            HddBitCmd command4 = construct(files[fh].bid, 0, 0,files[fh].size, HDD_BLOCK_READ); 
-            HddBitResp response4 = hdd_client_operation(command4, oldbuf); // read old data into buffer
+            uint32_t start = page * HDD_MAP_PAGE;
+            uint32_t count = ((page + run) * (uint64_t)HDD_MAP_PAGE > m->len) ? m->len - start : run * HDD_MAP_PAGE;
 
-            if (get_response(response4) == 1)
+            if (mprotect(&m->view[start], (size_t)run * HDD_MAP_PAGE, PROT_READ|PROT_WRITE) == -1)
             {
-                free(oldbuf);
-                return -1;      // error
+                r = -1;
+                break;
             }
 
-            memcpy(&oldbuf[files[fh].loc], data, count); // add new data to buffer
+            if ((r = map_io(m, start, &m->view[start], count, 0)) == 0)
+            {
+                memcpy(&m->twin[start], &m->view[start], count);
+                for (uint32_t i = page; i < page + run; i++)
+                    m->loaded[i / 8] |= 1 << (i % 8);
+            }
+            else
+                mprotect(&m->view[start], (size_t)run * HDD_MAP_PAGE, PROT_NONE);   // still not read
+        }
+        volume_leave(&saved);
 
-            HddBitCmd command5 = construct(files[fh].bid, 0, 0, files[fh].size, HDD_BLOCK_OVERWRITE);
-            HddBitResp response5 = hdd_client_operation(command5, oldbuf); // overwrite block to include new data
+        return r;
+}
 
-            free(oldbuf);    // free memory
-       
-           if (get_response(response5) == 1)
-           {
-              return -1;      // check for error
-           }
+///////////////////////////////////////////////////////////////////////////////
 
-           files[fh].loc += count;  // update seek position
+//  map_flush: writes back [from, to) of a view and updates its twin
 
+static int map_flush(Mapping *m, uint32_t from, uint32_t to)
+{
+    if (map_io(m, from, &m->view[from], to - from, 1) == -1)
+        return -1;
 
-           return count;      // return bytes written
-         }   
-            
-      }
+    memcpy(&m->twin[from], &m->view[from], to - from);
+    return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : hdd_seek
-// Description  : changes seek position of file
+// Function     : hdd_msync
+// Description  : writes back the bytes of a view that changed since they
+//                were loaded or last written back
 //
-// Inputs       : file handle, new position
+// Inputs       : the view
 // Outputs      : -1 on failure, 0 on success
 //
-int32_t hdd_seek(int16_t fh, uint32_t loc) {
+int32_t hdd_msync(void *addr) {
 
-	    if (init != 0)     // initialize device if needed
-	    {
-		    HddBitCmd initialize = construct(0, 0, HDD_INIT, 0, HDD_DEVICE);
-		    HddBitResp init_resp = hdd_client_operation(initialize, NULL);
+        Mapping *m = map_find(addr);
+        VolumeSaved saved;
+        File *file;
+        int64_t from = -1, to = 0;   // the run of changes being gathered
+        int r = 0, hole = 0, merge_all;
 
-		    init = get_response(init_resp);
-	    }
+        if (m == NULL)
+            return -1;
 
-        if (loc < 0 || loc > files[fh].size)
+        volume_enter(m->vol, &saved);
+        if ((file = handle_file(m->fh)) == NULL)
         {
-           return -1;        // check range
+            volume_leave(&saved);
+            return -1;       // the handle was closed under it
         }
 
-        files[fh].loc = loc;     // update seek position
+        // Without ranged writes each write sends the whole block, so one will do
+        merge_all = !HDD_FILE_SPARSE(file) && !(hdd_client_capabilities() & HDD_CAP_RANGE_WRITE);
 
-        return 0;
+        for (uint32_t page = 0; page < m->pages && r == 0; page++)
+        {
+            uint32_t start = page * HDD_MAP_PAGE, end, i, j;
+
+            if (!(m->loaded[page / 8] & (1 << (page % 8))))
+            {
+                hole = 1;    // a run can't reach across bytes never read
+                continue;
+            }
+
+            end = (m->len - start < HDD_MAP_PAGE) ? m->len : start + HDD_MAP_PAGE;
+            if (memcmp(&m->view[start], &m->twin[start], end - start) == 0)
+                continue;    // unchanged
+
+            for (i = start; m->view[i] == m->twin[i]; i++);   // the bytes that changed
+            for (j = end; m->view[j - 1] == m->twin[j - 1]; j--);
+
+            if (from != -1 && !hole && (merge_all || i - to < HDD_MAP_MERGE))
+            {
+                to = j;      // it joins the run
+                continue;
+            }
+
+            if (from != -1)
+                r = map_flush(m, from, to);
+            from = i;
+            to = j;
+            hole = 0;
+        }
+
+        if (from != -1 && r == 0)
+            r = map_flush(m, from, to);
+        volume_leave(&saved);
+
+        return r;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_unmap
+// Description  : writes back a view's changes (as hdd_msync) and drops it,
+//                even if the write back failed
+//
+// Inputs       : the view
+// Outputs      : -1 on failure, 0 on success
+//
+int32_t hdd_unmap(void *addr) {
+
+        Mapping *m = map_find(addr), **pp;
+        int32_t r;
 
+        if (m == NULL)
+            return -1;
 
+        r = hdd_msync(addr);
 
+        pthread_mutex_lock(&maps_lock);
+        for (pp = &maps; *pp != m; pp = &(*pp)->next);
+        *pp = m->next;
+        pthread_mutex_unlock(&maps_lock);
 
+        munmap(m->view, m->span);
+        if (m->twin != NULL)
+            munmap(m->twin, (size_t)m->pages * HDD_MAP_PAGE);
+        free(m->loaded);
+        free(m);
 
+        return r;
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -554,14 +3043,20 @@ int hddIOUnitTest(void) {
 
 	// Format and mount the file system
 	if (hdd_format() || hdd_mount()) {
-		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on format or mount operation.");
+		hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on format or mount operation.");
 		return(-1);
 	}
 
 	// Start by opening a file
 	fh = hdd_open("temp_file.txt");
 	if (fh == -1) {
-		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure open operation.");
+		hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure open operation.");
+		return(-1);
+	}
+
+	// Preallocate some of it, the file should still be empty
+	if (hdd_fallocate(fh, CIO_UNIT_TEST_MAX_WRITE_SIZE) || (hdd_read(fh, tbuf, 1) != 0)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure fallocate operation.");
 		return(-1);
 	}
 
@@ -574,17 +3069,17 @@ int hddIOUnitTest(void) {
 		} else {
 			cmd = getRandomValue(CIO_UNIT_TEST_READ, CIO_UNIT_TEST_SEEK);
 		}
-		logMessage(LOG_INFO_LEVEL, "----------");
+		hdd_log(LOG_INFO_LEVEL, "----------");
 
 		// Execute the command
 		switch (cmd) {
 
 		case CIO_UNIT_TEST_READ: // read a random set of data
 			count = getRandomValue(0, cio_utest_length);
-			logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : read %d at position %d", count, cio_utest_position);
+			hdd_log(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : read %d at position %d", count, cio_utest_position);
 			bytes = hdd_read(fh, tbuf, count);
 			if (bytes == -1) {
-				logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Read failure.");
+				hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Read failure.");
 				return(-1);
 			}
 
@@ -595,20 +3090,20 @@ int hddIOUnitTest(void) {
 				expected = count;
 			}
 			if (bytes != expected) {
-				logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : short/long read of [%d!=%d]", bytes, expected);
+				hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : short/long read of [%d!=%d]", bytes, expected);
 				return(-1);
 			}
 			if ( (bytes > 0) && (memcmp(&cio_utest_buffer[cio_utest_position], tbuf, bytes)) ) {
 
 				bufToString((unsigned char *)tbuf, bytes, (unsigned char *)lstr, 1024 );
-				logMessage(LOG_INFO_LEVEL, "CIO_UTEST R: %s", lstr);
+				hdd_log(LOG_INFO_LEVEL, "CIO_UTEST R: %s", lstr);
 				bufToString((unsigned char *)&cio_utest_buffer[cio_utest_position], bytes, (unsigned char *)lstr, 1024 );
-				logMessage(LOG_INFO_LEVEL, "CIO_UTEST U: %s", lstr);
+				hdd_log(LOG_INFO_LEVEL, "CIO_UTEST U: %s", lstr);
 
-				logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : read data mismatch (%d)", bytes);
+				hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : read data mismatch (%d)", bytes);
 				return(-1);
 			}
-			logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : read %d match", bytes);
+			hdd_log(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : read %d match", bytes);
 
 
 			// update the position pointer
@@ -622,10 +3117,10 @@ int hddIOUnitTest(void) {
 			if (cio_utest_length+count >= HDD_MAX_BLOCK_SIZE) {
 
 				// Log, seek to end of file, create random value
-				logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : append of %d bytes [%x]", count, ch);
-				logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : seek to position %d", cio_utest_length);
+				hdd_log(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : append of %d bytes [%x]", count, ch);
+				hdd_log(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : seek to position %d", cio_utest_length);
 				if (hdd_seek(fh, cio_utest_length)) {
-					logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : seek failed [%d].", cio_utest_length);
+					hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : seek failed [%d].", cio_utest_length);
 					return(-1);
 				}
 				cio_utest_position = cio_utest_length;
@@ -634,7 +3129,7 @@ int hddIOUnitTest(void) {
 				// Now write
 				bytes = hdd_write(fh, &cio_utest_buffer[cio_utest_position], count);
 				if (bytes != count) {
-					logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : append failed [%d].", count);
+					hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : append failed [%d].", count);
 					return(-1);
 				}
 				cio_utest_length = cio_utest_position += bytes;
@@ -647,11 +3142,11 @@ int hddIOUnitTest(void) {
 			// Check to make sure that the write is not too large
 			if (cio_utest_length+count < HDD_MAX_BLOCK_SIZE) {
 				// Log the write, perform it
-				logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : write of %d bytes [%x]", count, ch);
+				hdd_log(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : write of %d bytes [%x]", count, ch);
 				memset(&cio_utest_buffer[cio_utest_position], ch, count);
 				bytes = hdd_write(fh, &cio_utest_buffer[cio_utest_position], count);
 				if (bytes!=count) {
-					logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : write failed [%d].", count);
+					hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : write failed [%d].", count);
 					return(-1);
 				}
 				cio_utest_position += bytes;
@@ -663,9 +3158,9 @@ int hddIOUnitTest(void) {
 
 		case CIO_UNIT_TEST_SEEK:
 			count = getRandomValue(0, cio_utest_length);
-			logMessage(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : seek to position %d", count);
+			hdd_log(LOG_INFO_LEVEL, "HDD_IO_UNIT_TEST : seek to position %d", count);
 			if (hdd_seek(fh, count)) {
-				logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : seek failed [%d].", count);
+				hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : seek failed [%d].", count);
 				return(-1);
 			}
 			cio_utest_position = count;
@@ -679,9 +3174,62 @@ int hddIOUnitTest(void) {
 
 	}
 
+	// A second handle on the file starts at the beginning and sees all of it
+	i = hdd_open("temp_file.txt");
+	if ((i == -1) || (i == fh) || (hdd_read(i, tbuf, cio_utest_length) != cio_utest_length) ||
+			memcmp(cio_utest_buffer, tbuf, cio_utest_length) || hdd_close(i)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : second handle failure.");
+		return(-1);
+	}
+
+	// A view of the file loads what is touched, and writes back what changed
+	if (cio_utest_length > 1) {
+		uint32_t len;
+		char *view = hdd_map(fh, &len);
+		count = cio_utest_length / 2;
+		if ((view == NULL) || (len != cio_utest_length) ||
+				hdd_map_touch(view, count, cio_utest_length - count) ||
+				memcmp(&view[count], &cio_utest_buffer[count], cio_utest_length - count)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : map failure.");
+			return(-1);
+		}
+		view[count] = cio_utest_buffer[count] = 'm';
+		view[cio_utest_length - 1] = cio_utest_buffer[cio_utest_length - 1] = 'm';
+		i = hdd_open("temp_file.txt");
+		if (hdd_msync(view) || (hdd_msync(tbuf) != -1) || (i == -1) || (hdd_read(i, tbuf, cio_utest_length) != cio_utest_length) ||
+				memcmp(cio_utest_buffer, tbuf, cio_utest_length) || hdd_close(i) || hdd_unmap(view)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : map write back failure.");
+			return(-1);
+		}
+	}
+
+	// A file written well past its end goes sparse: the holes read as zeros
+	// (before and after its map is written back) and the seek queries find
+	// the data around them
+	memset(cio_utest_buffer, 0x0, 3 * HDD_SPARSE_CHUNK + 50);
+	memset(cio_utest_buffer, 's', 100);
+	memset(&cio_utest_buffer[3 * HDD_SPARSE_CHUNK + 10], 's', 40);
+	for (count = 0; count < 2; count++) {
+		i = hdd_open("sparse_file.txt");
+		if ((i == -1) || ((count == 0) && ((hdd_write(i, cio_utest_buffer, 100) != 100) ||
+				hdd_seek(i, 3 * HDD_SPARSE_CHUNK + 10) || (hdd_write(i, cio_utest_buffer, 100) != 100) ||
+				hdd_seek(i, 2 * HDD_MAX_BLOCK_SIZE) || (hdd_write(i, cio_utest_buffer, 100) != 100))) ||
+				(hdd_seek_data(i, 100, HDD_SEEK_DATA) != 3 * HDD_SPARSE_CHUNK + 10) ||
+				(hdd_seek_data(i, 0, HDD_SEEK_HOLE) != 100) ||
+				(hdd_seek_data(i, 3 * HDD_SPARSE_CHUNK + 20, HDD_SEEK_HOLE) != 3 * HDD_SPARSE_CHUNK + 110) ||
+				(hdd_seek_data(i, 2 * HDD_MAX_BLOCK_SIZE + 100, HDD_SEEK_DATA) != -1) ||
+				hdd_seek(i, 50) || (hdd_read(i, tbuf, 3 * HDD_SPARSE_CHUNK) != 3 * HDD_SPARSE_CHUNK) ||
+				memcmp(&cio_utest_buffer[50], tbuf, 3 * HDD_SPARSE_CHUNK) ||
+				(hdd_read(i, tbuf, HDD_MAX_BLOCK_SIZE) != HDD_MAX_BLOCK_SIZE) ||
+				hdd_seek(i, 2 * HDD_MAX_BLOCK_SIZE + 90) || (hdd_read(i, tbuf, 100) != 10) || hdd_close(i)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : sparse file failure.");
+			return(-1);
+		}
+	}
+
 	// Close the files and cleanup buffers, assert on failure
 	if (hdd_close(fh)) {
-		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure close close.", fh);
+		hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure close close.", fh);
 		return(-1);
 	}
 	free(cio_utest_buffer);
@@ -689,10 +3237,331 @@ int hddIOUnitTest(void) {
 
 	// Format and mount the file system
 	if (hdd_unmount()) {
-		logMessage(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on unmount operation.");
+		hdd_log(LOG_ERROR_LEVEL, "HDD_IO_UNIT_TEST : Failure on unmount operation.");
 		return(-1);
 	}
 
 	// Return successfully
 	return(0);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddJournalUnitTest
+// Description  : write files over many syncs (so the journal takes many
+//                batches and is checkpointed), grow a file past its block
+//                and make one after the last sync, then drop the volume
+//                without unmounting it; mounted again, the files must be
+//                just as they were synced (this formats the device)
+//
+// Inputs       : None
+// Outputs      : 0 if successful or -1 if failure
+
+int hddJournalUnitTest(void) {
+
+	// Local variables
+	HddVolume *v, *w;
+	VolumeSaved saved;
+	HddDirEntry entry;
+	uint8_t *model, *synced, *tbuf, ch;
+	uint32_t size[HDD_JOURNAL_UTEST_FILES], ssize[HDD_JOURNAL_UTEST_FILES];
+	uint32_t epoch, checkpoints = 0, i, pos, count;
+	int16_t fh[HDD_JOURNAL_UTEST_FILES];
+	char name[MAX_FILENAME_LENGTH];
+	int16_t lost;
+	int k, found;
+
+	// Each file's contents as written, and as of the last sync
+	model = calloc(HDD_JOURNAL_UTEST_FILES, HDD_JOURNAL_UTEST_ROOM);
+	synced = calloc(HDD_JOURNAL_UTEST_FILES, HDD_JOURNAL_UTEST_ROOM);
+	tbuf = malloc(HDD_JOURNAL_UTEST_ROOM + 1);
+	memset(size, 0x0, sizeof(size));
+	memset(ssize, 0x0, sizeof(ssize));
+
+	if ((model == NULL) || (synced == NULL) || (tbuf == NULL) || ((v = hdd_volume_format(NULL, 0)) == NULL)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure on format.");
+		return(-1);
+	}
+	for (i = 0; i < HDD_JOURNAL_UTEST_FILES; i++) {
+		snprintf(name, sizeof(name), "journal/%u.dat", i);
+		if ((fh[i] = hdd_volume_open(v, name)) == -1) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure opening [%s].", name);
+			return(-1);
+		}
+	}
+
+	// Scattered writes (mostly appends, which each change a size), synced
+	// now and then until a sync leaves batches in the journal (not just a
+	// checkpoint)
+	epoch = v->journal.epoch;
+	for (k = 0; (k < HDD_JOURNAL_UTEST_WRITES) || (v->journal.tail == 0); k++) {
+		i = getRandomValue(0, HDD_JOURNAL_UTEST_FILES - 1);
+		pos = (getRandomValue(0, 3) == 0) ? getRandomValue(0, size[i]) : size[i];   // mostly appends
+		if (pos >= HDD_JOURNAL_UTEST_SIZE) {
+			pos = 0;
+		}
+		count = getRandomValue(1, (pos + 256 < HDD_JOURNAL_UTEST_SIZE) ? 256 : HDD_JOURNAL_UTEST_SIZE - pos);
+		ch = getRandomValue(0, 0xff);
+		memset(&model[i * HDD_JOURNAL_UTEST_ROOM + pos], ch, count);
+		if (hdd_volume_seek(v, fh[i], pos) ||
+				(hdd_volume_write(v, fh[i], &model[i * HDD_JOURNAL_UTEST_ROOM + pos], count) != count)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure writing %u bytes at %u of file %u.", count, pos, i);
+			return(-1);
+		}
+		if (pos + count > size[i]) {
+			size[i] = pos + count;
+		}
+
+		if (k % HDD_JOURNAL_UTEST_SYNC == HDD_JOURNAL_UTEST_SYNC - 1) {
+			if (hdd_volume_sync(v)) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure on sync.");
+				return(-1);
+			}
+			memcpy(synced, model, (size_t)HDD_JOURNAL_UTEST_FILES * HDD_JOURNAL_UTEST_ROOM);
+			memcpy(ssize, size, sizeof(size));
+			checkpoints += (v->journal.epoch != epoch);
+			epoch = v->journal.epoch;
+		}
+	}
+	if (checkpoints == 0) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : the journal was never checkpointed.");
+		return(-1);
+	}
+
+	// After the sync, a file outgrows its block (moving to a new one unless
+	// the server resizes it) and a new file is made; neither is committed
+	// (too few records), so both are lost
+	memset(tbuf, 'g', HDD_JOURNAL_UTEST_ROOM - HDD_JOURNAL_UTEST_SIZE);
+	if (hdd_volume_seek(v, fh[0], size[0]) ||
+			(hdd_volume_write(v, fh[0], tbuf, HDD_JOURNAL_UTEST_ROOM - HDD_JOURNAL_UTEST_SIZE) !=
+				HDD_JOURNAL_UTEST_ROOM - HDD_JOURNAL_UTEST_SIZE) ||
+			((lost = hdd_volume_open(v, "journal/lost.dat")) == -1) || (hdd_volume_write(v, lost, tbuf, 100) != 100)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure writing after the sync.");
+		return(-1);
+	}
+
+	// Crash: the volume is dropped with nothing more written, and a new one
+	// mounts over its connection (a server taking one connection at a time
+	// keeps its blocks only while that stays open)
+	if ((w = volume_new(NULL, 0)) == NULL) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : out of memory.");
+		return(-1);
+	}
+	w->own = v->own;
+	w->init = 0;
+	v->own.sfd = -1;
+	volume_free(v);
+	v = w;
+	volume_enter(v, &saved);
+	found = hdd_mount();
+	volume_leave(&saved);
+	if (found) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure on mount after the crash.");
+		return(-1);
+	}
+	for (i = 0; i < HDD_JOURNAL_UTEST_FILES; i++) {
+		snprintf(name, sizeof(name), "journal/%u.dat", i);
+		if (((fh[i] = hdd_volume_open(v, name)) == -1) ||
+				(hdd_volume_read(v, fh[i], tbuf, HDD_JOURNAL_UTEST_ROOM + 1) != ssize[i]) ||
+				memcmp(tbuf, &synced[i * HDD_JOURNAL_UTEST_ROOM], ssize[i]) || hdd_volume_close(v, fh[i])) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : [%s] differs from its synced %u bytes.", name, ssize[i]);
+			return(-1);
+		}
+	}
+	volume_enter(v, &saved);
+	found = hdd_dir_find("journal/lost.dat", &entry);
+	volume_leave(&saved);
+	if (found != 0) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : a file made after the sync survived the crash.");
+		return(-1);
+	}
+
+	if (hdd_volume_unmount(v)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_JOURNAL_UTEST : Failure on unmount.");
+		return(-1);
+	}
+	hdd_log(LOG_INFO_LEVEL, "HDD_JOURNAL_UTEST : %d writes, %u checkpoints replayed correctly", k, checkpoints);
+	free(model);
+	free(synced);
+	free(tbuf);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sparse_utest_seek
+// Description  : where hdd_seek_data should go in the sparse unit test's
+//                model: each chunk's data is its hull, the bytes from the
+//                first written to the last (holes inside it read as zeros
+//                but are data), the rest of the file is holes
+//
+// Inputs       : first, last - each chunk's hull (last 0 if none), size -
+//                the file size, loc - where to start, whence - as hdd_seek_data
+// Outputs      : the position, -1 if there is none
+
+static int64_t sparse_utest_seek(const uint32_t *first, const uint32_t *last, uint32_t size, uint32_t loc, int whence) {
+
+	// Local variables
+	uint32_t at = loc, base;
+	int in;
+
+	while (at < size) {
+		base = at - at % HDD_SPARSE_CHUNK;
+		in = (at >= base + first[at / HDD_SPARSE_CHUNK]) && (at < base + last[at / HDD_SPARSE_CHUNK]);
+		if (in == (whence == HDD_SEEK_DATA)) {
+			return(at);
+		}
+		if (in) {
+			at = base + last[at / HDD_SPARSE_CHUNK];
+		} else if ((last[at / HDD_SPARSE_CHUNK] != 0) && (at < base + first[at / HDD_SPARSE_CHUNK])) {
+			at = base + first[at / HDD_SPARSE_CHUNK];
+		} else {
+			at = base + HDD_SPARSE_CHUNK;
+		}
+	}
+	return(((whence == HDD_SEEK_HOLE) && (loc < size)) ? size : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sparse_utest_check
+// Description  : checks hdd_seek_data from random places, and reads of the
+//                whole file in random pieces, against the sparse unit
+//                test's model
+//
+// Inputs       : fh - the file, model - its contents, first/last - its
+//                chunks' hulls, size - its size, tbuf - room to read to
+// Outputs      : 0 if they all match, -1 if not
+
+static int sparse_utest_check(int16_t fh, const uint8_t *model, const uint32_t *first, const uint32_t *last,
+		uint32_t size, uint8_t *tbuf) {
+
+	// Local variables
+	uint32_t loc, count;
+	int64_t got, want;
+	int i, whence;
+
+	for (i = 0; i < HDD_SPARSE_UTEST_SEEKS; i++) {
+		loc = getRandomValue(0, size + 10);
+		whence = getRandomValue(0, 1) ? HDD_SEEK_DATA : HDD_SEEK_HOLE;
+		got = hdd_seek_data(fh, loc, whence);
+		want = sparse_utest_seek(first, last, size, loc, whence);
+		if (got != want) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : seek %s from %u went to %lld, not %lld",
+					(whence == HDD_SEEK_DATA) ? "data" : "hole", loc, (long long)got, (long long)want);
+			return(-1);
+		}
+	}
+
+	if (hdd_seek(fh, 0)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : seek to the start failed.");
+		return(-1);
+	}
+	for (loc = 0; loc < size; loc += count) {
+		count = getRandomValue(1, 3 * HDD_SPARSE_CHUNK);
+		want = (loc + count > size) ? size - loc : count;
+		if ((hdd_read(fh, tbuf, count) != want) || memcmp(tbuf, &model[loc], want)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : read of %u at %u differs.", count, loc);
+			return(-1);
+		}
+	}
+	if (hdd_read(fh, tbuf, 1) != 0) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : read past the end returned data.");
+		return(-1);
+	}
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddSparseUnitTest
+// Description  : write a file first well past its start (so it is sparse)
+//                and then in random places, checking hdd_seek_data and
+//                reads against a model of its chunks, also after it is
+//                reopened and after the volume is mounted again (this
+//                formats the device)
+//
+// Inputs       : None
+// Outputs      : 0 if successful or -1 if failure
+
+int hddSparseUnitTest(void) {
+
+	// Local variables
+	uint32_t first[HDD_SPARSE_UTEST_CHUNKS], last[HDD_SPARSE_UTEST_CHUNKS];
+	uint32_t size = 0, loc, count, n, c, off, end;
+	uint8_t *model, *tbuf;
+	int16_t fh;
+	int i, round;
+
+	model = calloc(HDD_SPARSE_UTEST_CHUNKS, HDD_SPARSE_CHUNK);
+	tbuf = malloc(3 * HDD_SPARSE_CHUNK);
+	memset(first, 0x0, sizeof(first));
+	memset(last, 0x0, sizeof(last));
+
+	if ((model == NULL) || (tbuf == NULL) || hdd_format() || hdd_mount() ||
+			((fh = hdd_open("sparse_utest.dat")) == -1)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : Failure on format, mount or open.");
+		return(-1);
+	}
+
+	for (round = 0; round < 3; round++) {
+
+		// Random writes of nonzero bytes, the first a chunk or more in
+		for (i = 0; i < HDD_SPARSE_UTEST_WRITES; i++) {
+			loc = getRandomValue((size == 0) ? HDD_SPARSE_CHUNK : 0, HDD_SPARSE_UTEST_CHUNKS * HDD_SPARSE_CHUNK - 1);
+			count = getRandomValue(1, HDD_SPARSE_UTEST_MAX_WRITE);
+			if (loc + count > HDD_SPARSE_UTEST_CHUNKS * HDD_SPARSE_CHUNK) {
+				count = HDD_SPARSE_UTEST_CHUNKS * HDD_SPARSE_CHUNK - loc;
+			}
+			memset(&model[loc], getRandomValue(1, 0xff), count);
+			if (hdd_seek(fh, loc) || (hdd_write(fh, &model[loc], count) != count)) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : write of %u at %u failed.", count, loc);
+				return(-1);
+			}
+
+			// Each chunk it touches takes it into its hull
+			for (n = loc; n < loc + count; n = end) {
+				c = n / HDD_SPARSE_CHUNK;
+				off = n % HDD_SPARSE_CHUNK;
+				end = (loc + count < (c + 1) * HDD_SPARSE_CHUNK) ? loc + count : (c + 1) * HDD_SPARSE_CHUNK;
+				if ((last[c] == 0) || (off < first[c])) {
+					first[c] = off;
+				}
+				if (end - c * HDD_SPARSE_CHUNK > last[c]) {
+					last[c] = end - c * HDD_SPARSE_CHUNK;
+				}
+			}
+			if (loc + count > size) {
+				size = loc + count;
+			}
+
+			if ((i % 8 == 7) && sparse_utest_check(fh, model, first, last, size, tbuf)) {
+				return(-1);
+			}
+		}
+
+		// Again once the map was written and read back
+		if (hdd_close(fh) || ((round == 1) && (hdd_unmount() || hdd_mount())) ||
+				((fh = hdd_open("sparse_utest.dat")) == -1)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : Failure reopening the file.");
+			return(-1);
+		}
+		if (sparse_utest_check(fh, model, first, last, size, tbuf)) {
+			return(-1);
+		}
+	}
+
+	if (hdd_close(fh) || hdd_unmount()) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SPARSE_UTEST : Failure on close or unmount.");
+		return(-1);
+	}
+	for (c = n = 0; c < HDD_SPARSE_UTEST_CHUNKS; c++) {
+		n += (last[c] != 0);
+	}
+	hdd_log(LOG_INFO_LEVEL, "HDD_SPARSE_UTEST : %u bytes in %u of %u chunks checked", size, n, HDD_SPARSE_UTEST_CHUNKS);
+
+	free(model);
+	free(tbuf);
+	return(0);
+}
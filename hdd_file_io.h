@@ -20,6 +20,40 @@
 // Defines
 #define MAX_HDD_FILEDESCR 1024
 #define MAX_FILENAME_LENGTH 128
+#define HDD_PACK_THRESHOLD 2048        // files allocated no more than this share pack blocks
+#define HDD_PACK_BLOCK_SIZE (64*1024)  // largest pack block (slices are cut from its end)
+#define HDD_PACK_MAGIC "HDDP"          // start of a pack block, so no slice is at offset 0
+#define HDD_PACK_HEADER 4              // bytes of it
+#define HDD_SPARSE_CAPACITY 0xffffffff // capacity of a sparse file's entry (its block is its map)
+#define HDD_SPARSE_CHUNK (64*1024)     // bytes of a sparse file each of its data blocks covers
+#define HDD_SPARSE_MAGIC "HDDS"        // start of a sparse file's map block
+#define HDD_SEEK_DATA 3                // hdd_seek_data: the next byte of data
+#define HDD_SEEK_HOLE 4                // hdd_seek_data: the next hole (the end counts as one)
+#define HDD_MAP_PAGE 4096              // bytes a view (see hdd_map) is loaded in
+
+// Readahead/prefetch counters (see hdd_readahead_stats)
+typedef struct {
+	uint64_t reads;            // hdd_read calls that returned data
+	uint64_t hits;             // reads served from bytes already held locally
+	uint64_t misses;           // reads that waited on a server round trip
+	uint64_t prefetches;       // prefetch reads posted to the server
+	uint64_t prefetch_hits;    // prefetches that served a later read
+	uint64_t prefetch_wasted;  // prefetches dropped without serving a read
+	uint64_t prefetch_bytes;   // bytes asked for by prefetches
+} HddReadaheadStats;
+
+// A chunk of a sparse file holding data (see hdd_sparse_decode); the rest
+// of the chunk, and every chunk not listed, is a hole that reads as zeros
+typedef struct {
+	uint32_t index;    // which chunk, it covers HDD_SPARSE_CHUNK bytes from index * HDD_SPARSE_CHUNK
+	uint32_t start;    // where in the chunk its data starts
+	uint32_t length;   // bytes of data, all in its block
+	uint32_t bid;      // the block
+} HddSparseChunk;
+
+// A mounted filesystem and the server it is on (see hdd_volume_mount); the
+// calls without a volume work on a default one, on the default server
+typedef struct HddVolume HddVolume;
 
 
 // Management operations
@@ -49,7 +83,100 @@ int32_t hdd_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
 int32_t hdd_seek(int16_t fd, uint32_t loc);
-	// Seek to specific point in the file
+	// Seek to specific point in the file (past the end too, a write there
+	// leaves a hole)
+
+int64_t hdd_seek_data(int16_t fd, uint32_t loc, int whence);
+	// Seeks to the first byte of data (HDD_SEEK_DATA) or of a hole
+	// (HDD_SEEK_HOLE) at or after "loc"; the position, or -1 if there is none
+
+int32_t hdd_sync(void);
+	// Commits the metadata changes made so far to the journal
+
+int32_t hdd_adopt(int16_t fd, uint32_t bid, uint32_t size);
+	// Makes the "size" bytes the caller put in block "bid" the file's contents
+
+int32_t hdd_fallocate(int16_t fd, uint32_t bytes);
+	// Makes room for "bytes" bytes in the file without changing its size
+
+void *hdd_map(int16_t fd, uint32_t *len);
+	// Makes a local view of the file, its length (the file's size) in
+	// "len"; the handle must stay open while the view is used.  Unlike
+	// mmap, pages aren't loaded on access: see hdd_map_touch; NULL on
+	// failure
+
+int32_t hdd_map_touch(void *view, uint32_t off, uint32_t len);
+	// Reads the pages of "view" covering "len" bytes at "off" not yet read.
+	// NOTE: a page of a view is inaccessible until touched, and reading or
+	// writing it before then kills the process with SIGSEGV, so code moved
+	// over from mmap must touch each range before using it
+
+int32_t hdd_msync(void *view);
+	// Writes back just the bytes of "view" changed since they were read
+	// (or last written back)
+
+int32_t hdd_unmap(void *view);
+	// Writes back the changes (as hdd_msync) and drops the view
+
+void hdd_readahead_stats(HddReadaheadStats *stats);
+	// Copies out the readahead/prefetch counters
+
+//
+// Volumes (each its own files, handles and connection; a thread may use
+// several, one at a time, and threads may each use their own)
+
+HddVolume *hdd_volume_mount(const char *addr, unsigned short port);
+	// Connects to the server at "addr":"port" (NULL/0 for the defaults) and
+	// mounts its filesystem; NULL on failure
+
+HddVolume *hdd_volume_format(const char *addr, unsigned short port);
+	// As hdd_volume_mount, formatting the device first
+
+HddVolume *hdd_volume_namespace(const char *addr, unsigned short port, uint32_t ns, int format);
+	// As hdd_volume_mount, for the filesystem of namespace "ns" (1 to
+	// HDD_MAX_NAMESPACE) of the server's device, formatting just it first
+	// if "format"; the server must grant HDD_CAP_NAMESPACE.  Namespaces
+	// share the device's blocks, a formatted one leaves its old blocks
+	// behind until the device is formatted
+
+int hdd_volume_unmount(HddVolume *v);
+	// Unmounts the volume and frees it; 0 on success, -1 on failure
+
+int16_t hdd_volume_open(HddVolume *v, char *path);
+int16_t hdd_volume_close(HddVolume *v, int16_t fd);
+int32_t hdd_volume_read(HddVolume *v, int16_t fd, void *buf, int32_t count);
+int32_t hdd_volume_write(HddVolume *v, int16_t fd, void *buf, int32_t count);
+int32_t hdd_volume_seek(HddVolume *v, int16_t fd, uint32_t loc);
+int64_t hdd_volume_seek_data(HddVolume *v, int16_t fd, uint32_t loc, int whence);
+int32_t hdd_volume_sync(HddVolume *v);
+int32_t hdd_volume_adopt(HddVolume *v, int16_t fd, uint32_t bid, uint32_t size);
+int32_t hdd_volume_fallocate(HddVolume *v, int16_t fd, uint32_t bytes);
+void *hdd_volume_map(HddVolume *v, int16_t fd, uint32_t *len);
+	// The interface functions above, on the volume "v"
+
+HddVolume *hdd_volume_use(HddVolume *v);
+	// Makes "v" the calling thread's volume (NULL for the default one) until
+	// switched again, returning the one before (NULL if the default); for
+	// schedulers that switch between callers on one thread mid-call
+
+//
+// Block helpers (shared with the directory, bulk transfers and inspector)
+
+uint64_t construct(uint32_t bid, int r, int flags, int32_t block_size, int op);
+	// Builds the HddBitCmd for a block operation
+
+int get_response(uint64_t response);
+	// The R bit of a response, 1 on failure
+
+uint32_t get_bid(uint64_t response);
+	// The block ID of a response
+
+uint64_t hdd_block_operation(uint64_t command, void *buf);
+	// Sends a command that moves block data, checking its checksum
+
+int hdd_sparse_decode(const uint8_t *buf, uint32_t len, HddSparseChunk **chunks, uint32_t *count);
+	// Lists the chunks in the "len" bytes of a sparse file's map block, in
+	// order, as an array to free(); -1 if it is damaged
 
 //
 // Unit testing for the module
@@ -57,6 +184,12 @@ int32_t hdd_seek(int16_t fd, uint32_t loc);
 int hddIOUnitTest(void);
 	// Perform a test of the CRUD IO implementation
 
+int hddJournalUnitTest(void);
+	// Check that a volume dropped without unmounting mounts as last synced
+
+int hddSparseUnitTest(void);
+	// Check a sparse file's seeks for data and holes, and its reads
+
 #endif
 
 
@@ -0,0 +1,516 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_htable.c
+//  Description    : This is the implementation of the HDD hash table.  Items
+//                   (key and block) live in an array and never move, so an
+//                   iterator just walks it; a separate probe array of slots
+//                   (item number and hash) is kept in Robin Hood order, each
+//                   slot no nearer its home than the ones it displaced, so a
+//                   lookup stops as soon as it passes where the key would be.
+//                   Slots carry the key and block too, so a lookup touches
+//                   only the probe array.  Deletes shift the following
+//                   slots back instead of leaving tombstones, and freed
+//                   items are reused.
+//
+//  Author         :
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Project Includes
+#include <hdd_htable.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_HT_UTEST_KEYS 4096          // key range the unit test works in
+#define HDD_HT_UTEST_OPS 200000         // random operations in the unit test
+#define HDD_HT_BENCH_ITEMS (1 << 18)    // items per benchmark run
+#define HDD_HT_BENCH_OLD_BITS 15        // widest cmpsc311 table (it needs bits < 16)
+
+//
+// Local functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ht_hash
+// Description  : hash a key (64 bit finalizer, so sequential keys spread out)
+//
+// Inputs       : idx - the key
+// Outputs      : the hash
+
+static uint32_t hdd_ht_hash(HtIndexValue idx) {
+	uint64_t h = idx;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return((uint32_t)h);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ht_distance
+// Description  : how far a slot is from the home slot of its hash
+//
+// Inputs       : ht - the table, pos - the slot
+// Outputs      : the distance
+
+static uint32_t hdd_ht_distance(HddHTable *ht, uint32_t pos) {
+	return((pos - (ht->slots[pos].hash & ht->mask)) & ht->mask);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ht_lookup
+// Description  : find the slot of a key
+//
+// Inputs       : ht - the table, idx - the key, hash - its hash
+// Outputs      : the slot, -1 if the key isn't there
+
+static int64_t hdd_ht_lookup(HddHTable *ht, HtIndexValue idx, uint32_t hash) {
+	uint32_t pos = hash & ht->mask, dist = 0;
+	HddHtSlot *slot;
+
+	while (1) {
+		slot = &ht->slots[pos];
+		if (slot->index == idx && slot->item != 0) {
+			return(pos);
+		}
+		if ((slot->item == 0) || (((pos - slot->hash) & ht->mask) < dist)) {
+			return(-1);    // empty, or it would have displaced this one
+		}
+		pos = (pos + 1) & ht->mask;
+		dist++;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ht_place
+// Description  : put a slot in the probe array, displacing slots nearer
+//                their home than it is from its own
+//
+// Inputs       : ht - the table, cur - the slot
+// Outputs      : none
+
+static void hdd_ht_place(HddHTable *ht, HddHtSlot cur) {
+	uint32_t pos = cur.hash & ht->mask, dist = 0, sdist;
+	HddHtSlot tmp;
+
+	while (ht->slots[pos].item != 0) {
+		if ((sdist = hdd_ht_distance(ht, pos)) < dist) {
+			tmp = ht->slots[pos];    // take its place, carry it on
+			ht->slots[pos] = cur;
+			cur = tmp;
+			dist = sdist;
+		}
+		pos = (pos + 1) & ht->mask;
+		dist++;
+	}
+	ht->slots[pos] = cur;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_ht_grow
+// Description  : double the probe array, placing the slots again
+//
+// Inputs       : ht - the table
+// Outputs      : 0 if successful, -1 if failure
+
+static int hdd_ht_grow(HddHTable *ht) {
+	HddHtSlot *old = ht->slots;
+	uint32_t oldslots = ht->mask + 1, i;
+
+	if (oldslots >= ((uint32_t)1 << 31)) {
+		return(-1);
+	}
+	if ((ht->slots = calloc(oldslots * 2, sizeof(HddHtSlot))) == NULL) {
+		ht->slots = old;
+		return(-1);
+	}
+	ht->mask = oldslots * 2 - 1;
+	for (i = 0; i < oldslots; i++) {
+		if (old[i].item != 0) {
+			hdd_ht_place(ht, old[i]);
+		}
+	}
+	free(old);
+	return(0);
+}
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initHddHashTable
+// Description  : set up an empty table
+//
+// Inputs       : ht - the table, bits - log2 of the starting slots
+// Outputs      : 0 if successful, -1 if failure
+
+int initHddHashTable(HddHTable *ht, uint16_t bits) {
+	if (bits < HDD_HT_MIN_BITS) {
+		bits = HDD_HT_MIN_BITS;
+	}
+	if (bits > 30) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_HTABLE : table of 2^%u slots too large", bits);
+		return(-1);
+	}
+	memset(ht, 0x0, sizeof(HddHTable));
+	ht->mask = (1 << bits) - 1;
+	ht->capacity = (ht->mask + 1) * HDD_HT_LOAD_PERCENT / 100 + 1;
+	ht->slots = calloc(ht->mask + 1, sizeof(HddHtSlot));
+	ht->items = malloc(ht->capacity * sizeof(HddHtItem));
+	if ((ht->slots == NULL) || (ht->items == NULL)) {
+		cleanupHddHashTable(ht);
+		return(-1);
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cleanupHddHashTable
+// Description  : free the table (not the blocks in it)
+//
+// Inputs       : ht - the table
+// Outputs      : 0
+
+int cleanupHddHashTable(HddHTable *ht) {
+	free(ht->slots);
+	free(ht->items);
+	memset(ht, 0x0, sizeof(HddHTable));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insertValueInHddHashTable
+// Description  : add a block under a key
+//
+// Inputs       : ht - the table, idx - the key, blk - the block
+// Outputs      : 0 if successful, -1 if failure (or the key is there)
+
+int insertValueInHddHashTable(HddHTable *ht, HtIndexValue idx, void *blk) {
+	uint32_t hash = hdd_ht_hash(idx), item;
+	HddHtSlot slot;
+
+	if ((blk == NULL) || (hdd_ht_lookup(ht, idx, hash) != -1)) {
+		return(-1);
+	}
+
+	// Keep the probe array under the load factor
+	if ((uint64_t)(ht->elements + 1) * 100 > (uint64_t)(ht->mask + 1) * HDD_HT_LOAD_PERCENT) {
+		if (hdd_ht_grow(ht)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_HTABLE : failed to grow past %u slots", ht->mask + 1);
+			return(-1);
+		}
+	}
+
+	// Take a free item, or the next new one
+	if (ht->free != 0) {
+		item = ht->free - 1;
+		ht->free = ht->items[item].index;
+	} else {
+		if (ht->used == ht->capacity) {
+			HddHtItem *items = realloc(ht->items, (size_t)ht->capacity * 2 * sizeof(HddHtItem));
+
+			if (items == NULL) {
+				return(-1);
+			}
+			ht->items = items;
+			ht->capacity *= 2;
+		}
+		item = ht->used++;
+	}
+	ht->items[item].index = idx;
+	ht->items[item].block = blk;
+
+	slot.index = idx;
+	slot.block = blk;
+	slot.item = item + 1;
+	slot.hash = hash;
+	hdd_ht_place(ht, slot);
+	ht->elements++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findValueInHddHashTable
+// Description  : look a key up
+//
+// Inputs       : ht - the table, idx - the key
+// Outputs      : the block, NULL if not found
+
+void *findValueInHddHashTable(HddHTable *ht, HtIndexValue idx) {
+	int64_t pos = hdd_ht_lookup(ht, idx, hdd_ht_hash(idx));
+
+	return((pos == -1) ? NULL : ht->slots[pos].block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : deleteValueFromHddHashTable
+// Description  : remove a key, shifting the slots after it back a place
+//                until one is at its home (or the run ends)
+//
+// Inputs       : ht - the table, idx - the key
+// Outputs      : the block it had, NULL if not found
+
+void *deleteValueFromHddHashTable(HddHTable *ht, HtIndexValue idx) {
+	int64_t found = hdd_ht_lookup(ht, idx, hdd_ht_hash(idx));
+	uint32_t pos, next, item;
+	void *blk;
+
+	if (found == -1) {
+		return(NULL);
+	}
+	pos = found;
+	item = ht->slots[pos].item - 1;
+	blk = ht->items[item].block;
+
+	// Free the item (iterators skip it), it heads the free list
+	ht->items[item].block = NULL;
+	ht->items[item].index = ht->free;
+	ht->free = item + 1;
+	ht->elements--;
+
+	next = (pos + 1) & ht->mask;
+	while ((ht->slots[next].item != 0) && (hdd_ht_distance(ht, next) > 0)) {
+		ht->slots[pos] = ht->slots[next];
+		pos = next;
+		next = (next + 1) & ht->mask;
+	}
+	memset(&ht->slots[pos], 0x0, sizeof(HddHtSlot));
+	return(blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initHddHashTableIterator / iterateHddHashTable
+// Description  : walk the items of a table
+//
+// Inputs       : ht - the table, it - the iterator
+// Outputs      : 0 / the next block, NULL at the end
+
+int initHddHashTableIterator(HddHTable *ht, HddHtIterator *it) {
+	it->table = ht;
+	it->idx = 0;
+	return(0);
+}
+
+void *iterateHddHashTable(HddHtIterator *it) {
+	HddHtItem *item;
+
+	while (it->idx < it->table->used) {
+		item = &it->table->items[it->idx++];
+		if (item->block != NULL) {
+			return(item->block);
+		}
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddHashTableUnitTest
+// Description  : check the table against an array of what should be in it
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddHashTableUnitTest(void) {
+
+	// Local variables
+	HddHTable ht;
+	HddHtIterator it;
+	uintptr_t *model, *seen, blk;
+	uint32_t count = 0, i, key;
+	int op;
+
+	// The model holds key + 1 for keys in the table (blocks are just key + 1)
+	model = calloc(HDD_HT_UTEST_KEYS, sizeof(uintptr_t));
+	seen = calloc(HDD_HT_UTEST_KEYS, sizeof(uintptr_t));
+	if (initHddHashTable(&ht, 0)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : init failed");
+		return(-1);
+	}
+
+	for (i = 0; i < HDD_HT_UTEST_OPS; i++) {
+		key = getRandomValue(0, HDD_HT_UTEST_KEYS - 1);
+		op = getRandomValue(0, 2);
+		if ((i > HDD_HT_UTEST_OPS / 2) && (op == 0)) {
+			op = 1;    // drain it in the second half
+		}
+
+		if (op == 0) {
+			if (insertValueInHddHashTable(&ht, key, (void *)(uintptr_t)(key + 1)) != (model[key] ? -1 : 0)) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : insert of %u returned the wrong result", key);
+				return(-1);
+			}
+			if (!model[key]) {
+				model[key] = key + 1;
+				count++;
+			}
+		} else if (op == 1) {
+			if ((uintptr_t)deleteValueFromHddHashTable(&ht, key) != model[key]) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : delete of %u returned the wrong block", key);
+				return(-1);
+			}
+			if (model[key]) {
+				model[key] = 0;
+				count--;
+			}
+		} else if ((uintptr_t)findValueInHddHashTable(&ht, key) != model[key]) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : find of %u returned the wrong block", key);
+			return(-1);
+		}
+
+		if (ht.elements != count) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : %u elements, expected %u", ht.elements, count);
+			return(-1);
+		}
+
+		// Now and then walk it, deleting every other block and inserting new
+		// keys on the way: all blocks there throughout are seen just once
+		if (i % 10000 == 0) {
+			memset(seen, 0x0, HDD_HT_UTEST_KEYS * sizeof(uintptr_t));
+			initHddHashTableIterator(&ht, &it);
+			while ((blk = (uintptr_t)iterateHddHashTable(&it)) != 0) {
+				if (seen[blk - 1] == 1) {
+					hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : walk returned %lu twice", (unsigned long)blk - 1);
+					return(-1);
+				}
+				seen[blk - 1] = 1;
+				if ((blk & 1) && (deleteValueFromHddHashTable(&ht, blk - 1) == (void *)blk)) {
+					model[blk - 1] = 0;
+					count--;
+				}
+				key = getRandomValue(0, HDD_HT_UTEST_KEYS - 1);
+				if ((model[key] == 0) && (seen[key] == 0) &&
+						(insertValueInHddHashTable(&ht, key, (void *)(uintptr_t)(key + 1)) == 0)) {
+					model[key] = key + 1;
+					seen[key] = 2;    // may or may not be walked, either is right
+					count++;
+				}
+			}
+			for (key = 0; key < HDD_HT_UTEST_KEYS; key++) {
+				if (model[key] && !seen[key]) {
+					hdd_log(LOG_ERROR_LEVEL, "HDD_HT_UTEST : walk missed %u", key);
+					return(-1);
+				}
+			}
+		}
+	}
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_HT_UTEST : %u elements left in %u slots", ht.elements, ht.mask + 1);
+	cleanupHddHashTable(&ht);
+	free(model);
+	free(seen);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddHashTableBenchmark
+// Description  : time inserts, hits (in key and scattered order), misses, a
+//                walk and deletes of sequential keys (as block IDs are) in
+//                this table and in cmpsc311's
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddHashTableBenchmark(void) {
+
+	// Local variables
+	const char *names[] = { "cmpsc311", "hdd_htable" };
+	const char *phases[] = { "insert", "find", "find-rnd", "miss", "iterate", "delete" };
+	struct timespec start, stop;
+	double ns[2][6];
+	uintptr_t sink = 0;
+	HddHTable ht;
+	HTable old;
+	HddHtIterator it;
+	HtIterator oit;
+	uint32_t i;
+	int impl, phase;
+	void *blk;
+
+	for (impl = 0; impl < 2; impl++) {
+		if (((impl == 0) && initHashTable(&old, HDD_HT_BENCH_OLD_BITS)) ||
+				((impl == 1) && initHddHashTable(&ht, HDD_HT_MIN_BITS))) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_HT_BENCH : init failed");
+			return(-1);
+		}
+		for (phase = 0; phase < 6; phase++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			switch (phase) {
+			case 0:
+				for (i = 1; i <= HDD_HT_BENCH_ITEMS; i++) {
+					if (impl ? insertValueInHddHashTable(&ht, i, (void *)(uintptr_t)i) :
+							insertValueInHashTable(&old, i, (void *)(uintptr_t)i)) {
+						hdd_log(LOG_ERROR_LEVEL, "HDD_HT_BENCH : insert failed");
+						return(-1);
+					}
+				}
+				break;
+			case 1:
+			case 2:
+			case 3:
+				for (i = 1; i <= HDD_HT_BENCH_ITEMS; i++) {
+					HtIndexValue key = (phase == 1) ? i :
+						(phase == 2) ? (i * 2654435761U) % HDD_HT_BENCH_ITEMS + 1 : i + HDD_HT_BENCH_ITEMS;
+					blk = impl ? findValueInHddHashTable(&ht, key) : findValueInHashTable(&old, key);
+					sink += (uintptr_t)blk;
+				}
+				break;
+			case 4:
+				if (impl) {
+					initHddHashTableIterator(&ht, &it);
+					while ((blk = iterateHddHashTable(&it)) != NULL) {
+						sink += (uintptr_t)blk;
+					}
+				} else {
+					initHashTableIterator(&old, &oit);
+					while ((blk = iterateHashTable(&oit)) != NULL) {
+						sink += (uintptr_t)blk;
+					}
+				}
+				break;
+			case 5:
+				for (i = 1; i <= HDD_HT_BENCH_ITEMS; i++) {
+					blk = impl ? deleteValueFromHddHashTable(&ht, i) : deleteValueFromHashTable(&old, i);
+					sink += (uintptr_t)blk;
+				}
+				break;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+			ns[impl][phase] = ((stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec)) / HDD_HT_BENCH_ITEMS;
+		}
+		if (impl) {
+			cleanupHddHashTable(&ht);
+		} else {
+			cleanupHashTable(&old);
+		}
+	}
+
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_HT_BENCH : %u sequential keys, ns per item", HDD_HT_BENCH_ITEMS);
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_HT_BENCH : %-8s %12s %12s %8s", "phase", names[0], names[1], "speedup");
+	for (phase = 0; phase < 6; phase++) {
+		hdd_log(LOG_OUTPUT_LEVEL, "HDD_HT_BENCH : %-8s %12.1f %12.1f %7.1fx", phases[phase],
+			ns[0][phase], ns[1][phase], ns[0][phase] / ns[1][phase]);
+	}
+	hdd_log(LOG_INFO_LEVEL, "HDD_HT_BENCH : done [%lx]", (unsigned long)sink);
+	return(0);
+}
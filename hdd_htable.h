@@ -0,0 +1,93 @@
+#ifndef HDD_HTABLE_INCLUDED
+#define HDD_HTABLE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_htable.h
+//  Description    : This is the header file for the HDD hash table, an open
+//                   addressing (Robin Hood) replacement for the cmpsc311
+//                   hash table with the same interface, that grows as it
+//                   fills and can be changed while it is being iterated.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdint.h>
+#include <cmpsc311_hashtable.h>
+
+// Defines
+#define HDD_HT_MIN_BITS 4          // smallest table, 16 slots
+#define HDD_HT_LOAD_PERCENT 80     // slots in use before the table doubles
+
+// An item, stored inline in the table's item array
+typedef struct {
+	HtIndexValue index;   // key value, or the next free item when block is NULL
+	void *block;          // the data block of the item, NULL if the item is free
+} HddHtItem;
+
+// A slot of the probe array, with the key and block inline so a lookup
+// reads nothing else
+typedef struct {
+	HtIndexValue index;   // key value
+	void *block;          // the data block (a copy of the item's)
+	uint32_t item;        // item number + 1, 0 if the slot is empty
+	uint32_t hash;        // hash of the key (its low bits pick the home slot)
+} HddHtSlot;
+
+// Hash table structure
+typedef struct {
+	uint32_t   elements;  // This is the number of elements
+	uint32_t   mask;      // slots - 1 (a power of two less one)
+	HddHtSlot *slots;     // probe array, ordered by distance from the home slot
+	HddHtItem *items;     // items, which never move once inserted
+	uint32_t   used;      // items ever used (free ones are reused first)
+	uint32_t   capacity;  // items allocated
+	uint32_t   free;      // first free item + 1, 0 if none
+} HddHTable;
+
+// Hash table iterator
+typedef struct {
+	HddHTable *table;     // The table we are iterating through
+	uint32_t   idx;       // The next item to look at
+} HddHtIterator;
+
+//
+// Hashtable Interface (as in cmpsc311_hashtable.h)
+
+int initHddHashTable(HddHTable *ht, uint16_t bits);
+	// Initialize the hash table with 2^(bits) slots (it grows when needed)
+
+int cleanupHddHashTable(HddHTable *ht);
+	// Cleanup the hash table
+
+int insertValueInHddHashTable(HddHTable *ht, HtIndexValue idx, void *blk);
+	// Insert block blk (not NULL) with value idx, -1 if idx is already there
+
+void *findValueInHddHashTable(HddHTable *ht, HtIndexValue idx);
+	// Find the block for a particular index value in the table (NULL if none)
+
+void *deleteValueFromHddHashTable(HddHTable *ht, HtIndexValue idx);
+	// Delete a value from the hashtable of value idx, return it
+
+//
+// Iterator Functions
+
+int initHddHashTableIterator(HddHTable *ht, HddHtIterator *it);
+	// Initialize the iterator
+
+void *iterateHddHashTable(HddHtIterator *it);
+	// The next value in the table, NULL at the end; every value in the table
+	// for the whole walk is returned once even if values (the one just
+	// returned included) are deleted or inserted, or the table grows
+
+//
+// Unit testing and benchmarking for the module
+
+int hddHashTableUnitTest(void);
+	// Check the table against a simple model through inserts, deletes and walks
+
+int hddHashTableBenchmark(void);
+	// Compare insert, find, iterate and delete costs with cmpsc311_hashtable
+
+#endif
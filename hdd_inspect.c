@@ -0,0 +1,512 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_inspect.c
+//  Description   : This is an offline inspector for hdd_content.svd.  It
+//                  maps the file, mounts the filesystem from it without a
+//                  server (see hdd_svd.c) and lists, describes, extracts or
+//                  checksums the files, reading the contents straight from
+//                  the mapping (a sparse file's from the blocks of its
+//                  chunks, with zeros for the holes).
+//
+//  Author        :
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Project Include Files
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_file_io.h>
+#include <hdd_dir.h>
+#include <hdd_crc.h>
+#include <hdd_svd.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_INSPECT_ARGUMENTS "hvl:f:j:"
+#define HDD_INSPECT_MAX_THREADS 64
+#define USAGE \
+	"USAGE: hdd_inspect [-h] [-v] [-l <logfile>] [-f <svd file>] [-j <n>] <command> [<args>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -f - the content file to read (default hdd_content.svd)\n" \
+	"    -j - threads for scan (default one per CPU)\n" \
+	"\n" \
+	"    blocks             - summarize the blocks of the file\n" \
+	"    ls [<glob>]        - list the files (size, capacity, block, name)\n" \
+	"    stat <file>        - describe a file, with its CRC32C\n" \
+	"    get <file> [<out>] - extract a file (to <out>, default its name)\n" \
+	"    scan [<glob>]      - CRC32C of every file, computed in parallel\n" \
+	"\n" \
+
+// A file of the filesystem, with its contents in the mapping
+typedef struct {
+	char          *name;     // its name
+	HddDirEntry    entry;    // its directory entry
+	const uint8_t *data;     // its contents (NULL if it has none or they are missing),
+	                         //   a sparse file's map block
+	HddSparseChunk *chunks;  // a sparse file's chunks holding data
+	uint32_t       nchunks;  // how many there are
+	uint32_t       crc;      // CRC32C of the contents (scan)
+} HddInspectFile;
+
+// The files a command works on
+typedef struct {
+	HddSvd         *svd;       // the content file
+	const char     *pattern;   // glob the names must match (NULL for all)
+	HddInspectFile *files;     // the files, in name order
+	uint32_t        nfiles;    // how many there are
+	uint32_t        maxfiles;  // and room for
+	uint32_t        next;      // next file to checksum (atomic)
+} HddInspectList;
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_data
+// Description  : find the contents of a file in the mapping (a sparse
+//                file's map, and its chunks, which must all be there and
+//                inside the file)
+//
+// Inputs       : svd - the content file, file - the file (its entry)
+// Outputs      : none, data is NULL if the file has none (or a block is gone)
+
+static void inspect_data(HddSvd *svd, HddInspectFile *file) {
+	const HddDirEntry *entry = &file->entry;
+	HddSvdBlock *blk, *chunk;
+	uint32_t i;
+
+	file->data = NULL;
+	file->chunks = NULL;
+	file->nchunks = 0;
+	if ((entry->bid == 0) || ((blk = hdd_svd_block(svd, entry->bid)) == NULL)) {
+		return;
+	}
+	if (entry->capacity != HDD_SPARSE_CAPACITY) {
+		if ((blk->size >= entry->offset) && (blk->size - entry->offset >= entry->size)) {
+			file->data = blk->data + entry->offset;   // packed files are a slice of the block
+		}
+		return;
+	}
+	if (hdd_sparse_decode(blk->data, blk->size, &file->chunks, &file->nchunks) == -1) {
+		return;
+	}
+	for (i = 0; i < file->nchunks; i++) {
+		if (((chunk = hdd_svd_block(svd, file->chunks[i].bid)) == NULL) || (chunk->size < file->chunks[i].length) ||
+				((uint64_t)file->chunks[i].index * HDD_SPARSE_CHUNK + file->chunks[i].start +
+				 file->chunks[i].length > entry->size)) {
+			return;
+		}
+	}
+	file->data = blk->data;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_crc
+// Description  : the CRC32C of a file's contents, holes and all
+//
+// Inputs       : svd - the content file, file - the file (not missing)
+// Outputs      : the checksum
+
+static uint32_t inspect_crc(HddSvd *svd, const HddInspectFile *file) {
+	static const uint8_t zeros[4096];
+	uint32_t crc = 0, at = 0, from, n, i;
+
+	if (file->data == NULL) {
+		return(0);
+	}
+	if (file->entry.capacity != HDD_SPARSE_CAPACITY) {
+		return(hdd_crc32c(0, file->data, file->entry.size));
+	}
+	for (i = 0; i <= file->nchunks; i++) {
+		from = (i < file->nchunks) ? file->chunks[i].index * HDD_SPARSE_CHUNK + file->chunks[i].start : file->entry.size;
+		for (; at < from; at += n) {
+			n = (from - at < sizeof(zeros)) ? from - at : sizeof(zeros);
+			crc = hdd_crc32c(crc, zeros, n);
+		}
+		if (i < file->nchunks) {
+			crc = hdd_crc32c(crc, hdd_svd_block(svd, file->chunks[i].bid)->data, file->chunks[i].length);
+			at += file->chunks[i].length;
+		}
+	}
+	return(crc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_add
+// Description  : directory walk callback collecting the files that match
+//
+// Inputs       : name/entry - the file, arg - the list
+// Outputs      : 0 to carry on, -1 when out of memory
+
+static int inspect_add(const char *name, const HddDirEntry *entry, void *arg) {
+	HddInspectList *list = arg;
+	HddInspectFile *files;
+
+	if ((list->pattern != NULL) && (fnmatch(list->pattern, name, 0) != 0)) {
+		return(0);
+	}
+	if (list->nfiles == list->maxfiles) {
+		list->maxfiles = (list->maxfiles == 0) ? 1024 : list->maxfiles * 2;
+		if ((files = realloc(list->files, sizeof(HddInspectFile) * list->maxfiles)) == NULL) {
+			return(-1);
+		}
+		list->files = files;
+	}
+	files = &list->files[list->nfiles];
+	if ((files->name = strdup(name)) == NULL) {
+		return(-1);
+	}
+	files->entry = *entry;
+	inspect_data(list->svd, files);
+	files->crc = 0;
+	list->nfiles++;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_missing
+// Description  : whether a file's contents should be there but aren't
+//
+// Inputs       : file - the file
+// Outputs      : non-zero if missing
+
+static int inspect_missing(const HddInspectFile *file) {
+	return((file->entry.size > 0) && (file->data == NULL));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_scan_worker
+// Description  : checksum files until there are none left
+//
+// Inputs       : arg - the list
+// Outputs      : NULL
+
+static void *inspect_scan_worker(void *arg) {
+	HddInspectList *list = arg;
+	HddInspectFile *file;
+	uint32_t idx;
+
+	while ((idx = __atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED)) < list->nfiles) {
+		file = &list->files[idx];
+		file->crc = inspect_crc(list->svd, file);
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_scan
+// Description  : checksum the listed files over a number of threads
+//
+// Inputs       : list - the files, threads - how many threads
+// Outputs      : 0 if every file could be read, -1 if not
+
+static int inspect_scan(HddInspectList *list, int threads) {
+	pthread_t workers[HDD_INSPECT_MAX_THREADS - 1];
+	struct timespec start, stop;
+	uint64_t bytes = 0;
+	uint32_t i, missing = 0;
+	int started;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (started = 0; started < threads - 1; started++) {
+		if (pthread_create(&workers[started], NULL, inspect_scan_worker, list)) {
+			break;
+		}
+	}
+	inspect_scan_worker(list);   // this thread helps too
+	while (started > 0) {
+		pthread_join(workers[--started], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	for (i = 0; i < list->nfiles; i++) {
+		if (inspect_missing(&list->files[i])) {
+			printf("%8s %10u %s (block %u missing)\n", "-", list->files[i].entry.size,
+					list->files[i].name, list->files[i].entry.bid);
+			missing++;
+		} else {
+			printf("%08x %10u %s\n", list->files[i].crc, list->files[i].entry.size, list->files[i].name);
+			bytes += list->files[i].entry.size;
+		}
+	}
+
+	secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_INSPECT : checksummed %u files (%llu bytes) in %.3fs over %d threads, %.1f MB/s",
+			list->nfiles - missing, (unsigned long long)bytes, secs, threads, bytes / secs / (1 << 20));
+	return((missing == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_write
+// Description  : write bytes to a host file at an offset
+//
+// Inputs       : fd - the host file, data/length - the bytes, at - where
+// Outputs      : 0 if successful, -1 on failure
+
+static int inspect_write(int fd, const uint8_t *data, uint32_t length, uint32_t at) {
+	uint32_t done = 0;
+	ssize_t wrote;
+
+	while (done < length) {
+		if ((wrote = pwrite(fd, data + done, length - done, (off_t)at + done)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return(-1);
+		}
+		done += wrote;
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_get
+// Description  : write a file's contents out of the mapping to a host file
+//                (a sparse one's chunks, its holes left as holes)
+//
+// Inputs       : svd - the content file, file - the file, out - the host file
+// Outputs      : 0 if successful, -1 on failure
+
+static int inspect_get(HddSvd *svd, const HddInspectFile *file, const char *out) {
+	uint32_t i;
+	int fd, r = 0;
+
+	if (inspect_missing(file)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_INSPECT : block %u of [%s] is missing", file->entry.bid, file->name);
+		return(-1);
+	}
+	if ((fd = open(out, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_INSPECT : open of [%s] failed [%s]", out, strerror(errno));
+		return(-1);
+	}
+	if (file->entry.capacity != HDD_SPARSE_CAPACITY) {
+		r = inspect_write(fd, file->data, file->entry.size, 0);
+	} else {
+		for (i = 0; (i < file->nchunks) && (r == 0); i++) {
+			r = inspect_write(fd, hdd_svd_block(svd, file->chunks[i].bid)->data, file->chunks[i].length,
+					file->chunks[i].index * HDD_SPARSE_CHUNK + file->chunks[i].start);
+		}
+		if (r == 0) {
+			r = ftruncate(fd, file->entry.size);
+		}
+	}
+	if (r == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_INSPECT : write of [%s] failed [%s]", out, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	return(close(fd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : inspect_blocks
+// Description  : summarize the blocks of the content file
+//
+// Inputs       : svd - the content file
+// Outputs      : 0
+
+static int inspect_blocks(HddSvd *svd) {
+	uint64_t bytes = 0;
+	uint32_t i, largest = 0;
+
+	for (i = 0; i < svd->count; i++) {
+		bytes += svd->blocks[i].size;
+		if (svd->blocks[i].size > largest) {
+			largest = svd->blocks[i].size;
+		}
+	}
+	printf("file bytes    : %zu\n", svd->length);
+	printf("next block ID : %u\n", svd->next_bid);
+	printf("blocks        : %u (%llu bytes, largest %u)\n", svd->count, (unsigned long long)bytes, largest);
+	if (svd->meta != NULL) {
+		printf("meta block    : %u (%u bytes)\n", svd->meta->bid, svd->meta->size);
+	} else {
+		printf("meta block    : none\n");
+	}
+	printf("files         : %u\n", hdd_dir_count());
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the content file inspector
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0, threads = sysconf(_SC_NPROCESSORS_ONLN), r = 0;
+	const char *path = HDD_SVD_FILE, *command, *arg;
+	HddInspectList list;
+	HddInspectFile *file, one = { 0 };
+	HddSvd svd;
+	uint64_t bytes;
+	uint32_t i;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, HDD_INSPECT_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'f': // The content file
+			path = optarg;
+			break;
+
+		case 'j': // Scan threads
+			if ((sscanf(optarg, "%d", &threads) != 1) || (threads < 1) || (threads > HDD_INSPECT_MAX_THREADS)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  thread count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		hdd_log_enable( LOG_INFO_LEVEL );
+	}
+	if ( optind >= argc ) {
+		fprintf( stderr, "Missing command, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+	command = argv[optind];
+	arg = (optind + 1 < argc) ? argv[optind + 1] : NULL;
+	if ((threads < 1) || (threads > HDD_INSPECT_MAX_THREADS)) {
+		threads = (threads < 1) ? 1 : HDD_INSPECT_MAX_THREADS;
+	}
+
+	// Map the file and mount the filesystem from it
+	if (hdd_svd_open(&svd, path)) {
+		return( -1 );
+	}
+	hdd_client_offline(hdd_svd_serve, &svd);
+	if (hdd_mount()) {
+		hdd_log( LOG_ERROR_LEVEL, "HDD_INSPECT : [%s] holds no filesystem that mounts", path );
+		hdd_svd_close(&svd);
+		return( -1 );
+	}
+
+	// Find the file (stat, get) or list the files (ls, scan) the command is about
+	memset(&list, 0x0, sizeof(list));
+	list.svd = &svd;
+	if ((strcmp(command, "stat") == 0) || (strcmp(command, "get") == 0)) {
+		if ((arg == NULL) || (hdd_dir_find(arg, &one.entry) != 1)) {
+			hdd_log( LOG_ERROR_LEVEL, "HDD_INSPECT : no file [%s]", (arg != NULL) ? arg : "" );
+			command = NULL;
+			r = -1;
+		} else {
+			one.name = (char *)arg;
+			inspect_data(&svd, &one);
+		}
+	} else if ((strcmp(command, "ls") == 0) || (strcmp(command, "scan") == 0)) {
+		list.pattern = arg;
+		if (hdd_dir_walk(inspect_add, &list) != 0) {
+			hdd_log( LOG_ERROR_LEVEL, "HDD_INSPECT : listing the files failed" );
+			command = NULL;
+			r = -1;
+		}
+	}
+
+	// Then carry it out
+	if (command == NULL) {
+		// failed above
+	} else if (strcmp(command, "blocks") == 0) {
+		r = inspect_blocks(&svd);
+	} else if (strcmp(command, "ls") == 0) {
+		for (i = 0; i < list.nfiles; i++) {
+			file = &list.files[i];
+			if (file->entry.capacity == HDD_SPARSE_CAPACITY) {
+				printf("%10u %10s %8u %s%s\n", file->entry.size, "sparse", file->entry.bid,
+						file->name, inspect_missing(file) ? " (block missing)" : "");
+			} else {
+				printf("%10u %10u %8u %s%s\n", file->entry.size, file->entry.capacity, file->entry.bid,
+						file->name, inspect_missing(file) ? " (block missing)" : "");
+			}
+		}
+	} else if (strcmp(command, "stat") == 0) {
+		printf("name     : %s\n", one.name);
+		printf("size     : %u\n", one.entry.size);
+		if (one.entry.capacity == HDD_SPARSE_CAPACITY) {
+			for (i = 0, bytes = 0; i < one.nchunks; i++) {
+				bytes += one.chunks[i].length;
+			}
+			printf("capacity : sparse, %u chunks holding %llu bytes\n", one.nchunks, (unsigned long long)bytes);
+		} else {
+			printf("capacity : %u\n", one.entry.capacity);
+		}
+		printf("block    : %u%s\n", one.entry.bid, inspect_missing(&one) ? " (missing)" : "");
+		if (one.entry.offset != 0) {
+			printf("packed   : at %u\n", one.entry.offset);
+		}
+		if (!inspect_missing(&one)) {
+			printf("crc32c   : %08x\n", inspect_crc(&svd, &one));
+		}
+	} else if (strcmp(command, "get") == 0) {
+		r = inspect_get(&svd, &one, (optind + 2 < argc) ? argv[optind + 2] : arg);
+	} else if (strcmp(command, "scan") == 0) {
+		r = inspect_scan(&list, threads);
+	} else {
+		fprintf( stderr, "Unknown command [%s], use -h to see usage, aborting.\n", command );
+		r = -1;
+	}
+
+	// Nothing is written back
+	for (i = 0; i < list.nfiles; i++) {
+		free(list.files[i].name);
+		free(list.files[i].chunks);
+	}
+	free(one.chunks);
+	free(list.files);
+	hdd_svd_close(&svd);
+	return( r );
+}
@@ -0,0 +1,236 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_log.c
+//  Description    : This is the HDD logging front end.  Synchronously it just
+//                   hands messages to the cmpsc311 log.  Asynchronously a
+//                   logger claims a ring slot by bumping the tail (a
+//                   compare-and-swap, no lock), formats the message into it
+//                   and publishes it through the slot's sequence number; the
+//                   writer thread takes the slots in order, writes them out
+//                   and hands them back a lap later.  A full ring makes
+//                   loggers wait rather than drop messages.
+//
+//  Author         :
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// Project Includes
+#include <hdd_log.h>
+
+// A message in the ring
+typedef struct {
+	uint64_t      seq;                        // lap position it is free at (+1 once filled)
+	unsigned long level;                      // the level it was logged at
+	char          text[MAX_LOG_MESSAGE_SIZE]; // the message, formatted
+} HddLogSlot;
+
+//
+// Global data
+
+unsigned long hdd_log_levels = DEFAULT_LOG_LEVEL;   // levels enabled now
+
+static HddLogSlot *log_ring = NULL;   // the ring (NULL while synchronous)
+static uint64_t log_tail = 0;         // next slot to claim (atomic)
+static uint64_t log_head = 0;         // next slot to write (writer only)
+static uint64_t log_written = 0;      // slots written so far (atomic)
+static int log_stopping = 0;          // the writer should finish (atomic)
+static sem_t log_ready;               // a post per message published (and to stop)
+static pthread_t log_writer;          // the background writer
+static int log_trace = 0;             // TRACE has been registered
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_log_enable
+// Description  : turn on log levels, registering TRACE when first asked for
+//
+// Inputs       : lvl - the levels
+// Outputs      : none
+
+void hdd_log_enable(unsigned long lvl) {
+	if ((lvl & HDD_LOG_TRACE_LEVEL) && !log_trace) {
+		if (registerLogLevel("TRACE", 0) != HDD_LOG_TRACE_LEVEL) {
+			lvl &= ~HDD_LOG_TRACE_LEVEL;   // it went to another bit, so leave it off
+		}
+		log_trace = 1;
+	}
+	enableLogLevels(lvl);
+	hdd_log_levels |= lvl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_writer_main
+// Description  : the background writer, writing the slots out in order
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *log_writer_main(void *arg) {
+	HddLogSlot *slot;
+
+	while (1) {
+		while ((sem_wait(&log_ready) == -1));   // (interrupted)
+
+		// The next slot may still be being filled by a logger that claimed it
+		// before the one that posted
+		slot = &log_ring[log_head % HDD_LOG_RING_SLOTS];
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1) {
+			if (__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE) &&
+					(log_head == __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE))) {
+				return(NULL);
+			}
+			sched_yield();
+		}
+
+		logMessage(slot->level, "%s", slot->text);
+		__atomic_store_n(&slot->seq, log_head + HDD_LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		log_head++;
+		__atomic_store_n(&log_written, log_head, __ATOMIC_RELEASE);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_enqueue
+// Description  : format a message into the next slot of the ring
+//
+// Inputs       : lvl - the level, fmt/args - the message
+// Outputs      : none
+
+static void log_enqueue(unsigned long lvl, const char *fmt, va_list args) {
+	uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED), seq;
+	HddLogSlot *slot;
+
+	while (1) {
+		slot = &log_ring[pos % HDD_LOG_RING_SLOTS];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;   // ours (pos was reloaded if not)
+			}
+		} else if (seq < pos) {
+			sched_yield();   // a lap behind, the ring is full
+			pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);   // taken meanwhile
+		}
+	}
+
+	slot->level = lvl;
+	vsnprintf(slot->text, MAX_LOG_MESSAGE_SIZE, fmt, args);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&log_ready);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_log_message
+// Description  : log a message at once, or through the ring when asynchronous
+//                (errors are written at once, after the queue drains)
+//
+// Inputs       : lvl - the level, fmt - printf format, ... - its arguments
+// Outputs      : 0
+
+int hdd_log_message(unsigned long lvl, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	if ((__atomic_load_n(&log_ring, __ATOMIC_ACQUIRE) != NULL) && !(lvl & LOG_ERROR_LEVEL)) {
+		log_enqueue(lvl, fmt, args);
+	} else {
+		hdd_log_flush();
+		vlogMessage(lvl, fmt, args);
+	}
+	va_end(args);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_log_async
+// Description  : start the background writer
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 on failure
+
+int hdd_log_async(void) {
+	HddLogSlot *ring;
+	uint64_t i;
+
+	if (log_ring != NULL) {
+		return(0);
+	}
+	if ((ring = malloc(sizeof(HddLogSlot) * HDD_LOG_RING_SLOTS)) == NULL) {
+		return(-1);
+	}
+	for (i = 0; i < HDD_LOG_RING_SLOTS; i++) {
+		ring[i].seq = i;
+	}
+	log_tail = log_head = log_written = 0;
+	log_stopping = 0;
+	if (sem_init(&log_ready, 0, 0) == -1) {
+		free(ring);
+		return(-1);
+	}
+	__atomic_store_n(&log_ring, ring, __ATOMIC_RELEASE);
+	if (pthread_create(&log_writer, NULL, log_writer_main, NULL) != 0) {
+		log_ring = NULL;   // (nothing was logged meanwhile, this is called at startup)
+		sem_destroy(&log_ready);
+		free(ring);
+		return(-1);
+	}
+	atexit(hdd_log_stop);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_log_flush
+// Description  : wait for the messages queued so far to be written
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_log_flush(void) {
+	uint64_t target = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&log_ring, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
+	while (__atomic_load_n(&log_written, __ATOMIC_ACQUIRE) < target) {
+		sched_yield();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_log_stop
+// Description  : drain the queue and stop the writer (loggers racing the
+//                stop must be done first, as at exit)
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_log_stop(void) {
+	HddLogSlot *ring = __atomic_load_n(&log_ring, __ATOMIC_ACQUIRE);
+
+	if (ring == NULL) {
+		return;
+	}
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&log_ready);
+	pthread_join(log_writer, NULL);
+	__atomic_store_n(&log_ring, NULL, __ATOMIC_RELEASE);
+	sem_destroy(&log_ready);
+	free(ring);
+}
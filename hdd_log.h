@@ -0,0 +1,61 @@
+#ifndef HDD_LOG_INCLUDED
+#define HDD_LOG_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_log.h
+//  Description    : This is the header file for the HDD logging front end to
+//                   the cmpsc311 log.  hdd_log() only evaluates its arguments
+//                   when the level is enabled, and levels left out of
+//                   HDD_LOG_BUILD_LEVELS compile to nothing.  Once
+//                   hdd_log_async() is called, messages are formatted into a
+//                   lock-free ring and written by a background thread;
+//                   errors are still written at once, after what is queued.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdarg.h>
+
+// Project include files
+#include <cmpsc311_log.h>
+
+// Defines
+#define HDD_LOG_TRACE_LEVEL 16          // per-request tracing (registered as "TRACE")
+#ifndef HDD_LOG_BUILD_LEVELS            // levels compiled in (make LOGFLAGS=-DHDD_LOG_BUILD_LEVELS=11 drops INFO)
+#define HDD_LOG_BUILD_LEVELS (LOG_ERROR_LEVEL|LOG_WARNING_LEVEL|LOG_INFO_LEVEL|LOG_OUTPUT_LEVEL)
+#endif
+#define HDD_LOG_RING_SLOTS 512          // messages the ring holds before loggers wait
+
+// Levels enabled now (kept in step with the cmpsc311 log by hdd_log_enable)
+extern unsigned long hdd_log_levels;
+
+// Log a printf-style message, the arguments untouched unless "lvl" is on
+#define hdd_log(lvl, ...) \
+	do { \
+		if (((lvl) & HDD_LOG_BUILD_LEVELS) && ((lvl) & hdd_log_levels)) { \
+			hdd_log_message((lvl), __VA_ARGS__); \
+		} \
+	} while (0)
+
+//
+// Functional Prototypes
+
+void hdd_log_enable(unsigned long lvl);
+	// Turn on the levels "lvl" (use instead of enableLogLevels)
+
+int hdd_log_message(unsigned long lvl, const char *fmt, ...);
+	// Log a message at once or through the ring (call through hdd_log)
+
+int hdd_log_async(void);
+	// Start the background writer, 0 if successful, -1 on failure (logging
+	// stays synchronous); the queue is drained at exit
+
+void hdd_log_flush(void);
+	// Wait until every message queued so far is written
+
+void hdd_log_stop(void);
+	// Drain the queue, stop the writer and go back to writing at once
+
+#endif
@@ -11,6 +11,7 @@
 //
 
 // Include Files
+#include <stdint.h>
 
 // Project Include Files
 #include <hdd_driver.h>
@@ -21,14 +22,144 @@
 #define HDD_DEFAULT_IP "127.0.0.1"
 #define HDD_DEFAULT_PORT 19876
 
+// A request to the server, for callers that pipeline (post now, wait later)
+typedef struct {
+    HddBitCmd  cmd;     // The command
+    uint32_t   offset;  // Byte offset of HDD_RANGE commands
+    void      *buf;     // The payload to send or the buffer to receive into
+    uint32_t   crc;     // The block checksum (sent on writes, received on reads)
+    HddBitResp resp;    // The response, once done
+    int        done;    // Set when the response has arrived
+    int        discard; // Nobody waits for it: freed (with its buffer) once it arrives
+    struct HddFlight *flight;  // The identical read it leads or shares, if any
+} HddClientRequest;
+
+// Read latency and hedging, so far (see hdd_client_read_stats)
+typedef struct {
+    uint64_t reads;       // Synchronous reads timed
+    uint64_t hedged;      // Reads duplicated to a second replica
+    uint64_t hedge_wins;  // Of those, answered first by the second
+    uint64_t stale;       // Replicas dropped for answering a write differently
+    uint64_t coalesced;   // Reads answered by an identical one already on the wire
+    uint32_t p50_us;      // Read latency percentiles (us, to within 1/16)
+    uint32_t p95_us;
+    uint32_t p99_us;
+} HddClientReadStats;
+
+// Answers a request without a server (see hdd_client_offline)
+typedef HddBitResp (*HddClientServe)(void *ctx, HddClientRequest *req);
+
+// Waits for a socket to be ready in place of blocking on it (see
+// hdd_client_waiter): "fd" with POLLIN or POLLOUT, or -1 and 0 to just let
+// others run a while; 0 once it may be ready, -1 to give up
+typedef int (*HddClientWaiter)(int fd, int events);
+
+// A connection to a server and its pipeline (see hdd_client_use), or to
+// every shard or replica (see hdd_client_shards, hdd_client_replicas)
+#define HDD_CLIENT_MAX_PENDING 16   // posted requests in flight
+#define HDD_CLIENT_MAX_PEERS 16     // endpoints a connection spreads or copies blocks over
+#define HDD_SHARD_VNODES 64         // points each endpoint has on the placement ring
+#define HDD_SHARD_SHIFT 28          // block IDs carry their shard's index from this bit up
+#define HDD_SHARD_BID_MASK ((1u << HDD_SHARD_SHIFT) - 1)   // the block ID the shard knows
+#define HDD_HEDGE_SAMPLES 256       // recent read latencies the hedge delay is taken from
+#define HDD_HEDGE_WARMUP 32         // reads before any is hedged
+#define HDD_HEDGE_UPDATE 16         // reads between working the delay out again
+#define HDD_HEDGE_PERCENTILE 95     // default percentile of them a read waits before hedging
+#define HDD_HEDGE_MIN_US 200        // default least wait before hedging (us)
+typedef struct HddConnection {
+    int               sfd;          // Socket file descriptor (-1 if not connected)
+    const char       *address;      // Server address (NULL for hdd_network_address or the default)
+    unsigned short    port;         // Server port (0 for hdd_network_port or the default)
+    uint32_t          caps;         // Extensions granted by the server at INIT
+    HddClientRequest *pending[HDD_CLIENT_MAX_PENDING];  // Posted requests, oldest first
+    int               npending;     // Number of posted requests
+    HddClientServe    offline;      // Answers requests instead of a server, if set
+    void             *offline_ctx;  // And what it answers from
+    struct HddConnection *peer;     // Its connection to each shard or replica, NULL if neither
+    int               npeers;       // Number of them
+    int               shard_index;  // Which shard this connection is to, -1 if not one
+    uint32_t          place;        // Hash of what the next new block belongs to
+    int               placed;       // Set when "place" is for the next new block
+    int               stale;        // Set when this replica missed or differed on a write
+    int               reader;       // The replica reads go to first
+    uint32_t          lat[HDD_HEDGE_SAMPLES];  // Recent read latencies (us), a ring
+    uint32_t          nlat;         // Reads timed so far
+    uint32_t          hedge_us;     // How long a read waits before hedging (0 until warmed up)
+    HddClientRequest *follow[HDD_CLIENT_MAX_PENDING];  // Posted reads sharing another's
+    int               nfollow;      // Number of them
+} HddConnection;
+#define HDD_CONNECTION_INIT { .sfd = -1, .shard_index = -1 }
+
 //
-// Functional Prototypes
+// Functional Prototypes (each client thread has its own connection, made
+// by its HDD_INIT, and its own pipeline)
 HddBitResp hdd_client_operation(HddBitCmd cmd, void *buf);
     // This is the implementation of the client operation (hdd_client.c)
 
+HddBitResp hdd_client_request(HddClientRequest *req);
+    // Send a request and wait for its response
+
+int hdd_client_post(HddClientRequest *req);
+    // Send a request without waiting; 0 if sent, -1 on failure
+
+HddBitResp hdd_client_wait(HddClientRequest *req);
+    // Wait for the response to a posted request
+
+HddBitResp hdd_client_checked_operation(HddBitCmd cmd, void *buf, uint32_t *crc);
+    // As above, also exchanging the block checksum when HDD_CAP_CHECKSUM was
+    // granted: *crc is sent with CREATE/OVERWRITE and filled in on READ
+
+uint32_t hdd_client_capabilities(void);
+    // The HDD_CAP_* extensions granted by the server at HDD_INIT
+
+int hdd_client_disconnect(void);
+    // Close the connection without HDD_SAVE_AND_CLOSE; 0 if closed, -1 if none
+
+void hdd_client_offline(HddClientServe serve, void *ctx);
+    // Have "serve" answer requests in place of a server (NULL to undo)
+
+HddClientWaiter hdd_client_waiter(HddClientWaiter wait);
+    // Have the calling thread's waits on its sockets (and on reads it shares)
+    // call "wait" instead of blocking, for a scheduler of coroutines sharing
+    // the thread (NULL to block again); returns the one set before
+
+HddConnection *hdd_client_use(HddConnection *conn);
+    // Send the calling thread's requests over "conn" (NULL for the thread's
+    // own connection); returns the one used before (NULL if its own)
+
+int hdd_client_shards(int n, const char **addresses, const unsigned short *ports);
+    // Spread the blocks of connections that name no server over "n"
+    // endpoints (0 for a single server again), shard 0 holding the
+    // metadata; call before connecting.  0 if successful, -1 on failure
+
+int hdd_client_replicas(int n, const char **addresses, const unsigned short *ports);
+    // Copy the blocks of connections that name no server to each of "n"
+    // endpoints (0 for a single server again): writes go to all of them,
+    // reads to one, hedged to another when slow; call before connecting.
+    // 0 if successful, -1 on failure
+
+void hdd_client_hedge(int percentile, uint32_t min_us);
+    // Hedge a replica read once it has waited "percentile" of the recent
+    // read latencies, and at least "min_us" (percentile 0 never hedges)
+
+void hdd_client_read_stats(HddClientReadStats *stats);
+    // The read latency percentiles, hedging and coalescing counts so far, of
+    // all threads
+
+void hdd_client_place(const char *key);
+    // Name what the thread's next new block belongs to (its file), which
+    // picks its shard by consistent hashing
+
 int hdd_server( void );
     // This is the implementation of the server application (hdd_server.c)
 
+//
+// Unit testing for the module
+
+int hddClientUnitTest(void);
+    // Check shard placement and routing, replica staleness and hedging,
+    // and the sharing of identical reads
+
 //
 // Network Global Data
 extern int            hdd_network_shutdown; // Flag indicating shutdown
@@ -0,0 +1,474 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_pool.c
+//  Description    : This is the implementation of the HDD buffer pool.  Each
+//                   buffer carries a small header with its size class; a
+//                   freed buffer goes on the calling thread's list for its
+//                   class (no locking) until the thread keeps too many, and
+//                   the next allocation of the class takes it from there.
+//
+//  Author         :
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+// Project Includes
+#include <hdd_pool.h>
+#include <hdd_driver.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define HDD_POOL_CLASSES (HDD_POOL_MAX_SHIFT - HDD_POOL_MIN_SHIFT + 1)
+#define HDD_POOL_UNPOOLED HDD_POOL_CLASSES   // class of buffers too big to keep
+#define HDD_POOL_MAGIC 0x4850                // marks a header as ours
+#define HDD_POOL_BENCH_BYTES (256 << 20)     // bytes to allocate per benchmark row
+
+// Header in front of every buffer (16 bytes, keeps the buffer aligned)
+typedef struct HddPoolHeader {
+	struct HddPoolHeader *next;   // next buffer in a cache list
+	uint32_t size;                // bytes usable after the header
+	uint16_t cls;                 // size class, HDD_POOL_UNPOOLED if none
+	uint16_t magic;               // HDD_POOL_MAGIC
+} HddPoolHeader;
+
+// A thread's cached buffers and counters (only the thread changes them, the
+// counters and bytes with relaxed atomic stores so hdd_pool_stats can read them)
+typedef struct HddPoolCache {
+	HddPoolHeader *head[HDD_POOL_CLASSES];   // free buffers of each class
+	int count[HDD_POOL_CLASSES];             // buffers in each list
+	uint64_t bytes;                          // bytes in all of them
+	uint64_t allocations;                    // buffers handed out by the thread
+	uint64_t reused;                         // of those, from the cache
+	uint64_t released;                       // buffers the thread gave back to the system
+	int registered;                          // on the list of caches
+	struct HddPoolCache *next;               // next cache on the list
+} HddPoolCache;
+
+//
+// Global data
+
+static __thread HddPoolCache hdd_pool_cache __attribute__((tls_model("initial-exec")));   // the calling thread's cache
+static HddPoolCache *hdd_pool_caches = NULL;           // caches of the running threads
+static HddPoolStats hdd_pool_retired;                  // counters of the threads that exited
+static pthread_mutex_t hdd_pool_lock = PTHREAD_MUTEX_INITIALIZER;   // guards the two above
+static pthread_key_t hdd_pool_key;                     // drains a cache at thread exit
+static pthread_once_t hdd_pool_once = PTHREAD_ONCE_INIT;
+static uint64_t hdd_pool_held = 0;                     // bytes of all buffers, in use or cached
+static uint64_t hdd_pool_peak = 0;                     // most that ever was
+
+//
+// Local functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_count
+// Description  : add to a counter of the calling thread (the store is atomic
+//                for readers, the thread is the only writer)
+//
+// Inputs       : counter - the counter, value - amount to add
+// Outputs      : none
+
+static void hdd_pool_count(uint64_t *counter, int64_t value) {
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_hold
+// Description  : account for buffers got from or given back to the system,
+//                the only times the memory the pool holds changes
+//
+// Inputs       : bytes - bytes got (positive) or given back (negative)
+// Outputs      : none
+
+static void hdd_pool_hold(int64_t bytes) {
+	uint64_t held = __atomic_add_fetch(&hdd_pool_held, bytes, __ATOMIC_RELAXED);
+	uint64_t peak = __atomic_load_n(&hdd_pool_peak, __ATOMIC_RELAXED);
+
+	while ((held > peak) && !__atomic_compare_exchange_n(&hdd_pool_peak, &peak, held, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// peak was reloaded, try again
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_class
+// Description  : the size class holding "size" bytes
+//
+// Inputs       : size - bytes wanted
+// Outputs      : the class, HDD_POOL_UNPOOLED if it is larger than all of them
+
+static int hdd_pool_class(size_t size) {
+	int shift;
+
+	if (size <= ((size_t)1 << HDD_POOL_MIN_SHIFT)) {
+		return(0);
+	}
+	shift = 64 - __builtin_clzll(size - 1);
+	return((shift > HDD_POOL_MAX_SHIFT) ? HDD_POOL_UNPOOLED : shift - HDD_POOL_MIN_SHIFT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_thread_exit / hdd_pool_key_init / hdd_pool_register
+// Description  : drain the cache of an exiting thread and fold its counters
+//                into the retired ones, set up the key that calls it, put
+//                the calling thread's cache on the list
+//
+// Inputs       : arg - the thread's cache
+// Outputs      : none
+
+static void hdd_pool_thread_exit(void *arg) {
+	HddPoolCache *cache = arg, **link;
+
+	hdd_pool_drain();
+	pthread_mutex_lock(&hdd_pool_lock);
+	for (link = &hdd_pool_caches; *link != NULL; link = &(*link)->next) {
+		if (*link == cache) {
+			*link = cache->next;
+			break;
+		}
+	}
+	hdd_pool_retired.allocations += cache->allocations;
+	hdd_pool_retired.reused += cache->reused;
+	hdd_pool_retired.released += cache->released;
+	pthread_mutex_unlock(&hdd_pool_lock);
+}
+
+static void hdd_pool_key_init(void) {
+	pthread_key_create(&hdd_pool_key, hdd_pool_thread_exit);
+}
+
+static void hdd_pool_register(HddPoolCache *cache) {
+	pthread_once(&hdd_pool_once, hdd_pool_key_init);
+	pthread_mutex_lock(&hdd_pool_lock);
+	cache->next = hdd_pool_caches;
+	hdd_pool_caches = cache;
+	pthread_mutex_unlock(&hdd_pool_lock);
+	pthread_setspecific(hdd_pool_key, cache);   // so the cache is drained at thread exit
+	cache->registered = 1;
+}
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_alloc
+// Description  : get a buffer, from the thread's cache if it has one
+//
+// Inputs       : size - bytes wanted
+// Outputs      : the buffer, NULL on failure
+
+void *hdd_pool_alloc(size_t size) {
+	HddPoolCache *cache = &hdd_pool_cache;
+	HddPoolHeader *hdr;
+	int cls = hdd_pool_class(size);
+
+	if (!cache->registered) {
+		hdd_pool_register(cache);
+	}
+
+	if ((cls != HDD_POOL_UNPOOLED) && ((hdr = cache->head[cls]) != NULL)) {
+		cache->head[cls] = hdr->next;
+		cache->count[cls]--;
+		hdd_pool_count(&cache->bytes, -(int64_t)hdr->size);
+		hdd_pool_count(&cache->reused, 1);
+	} else {
+		size_t bytes = (cls == HDD_POOL_UNPOOLED) ? size : ((size_t)1 << (cls + HDD_POOL_MIN_SHIFT));
+
+		if ((hdr = malloc(sizeof(HddPoolHeader) + bytes)) == NULL) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_POOL : out of memory for a %lu byte buffer", (unsigned long)size);
+			return(NULL);
+		}
+		hdr->size = bytes;
+		hdr->cls = cls;
+		hdr->magic = HDD_POOL_MAGIC;
+		hdd_pool_hold(bytes);
+	}
+	hdr->next = NULL;
+	hdd_pool_count(&cache->allocations, 1);
+
+	return(&hdr[1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_calloc
+// Description  : get a zero filled buffer
+//
+// Inputs       : size - bytes wanted
+// Outputs      : the buffer, NULL on failure
+
+void *hdd_pool_calloc(size_t size) {
+	void *buf = hdd_pool_alloc(size);
+
+	if (buf != NULL) {
+		memset(buf, 0x0, size);
+	}
+	return(buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_free
+// Description  : give a buffer back, to the thread's cache if it has room
+//
+// Inputs       : buf - the buffer (or NULL)
+// Outputs      : none
+
+void hdd_pool_free(void *buf) {
+	HddPoolCache *cache = &hdd_pool_cache;
+	HddPoolHeader *hdr;
+
+	if (buf == NULL) {
+		return;
+	}
+	hdr = (HddPoolHeader *)buf - 1;
+	CMPSC_ASSERT1(hdr->magic == HDD_POOL_MAGIC, "HDD_POOL : freeing a buffer not from the pool [%p]", buf);
+
+	if (!cache->registered) {
+		hdd_pool_register(cache);
+	}
+
+	if ((hdr->cls == HDD_POOL_UNPOOLED) || (cache->count[hdr->cls] >= HDD_POOL_CACHE_DEPTH) ||
+			(cache->bytes + hdr->size > HDD_POOL_CACHE_BYTES)) {
+		hdd_pool_hold(-(int64_t)hdr->size);
+		hdd_pool_count(&cache->released, 1);
+		free(hdr);
+		return;
+	}
+
+	hdr->next = cache->head[hdr->cls];
+	cache->head[hdr->cls] = hdr;
+	cache->count[hdr->cls]++;
+	hdd_pool_count(&cache->bytes, hdr->size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_drain
+// Description  : free the buffers in the calling thread's cache
+//
+// Inputs       : none
+// Outputs      : none
+
+void hdd_pool_drain(void) {
+	HddPoolCache *cache = &hdd_pool_cache;
+	HddPoolHeader *hdr;
+	int i;
+
+	for (i = 0; i < HDD_POOL_CLASSES; i++) {
+		while ((hdr = cache->head[i]) != NULL) {
+			cache->head[i] = hdr->next;
+			hdd_pool_count(&cache->bytes, -(int64_t)hdr->size);
+			hdd_pool_count(&cache->released, 1);
+			hdd_pool_hold(-(int64_t)hdr->size);
+			free(hdr);
+		}
+		cache->count[i] = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_stats
+// Description  : add up the pool counters of all the threads
+//
+// Inputs       : stats - where they go
+// Outputs      : none
+
+void hdd_pool_stats(HddPoolStats *stats) {
+	HddPoolCache *cache;
+
+	pthread_mutex_lock(&hdd_pool_lock);
+	*stats = hdd_pool_retired;
+	for (cache = hdd_pool_caches; cache != NULL; cache = cache->next) {
+		stats->allocations += __atomic_load_n(&cache->allocations, __ATOMIC_RELAXED);
+		stats->reused += __atomic_load_n(&cache->reused, __ATOMIC_RELAXED);
+		stats->released += __atomic_load_n(&cache->released, __ATOMIC_RELAXED);
+		stats->cached_bytes += __atomic_load_n(&cache->bytes, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&hdd_pool_lock);
+
+	stats->peak_bytes = __atomic_load_n(&hdd_pool_peak, __ATOMIC_RELAXED);
+	stats->in_use_bytes = __atomic_load_n(&hdd_pool_held, __ATOMIC_RELAXED);
+	stats->in_use_bytes = (stats->in_use_bytes > stats->cached_bytes) ? stats->in_use_bytes - stats->cached_bytes : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_pool_thread_test
+// Description  : allocate and free in another thread, which exits with a
+//                full cache
+//
+// Inputs       : arg - unused
+// Outputs      : NULL
+
+static void *hdd_pool_thread_test(void *arg) {
+	void *bufs[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		bufs[i] = hdd_pool_alloc(4096);
+	}
+	for (i = 0; i < 4; i++) {
+		hdd_pool_free(bufs[i]);
+	}
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddPoolUnitTest
+// Description  : check buffer sizes, reuse and the counters
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddPoolUnitTest(void) {
+
+	// Local variables
+	const size_t sizes[] = { 1, 64, 65, 4096, 5000, HDD_MAX_BLOCK_SIZE };
+	const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	HddPoolStats before, after;
+	void *bufs[6], *again[6];
+	uint8_t *zero;
+	pthread_t thread;
+	int i;
+
+	// Buffers of each size are usable, and come back out of the cache
+	hdd_pool_stats(&before);
+	for (i = 0; i < nsizes; i++) {
+		if ((bufs[i] = hdd_pool_alloc(sizes[i])) == NULL) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : allocation of %lu failed", (unsigned long)sizes[i]);
+			return(-1);
+		}
+		memset(bufs[i], 0xa5, sizes[i]);
+	}
+	for (i = nsizes - 1; i >= 0; i--) {
+		hdd_pool_free(bufs[i]);
+	}
+	for (i = 0; i < nsizes; i++) {
+		again[i] = hdd_pool_alloc(sizes[i]);
+	}
+	hdd_pool_stats(&after);
+	for (i = 0; i < nsizes; i++) {
+		// 1 and 64 share a class, its list is last in, first out
+		if (again[i] != bufs[i]) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : size %lu not reused from the cache", (unsigned long)sizes[i]);
+			return(-1);
+		}
+	}
+	if ((after.allocations - before.allocations != 2 * nsizes) || (after.reused - before.reused != nsizes)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : bad counters [%lu allocations, %lu reused]",
+			(unsigned long)(after.allocations - before.allocations), (unsigned long)(after.reused - before.reused));
+		return(-1);
+	}
+	for (i = 0; i < nsizes; i++) {
+		hdd_pool_free(again[i]);
+	}
+
+	// A reused buffer from calloc is zero filled
+	zero = hdd_pool_calloc(4096);
+	for (i = 0; i < 4096; i++) {
+		if (zero[i] != 0) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : calloc buffer not zero filled");
+			return(-1);
+		}
+	}
+	hdd_pool_free(zero);
+
+	// Too big to pool: goes straight back to the system
+	hdd_pool_stats(&before);
+	hdd_pool_free(hdd_pool_alloc((size_t)4 << HDD_POOL_MAX_SHIFT));
+	hdd_pool_stats(&after);
+	if ((after.released != before.released + 1) || (after.cached_bytes != before.cached_bytes)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : oversized buffer was cached");
+		return(-1);
+	}
+
+	// Another thread's cache is drained when it exits, and so is ours on request
+	hdd_pool_stats(&before);
+	if (pthread_create(&thread, NULL, hdd_pool_thread_test, NULL) || pthread_join(thread, NULL)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : thread failed");
+		return(-1);
+	}
+	hdd_pool_stats(&after);
+	if (after.cached_bytes != before.cached_bytes) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : exiting thread left its cache behind");
+		return(-1);
+	}
+	hdd_pool_drain();
+	hdd_pool_stats(&after);
+	if (after.cached_bytes != 0) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_POOL_UTEST : drain left %lu bytes cached", (unsigned long)after.cached_bytes);
+		return(-1);
+	}
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_POOL_UTEST : %lu allocations, %lu reused, peak %lu bytes",
+		(unsigned long)after.allocations, (unsigned long)after.reused, (unsigned long)after.peak_bytes);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hddPoolBenchmark
+// Description  : time allocating, touching and freeing buffers of typical
+//                sizes with malloc/free and with the pool
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hddPoolBenchmark(void) {
+
+	// Local variables
+	const uint32_t sizes[] = { 64, 4096, 65536, HDD_MAX_BLOCK_SIZE };
+	const char *names[] = { "malloc", "pool" };
+	struct timespec start, stop;
+	volatile uint8_t *buf;
+	HddPoolStats stats;
+	double secs;
+	long iters, k;
+	uint32_t off;
+	int i, j;
+
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_POOL_BENCH : %-8s %10s %12s", "impl", "size", "ns/buffer");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		iters = HDD_POOL_BENCH_BYTES / sizes[i];
+		if (iters > 1000000) {
+			iters = 1000000;
+		}
+		for (j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (k = 0; k < iters; k++) {
+				buf = (j == 0) ? malloc(sizes[i]) : hdd_pool_alloc(sizes[i]);
+				for (off = 0; off < sizes[i]; off += 4096) {
+					buf[off] = k;   // touch every page, as filling it would
+				}
+				if (j == 0) {
+					free((void *)buf);
+				} else {
+					hdd_pool_free((void *)buf);
+				}
+			}
+			clock_gettime(CLOCK_MONOTONIC, &stop);
+			secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+			hdd_log(LOG_OUTPUT_LEVEL, "HDD_POOL_BENCH : %-8s %10u %12.1f", names[j], sizes[i], secs * 1e9 / iters);
+		}
+	}
+
+	hdd_pool_stats(&stats);
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_POOL_BENCH : %lu allocations, %lu reused, peak %lu bytes pooled",
+		(unsigned long)stats.allocations, (unsigned long)stats.reused, (unsigned long)stats.peak_bytes);
+	hdd_pool_drain();
+	return(0);
+}
@@ -0,0 +1,64 @@
+#ifndef HDD_POOL_INCLUDED
+#define HDD_POOL_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_pool.h
+//  Description    : This is the header file for the HDD buffer pool, which
+//                   recycles the I/O buffers of the client through per
+//                   thread caches of power of two size classes.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdint.h>
+#include <stddef.h>
+
+// Defines
+#define HDD_POOL_MIN_SHIFT 6                // smallest class, 64 bytes
+#define HDD_POOL_MAX_SHIFT 20               // largest class, 1MB (holds any block)
+#define HDD_POOL_CACHE_DEPTH 8              // buffers a thread keeps per class
+#define HDD_POOL_CACHE_BYTES (16 << 20)     // bytes a thread keeps in all classes
+
+// Pool counters (see hdd_pool_stats)
+typedef struct {
+	uint64_t allocations;        // buffers handed out
+	uint64_t reused;             // of those, taken from a cache (mallocs avoided)
+	uint64_t released;           // buffers given back to the system
+	uint64_t in_use_bytes;       // bytes of the buffers handed out now
+	uint64_t cached_bytes;       // bytes of the buffers waiting in caches now
+	uint64_t peak_bytes;         // most bytes ever held, in use plus cached
+} HddPoolStats;
+
+//
+// Functional Prototypes
+
+void *hdd_pool_alloc(size_t size);
+	// A buffer of at least "size" bytes (NULL on failure), from the calling
+	// thread's cache when it has one of the size class
+
+void *hdd_pool_calloc(size_t size);
+	// Same as hdd_pool_alloc, zero filled
+
+void hdd_pool_free(void *buf);
+	// Give back a buffer from hdd_pool_alloc (any thread, NULL is ignored),
+	// kept in the calling thread's cache unless it is full
+
+void hdd_pool_drain(void);
+	// Return the calling thread's cached buffers to the system (done for a
+	// thread when it exits)
+
+void hdd_pool_stats(HddPoolStats *stats);
+	// Copies out the pool counters
+
+//
+// Unit testing and benchmarking for the module
+
+int hddPoolUnitTest(void);
+	// Check buffer sizes, reuse and the counters
+
+int hddPoolBenchmark(void);
+	// Compare pool and malloc/free cost for typical buffer sizes
+
+#endif
@@ -0,0 +1,102 @@
+#!/bin/bash
+#
+#  File          : hdd_replica_bench.sh
+#  Description   : Tail latency harness for replicated reads.  It starts
+#                  hdd_standin servers that stall a share of their reads (a
+#                  slow disk), writes a set of files and reads them back
+#                  over and over, first from one server (nothing to hedge
+#                  to), then from replicas with hedging off and on, and
+#                  prints the read latency percentiles of each run.  Hedging
+#                  should pull p99 down to near the un-stalled latency while
+#                  the stall rate is below the hedging percentile's tail.
+#
+#  Usage         : hdd_replica_bench.sh [-n <replicas>] [-f <files>]
+#                                       [-r <rounds>] [-s <percent>:<ms>]
+#                                       [-H <pct>[:<us>]] [-p <first port>]
+#
+
+# Defaults
+REPLICAS=2
+FILES=50
+ROUNDS=20
+STALL=2:20
+HEDGE=95
+PORT=20200
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+while getopts "n:f:r:s:H:p:h" opt; do
+	case $opt in
+	n) REPLICAS=$OPTARG ;;
+	f) FILES=$OPTARG ;;
+	r) ROUNDS=$OPTARG ;;
+	s) STALL=$OPTARG ;;
+	H) HEDGE=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	*) sed -n '/^#  Usage/,/^#$/p' "$0"; exit 1 ;;
+	esac
+done
+
+WORK=$(mktemp -d /tmp/hdd_replica_bench.XXXXXX)
+PIDS=""
+
+# Stop the servers and drop the work directory however we leave
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2> /dev/null
+	wait 2> /dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# The workload: format, write every file, then read each back ROUNDS times
+# (a one byte write first each time, so the read isn't answered from what
+# the client already holds)
+{
+	echo "x FORMAT 0 0:"
+	for ((i = 0; i < FILES; i++)); do
+		DATA=$(head -c 800 /dev/urandom | base64 -w 0 | head -c $((500 + RANDOM % 500)))
+		echo "file$i.txt WRITE ${#DATA} 0 :$DATA"
+	done
+	for ((r = 0; r < ROUNDS; r++)); do
+		for ((i = 0; i < FILES; i++)); do
+			echo "file$i.txt WRITEAT 1 0 :$((r % 10))"
+			echo "file$i.txt SEEK 0 0 :"
+			echo "file$i.txt READ 500 0 :"
+		done
+	done
+	echo "x UNMOUNT 0 0:"
+} > "$WORK/workload.txt"
+
+# One run: start n stalled servers, replay, report the client's latencies
+run() {
+	local label=$1 n=$2 hedge=$3 list="" i
+
+	PIDS=""
+	for ((i = 0; i < n; i++)); do
+		mkdir -p "$WORK/$label/$i"
+		(cd "$WORK/$label/$i" && exec "$HERE/hdd_standin" -s "$STALL" -p $((PORT + i)) > server.log 2>&1) &
+		PIDS="$PIDS $!"
+		list="$list,127.0.0.1:$((PORT + i))"
+	done
+	list=${list#,}
+	sleep 0.5
+
+	if ! "$HERE/hdd_client" -v -r "$list" -H "$hedge" "$WORK/workload.txt" > "$WORK/$label.log" 2>&1; then
+		echo "$label run failed (see $WORK)"; trap - EXIT; exit 1
+	fi
+	sed -n 's/.*read latency p50 \([0-9]*\) us, p95 \([0-9]*\) us, p99 \([0-9]*\) us over \([0-9]*\).*/\1 \2 \3 \4/p' \
+		"$WORK/$label.log" > "$WORK/$label.lat"
+	sed -n 's/.*hedged \([0-9]*\), won by the hedge \([0-9]*\).*/\1 \2/p' "$WORK/$label.log" > "$WORK/$label.hedge"
+	read p50 p95 p99 reads < "$WORK/$label.lat"
+	read hedged won < "$WORK/$label.hedge"
+	printf "%-16s %8d %8d %8d %8d %8d %8d\n" "$label" "$reads" "$p50" "$p95" "$p99" "$hedged" "$won"
+
+	kill $PIDS 2> /dev/null
+	wait 2> /dev/null
+	PIDS=""
+}
+
+echo "stalling $STALL (percent:ms) of reads on every server"
+printf "%-16s %8s %8s %8s %8s %8s %8s\n" run reads "p50 us" "p95 us" "p99 us" hedged won
+run single 1 0
+run replicas $REPLICAS 0
+run hedged $REPLICAS "$HEDGE"
@@ -0,0 +1,899 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_server.c
+//  Description   : This is a stand-in for the HDD server.  It speaks the
+//                  same HddBitCmd protocol and reads/writes the same
+//                  hdd_content.svd layout as the reference hdd_server, and
+//                  also implements the optional HDD_CAP_* extensions.
+//                  Clients are served at the same time, each on a thread.
+//
+//                  hdd_content.svd layout (little endian):
+//
+//                    uint32_t next block ID, uint32_t block count, then for
+//                    each block: uint32_t ID, uint8_t meta flag,
+//                    uint32_t size, size bytes of contents
+//
+//                  (the meta blocks of namespaces, HDD_CAP_NAMESPACE, have
+//                  meta flag 2 and the namespace's number as their ID)
+//
+//  Author        :
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Project Include Files
+#include <hdd_network.h>
+#include <hdd_driver.h>
+#include <hdd_crc.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+#include <cmpsc311_util.h>
+#include <hdd_htable.h>
+
+// Defines
+#define HDD_SERVER_ARGUMENTS "hvl:p:s:"
+#define HDD_SERVER_CAPS (HDD_CAP_CHECKSUM|HDD_CAP_RANGE_READ|HDD_CAP_RANGE_WRITE|HDD_CAP_RESIZE|HDD_CAP_NAMESPACE)   // extensions this server grants
+#define HDD_CONTENT_FILE "hdd_content.svd"
+#define HDD_FIRST_BLOCK_ID 4096
+#define HDD_NAMESPACE_META 2             // meta flag of a namespace's meta block (stored under the namespace's number)
+#define HDD_SERVER_HASH_BITS 12          // starting size of the block index (it grows)
+#define HDD_SERVER_BACKLOG 128           // connections waiting to be accepted (a bulk transfer opens one per worker)
+#define USAGE \
+	"USAGE: hdd_standin [-h] [-v] [-l <logfile>] [-p <port>] [-s <percent>:<ms>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -p - port number to listen on.\n" \
+	"    -s - stall <percent> of reads for <ms> milliseconds (a slow disk, for testing;\n" \
+	"         identical reads arriving meanwhile share the stalled one)\n" \
+	"\n" \
+
+// This is a stored block
+typedef struct {
+	HddBlockID bid;    // The block ID
+	uint8_t    meta;   // 1 if this is the meta block, HDD_NAMESPACE_META a namespace's
+	uint32_t   size;   // The size of the block contents
+	uint32_t   crc;    // The CRC32C of the contents
+	char      *data;   // The block contents
+} HddServerBlock;
+
+// A block read under way, whose answer identical reads arriving meanwhile share
+typedef struct HddServerRead {
+	HddBlockID bid;       // The block read
+	int        flags;     // How (whole, range, meta)
+	uint32_t   offset;    // Where from
+	uint32_t   size;      // And how much
+	int        done;      // The answer below is worked out
+	int        live;      // The reader still holds the blocks, so the answer is good
+	int        refs;      // Connections holding it (the reader and those waiting)
+	HddServerBlock *blk;  // The answer: the block (NULL if the read failed)
+	uint32_t   length;    // Bytes of it sent
+	uint32_t   crc;       // Their checksum
+	int        has_crc;   // The checksum was worked out
+	struct HddServerRead *next;
+} HddServerRead;
+
+//
+// Global Data
+
+static HddHTable       hdd_blocks;                     // block ID -> HddServerBlock
+static HddServerBlock *hdd_meta = NULL;                // The meta block (if any)
+static HddBlockID      hdd_next_bid = HDD_FIRST_BLOCK_ID;  // Next block ID to hand out
+static int             hdd_loaded = 0;                 // Content has been loaded
+static pthread_rwlock_t hdd_lock = PTHREAD_RWLOCK_INITIALIZER;  // Reads share the blocks, anything else has them alone
+static int             hdd_stall_percent = 0;          // Reads stalled (-s), none by default
+static int             hdd_stall_ms = 0;               // And for how long
+static HddServerRead  *hdd_reads = NULL;               // Block reads under way
+static pthread_mutex_t hdd_reads_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards them
+static pthread_cond_t  hdd_reads_done = PTHREAD_COND_INITIALIZER;   // One has its answer
+static uint64_t        hdd_coalesced = 0;              // Reads that shared one (guarded too)
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the HDD server stand-in
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, HDD_SERVER_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'p': // Set the network port number
+			if ( sscanf(optarg, "%hu", &hdd_network_port) != 1 ) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  port number [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 's': // Stall some of the reads
+			if ( (sscanf(optarg, "%d:%d", &hdd_stall_percent, &hdd_stall_ms) != 2) ||
+					(hdd_stall_percent < 0) || (hdd_stall_percent > 100) || (hdd_stall_ms < 0) ) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  stall [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		hdd_log_enable( LOG_INFO_LEVEL );
+	}
+
+	// Run the server until shut down
+	return( hdd_server() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_pack
+// Description  : formats a response (same layout as the client's commands)
+//
+// Inputs       : bid, r, flags, size, op - the fields
+// Outputs      : the packed response
+
+static HddBitResp hdd_server_pack(HddBlockID bid, int r, int flags, uint32_t size, int op) {
+	return ((uint64_t)op << 62) | ((uint64_t)size << 36) | ((uint64_t)flags << 33) |
+	       ((uint64_t)r << 32) | bid;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_recv / hdd_server_send
+// Description  : read exactly len bytes / write a whole io vector
+//
+// Inputs       : fd - the connection, buffer or io vector
+// Outputs      : 0 if successful, -1 if the connection failed
+
+static int hdd_server_recv(int fd, void *buf, size_t len) {
+	size_t red = 0;
+	ssize_t got;
+
+	while (red < len) {
+		got = read(fd, (char *)buf + red, len - red);
+		if ((got == -1) && (errno == EINTR))
+			continue;
+		if (got <= 0)
+			return(-1);
+		red += got;
+	}
+	return(0);
+}
+
+static int hdd_server_send(int fd, struct iovec *iov, int cnt) {
+	ssize_t written;
+
+	while (cnt > 0) {
+		written = writev(fd, iov, cnt);
+		if ((written == -1) && (errno == EINTR))
+			continue;
+		if (written == -1)
+			return(-1);
+		while ((cnt > 0) && (written >= iov->iov_len)) {
+			written -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_add_block / hdd_server_drop_block
+// Description  : add a block to (or remove and free it from) the store
+//
+// Inputs       : blk - the block
+// Outputs      : 0 if successful, -1 if failure
+
+static int hdd_server_add_block(HddServerBlock *blk) {
+	if (insertValueInHddHashTable(&hdd_blocks, blk->bid, blk)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : failed to index block %u", blk->bid);
+		return(-1);
+	}
+	if (blk->meta == 1) {
+		hdd_meta = blk;
+	}
+	return(0);
+}
+
+static void hdd_server_drop_block(HddServerBlock *blk) {
+	deleteValueFromHddHashTable(&hdd_blocks, blk->bid);
+	if (blk == hdd_meta) {
+		hdd_meta = NULL;
+	}
+	free(blk->data);
+	free(blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_format
+// Description  : delete every block and restart block numbering
+//
+// Inputs       : none
+// Outputs      : none
+
+static void hdd_server_format(void) {
+	HddHtIterator it;
+	HddServerBlock *blk;
+
+	// The iterator carries on past the block just deleted
+	initHddHashTableIterator(&hdd_blocks, &it);
+	while ((blk = iterateHddHashTable(&it)) != NULL) {
+		hdd_server_drop_block(blk);
+	}
+	hdd_next_bid = HDD_FIRST_BLOCK_ID;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_load
+// Description  : load the store from hdd_content.svd (empty if not there)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int hdd_server_load(void) {
+	FILE *fhandle;
+	uint32_t next, count, i;
+	HddServerBlock *blk;
+
+	if (initHddHashTable(&hdd_blocks, HDD_SERVER_HASH_BITS)) {
+		return(-1);
+	}
+	hdd_loaded = 1;
+	if ((fhandle = fopen(HDD_CONTENT_FILE, "rb")) == NULL) {
+		hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : no %s, starting empty", HDD_CONTENT_FILE);
+		return(0);
+	}
+
+	if ((fread(&next, sizeof(next), 1, fhandle) != 1) || (fread(&count, sizeof(count), 1, fhandle) != 1)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : truncated header in %s", HDD_CONTENT_FILE);
+		fclose(fhandle);
+		return(-1);
+	}
+	for (i = 0; i < count; i++) {
+		blk = calloc(1, sizeof(HddServerBlock));
+		if ((fread(&blk->bid, sizeof(blk->bid), 1, fhandle) != 1) ||
+			(fread(&blk->meta, sizeof(blk->meta), 1, fhandle) != 1) ||
+			(fread(&blk->size, sizeof(blk->size), 1, fhandle) != 1) ||
+			((blk->data = malloc(blk->size + 1)) == NULL) ||
+			(fread(blk->data, 1, blk->size, fhandle) != blk->size)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : truncated block %u in %s", i, HDD_CONTENT_FILE);
+			free(blk->data);
+			free(blk);
+			fclose(fhandle);
+			return(-1);
+		}
+
+		// The file has no checksums, establish them as the blocks come in
+		blk->crc = hdd_crc32c(0, blk->data, blk->size);
+		if (hdd_server_add_block(blk)) {
+			fclose(fhandle);
+			return(-1);
+		}
+	}
+	hdd_next_bid = next;
+	fclose(fhandle);
+
+	hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : loaded %u blocks from %s", count, HDD_CONTENT_FILE);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_save
+// Description  : write the store out to hdd_content.svd
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+static int hdd_server_save(void) {
+	FILE *fhandle;
+	HddHtIterator it;
+	HddServerBlock *blk;
+	uint32_t count = hdd_blocks.elements;
+	int err = 0;
+
+	if ((fhandle = fopen(HDD_CONTENT_FILE, "wb")) == NULL) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : failed to open %s [%s]", HDD_CONTENT_FILE, strerror(errno));
+		return(-1);
+	}
+	err |= (fwrite(&hdd_next_bid, sizeof(hdd_next_bid), 1, fhandle) != 1);
+	err |= (fwrite(&count, sizeof(count), 1, fhandle) != 1);
+	initHddHashTableIterator(&hdd_blocks, &it);
+	while ((blk = iterateHddHashTable(&it)) != NULL) {
+		err |= (fwrite(&blk->bid, sizeof(blk->bid), 1, fhandle) != 1);
+		err |= (fwrite(&blk->meta, sizeof(blk->meta), 1, fhandle) != 1);
+		err |= (fwrite(&blk->size, sizeof(blk->size), 1, fhandle) != 1);
+		err |= (fwrite(blk->data, 1, blk->size, fhandle) != blk->size);
+	}
+	err |= (fclose(fhandle) != 0);
+
+	if (err) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : failed writing %s", HDD_CONTENT_FILE);
+		return(-1);
+	}
+	hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : saved %u blocks to %s", count, HDD_CONTENT_FILE);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_lookup
+// Description  : find the block a command addresses
+//
+// Inputs       : bid - block ID (a namespace, or 0, for the meta block),
+//                flags - command flags
+// Outputs      : the block or NULL
+
+static HddServerBlock *hdd_server_lookup(HddBlockID bid, int flags) {
+	HddServerBlock *blk;
+
+	if ((flags == HDD_META_BLOCK) && (bid == 0)) {
+		return(hdd_meta);
+	}
+	blk = findValueInHddHashTable(&hdd_blocks, bid);
+	if ((blk != NULL) && ((blk->meta == HDD_NAMESPACE_META) != (flags == HDD_META_BLOCK))) {
+		return(NULL);   // a namespace's meta block only as one, and only it as one
+	}
+	return(blk);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_read_begin
+// Description  : start a block read: an identical read under way is waited
+//                for (until its answer is worked out), otherwise this one is
+//                noted for others to wait on
+//
+// Inputs       : bid/flags/offset/size - the read, lead - set if this one
+//                works out the answer
+// Outputs      : the read under way (NULL if it can't be noted)
+
+static HddServerRead *hdd_server_read_begin(HddBlockID bid, int flags, uint32_t offset, uint32_t size, int *lead) {
+	HddServerRead *rd;
+
+	pthread_mutex_lock(&hdd_reads_lock);
+	for (rd = hdd_reads; rd != NULL; rd = rd->next) {
+		if ((rd->bid == bid) && (rd->flags == flags) && (rd->offset == offset) && (rd->size == size)) {
+			break;
+		}
+	}
+	if (rd != NULL) {
+		rd->refs++;
+		while (!rd->done) {
+			pthread_cond_wait(&hdd_reads_done, &hdd_reads_lock);
+		}
+		*lead = 0;
+	} else if ((rd = calloc(1, sizeof(HddServerRead))) != NULL) {
+		rd->bid = bid;
+		rd->flags = flags;
+		rd->offset = offset;
+		rd->size = size;
+		rd->refs = 1;
+		rd->next = hdd_reads;
+		hdd_reads = rd;
+		*lead = 1;
+	}
+	pthread_mutex_unlock(&hdd_reads_lock);
+	return(rd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_read_share
+// Description  : take the answer of the read waited for, if its reader still
+//                holds the blocks (so nothing has changed them since), and
+//                let go of it
+//
+// Inputs       : rd - the read, blk/length/crc/has_crc - get the answer
+// Outputs      : 1 if the answer was taken, 0 if the read must be done again
+
+static int hdd_server_read_share(HddServerRead *rd, HddServerBlock **blk, uint32_t *length, uint32_t *crc, int *has_crc) {
+	int shared;
+
+	pthread_mutex_lock(&hdd_reads_lock);
+	if ((shared = rd->live)) {
+		*blk = rd->blk;
+		*length = rd->length;
+		*crc = rd->crc;
+		*has_crc = rd->has_crc;
+		hdd_coalesced++;
+	}
+	if (--rd->refs == 0) {
+		free(rd);
+	}
+	pthread_mutex_unlock(&hdd_reads_lock);
+	return(shared);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_read_done
+// Description  : publish the answer of a read (called holding the blocks),
+//                or, with live 0, retire it before they are let go
+//
+// Inputs       : rd - the read, blk/length/crc/has_crc - the answer, live -
+//                whether the reader holds the blocks still
+// Outputs      : none
+
+static void hdd_server_read_done(HddServerRead *rd, HddServerBlock *blk, uint32_t length, uint32_t crc, int has_crc, int live) {
+	HddServerRead **pp;
+
+	pthread_mutex_lock(&hdd_reads_lock);
+	if (live) {
+		rd->blk = blk;
+		rd->length = length;
+		rd->crc = crc;
+		rd->has_crc = has_crc;
+		rd->done = rd->live = 1;
+		pthread_cond_broadcast(&hdd_reads_done);
+	} else {
+		for (pp = &hdd_reads; *pp != rd; pp = &(*pp)->next);
+		*pp = rd->next;
+		rd->live = 0;
+		if (--rd->refs == 0) {
+			free(rd);
+		}
+	}
+	pthread_mutex_unlock(&hdd_reads_lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_connection
+// Description  : process the commands of one client until it closes the
+//                connection or asks for HDD_SAVE_AND_CLOSE
+//
+// Inputs       : fd - the client connection
+// Outputs      : 0 if the client went away cleanly, -1 on failure
+
+static int hdd_server_connection(int fd) {
+
+	// Local variables
+	HddBitCmd cmd;
+	HddBitResp resp;
+	HddServerBlock *blk;
+	HddServerRead *rd;
+	HddBlockID bid;
+	uint32_t size, caps = 0, crc, crc_nbo, offset, offset_nbo, length;
+	int op, flags, r, done = 0, lead, shared, has_crc;
+	char *payload, *grown;
+	struct iovec iov[3];
+	int iovcnt, failed;
+	unsigned int seed = (unsigned int)fd * 2654435761u;   // which reads stall
+
+	while (!done) {
+
+		// Get the next command, a closed connection ends the session
+		if (hdd_server_recv(fd, &cmd, sizeof(cmd))) {
+			return(0);
+		}
+		cmd = ntohll64(cmd);
+		op = (cmd >> 62) & 3;
+		size = (cmd >> 36) & 67108863;
+		flags = (cmd >> 33) & 7;
+		bid = cmd & 0xffffffff;
+		if ((flags == HDD_META_BLOCK) && !(caps & HDD_CAP_NAMESPACE)) {
+			bid = 0;   // (the Block field means nothing there without namespaces)
+		}
+		r = 0;
+		payload = NULL;
+		blk = NULL;
+		rd = NULL;
+		offset = 0;
+		lead = shared = has_crc = 0;
+
+		// Ranged commands carry their starting offset
+		if (flags == HDD_RANGE) {
+			if (hdd_server_recv(fd, &offset_nbo, sizeof(offset_nbo))) {
+				return(-1);
+			}
+			offset = ntohl(offset_nbo);
+		}
+
+		// Receive the payload (and its checksum) for block writes
+		if ((((op == HDD_BLOCK_CREATE) || (op == HDD_BLOCK_OVERWRITE)) &&
+			((flags == HDD_NULL_FLAG) || (flags == HDD_META_BLOCK))) ||
+			((op == HDD_BLOCK_OVERWRITE) && (flags == HDD_RANGE))) {
+			payload = malloc(size + 1);
+			if (hdd_server_recv(fd, payload, size)) {
+				free(payload);
+				return(-1);
+			}
+			if (caps & HDD_CAP_CHECKSUM) {
+				if (hdd_server_recv(fd, &crc_nbo, sizeof(crc_nbo))) {
+					free(payload);
+					return(-1);
+				}
+				crc = hdd_crc32c(0, payload, size);
+				if (crc != ntohl(crc_nbo)) {
+					hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : checksum mismatch on write to block %u", bid);
+					r = 1;
+				}
+			} else {
+				crc = hdd_crc32c(0, payload, size);
+			}
+		}
+
+		// A read joins an identical one under way, or leads (reaching the
+		// disk, which if asked to be slow stalls before the blocks are taken)
+		if (op == HDD_BLOCK_READ) {
+			rd = hdd_server_read_begin(bid, flags, offset, size, &lead);
+			if (((rd == NULL) || lead) && (hdd_stall_percent > 0) &&
+					((int)(rand_r(&seed) % 100) < hdd_stall_percent)) {
+				usleep(hdd_stall_ms * 1000);
+			}
+		}
+
+		// Now process the command, holding the blocks until the response is out
+		if (op == HDD_BLOCK_READ) {
+			pthread_rwlock_rdlock(&hdd_lock);
+			if ((rd != NULL) && !lead) {
+				shared = hdd_server_read_share(rd, &blk, &length, &crc, &has_crc);
+				rd = NULL;
+			}
+		} else {
+			pthread_rwlock_wrlock(&hdd_lock);
+		}
+		if (shared) {
+
+			// The answer of the identical read, the blocks unchanged since
+			resp = (blk != NULL) ? hdd_server_pack(blk->bid, 0, flags, length, op) : hdd_server_pack(bid, 1, flags, 0, op);
+
+		} else if ((op == HDD_DEVICE) && (flags == HDD_INIT)) {
+
+			// Load the content on first use, agree on the extensions
+			if (!hdd_loaded && hdd_server_load()) {
+				r = 1;
+			}
+			caps = bid & HDD_SERVER_CAPS;
+			resp = hdd_server_pack(bid, r, flags, caps, op);
+			hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : init [caps %x]", caps);
+
+		} else if ((op == HDD_DEVICE) && (flags == HDD_FORMAT) && (bid != 0) && (caps & HDD_CAP_NAMESPACE)) {
+
+			// Just the namespace's meta block (its blocks stay until the device is)
+			if ((blk = hdd_server_lookup(bid, HDD_META_BLOCK)) != NULL) {
+				hdd_server_drop_block(blk);
+				blk = NULL;
+			}
+			resp = hdd_server_pack(bid, (bid > HDD_MAX_NAMESPACE), flags, 0, op);
+			hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : format namespace %u", bid);
+
+		} else if ((op == HDD_DEVICE) && (flags == HDD_FORMAT)) {
+
+			hdd_server_format();
+			resp = hdd_server_pack(0, 0, flags, 0, op);
+			hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : format");
+
+		} else if ((op == HDD_DEVICE) && (flags == HDD_SAVE_AND_CLOSE)) {
+
+			r = hdd_server_save() ? 1 : 0;
+			resp = hdd_server_pack(0, r, flags, 0, op);
+			done = 1;
+
+		} else if (op == HDD_BLOCK_CREATE) {
+
+			if ((r == 0) && (payload != NULL) && (size <= HDD_MAX_BLOCK_SIZE) &&
+					((flags != HDD_META_BLOCK) || (bid <= HDD_MAX_NAMESPACE))) {
+				if ((flags == HDD_META_BLOCK) && ((blk = hdd_server_lookup(bid, flags)) != NULL)) {
+					hdd_server_drop_block(blk);
+				}
+				blk = calloc(1, sizeof(HddServerBlock));
+				if ((flags == HDD_META_BLOCK) && (bid != 0)) {
+					blk->bid = bid;    // a namespace's, under its number
+					blk->meta = HDD_NAMESPACE_META;
+				} else {
+					blk->bid = hdd_next_bid++;
+					blk->meta = (flags == HDD_META_BLOCK);
+				}
+				blk->size = size;
+				blk->crc = crc;
+				blk->data = payload;
+				payload = NULL;
+				if (hdd_server_add_block(blk)) {
+					free(blk->data);
+					free(blk);
+					blk = NULL;
+					r = 1;
+				}
+			} else {
+				r = 1;
+			}
+			resp = hdd_server_pack((blk != NULL) ? blk->bid : 0, r, flags, size, op);
+			hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : create %u bytes [r=%d]", size, r);
+
+		} else if ((op == HDD_BLOCK_READ) && (flags == HDD_RANGE)) {
+
+			// Part of a block, short if it runs off the end
+			blk = hdd_server_lookup(bid, flags);
+			if ((blk == NULL) || (offset > blk->size)) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : bad ranged read of block %u [%u@%u]", bid, size, offset);
+				resp = hdd_server_pack(bid, 1, flags, 0, op);
+				blk = NULL;
+			} else {
+				length = (size < blk->size - offset) ? size : blk->size - offset;
+				resp = hdd_server_pack(blk->bid, 0, flags, length, op);
+			}
+
+		} else if (op == HDD_BLOCK_READ) {
+
+			// The caller's buffer must hold the whole block
+			blk = hdd_server_lookup(bid, flags);
+			if ((blk == NULL) || (size < blk->size)) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : bad read of block %u [%u bytes]", bid, size);
+				resp = hdd_server_pack(bid, 1, flags, 0, op);
+				blk = NULL;
+			} else {
+				length = blk->size;
+				resp = hdd_server_pack(blk->bid, 0, flags, blk->size, op);
+			}
+
+		} else if ((op == HDD_BLOCK_OVERWRITE) && (flags == HDD_RESIZE)) {
+
+			// Resizes zero fill what they add (and keep the checksum running)
+			blk = hdd_server_lookup(bid, flags);
+			if ((caps & HDD_CAP_RESIZE) && (blk != NULL) && (size <= HDD_MAX_BLOCK_SIZE) &&
+					((grown = realloc(blk->data, size + 1)) != NULL)) {
+				blk->data = grown;
+				if (size > blk->size) {
+					memset(&blk->data[blk->size], 0x0, size - blk->size);
+					blk->crc = hdd_crc32c(blk->crc, &blk->data[blk->size], size - blk->size);
+				} else {
+					blk->crc = hdd_crc32c(0, blk->data, size);
+				}
+				blk->size = size;
+			} else {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : bad resize of block %u [%u bytes]", bid, size);
+				r = 1;
+			}
+			resp = hdd_server_pack(bid, r, flags, size, op);
+			blk = NULL;
+
+		} else if ((op == HDD_BLOCK_OVERWRITE) && (flags == HDD_RANGE)) {
+
+			// Ranged overwrites patch the bytes in place; with HDD_CAP_RESIZE they
+			// may also run past the end, growing the block (appends keep the
+			// checksum running, anything else recomputes it)
+			blk = hdd_server_lookup(bid, flags);
+			if ((r == 0) && (caps & HDD_CAP_RANGE_WRITE) && (blk != NULL) &&
+					(offset <= blk->size) && (size <= blk->size - offset)) {
+				memcpy(&blk->data[offset], payload, size);
+				blk->crc = hdd_crc32c(0, blk->data, blk->size);
+			} else if ((r == 0) && (caps & HDD_CAP_RESIZE) && (blk != NULL) &&
+					(offset <= blk->size) && (size <= HDD_MAX_BLOCK_SIZE - offset) &&
+					((grown = realloc(blk->data, offset + size + 1)) != NULL)) {
+				blk->data = grown;
+				memcpy(&blk->data[offset], payload, size);
+				if (offset == blk->size) {
+					blk->crc = hdd_crc32c(blk->crc, payload, size);
+				} else {
+					blk->crc = hdd_crc32c(0, blk->data, offset + size);
+				}
+				blk->size = offset + size;
+			} else {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : bad ranged overwrite of block %u [%u bytes at %u]", bid, size, offset);
+				r = 1;
+			}
+			resp = hdd_server_pack(bid, r, flags, size, op);
+			blk = NULL;
+
+		} else if (op == HDD_BLOCK_OVERWRITE) {
+
+			// Overwrites replace the contents, the size may not change
+			blk = hdd_server_lookup(bid, flags);
+			if ((r == 0) && (blk != NULL) && (blk->size == size)) {
+				free(blk->data);
+				blk->data = payload;
+				blk->crc = crc;
+				payload = NULL;
+			} else {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : bad overwrite of block %u [%u bytes]", bid, size);
+				r = 1;
+			}
+			resp = hdd_server_pack(bid, r, flags, size, op);
+			blk = NULL;
+
+		} else if (op == HDD_BLOCK_DELETE) {
+
+			if ((blk = hdd_server_lookup(bid, flags)) != NULL) {
+				hdd_server_drop_block(blk);
+			} else {
+				r = 1;
+			}
+			resp = hdd_server_pack(bid, r, flags, 0, op);
+			blk = NULL;
+
+		} else {
+
+			hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : unknown command [%llx]", (unsigned long long)cmd);
+			resp = hdd_server_pack(bid, 1, flags, 0, op);
+
+		}
+		free(payload);
+
+		// Whole blocks send the stored checksum, ranges their own
+		if ((op == HDD_BLOCK_READ) && (blk != NULL) && (caps & HDD_CAP_CHECKSUM) && !has_crc) {
+			crc = (length == blk->size) ? blk->crc : hdd_crc32c(0, blk->data + offset, length);
+			has_crc = 1;
+		}
+		if (lead) {
+			hdd_server_read_done(rd, blk, length, crc, has_crc, 1);
+		}
+
+		// Send the response, followed by the block (and checksum) for reads
+		resp = htonll64(resp);
+		iovcnt = 0;
+		iov[iovcnt].iov_base = &resp;
+		iov[iovcnt++].iov_len = sizeof(resp);
+		if ((op == HDD_BLOCK_READ) && (blk != NULL)) {
+			iov[iovcnt].iov_base = blk->data + offset;
+			iov[iovcnt++].iov_len = length;
+			if (caps & HDD_CAP_CHECKSUM) {
+				crc_nbo = htonl(crc);
+				iov[iovcnt].iov_base = &crc_nbo;
+				iov[iovcnt++].iov_len = sizeof(crc_nbo);
+			}
+		}
+		failed = hdd_server_send(fd, iov, iovcnt);
+		if (lead) {
+			hdd_server_read_done(rd, NULL, 0, 0, 0, 0);   // before the blocks can change
+		}
+		pthread_rwlock_unlock(&hdd_lock);
+		if (failed) {
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_client
+// Description  : serve one client connection on its own thread
+//
+// Inputs       : arg - the client connection (as a pointer)
+// Outputs      : NULL
+
+static void *hdd_server_client(void *arg) {
+	int fd = (int)(intptr_t)arg;
+
+	if (hdd_server_connection(fd)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : client connection failed");
+	}
+	close(fd);
+	return(NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server_signal
+// Description  : asks the accept loop to shut down
+//
+// Inputs       : sig - the signal
+// Outputs      : none
+
+static void hdd_server_signal(int sig) {
+	hdd_network_shutdown = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_server
+// Description  : listen for clients and serve each on its own thread
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int hdd_server( void ) {
+
+	// Local variables
+	struct sockaddr_in addr;
+	struct sigaction sa;
+	int sfd, cfd, on = 1;
+	pthread_t thread;
+	pthread_attr_t attr;
+	unsigned short port = (hdd_network_port != 0) ? hdd_network_port : HDD_DEFAULT_PORT;
+
+	// Shut down cleanly on interrupt, survive clients that disappear
+	memset(&sa, 0x0, sizeof(sa));
+	sa.sa_handler = hdd_server_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Setup the listening socket
+	if ((sfd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : socket() failed [%s]", strerror(errno));
+		return(-1);
+	}
+	setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0x0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if ((bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) || (listen(sfd, HDD_SERVER_BACKLOG) == -1)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : bind/listen on port %u failed [%s]", port, strerror(errno));
+		close(sfd);
+		return(-1);
+	}
+	hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : listening on port %u", port);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// Serve clients until told to stop
+	while (!hdd_network_shutdown) {
+		if ((cfd = accept(sfd, NULL, NULL)) == -1) {
+			if (errno != EINTR) {
+				hdd_log(LOG_ERROR_LEVEL, "HDD_SERVER : accept() failed [%s]", strerror(errno));
+			}
+			continue;
+		}
+		setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (pthread_create(&thread, &attr, hdd_server_client, (void *)(intptr_t)cfd)) {
+			hdd_server_client((void *)(intptr_t)cfd);   // no thread to spare, serve it here
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(sfd);
+	pthread_mutex_lock(&hdd_reads_lock);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SERVER : %llu reads shared one already under way",
+			(unsigned long long)hdd_coalesced);
+	pthread_mutex_unlock(&hdd_reads_lock);
+	return(0);
+}
@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+#  File          : hdd_shard_bench.sh
+#  Description   : Scaling harness for the sharded client.  For each shard
+#                  count it starts that many hdd_standin servers on
+#                  consecutive ports (each in a directory of its own), imports
+#                  a generated set of files spread over them, then times a
+#                  parallel export (the replay) and checks what came back.
+#                  Throughput should grow close to linearly with the shard
+#                  count while the servers, not the client, are the limit
+#                  (so on a machine with more cores than servers).
+#
+#  Usage         : hdd_shard_bench.sh [-n "<shard counts>"] [-f <files>]
+#                                     [-s <bytes>] [-j <connections>]
+#                                     [-p <first port>]
+#
+
+# Defaults
+COUNTS="1 2 4"
+FILES=2000
+SIZE=32768
+CONNS=8
+PORT=20000
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+while getopts "n:f:s:j:p:h" opt; do
+	case $opt in
+	n) COUNTS=$OPTARG ;;
+	f) FILES=$OPTARG ;;
+	s) SIZE=$OPTARG ;;
+	j) CONNS=$OPTARG ;;
+	p) PORT=$OPTARG ;;
+	*) sed -n '/^#  Usage/,/^#$/p' "$0"; exit 1 ;;
+	esac
+done
+
+WORK=$(mktemp -d /tmp/hdd_shard_bench.XXXXXX)
+PIDS=""
+
+# Stop the servers and drop the work directory however we leave
+cleanup() {
+	[ -n "$PIDS" ] && kill $PIDS 2> /dev/null
+	wait 2> /dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# The files to import, sizes spread around SIZE
+mkdir -p "$WORK/in"
+for ((i = 0; i < FILES; i++)); do
+	head -c $((SIZE / 2 + RANDOM % SIZE)) /dev/urandom > "$WORK/in/file$i.dat"
+done
+TOTAL=$(du -sb "$WORK/in" | cut -f1)
+
+printf "%-8s %12s %12s %10s\n" shards "export (s)" "MB/s" speedup
+for n in $COUNTS; do
+
+	# Start the servers, each saving in its own directory
+	LIST=""
+	PIDS=""
+	for ((i = 0; i < n; i++)); do
+		mkdir -p "$WORK/s$n/$i"
+		(cd "$WORK/s$n/$i" && exec "$HERE/hdd_standin" -p $((PORT + i)) > server.log 2>&1) &
+		PIDS="$PIDS $!"
+		LIST="$LIST,127.0.0.1:$((PORT + i))"
+	done
+	LIST=${LIST#,}
+	sleep 0.5
+
+	# Format, then import everything (the import mounts)
+	printf "x FORMAT 0 0:\nx UNMOUNT 0 0:\n" > "$WORK/format.txt"
+	if ! "$HERE/hdd_client" -s "$LIST" "$WORK/format.txt" > "$WORK/format.log" 2>&1 ||
+			! "$HERE/hdd_client" -s "$LIST" -i "$WORK/in" > "$WORK/import.log" 2>&1; then
+		echo "import over $n shards failed (see $WORK)"; trap - EXIT; exit 1
+	fi
+
+	# The replay: export every file over CONNS connections, timed
+	rm -rf "$WORK/out"; mkdir "$WORK/out"
+	START=$(date +%s.%N)
+	"$HERE/hdd_client" -s "$LIST" -e "$WORK/out" -j "$CONNS" > "$WORK/export.log" 2>&1
+	END=$(date +%s.%N)
+	if ! diff -rq "$WORK/in" "$WORK/out" > /dev/null; then
+		echo "export over $n shards differs from what was imported"; trap - EXIT; exit 1
+	fi
+
+	SECS=$(awk "BEGIN { print $END - $START }")
+	[ -z "$BASE" ] && BASE=$SECS
+	awk -v n=$n -v s=$SECS -v b=$BASE -v t=$TOTAL \
+		'BEGIN { printf "%-8d %12.3f %12.1f %9.2fx\n", n, s, t / s / 1048576, b / s }'
+
+	kill $PIDS 2> /dev/null
+	wait 2> /dev/null
+	PIDS=""
+done
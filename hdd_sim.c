@@ -11,6 +11,7 @@
 // Include Files
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -20,29 +21,61 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 // Project Includes
 #include <hdd_driver.h>
 #include <hdd_network.h>
 #include <hdd_file_io.h>
+#include <hdd_crc.h>
+#include <hdd_dir.h>
+#include <hdd_pool.h>
+#include <hdd_htable.h>
+#include <hdd_bulk.h>
 #include <cmpsc311_log.h>
+#include <hdd_log.h>
 #include <cmpsc311_util.h>
 #include <cmpsc311_hashtable.h>
 
 // Defines
 #define HDD_SIM_MAX_OPEN_FILES 128
-#define HDD_ARGUMENTS "hvul:x:a:p:"
+#define HDD_SIM_MAX_CLIENTS 1024       // virtual clients of an open-loop replay
+#define HDD_SIM_MAX_FIBERS 4096        // or of one run as fibers (a connection each)
+#define HDD_SIM_MAX_RATES 32           // rates it is run at
+#define HDD_SIM_LEAD_NS 20000000       // time for the clients to start before the first send
+#define HDD_SIM_FIBER_STACK (128*1024) // stack of a virtual client run as a fiber
+#define HDD_SIM_FIBER_EVENTS 256       // socket events the fiber scheduler takes at a time
+#define HDD_ARGUMENTS "hvubl:x:e:g:j:i:a:p:s:r:H:R:C:PF"
 #define USAGE \
-	"USAGE: hdd [-h] [-v] [-l <logfile>] [-c <sz>] [-x <file>] [-a <ip addr>] [-p <port>] <workload-file>\n" \
+	"USAGE: hdd [-h] [-v] [-u] [-b] [-l <logfile>] [-c <sz>] [-x <file>] [-e <dir> [-g <glob>] [-j <n>]] [-i <dir>] [-a <ip addr>] [-p <port>] [-s <shards> | -r <replicas> [-H <pct>[:<us>]]] [-R <rate>,... [-C <clients>] [-P] [-F]] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -u - run the unit tests instead of the simulator\n" \
+	"    -b - run the microbenchmarks instead of the simulator (formats the device)\n" \
 	"    -v - verbose output\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"    -x - extract a file <file> from the hdd filesystem\n" \
+	"    -e - export every file of the hdd filesystem into the directory <dir>\n" \
+	"    -g - export only the files whose names match the pattern <glob>\n" \
+	"    -j - export over <n> server connections at once (default 8)\n" \
+	"    -i - import the files of the directory <dir> into the hdd filesystem\n" \
 	"    -a - IP address of server to connect to.\n" \
 	"    -p - port number of server to connect to.\n" \
+	"    -s - spread the blocks over the servers <ip addr>:<port>,... (the first holds the metadata)\n" \
+	"    -r - copy the blocks to each of the servers <ip addr>:<port>,... (reads go to one)\n" \
+	"    -H - hedge a slow replica read after <pct> of recent reads' latency, at least <us> (0 never)\n" \
+	"    -R - replay open loop at each <rate> (operations/s), printing throughput and latency\n" \
+	"    -C - virtual clients of the open-loop replay, each over a connection of its own (default 16)\n" \
+	"    -P - Poisson arrivals for the open-loop replay (default evenly spaced)\n" \
+	"    -F - run the virtual clients as fibers on one thread, not a thread each (up to 4096 of them)\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -51,17 +84,69 @@
 typedef struct {
 	char     *filename;  // This is the filename for the test file
 	int16_t   fhandle;   // This is a file handle for the opened file
+	uint64_t  used;      // The workload line that last used it (to close the coldest)
 } HddSimulationTable;
 
+// A line of a workload replayed open loop
+typedef struct {
+	char     *line;      // The line
+	int       client;    // The virtual client that replays it, -1 for FORMAT, MOUNT and UNMOUNT
+	uint32_t  next;      // The client's next line (the line count if none)
+	uint64_t  due;       // When it is to be sent (ns into its run of file commands)
+	uint64_t  latency;   // From then until it was done (ns)
+} HddSimLine;
+
+// A virtual client of an open-loop replay, with a connection, files and thread (or fiber) of its own
+typedef struct HddSimClient {
+	int                 index;     // Which client
+	HddVolume          *vol;       // The volume the clients share, NULL while unmounted
+	HddConnection       conn;      // Its connection, made as the volume is mounted
+	HddConnection      *via;       // What it sends over: conn, or NULL for the volume's own
+	HddSimulationTable  ftable[HDD_SIM_MAX_OPEN_FILES];   // Its open files
+	HddSimLine         *lines;     // The workload
+	uint32_t            cursor;    // Its next line
+	uint32_t            end;       // The end of the run of file commands under way
+	uint64_t            start;     // When the run started (ns, monotonic)
+	int                 failed;    // Set when one of its commands failed
+	int                 running;   // Set while its thread (or fiber) runs
+	pthread_t           thread;    // The thread
+	ucontext_t          ctx;       // Or the fiber's context
+	char               *stack;     // And its stack (a guard page below), NULL until first run
+	HddVolume          *in;        // The volume it was in a call on when it last switched out
+	uint64_t            wake;      // When it is due to run again, asleep (ns, monotonic)
+	struct HddSimClient *queued;   // The fiber after it waiting for the metadata lock
+} HddSimClient;
+
+// The fiber scheduler, an event loop on the thread replaying (see fiber_run)
+typedef struct {
+	ucontext_t     main;       // The loop's own context
+	HddSimClient  *current;    // The fiber running, NULL in the loop
+	HddSimClient **ready;      // Ring of the fibers ready to run
+	uint32_t       head;       // Its first
+	uint32_t       nready;     // How many are in it
+	HddSimClient **sleep;      // Heap of the sleeping fibers, soonest first
+	uint32_t       nsleep;     // How many are in it
+	uint32_t       size;       // Room in each (a place per client)
+	int            epfd;       // The epoll instance of the sockets fibers wait on
+	int            live;       // Fibers not finished
+	int            held;       // Set while a fiber holds the metadata lock
+	HddSimClient  *waiting;    // The fibers waiting for it, first to get it first
+	HddSimClient  *last;       // The last of them
+} HddSimLoop;
+
 //
 // Global Data
 int verbose;
+static HddSimLoop sim_loop;
+static pthread_mutex_t sim_meta_lock = PTHREAD_MUTEX_INITIALIZER;   // The metadata lock of client threads
 
 //
 // Functional Prototypes
 
 int simulate_HDD( char *wload );
+int simulate_open_loop( char *wload, uint32_t *rates, int nrates, int clients, int poisson, int fibers );
 int extract_file_from_hdd(char *ex_file);
+int configure_servers(char *list, int replicas);
 
 //
 // Functions
@@ -77,9 +162,13 @@ int extract_file_from_hdd(char *ex_file);
 
 int main( int argc, char *argv[] ) {
 	// Local variables
-	int ch, verbose = 0, unit_tests = 0, log_initialized = 0, extract_file = 0;
+	int ch, verbose = 0, unit_tests = 0, benchmarks = 0, log_initialized = 0, extract_file = 0;
+	int connections = HDD_BULK_CONNECTIONS;
 	uint32_t cache_size = 1024; // Defaults to 1024 cache lines
-	char *ex_file = NULL;
+	uint32_t hedge_us, rates[HDD_SIM_MAX_RATES];
+	int hedge_pct, nrates = 0, clients = 16, poisson = 0, fibers = 0;
+	HddClientReadStats rd;
+	char *ex_file = NULL, *ex_dir = NULL, *ex_glob = NULL, *im_dir = NULL, *sep;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, HDD_ARGUMENTS)) != -1) {
@@ -97,6 +186,10 @@ int main( int argc, char *argv[] ) {
 			unit_tests = 1;
 			break;
 
+		case 'b': // Benchmarks Flag
+			benchmarks = 1;
+			break;
+
 		case 'l': // Set the log filename
 			initializeLogWithFilename( optarg );
 			log_initialized = 1;
@@ -107,16 +200,36 @@ int main( int argc, char *argv[] ) {
 			extract_file = 1;
 			break;
 
+		case 'e': // Export to a directory
+			ex_dir = optarg;
+			break;
+
+		case 'g': // Only the files matching a pattern
+			ex_glob = optarg;
+			break;
+
+		case 'j': // Connections to export over
+			if ((sscanf(optarg, "%d", &connections) != 1) || (connections < 1) ||
+					(connections > HDD_BULK_MAX_CONNECTIONS)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  connection count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'i': // Import from a directory
+			im_dir = optarg;
+			break;
+
 		case 'c': // Set cache line size
 			if ( sscanf( optarg, "%u", &cache_size ) != 1 ) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
                 return(-1);
 			}
 			break;
 
         case 'a': // Get the IP address
             if (inet_addr(optarg) == INADDR_NONE) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
                 return(-1);
             } 
             hdd_network_address = (unsigned char *)strdup(optarg);
@@ -124,11 +237,59 @@ int main( int argc, char *argv[] ) {
 
         case 'p': // Set the network port number
 			if ( sscanf(optarg, "%hu", &hdd_network_port) != 1 ) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  port number [%s]", argv[optind] );
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  port number [%s]", argv[optind] );
                 return(-1);
 			}
             break;
 
+        case 's': // Servers to shard over
+            if (configure_servers(optarg, 0)) {
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  shard list [%s]", optarg );
+                return(-1);
+            }
+            break;
+
+        case 'r': // Servers to replicate to
+            if (configure_servers(optarg, 1)) {
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  replica list [%s]", optarg );
+                return(-1);
+            }
+            break;
+
+        case 'H': // When to hedge replica reads
+            hedge_us = HDD_HEDGE_MIN_US;
+            if ((sscanf(optarg, "%d:%u", &hedge_pct, &hedge_us) < 1) || (hedge_pct < 0) || (hedge_pct > 100)) {
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  hedge percentile [%s]", optarg );
+                return(-1);
+            }
+            hdd_client_hedge(hedge_pct, hedge_us);
+            break;
+
+        case 'R': // Rates to replay open loop at
+            for (sep = strtok(optarg, ","); sep != NULL; sep = strtok(NULL, ",")) {
+                if ((nrates == HDD_SIM_MAX_RATES) || (sscanf(sep, "%u", &rates[nrates]) != 1) || (rates[nrates] == 0)) {
+			        hdd_log( LOG_ERROR_LEVEL, "Bad  rate list [%s]", optarg );
+                    return(-1);
+                }
+                nrates++;
+            }
+            break;
+
+        case 'C': // Virtual clients
+            if ((sscanf(optarg, "%d", &clients) != 1) || (clients < 1) || (clients > HDD_SIM_MAX_FIBERS)) {
+			    hdd_log( LOG_ERROR_LEVEL, "Bad  client count [%s]", optarg );
+                return(-1);
+            }
+            break;
+
+        case 'P': // Poisson arrivals
+            poisson = 1;
+            break;
+
+        case 'F': // Virtual clients as fibers
+            fibers = 1;
+            break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -139,28 +300,62 @@ int main( int argc, char *argv[] ) {
 	if ( ! log_initialized ) {
 		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
 	}
-	if ( verbose ) {
-		enableLogLevels( LOG_INFO_LEVEL );
+
+	// Threads only go so far (fibers go further)
+	if ( (clients > HDD_SIM_MAX_CLIENTS) && !fibers ) {
+		hdd_log( LOG_ERROR_LEVEL, "Bad  client count [%d], more than %d need -F", clients, HDD_SIM_MAX_CLIENTS );
+		return(-1);
+	}
+	if ( verbose || unit_tests ) {
+		// (tracing too, if it was built in), written out in the background
+		hdd_log_enable( LOG_INFO_LEVEL | (HDD_LOG_TRACE_LEVEL & HDD_LOG_BUILD_LEVELS) );
+		hdd_log_async();
 	}
 
 	// If we are running the unit tests, do that
 	if ( unit_tests ) {
 
-		// Enable verbose, run the tests and check the results
-		enableLogLevels( LOG_INFO_LEVEL );
-		if ( b64UnitTest() || hddIOUnitTest() ) {
-			logMessage( LOG_ERROR_LEVEL, "HDD unit tests failed.\n\n" );
+		// Run the tests and check the results
+		if ( b64UnitTest() || hddCrcUnitTest() || hddPoolUnitTest() || hddHashTableUnitTest() || hddIOUnitTest() || hddJournalUnitTest() || hddSparseUnitTest() || hddDirUnitTest() || hddClientUnitTest() ) {
+			hdd_log( LOG_ERROR_LEVEL, "HDD unit tests failed.\n\n" );
 		} else {
-			logMessage( LOG_INFO_LEVEL, "HDD unit tests completed successfully.\n\n" );
+			hdd_log( LOG_INFO_LEVEL, "HDD unit tests completed successfully.\n\n" );
+		}
+
+	} else if ( benchmarks ) {
+
+		// Run the microbenchmarks, results go to the output log level
+		if ( hddCrcBenchmark() || hddPoolBenchmark() || hddHashTableBenchmark() || hddDirBenchmark() ) {
+			hdd_log( LOG_ERROR_LEVEL, "HDD benchmarks failed.\n\n" );
 		}
 
 	} else if (extract_file) {
 
 		// Extracting a file from the hdd file systems
 		if (extract_file_from_hdd(ex_file) == 0) {
-			logMessage(LOG_INFO_LEVEL, "File [%s] extracted from hdd successfully.\n\n", ex_file);
+			hdd_log(LOG_INFO_LEVEL, "File [%s] extracted from hdd successfully.\n\n", ex_file);
 		} else {
-			logMessage(LOG_ERROR_LEVEL, "File [%s] extraction failed, aborting.\n\n");
+			hdd_log(LOG_ERROR_LEVEL, "File [%s] extraction failed, aborting.\n\n", ex_file);
+		}
+
+	} else if (ex_dir != NULL) {
+
+		// Exporting files from the hdd file system
+		if (hdd_bulk_export(ex_dir, ex_glob, connections) == 0) {
+			hdd_log(LOG_INFO_LEVEL, "Files exported from hdd to [%s] successfully.\n\n", ex_dir);
+		} else {
+			hdd_log(LOG_ERROR_LEVEL, "Export to [%s] failed.\n\n", ex_dir);
+		}
+		hdd_client_read_stats(&rd);
+		hdd_log(LOG_INFO_LEVEL, "HDD_SIM : %llu reads shared one already on the wire", (unsigned long long)rd.coalesced);
+
+	} else if (im_dir != NULL) {
+
+		// Importing files into the hdd file system
+		if (hdd_bulk_import(im_dir) == 0) {
+			hdd_log(LOG_INFO_LEVEL, "Files imported into hdd from [%s] successfully.\n\n", im_dir);
+		} else {
+			hdd_log(LOG_ERROR_LEVEL, "Import from [%s] failed.\n\n", im_dir);
 		}
 
 	} else {
@@ -174,12 +369,207 @@ int main( int argc, char *argv[] ) {
 
 		}
 
-		// Run the simulation
-		if ( simulate_HDD(argv[optind]) == 0 ) {
-			logMessage( LOG_INFO_LEVEL, "HDD simulation completed successfully.\n\n" );
+		// Run the simulation (open loop if given rates)
+		if ( nrates > 0 ) {
+			if ( simulate_open_loop(argv[optind], rates, nrates, clients, poisson, fibers) == 0 ) {
+				hdd_log( LOG_INFO_LEVEL, "HDD open-loop replay completed successfully.\n\n" );
+			} else {
+				hdd_log( LOG_ERROR_LEVEL, "HDD open-loop replay failed.\n\n" );
+			}
+		} else if ( simulate_HDD(argv[optind]) == 0 ) {
+			hdd_log( LOG_INFO_LEVEL, "HDD simulation completed successfully.\n\n" );
 		} else {
-			logMessage( LOG_INFO_LEVEL, "HDD simulation failed.\n\n" );
+			hdd_log( LOG_INFO_LEVEL, "HDD simulation failed.\n\n" );
+		}
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sim_open, sim_close, sim_read, sim_write, sim_seek
+// Description  : the file calls, on a volume (NULL for the default one)
+//
+// Inputs       : v - the volume, then as the file call
+// Outputs      : as the file call
+
+static int16_t sim_open(HddVolume *v, char *path) {
+	return( (v != NULL) ? hdd_volume_open(v, path) : hdd_open(path) );
+}
+
+static int16_t sim_close(HddVolume *v, int16_t fh) {
+	return( (v != NULL) ? hdd_volume_close(v, fh) : hdd_close(fh) );
+}
+
+static int32_t sim_read(HddVolume *v, int16_t fh, void *buf, int32_t count) {
+	return( (v != NULL) ? hdd_volume_read(v, fh, buf, count) : hdd_read(fh, buf, count) );
+}
+
+static int32_t sim_write(HddVolume *v, int16_t fh, void *buf, int32_t count) {
+	return( (v != NULL) ? hdd_volume_write(v, fh, buf, count) : hdd_write(fh, buf, count) );
+}
+
+static int32_t sim_seek(HddVolume *v, int16_t fh, uint32_t loc) {
+	return( (v != NULL) ? hdd_volume_seek(v, fh, loc) : hdd_seek(fh, loc) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_op
+// Description  : perform one file command of a workload (opening the file
+//                on first use, closing the one used longest ago if the
+//                table is full)
+//
+// Inputs       : v - the volume (NULL for the default one), ftable - the
+//                open files, used - the workload line, then its fields
+//                (sep - the ':' before its payload)
+// Outputs      : 0 if successful, -1 if failure
+
+static int simulate_op(HddVolume *v, HddSimulationTable *ftable, uint64_t used, char *fname,
+		char *command, int32_t len, int32_t off, char *sep) {
+
+	// Local variables
+	char text[2048], *rbuf;
+	int idx, i;
+
+	// Now walk the the table looking for the file
+	idx = -1;
+	i = 0;
+	while ( (i < HDD_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
+		if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
+			idx = i;
+		}
+		i++;
+	}
+
+	// File is not found, open the file
+	if (idx == -1) {
+
+		// Log message, find unused index and save filename for later use
+		hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Opening file [%s]", fname);
+		idx = 0;
+		while ((idx < HDD_SIM_MAX_OPEN_FILES) && (ftable[idx].filename != NULL)) {
+			idx++;
+		}
+
+		// A full table gives up the file used longest ago (workloads
+		// over more files seek before using a file again)
+		if (idx == HDD_SIM_MAX_OPEN_FILES) {
+			idx = 0;
+			for (i=1; i<HDD_SIM_MAX_OPEN_FILES; i++) {
+				if (ftable[i].used < ftable[idx].used) {
+					idx = i;
+				}
+			}
+			hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
+			if (sim_close(v, ftable[idx].fhandle) == -1) {
+				hdd_log(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
+				return(-1);
+			}
+			free(ftable[idx].filename);
+		}
+		ftable[idx].filename = strdup(fname);
+
+		// Now perform the open
+		ftable[idx].fhandle = sim_open(v, ftable[idx].filename);
+		if (ftable[idx].fhandle == -1) {
+			// Failed, error out
+			hdd_log(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
+			return(-1);
+		}
+
+	}
+	ftable[idx].used = used;
+
+	// Now execute the specific command
+	if (strncmp(command, "WRITEAT", 7) == 0) {
+
+		// Log the command executed
+		hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
+
+		// First perform the seek
+		if (sim_seek(v, ftable[idx].fhandle, off)) {
+			// Failed, error out
+			hdd_log(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
+			return(-1);
+		}
+
+		// Now see if we need more data to fill, terminate the lines
+		CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
+		CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
+		strncpy(text, sep+1, len);
+		text[len] = 0x0;
+		for (i=0; i<strlen(text); i++) {
+			if (text[i] == '*') {
+				text[i] = '\n';
+			}
+		}
+
+		// Now perform the write
+		if (sim_write(v, ftable[idx].fhandle, text, len) != len) {
+			// Failed, error out
+			hdd_log(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
+			return(-1);
 		}
+
+	} else if (strncmp(command, "WRITE", 5) == 0) {
+
+		// Now see if we need more data to fill, terminate the lines
+		CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
+		CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
+		strncpy(text, sep+1, len);
+		text[len] = 0x0;
+		for (i=0; i<strlen(text); i++) {
+			if (text[i] == '*') {
+				text[i] = '\n';
+			}
+		}
+
+		// Log the command executed
+		hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes to file [%s]", len, fname);
+
+		// Now perform the write
+		if (sim_write(v, ftable[idx].fhandle, text, len) != len) {
+			// Failed, error out
+			hdd_log(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
+			return(-1);
+		}
+
+	} else if (strncmp(command, "SEEK", 4) == 0) {
+
+		// Log the command executed
+		hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Seeking to position %d in file [%s]", off, fname);
+
+		// Now perform the seek
+		if (sim_seek(v, ftable[idx].fhandle, off) != len) {
+			// Failed, error out
+			hdd_log(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
+			return(-1);
+		}
+
+	} else if (strncmp(command, "READ", 4) == 0) {
+
+		// Log the command executed
+		hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Reading %d bytes from file [%s]", len, fname);
+
+		// Now perform the read
+		rbuf = hdd_pool_alloc(len);
+		if (sim_read(v, ftable[idx].fhandle, rbuf, len) != len) {
+			// Failed, error out
+			hdd_log(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
+			hdd_pool_free(rbuf);
+			return(-1);
+		}
+		hdd_pool_free(rbuf);
+		rbuf = NULL;
+
+	} else {
+
+		// Bomb out, don't understand the command
+		CMPSC_ASSERT1(0, "HDD_SIM : Failed, unknown command [%s]", command);
+
 	}
 
 	// Return successfully
@@ -198,11 +588,14 @@ int main( int argc, char *argv[] ) {
 int simulate_HDD( char *wload ) {
 
 	// Local variables
-	char line[2048], fname[128], command[128], text[2048], *sep, *rbuf;
+	char line[2048], fname[128], command[128], *sep;
 	FILE *fhandle = NULL;
 	int32_t err=0, len, off, fields, linecount;
 	HddSimulationTable ftable[HDD_SIM_MAX_OPEN_FILES];
-	int idx, i;
+	HddReadaheadStats ra;
+	HddPoolStats pool;
+	HddClientReadStats rd;
+	int idx;
 
 	// Setup the file table
 	memset(ftable, 0x0, sizeof(HddSimulationTable)*HDD_SIM_MAX_OPEN_FILES);
@@ -210,7 +603,7 @@ int simulate_HDD( char *wload ) {
 	// Open the workload file
 	linecount = 0;
 	if ( (fhandle=fopen(wload, "r")) == NULL ) {
-		logMessage( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
+		hdd_log( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
 			wload, strerror(errno) );
 		return( -1 );
 	}
@@ -226,45 +619,45 @@ int simulate_HDD( char *wload ) {
 			fields = sscanf(line, "%s %s %d %d", fname, command, &len, &off);
 			sep = strchr(line, ':');
 			if ( (fields != 4) || (sep == NULL) ) {
-				logMessage( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%s], line %d",
+				hdd_log( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%s], line %d",
 						line, linecount );
 				fclose( fhandle );
 				return( -1 );
 			}
 
 			// Just log the contents
-			logMessage(LOG_INFO_LEVEL, "File [%s], command [%s], len=%d, offset=%d",
+			hdd_log(LOG_INFO_LEVEL, "File [%s], command [%s], len=%d, offset=%d",
 					fname, command, len, off);
 
 			// Now process the commands
 			if (strncmp(command, "FORMAT", 6) == 0) {
 
 				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Formatting HDD filesystem");
+				hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Formatting HDD filesystem");
 
 				// Now perform the format
 				if (hdd_format() != len) {
 					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Formatting failed, aborting simulation.");
+					hdd_log(LOG_ERROR_LEVEL, "Formatting failed, aborting simulation.");
 					return(-1);
 				}
 
 			} else if (strncmp(command, "MOUNT", 5) == 0) {
 
 				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Mounting HDD filesystem");
+				hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Mounting HDD filesystem");
 
 				// Now perform the filesystem mount
 				if (hdd_mount() != len) {
 					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
+					hdd_log(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
 					return(-1);
 				}
 
 			} else if (strncmp(command, "UNMOUNT", 5) == 0) {
 
 				// Log the command executed
-				logMessage(LOG_INFO_LEVEL, "HDD_SIM : Un-mounting HDD filesystem");
+				hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Un-mounting HDD filesystem");
 
 				// Finished, close all of the files
 				for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
@@ -272,10 +665,10 @@ int simulate_HDD( char *wload ) {
 					// If file in use, close if
 					if (ftable[idx].filename != NULL) {
 						// Log the file close
-						logMessage(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
+						hdd_log(LOG_INFO_LEVEL, "HDD_SIM : Closing file [%s]", ftable[idx].filename);
 						if (hdd_close(ftable[idx].fhandle) == -1) {
 							// Failed, error out
-							logMessage(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
+							hdd_log(LOG_ERROR_LEVEL, "Close file [%s] failed, aborting simulation.", ftable[idx].filename);
 							return(-1);
 						}
 						free(ftable[idx].filename);
@@ -287,7 +680,7 @@ int simulate_HDD( char *wload ) {
 				// Now perform the filesystem unmount
 				if (hdd_unmount() != len) {
 					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
+					hdd_log(LOG_ERROR_LEVEL, "Mount failed, aborting simulation.");
 					return(-1);
 				}
 
@@ -297,139 +690,727 @@ int simulate_HDD( char *wload ) {
 				//
 				// File operations
 
-				// Now walk the the table looking for the file
-				idx = -1;
-				i = 0;
-				while ( (i < HDD_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-					if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-						idx = i;
-					}
-					i++;
+				// Now perform it on the file (opened on first use)
+				if (simulate_op(NULL, ftable, linecount, fname, command, len, off, sep)) {
+					fclose( fhandle );
+					return( -1 );
 				}
+			}
+
+			// Check for the virtual level failing
+			if ( err ) {
+				hdd_log( LOG_ERROR_LEVEL, "HDD system failed, aborting [%d]", err );
+				fclose( fhandle );
+				return( -1 );
+			}
+		}
+	}
 
-				// File is not found, open the file
-				if (idx == -1) {
+	// Report how well reads were anticipated
+	hdd_readahead_stats(&ra);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SIM : reads %llu, local hits %llu, misses %llu",
+			(unsigned long long)ra.reads, (unsigned long long)ra.hits, (unsigned long long)ra.misses);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SIM : prefetches %llu (%llu bytes), used %llu, wasted %llu",
+			(unsigned long long)ra.prefetches, (unsigned long long)ra.prefetch_bytes,
+			(unsigned long long)ra.prefetch_hits, (unsigned long long)ra.prefetch_wasted);
+
+	// And how often a buffer came from the pool instead of malloc
+	hdd_pool_stats(&pool);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SIM : buffers %llu, reused %llu, peak pooled %llu bytes",
+			(unsigned long long)pool.allocations, (unsigned long long)pool.reused,
+			(unsigned long long)pool.peak_bytes);
+
+	// And how long reads took (hedged to a second replica if slow)
+	hdd_client_read_stats(&rd);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SIM : read latency p50 %u us, p95 %u us, p99 %u us over %llu reads",
+			rd.p50_us, rd.p95_us, rd.p99_us, (unsigned long long)rd.reads);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SIM : hedged %llu, won by the hedge %llu, stale replicas %llu, coalesced %llu",
+			(unsigned long long)rd.hedged, (unsigned long long)rd.hedge_wins, (unsigned long long)rd.stale,
+			(unsigned long long)rd.coalesced);
 
-					// Log message, find unused index and save filename for later use
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Opening file [%s]", fname);
-					idx = 0;
-					while ((ftable[idx].filename != NULL) && (idx < HDD_SIM_MAX_OPEN_FILES)) {
-						idx++;
-					}
-					CMPSC_ASSERT1(idx<HDD_SIM_MAX_OPEN_FILES, "Too many open files on HDD sim [%d]", idx);
-					ftable[idx].filename = strdup(fname);
-
-					// Now perform the open
-					ftable[idx].fhandle = hdd_open(ftable[idx].filename);
-					if (ftable[idx].fhandle == -1) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
-						return(-1);
-					}
+	// Close the workload file, successfully
+	fclose( fhandle );
+	return( 0 );
+}
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Open-loop replay: each line is sent at its own time, whether or not the
+// ones before it are done, so queueing shows up in the latency instead of
+// slowing the sender down.  The arrivals run at the rate asked for, evenly
+// spaced or Poisson; each file belongs to one of the virtual clients (by
+// the hash of its name), which replays that file's lines in order on its
+// own thread (or fiber), over a connection of its own to the one volume
+// they all share.  Opens, closes and writes change the volume's metadata,
+// so the clients take turns at them (see open_loop_lock); reads and seeks,
+// of files no other client uses, go on alongside.  A line's latency runs
+// from when it was due, not from when its client got to it.  FORMAT, MOUNT
+// and UNMOUNT wait for everything before them; they aren't timed.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sim_now
+// Description  : the monotonic clock in nanoseconds
+//
+// Inputs       : none
+// Outputs      : the time
+
+static uint64_t sim_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return( (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Fibers: with -F the virtual clients run as coroutines on the replaying
+// thread instead of a thread each, so thousands fit in one process.  The
+// scheduler is an event loop: a fiber runs until the client library would
+// block on its socket (see hdd_client_waiter) or it has to wait for its
+// next line to be due, then switches back to the loop, which waits on the
+// sockets with epoll and on the soonest sleeper with its timeout, and runs
+// whatever is ready.  A fiber can switch out in the middle of a volume
+// call, so each switch swaps the thread's volume and connection (see
+// hdd_volume_use and hdd_client_use).
+// Sleeps are to the millisecond the loop waits in, it spins for the rest.
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fiber_ready
+// Description  : queue a fiber to run
+//
+// Inputs       : c - the fiber
+// Outputs      : none
+
+static void fiber_ready(HddSimClient *c) {
+	sim_loop.ready[(sim_loop.head + sim_loop.nready++) % sim_loop.size] = c;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fiber_wake
+// Description  : take the soonest sleeper off the heap
+//
+// Inputs       : none
+// Outputs      : the fiber
+
+static HddSimClient *fiber_wake(void) {
+	HddSimClient **h = sim_loop.sleep, *c = h[0], *t;
+	uint32_t i = 0, k;
+
+	h[0] = h[--sim_loop.nsleep];
+	while ((k = 2 * i + 1) < sim_loop.nsleep) {
+		if ((k + 1 < sim_loop.nsleep) && (h[k + 1]->wake < h[k]->wake)) {
+			k++;
+		}
+		if (h[i]->wake <= h[k]->wake) {
+			break;
+		}
+		t = h[i]; h[i] = h[k]; h[k] = t;
+		i = k;
+	}
+	return( c );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fiber_switch
+// Description  : switch from the running fiber to the loop, until the loop
+//                runs it again
+//
+// Inputs       : none
+// Outputs      : none
+
+static void fiber_switch(void) {
+	HddSimClient *c = sim_loop.current;
+
+	c->in = hdd_volume_use(NULL);
+	swapcontext(&c->ctx, &sim_loop.main);
+	hdd_volume_use(c->in);
+	if (c->via != NULL) {
+		hdd_client_use(c->via);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fiber_wait
+// Description  : the client library's wait on a socket (its waiter): run
+//                the other fibers until the socket may be ready
+//
+// Inputs       : fd - the socket (-1 for none, just let the others run),
+//                events - POLLIN or POLLOUT
+// Outputs      : 0 once it may be ready, -1 on failure
+
+static int fiber_wait(int fd, int events) {
+	HddSimClient *c = sim_loop.current;
+	struct epoll_event ev = { .events = ((events & POLLOUT) ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT, .data.ptr = c };
+	struct pollfd pfd = { .fd = fd, .events = events };
+
+	if (c == NULL) {   // (not in a fiber, just block)
+		return( ((fd == -1) || (poll(&pfd, 1, -1) >= 0)) ? 0 : -1 );
+	}
+	if (fd == -1) {
+		fiber_ready(c);
+	} else if ((epoll_ctl(sim_loop.epfd, EPOLL_CTL_MOD, fd, &ev) == -1) &&
+			((errno != ENOENT) || (epoll_ctl(sim_loop.epfd, EPOLL_CTL_ADD, fd, &ev) == -1))) {
+		return( -1 );
+	}
+	fiber_switch();
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sim_sleep_until
+// Description  : wait until a time, switching to the other fibers if in one
+//
+// Inputs       : due - the time (ns, monotonic)
+// Outputs      : none
+
+static void sim_sleep_until(uint64_t due) {
+	HddSimClient *c = sim_loop.current, *t;
+	struct timespec ts;
+	uint32_t i;
+
+	if (c == NULL) {
+		ts.tv_sec = due / 1000000000ULL;
+		ts.tv_nsec = due % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		return;
+	}
+	if (due <= sim_now()) {
+		return;
+	}
+
+	// Onto the heap, then let the others run
+	c->wake = due;
+	i = sim_loop.nsleep++;
+	sim_loop.sleep[i] = c;
+	while ((i > 0) && (sim_loop.sleep[(i - 1) / 2]->wake > c->wake)) {
+		t = sim_loop.sleep[(i - 1) / 2]; sim_loop.sleep[(i - 1) / 2] = sim_loop.sleep[i]; sim_loop.sleep[i] = t;
+		i = (i - 1) / 2;
+	}
+	fiber_switch();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_loop_lock, open_loop_unlock
+// Description  : take and give up the metadata lock: a client thread waits
+//                on the mutex, a fiber queues up and lets the others run
+//                until the one holding it hands it over
+//
+// Inputs       : none
+// Outputs      : none
+
+static void open_loop_lock(void) {
+	HddSimClient *c = sim_loop.current;
+
+	if (c == NULL) {
+		pthread_mutex_lock(&sim_meta_lock);
+	} else if (sim_loop.held) {
+		c->queued = NULL;
+		if (sim_loop.waiting == NULL) {
+			sim_loop.waiting = c;
+		} else {
+			sim_loop.last->queued = c;
+		}
+		sim_loop.last = c;
+		fiber_switch();   // (it holds the lock when run again)
+	} else {
+		sim_loop.held = 1;
+	}
+}
+
+static void open_loop_unlock(void) {
+	HddSimClient *c = sim_loop.waiting;
+
+	if (sim_loop.current == NULL) {
+		pthread_mutex_unlock(&sim_meta_lock);
+	} else if (c != NULL) {
+		sim_loop.waiting = c->queued;
+		fiber_ready(c);
+	} else {
+		sim_loop.held = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_loop_opened
+// Description  : whether a client has a file open
+//
+// Inputs       : c - the client, fname - the file
+// Outputs      : 1 if so, 0 if not
+
+static int open_loop_opened(HddSimClient *c, char *fname) {
+	int idx;
+
+	for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
+		if ( (c->ftable[idx].filename != NULL) && (strcmp(c->ftable[idx].filename, fname) == 0) ) {
+			return( 1 );
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_loop_client
+// Description  : a virtual client's thread (or fiber): sends each of its
+//                lines of the run when due and times it
+//
+// Inputs       : arg - the client
+// Outputs      : NULL
+
+static void *open_loop_client(void *arg) {
+
+	// Local variables
+	HddSimClient *c = arg;
+	HddSimLine *l;
+	char fname[128], command[128];
+	int32_t len, off;
+	uint64_t due;
+	int meta;
+
+	// The shared volume, over the client's own connection if it has one
+	hdd_volume_use(c->vol);
+	if (c->via != NULL) {
+		hdd_client_use(c->via);
+	}
+
+	while ((c->cursor < c->end) && !c->failed) {
+
+		// Wait until it is due (if it isn't overdue already)
+		l = &c->lines[c->cursor];
+		due = c->start + l->due;
+		sim_sleep_until(due);
+
+		// Send it (the line was checked as it was loaded), holding the
+		// metadata lock unless it just reads or seeks in an open file
+		// over a connection of its own
+		sscanf(l->line, "%s %s %d %d", fname, command, &len, &off);
+		meta = ((strncmp(command, "READ", 4) != 0) && (strncmp(command, "SEEK", 4) != 0)) ||
+			!open_loop_opened(c, fname) || (c->via == NULL);
+		if (meta) {
+			open_loop_lock();
+		}
+		if (simulate_op(NULL, c->ftable, c->cursor, fname, command, len, off, strchr(l->line, ':'))) {
+			c->failed = 1;
+		}
+		if (meta) {
+			open_loop_unlock();
+		}
+		l->latency = sim_now() - due;
+		c->cursor = l->next;
+	}
+
+	hdd_volume_use(NULL);
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fiber_start
+// Description  : where a fiber starts: run its client (the fiber ends by
+//                returning to the loop)
+//
+// Inputs       : none
+// Outputs      : none
+
+static void fiber_start(void) {
+	HddSimClient *c = sim_loop.current;
+
+	open_loop_client(c);
+	c->running = 0;
+	sim_loop.live--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fiber_run
+// Description  : run the clients marked running as fibers until all are done
+//
+// Inputs       : cl - the clients, clients - how many
+// Outputs      : 0 if successful, -1 if failure
+
+static int fiber_run(HddSimClient *cl, int clients) {
+
+	// Local variables
+	struct epoll_event ev[HDD_SIM_FIBER_EVENTS];
+	size_t page = sysconf(_SC_PAGESIZE);
+	HddClientWaiter before;
+	HddSimClient *c;
+	uint64_t now;
+	int k, n, timeout;
+
+	if ((sim_loop.epfd = epoll_create1(0)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "Cannot make the fiber event loop [%s]", strerror(errno));
+		return(-1);
+	}
+
+	// Each fiber starts at the top of its stack, ready to run
+	sim_loop.head = sim_loop.nready = sim_loop.nsleep = 0;
+	sim_loop.live = sim_loop.held = 0;
+	sim_loop.waiting = NULL;
+	for (k=0; k<clients; k++) {
+		c = &cl[k];
+		if (!c->running) {
+			continue;
+		}
+		if (c->stack == NULL) {
+			c->stack = mmap(NULL, HDD_SIM_FIBER_STACK + page, PROT_READ|PROT_WRITE,
+					MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+			if ((c->stack == MAP_FAILED) || mprotect(c->stack, page, PROT_NONE)) {
+				hdd_log(LOG_ERROR_LEVEL, "Cannot start client %d [%s]", k, strerror(errno));
+				if (c->stack != MAP_FAILED) {
+					munmap(c->stack, HDD_SIM_FIBER_STACK + page);
 				}
+				c->stack = NULL;
+				c->running = 0;
+				c->failed = 1;
+				continue;
+			}
+		}
+		getcontext(&c->ctx);
+		c->ctx.uc_stack.ss_sp = c->stack + page;
+		c->ctx.uc_stack.ss_size = HDD_SIM_FIBER_STACK;
+		c->ctx.uc_link = &sim_loop.main;
+		makecontext(&c->ctx, fiber_start, 0);
+		fiber_ready(c);
+		sim_loop.live++;
+	}
 
-				// Now execute the specific command
-				if (strncmp(command, "WRITEAT", 7) == 0) {
+	// Then the loop: wake who is due, take the socket events (waiting if
+	// nobody is ready), and run each fiber ready once
+	before = hdd_client_waiter(fiber_wait);
+	while (sim_loop.live > 0) {
+		now = sim_now();
+		while ((sim_loop.nsleep > 0) && (sim_loop.sleep[0]->wake <= now)) {
+			fiber_ready(fiber_wake());
+		}
+		timeout = (sim_loop.nready > 0) ? 0 : (sim_loop.nsleep > 0) ? (int)((sim_loop.sleep[0]->wake - now) / 1000000) : -1;
+		if ((n = epoll_wait(sim_loop.epfd, ev, HDD_SIM_FIBER_EVENTS, timeout)) == -1) {
+			n = 0;   // (interrupted)
+		}
+		for (k=0; k<n; k++) {
+			fiber_ready(ev[k].data.ptr);
+		}
+		for (n=sim_loop.nready; n>0; n--) {
+			c = sim_loop.ready[sim_loop.head];
+			sim_loop.head = (sim_loop.head + 1) % sim_loop.size;
+			sim_loop.nready--;
+			sim_loop.current = c;
+			swapcontext(&sim_loop.main, &c->ctx);
+			sim_loop.current = NULL;
+		}
+	}
+	hdd_client_waiter(before);
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
+	close(sim_loop.epfd);
+	return(0);
+}
 
-					// First perform the seek
-					if (hdd_seek(ftable[idx].fhandle, off)) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_loop_unmount
+// Description  : close a virtual client's files (over its connection, where
+//                their readahead is on the wire) and its connection, if it
+//                has one
+//
+// Inputs       : c - the client
+// Outputs      : 0 if successful, -1 if failure
 
-					// Now see if we need more data to fill, terminate the lines
-					CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-					CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-					strncpy(text, sep+1, len);
-					text[len] = 0x0;
-					for (i=0; i<strlen(text); i++) {
-						if (text[i] == '*') {
-							text[i] = '\n';
-						}
-					}
+static int open_loop_unmount(HddSimClient *c) {
+	int idx, r = 0;
 
-					// Now perform the write
-					if (hdd_write(ftable[idx].fhandle, text, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-						return(-1);
-					}
+	if (c->vol == NULL) {
+		return( 0 );
+	}
+	hdd_volume_use(c->vol);
+	if (c->via != NULL) {
+		hdd_client_use(c->via);
+	}
+	for (idx=0; idx<HDD_SIM_MAX_OPEN_FILES; idx++) {
+		if (c->ftable[idx].filename != NULL) {
+			r |= (hdd_close(c->ftable[idx].fhandle) == -1);
+			free(c->ftable[idx].filename);
+			c->ftable[idx].filename = NULL;
+		}
+	}
+	if (c->via != NULL) {
+		hdd_client_disconnect();
+		c->via = NULL;
+	}
+	hdd_volume_use(NULL);
+	c->vol = NULL;
+	return( r ? -1 : 0 );
+}
 
-				} else if (strncmp(command, "WRITE", 5) == 0) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_loop_device
+// Description  : perform a FORMAT, MOUNT or UNMOUNT of the shared volume,
+//                connecting the clients to it or closing their connections
+//                (a server that doesn't grant namespaces serves just one
+//                connection at a time, so they take turns over the
+//                volume's instead)
+//
+// Inputs       : command - which, dev - the volume (NULL while unmounted),
+//                cl - the clients, clients - how many
+// Outputs      : 0 if successful, -1 if failure
 
-					// Now see if we need more data to fill, terminate the lines
-					CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-					CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-					strncpy(text, sep+1, len);
-					text[len] = 0x0;
-					for (i=0; i<strlen(text); i++) {
-						if (text[i] == '*') {
-							text[i] = '\n';
-						}
-					}
+static int open_loop_device(char *command, HddVolume **dev, HddSimClient *cl, int clients) {
+	int format = (strncmp(command, "FORMAT", 6) == 0), r = 0, k;
+	uint32_t caps;
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Writing %d bytes to file [%s]", len, fname);
+	// A mount of the mounted volume leaves it be
+	if ((*dev != NULL) && (strncmp(command, "MOUNT", 5) == 0)) {
+		return(0);
+	}
 
-					// Now perform the write
-					if (hdd_write(ftable[idx].fhandle, text, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-						return(-1);
-					}
+	// Unmounts and formats start by closing the clients, then the volume
+	if (*dev != NULL) {
+		for (k=0; k<clients; k++) {
+			r |= open_loop_unmount(&cl[k]);
+		}
+		r |= (hdd_volume_unmount(*dev) != 0);
+		*dev = NULL;
+		if (r) {
+			hdd_log(LOG_ERROR_LEVEL, "Unmount failed, aborting simulation.");
+			return(-1);
+		}
+	}
+	if (strncmp(command, "UNMOUNT", 5) == 0) {
+		return(0);
+	}
+
+	// Then it is mounted (formatted first for a FORMAT) and the clients
+	// connect to its server one after another
+	if ((*dev = format ? hdd_volume_format(NULL, 0) : hdd_volume_mount(NULL, 0)) == NULL) {
+		hdd_log(LOG_ERROR_LEVEL, "%s failed, aborting simulation.", format ? "Formatting" : "Mount");
+		return(-1);
+	}
+	hdd_volume_use(*dev);
+	caps = hdd_client_capabilities();
+	hdd_volume_use(NULL);
+	if (!(caps & HDD_CAP_NAMESPACE)) {
+		hdd_log(LOG_OUTPUT_LEVEL, "HDD_SIM : the server takes one connection at a time, the clients take turns on it");
+	}
+	for (k=0; k<clients; k++) {
+		cl[k].vol = *dev;
+		if (!(caps & HDD_CAP_NAMESPACE)) {
+			continue;
+		}
+		cl[k].conn = (HddConnection)HDD_CONNECTION_INIT;
+		cl[k].via = &cl[k].conn;
+		hdd_client_use(cl[k].via);
+		r = get_response(hdd_client_operation(construct(0, 0, HDD_INIT, 0, HDD_DEVICE), NULL));
+		hdd_client_use(NULL);
+		if (r) {
+			hdd_log(LOG_ERROR_LEVEL, "Connection of client %d failed, aborting simulation.", k);
+			return(-1);
+		}
+	}
+	return(0);
+}
 
-				} else if (strncmp(command, "SEEK", 4) == 0) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_loop_cmp
+// Description  : order latencies for qsort
+//
+// Inputs       : a, b - the latencies
+// Outputs      : -1, 0 or 1
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Seeking to position %d in file [%s]", off, fname);
+static int open_loop_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-					// Now perform the seek
-					if (hdd_seek(ftable[idx].fhandle, off) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
+	return( (x > y) - (x < y) );
+}
 
-				} else if (strncmp(command, "READ", 4) == 0) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_open_loop
+// Description  : replay a workload open loop at each of a list of rates,
+//                printing the throughput reached and the latency
+//                percentiles at each (the throughput-latency curve)
+//
+// Inputs       : wload - the name of the workload file, rates - the rates
+//                (operations/s), nrates - how many, clients - virtual
+//                clients, poisson - Poisson arrivals (else evenly spaced),
+//                fibers - run the clients as fibers (else threads)
+// Outputs      : 0 if successful, -1 if failure
 
-					// Log the command executed
-					logMessage(LOG_INFO_LEVEL, "HDD_SIM : Reading %d bytes from file [%s]", len, fname);
+int simulate_open_loop( char *wload, uint32_t *rates, int nrates, int clients, int poisson, int fibers ) {
 
-					// Now perform the read
-					rbuf = malloc(len);
-					if (hdd_read(ftable[idx].fhandle, rbuf, len) != len) {
-						// Failed, error out
-						logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-						return(-1);
-					}
-					free(rbuf);
-					rbuf = NULL;
+	// Local variables
+	char line[2048], fname[128], command[128];
+	FILE *fhandle;
+	HddSimLine *lines = NULL;
+	HddSimClient *cl;
+	HddVolume *dev = NULL;
+	uint32_t nlines = 0, maxlines = 0, i, j, *first;
+	uint64_t t, elapsed, *lat, nops;
+	int32_t len, off;
+	unsigned short seed[3] = { 0x4844, 0x4453, 0x494d };
+	struct rlimit rl;
+	int k, r, ret = -1;
+
+	// Load the workload, each file's lines going to one client
+	if ( (fhandle=fopen(wload, "r")) == NULL ) {
+		hdd_log( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
+			wload, strerror(errno) );
+		return( -1 );
+	}
+	while (fgets(line, 2048, fhandle) != NULL) {
+		if ((sscanf(line, "%s %s %d %d", fname, command, &len, &off) != 4) || (strchr(line, ':') == NULL)) {
+			hdd_log( LOG_ERROR_LEVEL, "HDD un-parsable workload string, aborting [%s], line %u", line, nlines + 1 );
+			fclose( fhandle );
+			return( -1 );
+		}
+		if (nlines == maxlines) {
+			maxlines = (maxlines == 0) ? 4096 : maxlines * 2;
+			CMPSC_ASSERT0((lines = realloc(lines, maxlines * sizeof(HddSimLine))) != NULL, "Out of memory for the workload");
+		}
+		memset(&lines[nlines], 0x0, sizeof(HddSimLine));
+		lines[nlines].line = strdup(line);
+		lines[nlines].client = ((strncmp(command, "FORMAT", 6) == 0) || (strncmp(command, "MOUNT", 5) == 0) ||
+			(strncmp(command, "UNMOUNT", 5) == 0)) ? -1 : (int)(hdd_crc32c(0, fname, strlen(fname)) % (uint32_t)clients);
+		nlines++;
+	}
+	fclose( fhandle );
+
+	// Chain each client's lines together
+	cl = calloc(clients, sizeof(HddSimClient));
+	first = malloc(clients * sizeof(uint32_t));
+	lat = malloc((nlines + 1) * sizeof(uint64_t));
+	CMPSC_ASSERT0((cl != NULL) && (first != NULL) && (lat != NULL), "Out of memory for the clients");
+	if (fibers) {
+		sim_loop.size = clients;
+		sim_loop.ready = malloc(clients * sizeof(HddSimClient *));
+		sim_loop.sleep = malloc(clients * sizeof(HddSimClient *));
+		CMPSC_ASSERT0((sim_loop.ready != NULL) && (sim_loop.sleep != NULL), "Out of memory for the fibers");
+	}
+	for (k=0; k<clients; k++) {
+		first[k] = nlines;
+		cl[k].index = k;
+		cl[k].lines = lines;
+	}
+	for (i=nlines; i-- > 0; ) {
+		if (lines[i].client != -1) {
+			lines[i].next = first[lines[i].client];
+			first[lines[i].client] = i;
+		}
+	}
+
+	// Every client has a connection of its own
+	if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < rl.rlim_max)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
 
-				} else {
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_SIM : open loop, %u lines, %d clients (%s), %s arrivals", nlines, clients,
+			fibers ? "fibers" : "threads", poisson ? "Poisson" : "evenly spaced");
+	hdd_log(LOG_OUTPUT_LEVEL, "HDD_SIM : %12s %12s %10s %10s %10s %10s %10s", "offered/s", "achieved/s",
+			"p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
 
-					// Bomb out, don't understand the command
-					CMPSC_ASSERT1(0, "HDD_SIM : Failed, unknown command [%s]", command);
+	for (r=0; r<nrates; r++) {
 
+		// Each rate replays the whole workload
+		for (k=0; k<clients; k++) {
+			cl[k].cursor = first[k];
+		}
+		elapsed = 0;
+		nops = 0;
+		for (i=0; i<nlines; i=j) {
+
+			// FORMAT, MOUNT and UNMOUNT, once what came before is done
+			if (lines[i].client == -1) {
+				sscanf(lines[i].line, "%s %s", fname, command);
+				if (open_loop_device(command, &dev, cl, clients)) {
+					goto done;
 				}
+				j = i + 1;
+				continue;
 			}
 
-			// Check for the virtual level failing
-			if ( err ) {
-				logMessage( LOG_ERROR_LEVEL, "HDD system failed, aborting [%d]", err );
-				fclose( fhandle );
-				return( -1 );
+			// Otherwise the run of file commands up to the next, each due
+			// a gap after the last
+			for (j=i, t=0; (j<nlines) && (lines[j].client != -1); j++) {
+				t += poisson ? (uint64_t)(-log(1.0 - erand48(seed)) * 1e9 / rates[r]) : 1000000000ULL / rates[r];
+				lines[j].due = t;
+			}
+			t = sim_now() + HDD_SIM_LEAD_NS;
+			for (k=0; k<clients; k++) {
+				if ((cl[k].vol == NULL) && (cl[k].cursor < j)) {
+					hdd_log(LOG_ERROR_LEVEL, "Client %d has file commands before a MOUNT, aborting simulation.", k);
+					goto done;
+				}
+				cl[k].end = j;
+				cl[k].start = t;
+				cl[k].running = (cl[k].cursor < j) &&
+					(fibers || (pthread_create(&cl[k].thread, NULL, open_loop_client, &cl[k]) == 0));
+				if ((cl[k].cursor < j) && !cl[k].running) {
+					hdd_log(LOG_ERROR_LEVEL, "Cannot start client %d", k);
+					cl[k].failed = 1;
+				}
+			}
+			if (fibers && fiber_run(cl, clients)) {
+				goto done;
+			}
+			for (k=0; k<clients; k++) {
+				if (cl[k].running) {
+					pthread_join(cl[k].thread, NULL);
+					cl[k].running = 0;
+				}
+			}
+			elapsed += sim_now() - t;
+			for (k=0; k<clients; k++) {
+				if (cl[k].failed) {
+					goto done;
+				}
 			}
+			for (; i<j; i++) {
+				lat[nops++] = lines[i].latency;
+			}
+		}
+
+		// The point on the curve
+		if (nops > 0) {
+			qsort(lat, nops, sizeof(uint64_t), open_loop_cmp);
+			hdd_log(LOG_OUTPUT_LEVEL, "HDD_SIM : %12u %12.0f %10llu %10llu %10llu %10llu %10llu%s", rates[r],
+					nops * 1e9 / elapsed, (unsigned long long)lat[nops / 2] / 1000,
+					(unsigned long long)lat[nops * 90 / 100] / 1000, (unsigned long long)lat[nops * 99 / 100] / 1000,
+					(unsigned long long)lat[nops * 999 / 1000] / 1000, (unsigned long long)lat[nops - 1] / 1000,
+					(nops * 1e9 / elapsed < rates[r] * 0.95) ? "  saturated" : "");
+		}
+		if (open_loop_device("UNMOUNT", &dev, cl, clients)) {
+			goto done;
 		}
 	}
+	ret = 0;
 
-	// Close the workload file, successfully
-	fclose( fhandle );
-	return( 0 );
+done:
+	open_loop_device("UNMOUNT", &dev, cl, clients);
+	for (k=0; k<clients; k++) {
+		if (cl[k].stack != NULL) {
+			munmap(cl[k].stack, HDD_SIM_FIBER_STACK + sysconf(_SC_PAGESIZE));
+		}
+	}
+	free(sim_loop.ready);
+	free(sim_loop.sleep);
+	sim_loop.ready = sim_loop.sleep = NULL;
+	for (i=0; i<nlines; i++) {
+		free(lines[i].line);
+	}
+	free(lines);
+	free(cl);
+	free(first);
+	free(lat);
+	return( ret );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -453,7 +1434,7 @@ int extract_file_from_hdd(char *ex_file) {
 		 ((len = hdd_read(fd, buf, HDD_MAX_BLOCK_SIZE)) == -1) ||
 		 (hdd_close(fd) == -1)	) {
 		// Error out
-		logMessage(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
+		hdd_log(LOG_INFO_LEVEL, "HDD : extraction failed on hdd interface [%s].", ex_file);
 		return(-1);
 	}
 
@@ -476,3 +1457,52 @@ int extract_file_from_hdd(char *ex_file) {
     // Return successfully
 	return( 0 );
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : configure_servers
+// Description  : Spread the blocks over (or copy them to) the servers of a
+//                comma separated list of <ip addr>:<port> (or just <port>,
+//                on this machine)
+//
+// Inputs       : list - the servers, replicas - copy instead of spread
+// Outputs      : 0 if successful, -1 if failure
+
+int configure_servers(char *list, int replicas) {
+
+	// Local variables
+	const char *addresses[HDD_CLIENT_MAX_PEERS];
+	unsigned short ports[HDD_CLIENT_MAX_PEERS];
+	char *copy, *item, *save, *colon;
+	int n = 0, ret;
+
+	// Split up the list, each server an address and a port
+	if ((copy = strdup(list)) == NULL) {
+		return(-1);
+	}
+	for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+		if (n == HDD_CLIENT_MAX_PEERS) {
+			free(copy);
+			return(-1);
+		}
+		if ((colon = strrchr(item, ':')) != NULL) {
+			*colon = 0x0;
+			addresses[n] = item;
+			item = colon + 1;
+		} else {
+			addresses[n] = NULL;
+		}
+		if ((sscanf(item, "%hu", &ports[n]) != 1) ||
+				((addresses[n] != NULL) && (inet_addr(addresses[n]) == INADDR_NONE))) {
+			free(copy);
+			return(-1);
+		}
+		n++;
+	}
+
+	// Hand them to the client (which keeps copies)
+	ret = (n == 0) ? -1 : replicas ? hdd_client_replicas(n, addresses, ports) :
+		hdd_client_shards(n, addresses, ports);
+	free(copy);
+	return(ret);
+}
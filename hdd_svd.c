@@ -0,0 +1,290 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_svd.c
+//  Description    : This is the offline reader of hdd_content.svd.  The file
+//                   is mapped read-only and every block header is checked
+//                   and indexed by ID, the contents staying where they are
+//                   in the mapping.  Requests are answered the way the
+//                   server answers them, so the file layer can mount the
+//                   filesystem from the file (journal and all) through
+//                   hdd_client_offline; a change copies the block into
+//                   memory, the file itself is never written.
+//
+//                   hdd_content.svd layout (little endian):
+//
+//                     uint32_t next block ID, uint32_t block count, then for
+//                     each block: uint32_t ID, uint8_t meta flag,
+//                     uint32_t size, size bytes of contents
+//
+//  Author         :
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Project Includes
+#include <hdd_svd.h>
+#include <hdd_file_io.h>
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+
+// Defines
+#define HDD_SVD_HASH_BITS 12           // starting size of the block index (it grows)
+#define HDD_SVD_CAPS HDD_CAP_RANGE_READ // extensions granted (writes are whole blocks)
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : svd_free_block
+// Description  : free what a block owns (blocks of the file stay in the array)
+//
+// Inputs       : blk - the block
+// Outputs      : none
+
+static void svd_free_block(HddSvdBlock *blk) {
+	free(blk->copy);
+	blk->copy = NULL;
+	if (blk->owned) {
+		free(blk);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_svd_open
+// Description  : map the file and index its blocks
+//
+// Inputs       : svd - the reader, path - the file
+// Outputs      : 0 if successful, -1 on failure
+
+int hdd_svd_open(HddSvd *svd, const char *path) {
+	struct stat st;
+	HddSvdBlock *blk;
+	size_t pos;
+	uint32_t i;
+	int fd;
+
+	memset(svd, 0x0, sizeof(HddSvd));
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SVD : open of [%s] failed [%s]", path, strerror(errno));
+		return(-1);
+	}
+	if ((fstat(fd, &st) == -1) || (st.st_size < HDD_SVD_HEADER)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SVD : [%s] is too short to be a content file", path);
+		close(fd);
+		return(-1);
+	}
+	svd->length = st.st_size;
+	svd->map = mmap(NULL, svd->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);   // the mapping keeps the file
+	if (svd->map == MAP_FAILED) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SVD : mmap of [%s] failed [%s]", path, strerror(errno));
+		svd->map = NULL;
+		return(-1);
+	}
+
+	// The header, then the blocks one after another
+	memcpy(&svd->next_bid, svd->map, sizeof(uint32_t));
+	memcpy(&svd->count, svd->map + sizeof(uint32_t), sizeof(uint32_t));
+	if ((svd->count > (svd->length - HDD_SVD_HEADER) / HDD_SVD_BLOCK_HEADER) ||
+			((svd->blocks = calloc(svd->count + 1, sizeof(HddSvdBlock))) == NULL) ||
+			initHddHashTable(&svd->index, HDD_SVD_HASH_BITS)) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SVD : bad block count %u in [%s]", svd->count, path);
+		hdd_svd_close(svd);
+		return(-1);
+	}
+	for (i = 0, pos = HDD_SVD_HEADER; i < svd->count; i++) {
+		blk = &svd->blocks[i];
+		if (svd->length - pos < HDD_SVD_BLOCK_HEADER) {
+			break;
+		}
+		memcpy(&blk->bid, svd->map + pos, sizeof(uint32_t));
+		blk->meta = svd->map[pos + 4];
+		memcpy(&blk->size, svd->map + pos + 5, sizeof(uint32_t));
+		pos += HDD_SVD_BLOCK_HEADER;
+		if (svd->length - pos < blk->size) {
+			break;
+		}
+		blk->data = svd->map + pos;
+		pos += blk->size;
+		if (insertValueInHddHashTable(&svd->index, blk->bid, blk)) {
+			hdd_log(LOG_ERROR_LEVEL, "HDD_SVD : block %u appears twice in [%s]", blk->bid, path);
+			hdd_svd_close(svd);
+			return(-1);
+		}
+		if (blk->meta == 1) {
+			svd->meta = blk;   // (not a namespace's, see hdd_server.c)
+		}
+	}
+	if (i < svd->count) {
+		hdd_log(LOG_ERROR_LEVEL, "HDD_SVD : [%s] is truncated at block %u of %u", path, i, svd->count);
+		hdd_svd_close(svd);
+		return(-1);
+	}
+
+	madvise(svd->map, svd->length, MADV_WILLNEED);
+	hdd_log(LOG_INFO_LEVEL, "HDD_SVD : mapped %u blocks (%zu bytes) from [%s]", svd->count, svd->length, path);
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_svd_close
+// Description  : drop the index (and any changes), unmap the file
+//
+// Inputs       : svd - the reader
+// Outputs      : none
+
+void hdd_svd_close(HddSvd *svd) {
+	HddHtIterator it;
+	HddSvdBlock *blk;
+	uint32_t i;
+
+	if (svd->index.slots != NULL) {
+		initHddHashTableIterator(&svd->index, &it);
+		while ((blk = iterateHddHashTable(&it)) != NULL) {
+			if (blk->owned) {
+				svd_free_block(blk);
+			}
+		}
+		cleanupHddHashTable(&svd->index);
+	}
+	if (svd->blocks != NULL) {
+		for (i = 0; i < svd->count; i++) {
+			svd_free_block(&svd->blocks[i]);
+		}
+		free(svd->blocks);
+	}
+	if (svd->map != NULL) {
+		munmap(svd->map, svd->length);
+	}
+	memset(svd, 0x0, sizeof(HddSvd));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_svd_block
+// Description  : find a block by ID
+//
+// Inputs       : svd - the reader, bid - the block ID
+// Outputs      : the block or NULL
+
+HddSvdBlock *hdd_svd_block(HddSvd *svd, HddBlockID bid) {
+	return(findValueInHddHashTable(&svd->index, bid));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : svd_set_data
+// Description  : give a block new contents (a copy of them)
+//
+// Inputs       : blk - the block, data/size - the contents
+// Outputs      : 0 if successful, -1 if out of memory
+
+static int svd_set_data(HddSvdBlock *blk, const void *data, uint32_t size) {
+	uint8_t *copy;
+
+	if ((copy = malloc(size + 1)) == NULL) {
+		return(-1);
+	}
+	memcpy(copy, data, size);
+	free(blk->copy);
+	blk->copy = copy;
+	blk->data = copy;
+	blk->size = size;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hdd_svd_serve
+// Description  : answer a client request from the file
+//
+// Inputs       : ctx - the reader, req - the request
+// Outputs      : the response
+
+HddBitResp hdd_svd_serve(void *ctx, HddClientRequest *req) {
+	HddSvd *svd = ctx;
+	HddSvdBlock *blk;
+	HddBlockID bid = req->cmd & 0xffffffff;
+	uint32_t size = (req->cmd >> 36) & 67108863, length;
+	int op = (req->cmd >> 62) & 3, flags = (req->cmd >> 33) & 7;
+
+	blk = (flags == HDD_META_BLOCK) ? svd->meta : hdd_svd_block(svd, bid);
+
+	if (op == HDD_DEVICE) {
+
+		// Always there, never formatted, saved only in memory
+		if (flags == HDD_INIT) {
+			return(construct(0, 0, flags, HDD_SVD_CAPS, op));
+		}
+		return(construct(0, (flags != HDD_SAVE_AND_CLOSE), flags, 0, op));
+
+	} else if (op == HDD_BLOCK_READ) {
+
+		// The caller's buffer must hold the whole block (or the range)
+		if ((blk == NULL) || ((flags == HDD_RANGE) ? (req->offset > blk->size) : (size < blk->size))) {
+			return(construct(bid, 1, flags, 0, op));
+		}
+		if (flags == HDD_RANGE) {
+			length = (size < blk->size - req->offset) ? size : blk->size - req->offset;
+			memcpy(req->buf, blk->data + req->offset, length);
+		} else {
+			length = blk->size;
+			memcpy(req->buf, blk->data, length);
+		}
+		return(construct(blk->bid, 0, flags, length, op));
+
+	} else if (op == HDD_BLOCK_CREATE) {
+
+		if ((size > HDD_MAX_BLOCK_SIZE) || ((flags != HDD_NULL_FLAG) && (flags != HDD_META_BLOCK)) ||
+				((blk = calloc(1, sizeof(HddSvdBlock))) == NULL)) {
+			return(construct(0, 1, flags, size, op));
+		}
+		blk->owned = 1;
+		blk->bid = svd->next_bid++;
+		blk->meta = (flags == HDD_META_BLOCK);
+		if ((svd_set_data(blk, req->buf, size) == -1) || insertValueInHddHashTable(&svd->index, blk->bid, blk)) {
+			svd_free_block(blk);
+			return(construct(0, 1, flags, size, op));
+		}
+		if (blk->meta) {
+			if (svd->meta != NULL) {
+				deleteValueFromHddHashTable(&svd->index, svd->meta->bid);
+				svd_free_block(svd->meta);
+			}
+			svd->meta = blk;
+		}
+		return(construct(blk->bid, 0, flags, size, op));
+
+	} else if (op == HDD_BLOCK_OVERWRITE) {
+
+		// Whole blocks of the same size (no ranges or resizes were granted)
+		if ((blk == NULL) || ((flags != HDD_NULL_FLAG) && (flags != HDD_META_BLOCK)) ||
+				(size != blk->size) || (svd_set_data(blk, req->buf, size) == -1)) {
+			return(construct(bid, 1, flags, size, op));
+		}
+		return(construct(bid, 0, flags, size, op));
+
+	}
+
+	// Deletes
+	if (blk == NULL) {
+		return(construct(bid, 1, flags, 0, op));
+	}
+	deleteValueFromHddHashTable(&svd->index, blk->bid);
+	if (blk == svd->meta) {
+		svd->meta = NULL;
+	}
+	svd_free_block(blk);
+	return(construct(bid, 0, flags, 0, op));
+}
@@ -0,0 +1,67 @@
+#ifndef HDD_SVD_INCLUDED
+#define HDD_SVD_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : hdd_svd.h
+//  Description    : This is the header file for the offline reader of
+//                   hdd_content.svd, which maps the file the server saves
+//                   and indexes its blocks so they can be read (and the
+//                   filesystem mounted) without a server.
+//
+//  Author         :
+//
+
+// Include files
+#include <stdint.h>
+#include <stddef.h>
+
+// Project include files
+#include <hdd_driver.h>
+#include <hdd_network.h>
+#include <hdd_htable.h>
+
+// Defines
+#define HDD_SVD_FILE "hdd_content.svd"   // what the server saves to
+#define HDD_SVD_HEADER 8                 // next block ID and block count
+#define HDD_SVD_BLOCK_HEADER 9           // block ID, meta flag and size
+
+// A block of the file
+typedef struct {
+	HddBlockID     bid;    // The block ID
+	uint8_t        meta;   // 1 if this is the meta block (2 a namespace's)
+	uint8_t        owned;  // Made since the file was read (freed with the reader)
+	uint32_t       size;   // The size of the block contents
+	const uint8_t *data;   // The contents, in the mapping unless changed
+	uint8_t       *copy;   // The contents once changed (data points here), or NULL
+} HddSvdBlock;
+
+// An open hdd_content.svd
+typedef struct {
+	uint8_t     *map;       // the file, mapped
+	size_t       length;    // bytes in it
+	HddBlockID   next_bid;  // next block ID the server would hand out
+	uint32_t     count;     // blocks in the file
+	HddSvdBlock *blocks;    // them, in file order
+	HddSvdBlock *meta;      // the meta block (NULL if none)
+	HddHTable    index;     // block ID -> HddSvdBlock (as changed since)
+} HddSvd;
+
+//
+// Functional Prototypes
+
+int hdd_svd_open(HddSvd *svd, const char *path);
+	// Map and index the file at "path", 0 if successful, -1 on failure
+
+void hdd_svd_close(HddSvd *svd);
+	// Unmap the file, dropping any changes
+
+HddSvdBlock *hdd_svd_block(HddSvd *svd, HddBlockID bid);
+	// The block "bid" (NULL if there isn't one)
+
+HddBitResp hdd_svd_serve(void *svd, HddClientRequest *req);
+	// Answer a client request from the file as the server would (an
+	// HddClientServe, see hdd_client_offline): reads come from the mapping,
+	// changes stay in memory and are never written back
+
+#endif
@@ -0,0 +1,420 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : hdd_wlgen.c
+//  Description   : This is a generator of synthetic workloads for the
+//                  simulator (hdd_client).  It writes a workload in the
+//                  format of workload-*.txt: a set of files with sizes from
+//                  a chosen distribution, created one after another, then a
+//                  mix of reads, writes and seeks spread over the files by a
+//                  Zipfian popularity, at the file's position (sequential)
+//                  or at random offsets, with payloads of a chosen entropy.
+//                  The workload only ever reads bytes that are there, and
+//                  seeks before using a file it didn't use last, so the
+//                  simulator may close and reopen files between uses.
+//
+//  Author        :
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+// Project Include Files
+#include <cmpsc311_log.h>
+#include <hdd_log.h>
+
+// Defines
+#define HDD_WLGEN_ARGUMENTS "hn:o:z:s:r:m:q:e:S:O:"
+#define HDD_WLGEN_MAX_WRITE 1023        // longest payload the simulator takes
+#define HDD_WLGEN_MAX_SIZE (64*1024*1024) // largest file generated
+#define USAGE \
+	"USAGE: hdd_wlgen [-h] [-n <files>] [-o <ops>] [-z <s>] [-s <dist>] [-r <dist>] [-m <r>:<w>:<s>]\n" \
+	"                 [-q <seq>] [-e <bits>] [-S <seed>] [-O <out>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -n - number of files (default 100)\n" \
+	"    -o - number of operations after the files are created (default 100000)\n" \
+	"    -z - Zipf exponent of file popularity, 0 for uniform (default 0.99)\n" \
+	"    -s - file size distribution (default uniform:500:1000)\n" \
+	"    -r - read and write length distribution (default uniform:1:1023, writes stop at 1023)\n" \
+	"    -m - percentages of reads, writes and seeks (default 50:10:40)\n" \
+	"    -q - share of operations at the file's position, not a random offset (default 0.5)\n" \
+	"    -e - payload entropy in bits per byte, 0 (runs of one character) to 6 (default 0)\n" \
+	"    -S - random seed (default 1)\n" \
+	"    -O - write the workload to <out> (default standard output)\n" \
+	"\n" \
+	"    <dist> - fixed:<n>, uniform:<min>:<max>, lognormal:<median>:<sigma> or pareto:<min>:<alpha>\n" \
+	"\n" \
+
+// The distributions of sizes and lengths
+typedef enum {
+	HDD_DIST_FIXED,      // always a
+	HDD_DIST_UNIFORM,    // a to b
+	HDD_DIST_LOGNORMAL,  // median a, shape b
+	HDD_DIST_PARETO,     // at least a, tail index b (heavier as it falls)
+} HddDistKind;
+
+typedef struct {
+	HddDistKind kind;    // which one
+	double      a, b;    // its parameters
+} HddDist;
+
+// A file of the workload
+typedef struct {
+	uint32_t size;       // bytes written so far
+	uint32_t pos;        // where its handle is in the simulator
+} HddWlFile;
+
+// The operations after creation
+typedef enum {
+	HDD_WL_READ,
+	HDD_WL_WRITE,
+	HDD_WL_SEEK,
+} HddWlOp;
+
+//
+// Global Data
+
+static uint64_t wl_rng;   // xorshift64* state, so a seed gives the same workload anywhere
+
+// The payload alphabet (the simulator turns '*' into a newline)
+static const char wl_alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789*.";
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wl_random
+// Description  : the next random number, and one in [0, 1)
+//
+// Inputs       : none
+// Outputs      : the number
+
+static uint64_t wl_random(void) {
+	wl_rng ^= wl_rng >> 12;
+	wl_rng ^= wl_rng << 25;
+	wl_rng ^= wl_rng >> 27;
+	return(wl_rng * 0x2545F4914F6CDD1DULL);
+}
+
+static double wl_uniform(void) {
+	return((wl_random() >> 11) * (1.0 / 9007199254740992.0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wl_parse_dist
+// Description  : parse a distribution (see USAGE)
+//
+// Inputs       : spec - the text, dist - where it goes
+// Outputs      : 0 if successful, -1 if failure
+
+static int wl_parse_dist(const char *spec, HddDist *dist) {
+	double a, b = 0;
+	int n;
+
+	if (((n = sscanf(spec, "fixed:%lf", &a)) == 1) && (a >= 1)) {
+		dist->kind = HDD_DIST_FIXED;
+	} else if (((n = sscanf(spec, "uniform:%lf:%lf", &a, &b)) == 2) && (a >= 1) && (b >= a)) {
+		dist->kind = HDD_DIST_UNIFORM;
+	} else if (((n = sscanf(spec, "lognormal:%lf:%lf", &a, &b)) == 2) && (a >= 1) && (b >= 0)) {
+		dist->kind = HDD_DIST_LOGNORMAL;
+	} else if (((n = sscanf(spec, "pareto:%lf:%lf", &a, &b)) == 2) && (a >= 1) && (b > 0)) {
+		dist->kind = HDD_DIST_PARETO;
+	} else {
+		return(-1);
+	}
+	dist->a = a;
+	dist->b = b;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wl_draw
+// Description  : draw from a distribution, clamped to [1, max]
+//
+// Inputs       : dist - the distribution, max - the most allowed
+// Outputs      : the value
+
+static uint32_t wl_draw(const HddDist *dist, uint32_t max) {
+	double v, u;
+
+	switch (dist->kind) {
+	case HDD_DIST_FIXED:
+		v = dist->a;
+		break;
+	case HDD_DIST_UNIFORM:
+		v = dist->a + floor(wl_uniform() * (dist->b - dist->a + 1));
+		break;
+	case HDD_DIST_LOGNORMAL:  // Box-Muller for the normal
+		u = 1.0 - wl_uniform();
+		v = dist->a * exp(dist->b * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * wl_uniform()));
+		break;
+	default:                  // Pareto, by inverting its distribution
+		v = dist->a / pow(1.0 - wl_uniform(), 1.0 / dist->b);
+		break;
+	}
+	return((v < 1) ? 1 : (v >= max) ? max : (uint32_t)v);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wl_zipf_table / wl_zipf
+// Description  : the cumulative Zipf distribution over n ranks, and a rank
+//                drawn from it (binary search)
+//
+// Inputs       : n - ranks, s - exponent / cdf - the table
+// Outputs      : the table (NULL on failure) / the rank, from 0
+
+static double *wl_zipf_table(uint32_t n, double s) {
+	double *cdf = malloc(n * sizeof(double)), sum = 0;
+	uint32_t i;
+
+	if (cdf == NULL) {
+		return(NULL);
+	}
+	for (i = 0; i < n; i++) {
+		sum += 1.0 / pow(i + 1, s);
+		cdf[i] = sum;
+	}
+	for (i = 0; i < n; i++) {
+		cdf[i] /= sum;
+	}
+	return(cdf);
+}
+
+static uint32_t wl_zipf(const double *cdf, uint32_t n) {
+	double u = wl_uniform();
+	uint32_t lo = 0, hi = n - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cdf[mid] < u) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return(lo);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wl_payload
+// Description  : write a payload of the chosen entropy: each byte drawn
+//                from 2^bits consecutive characters of the alphabet (from
+//                a random one), so 0 bits is a run of one character
+//
+// Inputs       : out - where to, len - bytes, bits - entropy per byte
+// Outputs      : none
+
+static void wl_payload(FILE *out, uint32_t len, int bits) {
+	char buf[HDD_WLGEN_MAX_WRITE + 1];
+	uint32_t base = wl_random() % 64, mask = (1u << bits) - 1, i;
+	uint64_t r = 0;
+
+	for (i = 0; i < len; i++) {
+		if ((i % 10) == 0) {
+			r = wl_random();   // six bits a byte, ten bytes a draw
+		}
+		buf[i] = wl_alphabet[(base + (r & mask)) % 64];
+		r >>= 6;
+	}
+	buf[len] = 0x0;
+	fputs(buf, out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the workload generator
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+	// Local variables
+	int ch, bits = 0, mix[3] = { 50, 10, 40 }, last = -1;
+	uint32_t nfiles = 100, i, f, len, off, *rank;
+	uint64_t ops = 100000, n, seed = 1, lines = 0;
+	double zipf = 0.99, seq = 0.5, *cdf;
+	HddDist sizes = { HDD_DIST_UNIFORM, 500, 1000 }, lengths = { HDD_DIST_UNIFORM, 1, HDD_WLGEN_MAX_WRITE };
+	HddWlFile *files;
+	HddWlOp op;
+	FILE *out = stdout;
+
+	// Process the command line parameters
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	while ((ch = getopt(argc, argv, HDD_WLGEN_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'n': // Files
+			if ((sscanf(optarg, "%u", &nfiles) != 1) || (nfiles < 1)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  file count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'o': // Operations
+			if (sscanf(optarg, "%llu", (unsigned long long *)&ops) != 1) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  operation count [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'z': // Popularity
+			if ((sscanf(optarg, "%lf", &zipf) != 1) || (zipf < 0)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  Zipf exponent [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 's': // File sizes
+			if (wl_parse_dist(optarg, &sizes)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  size distribution [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'r': // Read and write lengths
+			if (wl_parse_dist(optarg, &lengths)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  length distribution [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'm': // The mix
+			if ((sscanf(optarg, "%d:%d:%d", &mix[0], &mix[1], &mix[2]) != 3) || (mix[0] < 0) ||
+					(mix[1] < 0) || (mix[2] < 0) || (mix[0] + mix[1] + mix[2] == 0)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  operation mix [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'q': // Sequential share
+			if ((sscanf(optarg, "%lf", &seq) != 1) || (seq < 0) || (seq > 1)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  sequential share [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'e': // Payload entropy
+			if ((sscanf(optarg, "%d", &bits) != 1) || (bits < 0) || (bits > 6)) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  entropy [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'S': // Seed
+			if (sscanf(optarg, "%llu", (unsigned long long *)&seed) != 1) {
+				hdd_log( LOG_ERROR_LEVEL, "Bad  seed [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		case 'O': // Output file
+			if ((out = fopen(optarg, "w")) == NULL) {
+				hdd_log( LOG_ERROR_LEVEL, "Cannot create [%s]", optarg );
+				return(-1);
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// The files, and which is how popular (ranks shuffled over the names)
+	wl_rng = (seed * 0x9E3779B97F4A7C15ULL) | 1;
+	files = calloc(nfiles, sizeof(HddWlFile));
+	rank = malloc(nfiles * sizeof(uint32_t));
+	if ((files == NULL) || (rank == NULL) || ((cdf = wl_zipf_table(nfiles, zipf)) == NULL)) {
+		hdd_log( LOG_ERROR_LEVEL, "Out of memory for %u files", nfiles );
+		return(-1);
+	}
+	for (i = 0; i < nfiles; i++) {
+		rank[i] = i;
+	}
+	for (i = nfiles - 1; i > 0; i--) {
+		f = wl_random() % (i + 1);
+		len = rank[i];
+		rank[i] = rank[f];
+		rank[f] = len;
+	}
+
+	// Create the files, each written out in one go
+	fprintf(out, "x FORMAT 0 0:\nx MOUNT 0 0:\n");
+	for (f = 0; f < nfiles; f++) {
+		uint32_t size = wl_draw(&sizes, HDD_WLGEN_MAX_SIZE);
+		while (files[f].size < size) {
+			len = (size - files[f].size > HDD_WLGEN_MAX_WRITE) ? HDD_WLGEN_MAX_WRITE : size - files[f].size;
+			fprintf(out, "file%u.dat WRITE %u 0 :", f, len);
+			wl_payload(out, len, bits);
+			fputc('\n', out);
+			files[f].size += len;
+			lines++;
+		}
+		files[f].pos = files[f].size;
+	}
+	last = -1;
+
+	// Then the mix, each operation on a file drawn by popularity
+	for (n = 0; n < ops; n++) {
+		f = rank[wl_zipf(cdf, nfiles)];
+		i = wl_random() % (mix[0] + mix[1] + mix[2]);
+		op = (i < mix[0]) ? HDD_WL_READ : (i < mix[0] + mix[1]) ? HDD_WL_WRITE : HDD_WL_SEEK;
+
+		// Where: the file's position, or a random offset (reads need
+		// something to read there, and nothing is read past the end)
+		off = files[f].pos;
+		if ((wl_uniform() >= seq) || ((op == HDD_WL_READ) && (off >= files[f].size))) {
+			off = wl_random() % (files[f].size + ((op == HDD_WL_READ) ? 0 : 1));
+		}
+		len = wl_draw(&lengths, (op == HDD_WL_WRITE) ? HDD_WLGEN_MAX_WRITE : files[f].size - off);
+
+		// Seek first if the handle isn't there (or the simulator may have
+		// closed the file since it was last used)
+		if ((op == HDD_WL_SEEK) || (off != files[f].pos) || (last != (int)f)) {
+			fprintf(out, "file%u.dat SEEK 0 %u :\n", f, off);
+			files[f].pos = off;
+			lines++;
+		}
+		last = f;
+		if (op == HDD_WL_READ) {
+			fprintf(out, "file%u.dat READ %u 0 :\n", f, len);
+		} else if (op == HDD_WL_WRITE) {
+			fprintf(out, "file%u.dat WRITE %u 0 :", f, len);
+			wl_payload(out, len, bits);
+			fputc('\n', out);
+			if (off + len > files[f].size) {
+				files[f].size = off + len;
+			}
+		} else {
+			continue;
+		}
+		files[f].pos = off + len;
+		lines++;
+	}
+	fprintf(out, "x UNMOUNT 0 0:\n");
+
+	// Report what was made
+	hdd_log( LOG_OUTPUT_LEVEL, "HDD_WLGEN : %u files, %llu operations, %llu workload lines",
+			nfiles, (unsigned long long)ops, (unsigned long long)lines + 3 );
+	free(files);
+	free(rank);
+	free(cdf);
+	return((fclose(out) == 0) ? 0 : -1);
+}